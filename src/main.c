@@ -1,15 +1,89 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "elfloader.h"
 #include "x64context.h"
+#include "x64cpuid.h"
 #include "x64emu.h"
 
+static void usage(const char *name) {
+    printf("Usage: %s [--engine=interp|jit] [--jit-threshold=<runs>] [--jit-opt-threshold=<runs>]\n"
+           "       [--cache-dir=<dir>] [--cache-size=<MiB>] [--cpu=x86-64|x86-64-v2|x86-64-v3|max]\n"
+           "       [--cpu-features=<+feature|-feature>,...] <path/to/binary> [args]\n", name);
+}
+
 int main(int argc, char *argv[], char *envp[]) {
-    if (argc == 1) {
-        printf("Usage: %s <path/to/binary> [args]\n", argv[0]);
+    x64emu_t emu = { 0 };
+    emu.engine = X64_ENGINE_INTERP;
+    emu.jit_threshold = X64JIT_THRESHOLD;
+    emu.jit_opt_threshold = X64JIT_OPT_THRESHOLD;
+    emu.cache_size = X64_CACHE_SIZE;
+    x64cpuid_preset(&emu.cpuid, X64_CPUID_PRESET);
+    const char *cpu_features = NULL;
+
+    /* options come before the binary, the rest belongs to the guest. */
+    int i = 1;
+    for (; i < argc && !strncmp(argv[i], "--", 2); i++) {
+        if (!strcmp(argv[i], "--engine=interp")) {
+            emu.engine = X64_ENGINE_INTERP;
+        } else if (!strcmp(argv[i], "--engine=jit")) {
+            emu.engine = X64_ENGINE_JIT;
+        } else if (!strncmp(argv[i], "--jit-threshold=", 16) && argv[i][16]) {
+            /* 0 compiles blocks before they first run. */
+            char *end;
+            emu.jit_threshold = strtoul(argv[i] + 16, &end, 10);
+            if (*end) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strncmp(argv[i], "--jit-opt-threshold=", 20) && argv[i][20]) {
+            /* 0 leaves blocks to the baseline JIT. */
+            char *end;
+            emu.jit_opt_threshold = strtoul(argv[i] + 20, &end, 10);
+            if (*end) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strncmp(argv[i], "--cache-dir=", 12) && argv[i][12]) {
+            emu.cache_dir = argv[i] + 12;
+        } else if (!strncmp(argv[i], "--cache-size=", 13) && argv[i][13]) {
+            /* Decoded blocks and translated code are evicted to stay within it. */
+            char *end;
+            emu.cache_size = strtoul(argv[i] + 13, &end, 10) << 20;
+            if (*end) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strncmp(argv[i], "--cpu=", 6) && argv[i][6]) {
+            if (!x64cpuid_preset(&emu.cpuid, argv[i] + 6)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strncmp(argv[i], "--cpu-features=", 15) && argv[i][15]) {
+            /* Applied to the preset whatever the order of the options. */
+            cpu_features = argv[i] + 15;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cpu_features && !x64cpuid_override(&emu.cpuid, cpu_features)) {
+        usage(argv[0]);
         return 1;
     }
 
+    if (i == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* context takes the binary as argv[1]. */
+    argv[i - 1] = argv[0];
+    argc -= i - 1;
+    argv += i - 1;
+
     x64context_t ctx = { 0 };
     if (!x64context_init(&ctx, argc, argv, envp)) {
         return 1;
@@ -19,7 +93,6 @@ int main(int argc, char *argv[], char *envp[]) {
         return 1;
     }
 
-    x64emu_t emu = { 0 };
     if (!x64emu_init(&emu, &ctx)) {
         return 1;
     }
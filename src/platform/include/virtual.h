@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * @return whether virtual address space is bigger than 39 bits.
@@ -11,4 +12,10 @@ bool detect_48bit_va(void);
 
 bool dump_self_maps(void);
 
+/**
+ * Get protection (PROT_* flags) of the mapping containing `addr`.
+ * @return false if `addr` is not mapped.
+ */
+bool query_prot(uintptr_t addr, int *prot);
+
 #endif /* __VIRTUAL_H_ */
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "debug.h"
 #include "virtual.h"
@@ -59,3 +60,27 @@ bool dump_self_maps(void) {
 
     return true;
 }
+
+bool query_prot(uintptr_t addr, int *prot) {
+    FILE *maps = open_maps();
+    if (!maps) return false;
+
+    char line[256];
+    bool found = false;
+
+    while (fgets(line, sizeof(line), maps)) {
+        uintptr_t start, end;
+        char perms[5];
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3) continue;
+        if (addr < start || addr >= end) continue;
+
+        *prot = (perms[0] == 'r' ? PROT_READ : 0) |
+                (perms[1] == 'w' ? PROT_WRITE : 0) |
+                (perms[2] == 'x' ? PROT_EXEC : 0);
+        found = true;
+        break;
+    }
+    fclose(maps);
+
+    return found;
+}
@@ -0,0 +1,212 @@
+#ifndef __X64AVX_PRIVATE_H_
+#define __X64AVX_PRIVATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "simd_private.h"
+
+/*
+ * Operands of VEX encoded instructions. A YMM register is the XMM register
+ * of the same number with its upper half in `ymmh`. Nearly all AVX/AVX2
+ * instructions work within 128 bit lanes, their 256 bit forms run the
+ * kernels of simd_private.h and fp_private.h on each half. The few that
+ * cross lanes have kernels of their own here.
+ *
+ * VEX.128 forms clear bits 255:128 of their destination register,
+ * legacy SSE forms leave them alone.
+ */
+
+/**
+ * 256 bit operand as its two halves, 32 byte host vectors would change
+ * the calling convention of hosts built without AVX.
+ */
+typedef struct {
+    simd_t lo, hi;
+} simd256_t;
+
+static inline simd_t avx_lo(simd256_t v) { return v.lo; }
+static inline simd_t avx_hi(simd256_t v) { return v.hi; }
+
+static inline simd256_t avx_join(simd_t lo, simd_t hi) {
+    return (simd256_t){ lo, hi };
+}
+
+/** `kernel(a, b, ...)` on each 128 bit half. */
+#define AVX_LANES(kernel, a, b, ...) \
+    avx_join(kernel(avx_lo(a), avx_lo(b), ##__VA_ARGS__), kernel(avx_hi(a), avx_hi(b), ##__VA_ARGS__))
+
+/** Register of the ModR/M reg field. */
+static inline uint8_t avx_reg(x64instr_t *ins) {
+    return ins->modrm.reg | (ins->rex.r << 3);
+}
+
+static inline simd256_t avx_load_ymm(x64emu_t *emu, uint8_t n) {
+    return avx_join(simd_load(&emu->xmm[n]), simd_load(&emu->ymmh[n]));
+}
+
+static inline void avx_store_ymm(x64emu_t *emu, uint8_t n, simd256_t v) {
+    simd_store(&emu->xmm[n], avx_lo(v));
+    simd_store(&emu->ymmh[n], avx_hi(v));
+}
+
+/** Destination of a VEX.128 form, the upper half is cleared. */
+static inline void avx_store_xmm(x64emu_t *emu, uint8_t n, simd_t v) {
+    simd_store(&emu->xmm[n], v);
+    simd_store(&emu->ymmh[n], (simd_t){ 0, 0 });
+}
+
+/** xmm register of VEX.vvvv. */
+static inline simd_t avx_load_vex(x64emu_t *emu, x64instr_t *ins) {
+    return simd_load(&emu->xmm[ins->vex.v]);
+}
+
+/** ymm/m256 of the ModR/M r/m field. */
+static inline simd256_t avx_load_m(x64emu_t *emu, x64instr_t *ins) {
+    simd256_t v;
+    if (ins->amode == X64_AMODE_REG)
+        return avx_load_ymm(emu, ins->ea_base);
+    memcpy(&v, x64modrm_get_indirect(emu, ins), sizeof(v));
+    return v;
+}
+
+static inline void avx_store_m(x64emu_t *emu, x64instr_t *ins, simd256_t v) {
+    if (ins->amode == X64_AMODE_REG)
+        avx_store_ymm(emu, ins->ea_base, v);
+    else
+        memcpy(x64modrm_get_indirect(emu, ins), &v, sizeof(v));
+}
+
+/** xmm/m128 destination of a VEX.128 form. */
+static inline void avx_store_xmm_m(x64emu_t *emu, x64instr_t *ins, simd_t v) {
+    if (ins->amode == X64_AMODE_REG)
+        avx_store_xmm(emu, ins->ea_base, v);
+    else
+        simd_store(x64modrm_get_indirect(emu, ins), v);
+}
+
+/** `size` bytes of xmm/m zero-extended, memory past them is not read. */
+static inline simd_t avx_load_part(x64emu_t *emu, x64instr_t *ins, size_t size) {
+    simd_t v = { 0, 0 };
+    memcpy(&v, x64modrm_get_xmm_m(emu, ins), size);
+    return v;
+}
+
+/** Low float of xmm/m32. */
+static inline float avx_src32(x64emu_t *emu, x64instr_t *ins) {
+    float f;
+    memcpy(&f, x64modrm_get_xmm_m(emu, ins), 4);
+    return f;
+}
+
+/** Low double of xmm/m64. */
+static inline double avx_src64(x64emu_t *emu, x64instr_t *ins) {
+    double d;
+    memcpy(&d, x64modrm_get_xmm_m(emu, ins), 8);
+    return d;
+}
+
+/*
+ * Handlers of the VEX.128 and VEX.256 forms of an instruction, named
+ * `x64execute_vex_<op>_128` and `_256`, and the array `x64execute_vex_<op>`
+ * of both indexed by VEX.L. Users include execute_private.h first.
+ */
+
+#define AVX_FORMS(op) \
+    static const x64handler_t x64execute_vex_ ## op[2] = { \
+        x64execute_vex_ ## op ## _128, x64execute_vex_ ## op ## _256, \
+    };
+
+/**
+ * `kernel(src1, src2, ...)` to dest, xmm,xmm,xmm/m128 or ymm,ymm,ymm/m256,
+ * without the array for users with tables of their own.
+ */
+#define AVX_BINARY_HANDLERS(op, kernel, ...) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        avx_store_xmm(emu, avx_reg(ins), kernel(avx_load_vex(emu, ins), b, ##__VA_ARGS__)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t a = avx_load_ymm(emu, ins->vex.v), b = avx_load_m(emu, ins); \
+        avx_store_ymm(emu, avx_reg(ins), AVX_LANES(kernel, a, b, ##__VA_ARGS__)); \
+        return true; \
+    }
+
+/** AVX_BINARY_HANDLERS and the array of both forms. */
+#define AVX_BINARY(op, kernel, ...) \
+    AVX_BINARY_HANDLERS(op, kernel, ##__VA_ARGS__) \
+    AVX_FORMS(op)
+
+/** `kernel(src1, src2, imm8)`, the upper half takes `imm8 >> shift`. */
+#define AVX_BINARY_IMM(op, kernel, shift) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        avx_store_xmm(emu, avx_reg(ins), kernel(avx_load_vex(emu, ins), b, ins->imm.ub[0])); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t a = avx_load_ymm(emu, ins->vex.v), b = avx_load_m(emu, ins); \
+        uint8_t imm = ins->imm.ub[0]; \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(avx_lo(a), avx_lo(b), imm), \
+                                                  kernel(avx_hi(a), avx_hi(b), imm >> (shift)))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+/** `kernel(src, imm8)` to dest, xmm,xmm/m128 or ymm,ymm/m256, the upper half takes `imm8 >> shift`. */
+#define AVX_UNARY_IMM(op, kernel, shift) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        avx_store_xmm(emu, avx_reg(ins), kernel(simd_load(x64modrm_get_xmm_m(emu, ins)), ins->imm.ub[0])); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t a = avx_load_m(emu, ins); \
+        uint8_t imm = ins->imm.ub[0]; \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(avx_lo(a), imm), kernel(avx_hi(a), imm >> (shift)))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+/* Cross-lane kernels. */
+
+/** Dwords of `a` selected by the low 3 bits of those of `idx`, VPERMD/VPERMPS. */
+static inline simd256_t avx_permd(simd256_t a, simd256_t idx) {
+    simd_u32x8_t v, i;
+    simd256_t r;
+    memcpy(&v, &a, sizeof(v));
+    memcpy(&i, &idx, sizeof(i));
+    v = __builtin_shuffle(v, i & 7);
+    memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+/** Qwords of `a` selected by two bits of `imm` each, VPERMQ/VPERMPD. */
+static inline simd256_t avx_permq(simd256_t a, uint8_t imm) {
+    uint64_t q[4], r[4];
+    memcpy(q, &a, sizeof(q));
+    for (int i = 0; i < 4; i++)
+        r[i] = q[(imm >> (i * 2)) & 3];
+    memcpy(&a, r, sizeof(r));
+    return a;
+}
+
+/** Halves of `a` and `b`, or zeros, selected by `imm` nibbles, VPERM2F128/VPERM2I128. */
+static inline simd256_t avx_perm2x128(simd256_t a, simd256_t b, uint8_t imm) {
+    simd_t halves[4] = { avx_lo(a), avx_hi(a), avx_lo(b), avx_hi(b) };
+    simd_t lo = imm & 0x08 ? (simd_t){ 0, 0 } : halves[imm & 3];
+    simd_t hi = imm & 0x80 ? (simd_t){ 0, 0 } : halves[(imm >> 4) & 3];
+    return avx_join(lo, hi);
+}
+
+/** Most significant bits of the bytes, VPMOVMSKB. */
+static inline uint32_t avx_movmsk8(simd256_t a) {
+    return simd_movmsk8(avx_lo(a)) | simd_movmsk8(avx_hi(a)) << 16;
+}
+
+#endif /* __X64AVX_PRIVATE_H_ */
@@ -0,0 +1,474 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64block.h"
+
+#include "x64flags.h"
+
+#include "regs_private.h"
+
+/** Status flags tested by condition codes `cc` and `cc + 1`. */
+static const uint16_t x64block_cc_flags[8] = {
+    X64_FLAG_OF,
+    X64_FLAG_CF,
+    X64_FLAG_ZF,
+    X64_FLAG_CF | X64_FLAG_ZF,
+    X64_FLAG_SF,
+    X64_FLAG_PF,
+    X64_FLAG_SF | X64_FLAG_OF,
+    X64_FLAG_ZF | X64_FLAG_SF | X64_FLAG_OF,
+};
+
+/** Width in bits of the r/m operand of 8 or 16/32/64 bit opcode. */
+static inline uint8_t x64block_width(x64instr_t *ins, bool byte_op) {
+    if (byte_op)         return 8;
+    if (ins->rex.w)      return 64;
+    if (ins->operand_sz) return 16;
+    return 32;
+}
+
+/** Same as `x64block_flags_usage` for two-byte and VEX opcodes. */
+static void x64block_flags_usage_0f(x64instr_t *ins, uint16_t *use, uint16_t *def) {
+    *use = 0;
+    *def = 0;
+
+    switch (ins->opcode[1]) {
+        case 0x40 ... 0x4F:   /* CMOVcc */
+        case 0x80 ... 0x8F:   /* Jcc rel32 */
+        case 0x90 ... 0x9F:   /* SETcc */
+            *use = x64block_cc_flags[(ins->opcode[1] & 0xF) >> 1];
+            return;
+
+        case 0x2E ... 0x2F:   /* UCOMIS, COMIS */
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0x38:
+            if (ins->opcode[2] == 0x17 ||                                        /* PTEST */
+                    (ins->opcode[0] == 0xC4 && (ins->opcode[2] & 0xFE) == 0x0E)) {   /* VTESTPS/PD */
+                *def = X64_FLAGS_STATUS;
+                return;
+            }
+            if (ins->opcode[2] < 0xF0) return;   /* SSSE3, SSE4, AVX */
+            if (ins->opcode[0] == 0xC4 && (ins->opcode[2] == 0xF2 || ins->opcode[2] == 0xF3 ||
+                    ((ins->opcode[2] == 0xF5 || ins->opcode[2] == 0xF7) && !ins->rep && !ins->operand_sz))) {
+                *def = X64_FLAGS_STATUS;          /* ANDN, BLSR/BLSMSK/BLSI, BZHI, BEXTR */
+                return;
+            }
+            if (ins->opcode[2] <= 0xF7) return;  /* MOVBE, CRC32, PDEP/PEXT, MULX, SHLX/SARX/SHRX */
+            break;
+
+        case 0x3A:
+            if (ins->opcode[2] >= 0x60 && ins->opcode[2] <= 0x63) {   /* PCMPxSTRx */
+                *def = X64_FLAGS_STATUS;
+                return;
+            }
+            if (ins->opcode[2] <= 0xF0) return;   /* RORX */
+            break;
+
+        case 0xA3:
+        case 0xAB:
+        case 0xB3:
+        case 0xBA ... 0xBB:   /* BT, BTS, BTR, BTC */
+            *def = X64_FLAG_CF;
+            return;
+
+        case 0xB8:
+        case 0xBC ... 0xBD:   /* POPCNT, BSF/TZCNT, BSR/LZCNT */
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0x0D ... 0x1F:   /* SSE moves, NOP */
+        case 0x28 ... 0x2D:   /* SSE moves, conversions */
+        case 0x50 ... 0x5F:   /* SSE floating point, bitwise */
+        case 0x60 ... 0x7F:   /* MMX/SSE integer */
+        case 0xAE:            /* LDMXCSR, STMXCSR, fences */
+        case 0xB6 ... 0xB7:   /* MOVZX */
+        case 0xC2:            /* CMPPS/PD/SS/SD */
+        case 0xC4 ... 0xC6:   /* MMX/SSE integer */
+        case 0xD0 ... 0xFF:
+            return;
+    }
+    *use = X64_FLAGS_STATUS;
+}
+
+/**
+ * Get status flags read (`use`) and unconditionally written (`def`)
+ * by the instruction. Anything not known to leave flags alone reads all.
+ */
+static void x64block_flags_usage(x64instr_t *ins, uint16_t *use, uint16_t *def) {
+    uint8_t op = ins->opcode[0];
+    uint8_t reg = ins->modrm.reg;
+
+    if (op == 0x0F || op == 0xC4) {   /* VEX opcodes follow C4 as they follow 0F */
+        x64block_flags_usage_0f(ins, use, def);
+        return;
+    }
+
+    *use = 0;
+    *def = 0;
+
+    switch (op) {
+        case 0x00 ... 0x3D:   /* ALU */
+            if ((op & 7) > 5) break;
+            if ((op & 0xF0) == 0x10) *use = X64_FLAG_CF;   /* ADC, SBB */
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0x80 ... 0x83:   /* ALU r/m,imm */
+            if (reg == 2 || reg == 3) *use = X64_FLAG_CF;  /* ADC, SBB */
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0x84 ... 0x85:   /* TEST r/m,r */
+        case 0xA8 ... 0xA9:   /* TEST rAX,imm */
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0xA6 ... 0xA7:   /* CMPS */
+        case 0xAE ... 0xAF:   /* SCAS */
+            /* Repeated ones leave flags alone if RCX is 0. */
+            if (ins->rep) break;
+            *def = X64_FLAGS_STATUS;
+            return;
+
+        case 0x70 ... 0x7F:   /* Jcc rel8 */
+            *use = x64block_cc_flags[(op & 0xF) >> 1];
+            return;
+
+        case 0xC0 ... 0xC1:   /* rotate/shift r/m,imm8 */
+        case 0xD0 ... 0xD1:   /* rotate/shift r/m,1 */
+            /* Shifts by non-zero count write all flags, rotates keep most of them. */
+            if (reg >= 4 && (op >= 0xD0 ||
+                    (ins->imm.ub[0] & (x64block_width(ins, !(op & 1)) - 1)))) {
+                *def = X64_FLAGS_STATUS;
+                return;
+            }
+            break;
+
+        case 0xF6 ... 0xF7:
+            if (reg == 2) return;                          /* NOT */
+            if (reg <= 3) {                                /* TEST, NEG */
+                *def = X64_FLAGS_STATUS;
+                return;
+            }
+            break;
+
+        case 0xFE ... 0xFF:
+            if (reg <= 1) {                                /* INC, DEC */
+                *def = X64_FLAGS_STATUS & ~X64_FLAG_CF;
+                return;
+            }
+            if (op == 0xFF && reg <= 6) return;            /* CALL, JMP, PUSH */
+            break;
+
+        case 0x50 ... 0x5F:   /* PUSH/POP+r */
+        case 0x63:            /* MOVSXD */
+        case 0x68:            /* PUSH imm */
+        case 0x6A:
+        case 0x86 ... 0x8B:   /* XCHG, MOV */
+        case 0x8D:            /* LEA */
+        case 0x8F:            /* POP r/m */
+        case 0x90 ... 0x99:   /* XCHG+r, CBW, CWD */
+        case 0xA4 ... 0xA5:   /* MOVS */
+        case 0xAA ... 0xAD:   /* STOS, LODS */
+        case 0xB0 ... 0xBF:   /* MOV+r imm */
+        case 0xC2 ... 0xC3:   /* RET */
+        case 0xC6 ... 0xC7:   /* MOV r/m,imm */
+        case 0xC9:            /* LEAVE */
+        case 0xE8 ... 0xE9:   /* CALL/JMP rel32 */
+        case 0xEB:            /* JMP rel8 */
+        case 0xFA ... 0xFD:   /* CLI/STI/CLD/STD */
+            return;
+    }
+    *use = X64_FLAGS_STATUS;
+}
+
+/**
+ * Backward pass over the block, records which status flags are read
+ * after every instruction. Everything is assumed live past the block end.
+ * Instructions whose written flags are all dead switch to handlers
+ * which do not record flags.
+ * @return Number of such instructions.
+ */
+static uint32_t x64block_flags_liveness(x64instr_t *instrs, uint32_t instrs_len) {
+    uint16_t live = X64_FLAGS_STATUS;
+    uint32_t dead = 0;
+
+    for (uint32_t i = instrs_len; i-- > 0;) {
+        x64instr_t *ins = instrs + i;
+        uint16_t use, def;
+
+        x64block_flags_usage(ins, &use, &def);
+        ins->flags_live = live;
+
+        if (def && !(live & def)) {
+            x64handler_t handler = x64execute_resolve_spec_nf(ins);
+            if (handler) {
+                ins->handler = handler;
+                dead++;
+            }
+        }
+
+        live = (live & ~def) | use;
+    }
+    return dead;
+}
+
+/**
+ * Replace handlers of flag producing instructions immediately followed
+ * by a flag consumer with fused ones, the consumer is skipped then.
+ */
+static void x64block_fuse(x64instr_t *instrs, uint32_t instrs_len) {
+    for (uint32_t i = 0; i + 1 < instrs_len; i++) {
+        x64handler_t handler = x64execute_resolve_fused(instrs + i);
+        if (handler) {
+            instrs[i].handler = handler;
+            instrs[i].fused = 1;
+            i++;
+        }
+    }
+}
+
+/**
+ * Replace the handler of the first instruction of runs of pushes or pops
+ * with one executing the whole run, the others are skipped then.
+ */
+static void x64block_fuse_runs(x64instr_t *instrs, uint32_t instrs_len) {
+    for (uint32_t i = 0; i < instrs_len; i++) {
+        x64handler_t handler = x64execute_resolve_run(instrs + i);
+        if (!handler) continue;
+
+        uint32_t len = 1;
+        while (i + len < instrs_len && x64execute_resolve_run(instrs + i + len) == handler)
+            len++;
+        if (len > 1) {
+            instrs[i].handler = handler;
+            instrs[i].fused = len - 1;
+        }
+        i += len - 1;
+    }
+}
+
+/**
+ * Set direct exits of the block from its last instruction.
+ * Indirect branches, returns and syscalls have none.
+ */
+static void x64block_exits(x64block_t *block) {
+    x64instr_t *last = block->instrs + block->instrs_len - 1;
+    uint64_t target = 0;
+
+    memset(block->exits, 0, sizeof(block->exits));
+    memset(&block->ic, 0, sizeof(block->ic));
+    block->indirect = false;
+    block->call = false;
+    block->ret = false;
+
+    switch (last->opcode[0]) {
+        case 0x70 ... 0x7F:   /* Jcc rel8 */
+            target = block->end + last->imm.sb[0];
+            break;
+        case 0xEB:            /* JMP rel8 */
+            block->exits[0].target = block->end + last->imm.sb[0];
+            return;
+        case 0xE8:            /* CALL rel32 */
+            block->exits[0].target = block->end + last->imm.sd[0];
+            block->exits[X64_BLOCK_EXITS - 1].target = block->end;
+            block->call = true;
+            return;
+        case 0xE9:            /* JMP rel32 */
+            block->exits[0].target = block->end + last->imm.sd[0];
+            return;
+        case 0xC2 ... 0xC3:   /* RET */
+            block->indirect = true;
+            block->ret = true;
+            return;
+        case 0xFF:            /* CALL/JMP r/m64 */
+            block->indirect = last->modrm.reg == 2 || last->modrm.reg == 4;
+            if (last->modrm.reg == 2) {
+                block->exits[X64_BLOCK_EXITS - 1].target = block->end;
+                block->call = true;
+            }
+            return;
+        case 0x0F:
+            if (last->opcode[1] >= 0x80 && last->opcode[1] <= 0x8F) {   /* Jcc rel32 */
+                target = block->end + last->imm.sd[0];
+                break;
+            }
+            /* fallthrough */
+        default:
+            if (x64block_is_end(last)) return;
+            break;
+    }
+
+    block->exits[0].target = target ? target : block->end;
+    if (target) block->exits[1].target = block->end;
+}
+
+/** Point the translated jump of the exit to `code`. */
+static inline void x64block_patch(x64block_exit_t *exit, uint64_t code) {
+    if (exit->patch)
+        memcpy(exit->patch, &code, sizeof(code));
+}
+
+/** Point the translated check of the inline cache to its linked target. */
+static void x64block_ic_patch(x64block_t *block) {
+    x64block_ic_t *ic = &block->ic;
+    if (!ic->patch) return;
+
+    x64block_t *to = ic->linked;
+    uint64_t target = to && to->code ? to->rip : 0;
+    uint64_t code = to && to->code ? (uintptr_t)to->code : ic->unlinked;
+    memcpy(ic->patch_target, &target, sizeof(target));
+    memcpy(ic->patch, &code, sizeof(code));
+}
+
+void x64block_link(x64block_t *block, x64block_t *to) {
+    bool direct = false;
+
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++) {
+        x64block_exit_t *exit = block->exits + i;
+        if (exit->target != to->rip) continue;
+
+        direct = true;
+        if (exit->to) continue;
+
+        exit->to = to;
+        exit->next_in = to->incoming;
+        to->incoming = exit;
+        if (to->code)
+            x64block_patch(exit, (uintptr_t)to->code);
+    }
+
+    if (block->indirect && !direct) {
+        /* Least recently added target drops out. */
+        memmove(block->ic.to + 1, block->ic.to, (X64_BLOCK_IC - 1) * sizeof(x64block_t *));
+        block->ic.to[0] = to;
+        if (!block->ic.linked && to->code) {
+            block->ic.linked = to;
+            x64block_ic_patch(block);
+        }
+    }
+}
+
+void x64block_relink(x64block_t *block) {
+    if (block->code) {
+        for (x64block_exit_t *exit = block->incoming; exit; exit = exit->next_in)
+            x64block_patch(exit, (uintptr_t)block->code);
+    }
+
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++) {
+        x64block_exit_t *exit = block->exits + i;
+        x64block_patch(exit, exit->to && exit->to->code ? (uintptr_t)exit->to->code : exit->unlinked);
+    }
+    x64block_ic_patch(block);
+}
+
+void x64block_ic_reset(x64block_t *block) {
+    if (!block->indirect) return;
+
+    memset(block->ic.to, 0, sizeof(block->ic.to));
+    block->ic.linked = NULL;
+    x64block_ic_patch(block);
+}
+
+void x64block_unlink(x64block_t *block) {
+    /* Exits of other blocks return to the dispatcher again. */
+    for (x64block_exit_t *exit = block->incoming; exit; exit = exit->next_in) {
+        exit->to = NULL;
+        x64block_patch(exit, exit->unlinked);
+    }
+    block->incoming = NULL;
+
+    /* Successors forget exits of this block. */
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++) {
+        x64block_exit_t *exit = block->exits + i;
+        if (!exit->to) continue;
+
+        x64block_exit_t **in = &exit->to->incoming;
+        while (*in && *in != exit)
+            in = &(*in)->next_in;
+        if (*in) *in = exit->next_in;
+
+        exit->to = NULL;
+        x64block_patch(exit, exit->unlinked);
+    }
+}
+
+x64block_t *x64block_build(x64emu_t *emu, uint64_t rip) {
+    x64instr_t instrs[X64_BLOCK_MAX_INSTRS + 1];
+    uint32_t instrs_len = 0;
+    uint64_t end = rip;
+
+    /* decoder fetches through r_rip, restore it afterwards. */
+    uint64_t saved_rip = r_rip;
+    r_rip = rip;
+
+    while (instrs_len < X64_BLOCK_MAX_INSTRS) {
+        x64instr_t *ins = instrs + instrs_len;
+        memset(ins, 0, sizeof(x64instr_t));
+
+        /* An undecodable instruction in the middle ends the block before it,
+           it is reported again once execution actually reaches it. */
+        if (!x64decode(emu, ins))
+            break;
+
+        ins->len = r_rip - end;
+        ins->end = r_rip - rip;
+        end = r_rip;
+        instrs_len++;
+
+        if (x64block_is_end(ins))
+            break;
+    }
+
+    r_rip = saved_rip;
+
+    if (!instrs_len) return NULL;
+
+    uint32_t flags_dead = x64block_flags_liveness(instrs, instrs_len);
+    x64block_fuse(instrs, instrs_len);
+    x64block_fuse_runs(instrs, instrs_len);
+
+    return x64block_new(&emu->cache, rip, end, instrs, instrs_len, flags_dead);
+}
+
+x64block_t *x64block_new(x64cache_t *cache, uint64_t rip, uint64_t end, const x64instr_t *instrs,
+                         uint32_t instrs_len, uint32_t flags_dead) {
+    x64block_t *block = x64cache_alloc(cache, sizeof(x64block_t) + (instrs_len + 1) * sizeof(x64instr_t));
+
+    block->rip = rip;
+    block->end = end;
+    block->next = NULL;
+    block->instrs_len = instrs_len;
+    block->flags_dead = flags_dead;
+    block->code = NULL;
+    block->trace_rip = rip;
+    block->trace_end = end;
+    block->hits = 0;
+    block->tier = X64_TIER_COLD;
+    block->regions = 0;
+    block->jit_instrs = NULL;
+    block->incoming = NULL;
+    memcpy(block->instrs, instrs, instrs_len * sizeof(x64instr_t));
+
+    /* handlers continue with the next instruction,
+       terminate the block with the one that returns. */
+    memset(block->instrs + instrs_len, 0, sizeof(x64instr_t));
+    block->instrs[instrs_len].end = end - rip;
+    block->instrs[instrs_len].handler = x64block_is_end(block->instrs + instrs_len - 1) ?
+        x64execute_block_end : x64execute_block_next;
+
+    x64block_exits(block);
+
+    return block;
+}
+
+void x64block_free(x64block_t *block) {
+    free(block->jit_instrs);
+    block->jit_instrs = NULL;
+}
@@ -0,0 +1,262 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "x64cache.h"
+#include "x64block.h"
+
+SET_DEBUG_CHANNEL("X64CACHE")
+
+/* Initial number of buckets, grows twice when the table gets full. */
+#define CACHE_INIT_BUCKETS 4096
+
+/* Blocks in the arena are aligned to this. */
+#define CACHE_BLOCK_ALIGN 16
+
+static inline uint32_t cache_hash(x64cache_t *cache, uint64_t rip) {
+    /* Fibonacci hashing, spreads nearby addresses over the table. */
+    return (uint32_t)((rip * 0x9E3779B97F4A7C15UL) >> 32) & (cache->buckets_len - 1);
+}
+
+/** Slot of the direct-mapped table, code addresses are rarely aligned to more than 16. */
+static inline uint32_t cache_recent(uint64_t rip) {
+    return (uint32_t)(rip ^ (rip >> 12)) & (X64_CACHE_RECENT - 1);
+}
+
+bool x64cache_init(x64cache_t *cache, size_t size) {
+    if (!cache) return false;
+
+    memset(cache, 0, sizeof(x64cache_t));
+
+    /* Each generation holds a block of the largest size at least. */
+    cache->gen_size = (size / X64_CACHE_GENERATIONS) & ~(size_t)(CACHE_BLOCK_ALIGN - 1);
+    if (cache->gen_size < X64_BLOCK_MAX_SIZE) {
+        log_err("Block cache of %lu bytes is too small", size);
+        return false;
+    }
+
+    /* Pages are only backed once blocks are allocated from them. */
+    cache->arena = mmap(NULL, cache->gen_size * X64_CACHE_GENERATIONS, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cache->arena == MAP_FAILED) {
+        log_err("Failed to map block cache arena");
+        cache->arena = NULL;
+        return false;
+    }
+
+    cache->buckets = calloc(CACHE_INIT_BUCKETS, sizeof(x64block_t *));
+    if (!cache->buckets) {
+        log_err("Failed to allocate block cache");
+        munmap(cache->arena, cache->gen_size * X64_CACHE_GENERATIONS);
+        cache->arena = NULL;
+        return false;
+    }
+    cache->buckets_len = CACHE_INIT_BUCKETS;
+    return true;
+}
+
+/** @return Generation the block was allocated from. */
+static inline uint32_t cache_gen(x64cache_t *cache, x64block_t *block) {
+    return ((uint8_t *)block - cache->arena) / cache->gen_size;
+}
+
+/** Free the block, its generation is emptied along with the last one of it. */
+static void cache_release(x64cache_t *cache, x64block_t *block) {
+    uint32_t g = cache_gen(cache, block);
+
+    x64block_free(block);
+    if (--cache->gens[g].blocks) return;
+
+    cache->gens[g].used = 0;
+    /* Give the pages back, the generation is not allocated from until the others are full. */
+    if (g != cache->gen)
+        madvise(cache->arena + g * cache->gen_size, cache->gen_size, MADV_DONTNEED);
+}
+
+void x64cache_free(x64cache_t *cache) {
+    if (!cache || !cache->buckets) return;
+
+    for (uint32_t i = 0; i < cache->buckets_len; i++) {
+        x64block_t *block = cache->buckets[i];
+        while (block) {
+            x64block_t *next = block->next;
+            x64block_free(block);
+            block = next;
+        }
+    }
+
+    while (cache->retired) {
+        x64block_t *next = cache->retired->next;
+        x64block_free(cache->retired);
+        cache->retired = next;
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->buckets_len = cache->blocks_len = 0;
+
+    munmap(cache->arena, cache->gen_size * X64_CACHE_GENERATIONS);
+    cache->arena = NULL;
+}
+
+x64block_t *x64cache_lookup(x64cache_t *cache, uint64_t rip) {
+    /* Indirect branches missing their inline caches mostly come back here
+       with a few targets, try the last block seen in the slot first. */
+    x64block_t **recent = cache->recent + cache_recent(rip);
+    if (*recent && (*recent)->rip == rip) {
+        cache->hits++;
+        return *recent;
+    }
+
+    for (x64block_t *block = cache->buckets[cache_hash(cache, rip)]; block; block = block->next) {
+        if (block->rip == rip) {
+            cache->hits++;
+            *recent = block;
+            return block;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/** Double the number of buckets and rehash all blocks. */
+static bool cache_grow(x64cache_t *cache) {
+    x64block_t **old = cache->buckets;
+    uint32_t old_len = cache->buckets_len;
+
+    cache->buckets = calloc(old_len * 2, sizeof(x64block_t *));
+    if (!cache->buckets) {
+        cache->buckets = old;
+        return false;
+    }
+    cache->buckets_len = old_len * 2;
+
+    for (uint32_t i = 0; i < old_len; i++) {
+        x64block_t *block = old[i];
+        while (block) {
+            x64block_t *next = block->next;
+            uint32_t h = cache_hash(cache, block->rip);
+            block->next = cache->buckets[h];
+            cache->buckets[h] = block;
+            block = next;
+        }
+    }
+
+    free(old);
+    return true;
+}
+
+bool x64cache_insert(x64cache_t *cache, x64block_t *block) {
+    if (cache->blocks_len >= cache->buckets_len && !cache_grow(cache))
+        log_warn("Failed to grow block cache, lookups will get slower");
+
+    uint32_t h = cache_hash(cache, block->rip);
+    block->next = cache->buckets[h];
+    cache->buckets[h] = block;
+    cache->blocks_len++;
+    return true;
+}
+
+void *x64cache_alloc(x64cache_t *cache, size_t size) {
+    x64cache_gen_t *gen = cache->gens + cache->gen;
+    void *mem = cache->arena + cache->gen * cache->gen_size + gen->used;
+
+    gen->used += (size + CACHE_BLOCK_ALIGN - 1) & ~(size_t)(CACHE_BLOCK_ALIGN - 1);
+    gen->blocks++;
+    return mem;
+}
+
+/** Which blocks `cache_retire` retires. */
+typedef struct {
+    uint64_t start, end;    /* guest code the blocks come from */
+    int32_t  gen;           /* generation they are allocated from, or -1 */
+    int32_t  region;        /* part of the code buffer their code is in, or -1 */
+} cache_match_t;
+
+static inline bool cache_matches(x64cache_t *cache, x64block_t *block, const cache_match_t *match) {
+    if (match->gen >= 0)
+        return cache_gen(cache, block) == (uint32_t)match->gen;
+    if (match->region >= 0)
+        return block->regions & (1U << match->region);
+    return block->trace_rip < match->end && block->trace_end > match->start;
+}
+
+/**
+ * Unlink and retire matching blocks, and reset inline caches of the others.
+ * @return Number of blocks retired.
+ */
+static uint32_t cache_retire(x64cache_t *cache, const cache_match_t *match) {
+    uint32_t retired = 0;
+
+    for (uint32_t i = 0; i < cache->buckets_len; i++) {
+        x64block_t **link = cache->buckets + i;
+        while (*link) {
+            x64block_t *block = *link;
+            if (!cache_matches(cache, block, match)) {
+                link = &block->next;
+                continue;
+            }
+
+            *link = block->next;
+            if (cache->recent[cache_recent(block->rip)] == block)
+                cache->recent[cache_recent(block->rip)] = NULL;
+            x64block_unlink(block);
+            block->next = cache->retired;
+            cache->retired = block;
+            retired++;
+        }
+    }
+
+    /* Inline caches do not know which blocks they point to went away. */
+    if (retired) {
+        for (uint32_t i = 0; i < cache->buckets_len; i++) {
+            for (x64block_t *block = cache->buckets[i]; block; block = block->next)
+                x64block_ic_reset(block);
+        }
+    }
+
+    cache->blocks_len -= retired;
+    return retired;
+}
+
+uint32_t x64cache_invalidate(x64cache_t *cache, uint64_t start, uint64_t end) {
+    cache_match_t match = { .start = start, .end = end, .gen = -1, .region = -1 };
+    return cache_retire(cache, &match);
+}
+
+uint32_t x64cache_reserve(x64cache_t *cache) {
+    if (cache->gens[cache->gen].used + X64_BLOCK_MAX_SIZE <= cache->gen_size)
+        return 0;
+
+    /* Blocks of the oldest generation are freed before the next one is allocated. */
+    cache->gen = (cache->gen + 1) % X64_CACHE_GENERATIONS;
+    cache_match_t match = { .gen = cache->gen, .region = -1 };
+    uint32_t retired = cache_retire(cache, &match);
+    cache->evicted += retired;
+    return retired;
+}
+
+uint32_t x64cache_evict_code(x64cache_t *cache, uint32_t region) {
+    cache_match_t match = { .gen = -1, .region = region };
+    uint32_t retired = cache_retire(cache, &match);
+    cache->evicted += retired;
+    return retired;
+}
+
+bool x64cache_free_retired(x64cache_t *cache) {
+    if (!cache->retired) return false;
+
+    while (cache->retired) {
+        x64block_t *next = cache->retired->next;
+        cache_release(cache, cache->retired);
+        cache->retired = next;
+    }
+    return true;
+}
+
+void x64cache_dump_stats(x64cache_t *cache) {
+    log_debug("Block cache: %u blocks, %lu hits, %lu misses, %lu evicted",
+              cache->blocks_len, cache->hits, cache->misses, cache->evicted);
+}
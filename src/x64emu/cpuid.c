@@ -0,0 +1,336 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "x64cpuid.h"
+
+SET_DEBUG_CHANNEL("X64CPUID")
+
+/*
+ * Extensions the emulator executes, presets never advertise more. The guest
+ * runtime picks its string and memory routines from these bits, so each
+ * instruction set is added here with its last instruction, not before.
+ */
+static const uint32_t cpuid_implemented[X64_CPUID_WORDS] = {
+    [X64_CPUID_1_ECX]  = X64_CPUID_1_ECX_SSE3 | X64_CPUID_1_ECX_PCLMULQDQ | X64_CPUID_1_ECX_SSSE3 |
+                         X64_CPUID_1_ECX_SSE41 | X64_CPUID_1_ECX_SSE42 | X64_CPUID_1_ECX_MOVBE |
+                         X64_CPUID_1_ECX_POPCNT | X64_CPUID_1_ECX_AES | X64_CPUID_1_ECX_AVX |
+                         X64_CPUID_1_ECX_FMA,
+    [X64_CPUID_1_EDX]  = X64_CPUID_1_EDX_CMOV | X64_CPUID_1_EDX_MMX | X64_CPUID_1_EDX_SSE |
+                         X64_CPUID_1_EDX_SSE2,
+    [X64_CPUID_7_EBX]  = X64_CPUID_7_EBX_BMI1 | X64_CPUID_7_EBX_AVX2 | X64_CPUID_7_EBX_BMI2 |
+                         X64_CPUID_7_EBX_ERMS | X64_CPUID_7_EBX_SHA,
+    [X64_CPUID_7_EDX]  = X64_CPUID_7_EDX_FSRM,
+    [X64_CPUID_81_ECX] = X64_CPUID_81_ECX_LAHF | X64_CPUID_81_ECX_LZCNT | X64_CPUID_81_ECX_PREFETCHW,
+    [X64_CPUID_81_EDX] = X64_CPUID_81_EDX_SYSCALL | X64_CPUID_81_EDX_NX | X64_CPUID_81_EDX_LM,
+};
+
+#define CPUID_V1_1_EDX (X64_CPUID_1_EDX_FPU | X64_CPUID_1_EDX_CX8 | X64_CPUID_1_EDX_CMOV | \
+                        X64_CPUID_1_EDX_MMX | X64_CPUID_1_EDX_FXSR | X64_CPUID_1_EDX_SSE | \
+                        X64_CPUID_1_EDX_SSE2)
+#define CPUID_V1_81_EDX (X64_CPUID_81_EDX_SYSCALL | X64_CPUID_81_EDX_NX | X64_CPUID_81_EDX_LM)
+#define CPUID_V2_1_ECX (X64_CPUID_1_ECX_SSE3 | X64_CPUID_1_ECX_SSSE3 | X64_CPUID_1_ECX_SSE41 | \
+                        X64_CPUID_1_ECX_SSE42 | X64_CPUID_1_ECX_POPCNT | X64_CPUID_1_ECX_CX16)
+#define CPUID_V3_1_ECX (CPUID_V2_1_ECX | X64_CPUID_1_ECX_AVX | X64_CPUID_1_ECX_FMA | \
+                        X64_CPUID_1_ECX_F16C | X64_CPUID_1_ECX_MOVBE)
+
+/* Feature sets of the presets, before they are limited to the implemented ones. */
+static const struct {
+    const char *name;
+    uint32_t    features[X64_CPUID_WORDS];
+} cpuid_presets[] = {
+    { "x86-64", {
+        [X64_CPUID_1_EDX]  = CPUID_V1_1_EDX,
+        [X64_CPUID_81_EDX] = CPUID_V1_81_EDX,
+    } },
+    { "x86-64-v2", {
+        [X64_CPUID_1_ECX]  = CPUID_V2_1_ECX,
+        [X64_CPUID_1_EDX]  = CPUID_V1_1_EDX,
+        [X64_CPUID_81_ECX] = X64_CPUID_81_ECX_LAHF,
+        [X64_CPUID_81_EDX] = CPUID_V1_81_EDX,
+    } },
+    { "x86-64-v3", {
+        [X64_CPUID_1_ECX]  = CPUID_V3_1_ECX,
+        [X64_CPUID_1_EDX]  = CPUID_V1_1_EDX,
+        [X64_CPUID_7_EBX]  = X64_CPUID_7_EBX_BMI1 | X64_CPUID_7_EBX_AVX2 | X64_CPUID_7_EBX_BMI2,
+        [X64_CPUID_81_ECX] = X64_CPUID_81_ECX_LAHF | X64_CPUID_81_ECX_LZCNT,
+        [X64_CPUID_81_EDX] = CPUID_V1_81_EDX,
+    } },
+    { "max", {
+        [X64_CPUID_1_ECX]  = 0xFFFFFFFF,
+        [X64_CPUID_1_EDX]  = 0xFFFFFFFF,
+        [X64_CPUID_7_EBX]  = 0xFFFFFFFF,
+        [X64_CPUID_7_EDX]  = 0xFFFFFFFF,
+        [X64_CPUID_81_ECX] = 0xFFFFFFFF,
+        [X64_CPUID_81_EDX] = 0xFFFFFFFF,
+    } },
+};
+
+/* Names of the features for overrides, as in /proc/cpuinfo. */
+static const struct {
+    const char *name;
+    uint8_t     word;
+    uint32_t    bit;
+} cpuid_names[] = {
+    { "sse3",      X64_CPUID_1_ECX,  X64_CPUID_1_ECX_SSE3 },
+    { "pclmulqdq", X64_CPUID_1_ECX,  X64_CPUID_1_ECX_PCLMULQDQ },
+    { "ssse3",     X64_CPUID_1_ECX,  X64_CPUID_1_ECX_SSSE3 },
+    { "fma",       X64_CPUID_1_ECX,  X64_CPUID_1_ECX_FMA },
+    { "cx16",      X64_CPUID_1_ECX,  X64_CPUID_1_ECX_CX16 },
+    { "sse4_1",    X64_CPUID_1_ECX,  X64_CPUID_1_ECX_SSE41 },
+    { "sse4_2",    X64_CPUID_1_ECX,  X64_CPUID_1_ECX_SSE42 },
+    { "movbe",     X64_CPUID_1_ECX,  X64_CPUID_1_ECX_MOVBE },
+    { "popcnt",    X64_CPUID_1_ECX,  X64_CPUID_1_ECX_POPCNT },
+    { "aes",       X64_CPUID_1_ECX,  X64_CPUID_1_ECX_AES },
+    { "avx",       X64_CPUID_1_ECX,  X64_CPUID_1_ECX_AVX },
+    { "f16c",      X64_CPUID_1_ECX,  X64_CPUID_1_ECX_F16C },
+    { "fpu",       X64_CPUID_1_EDX,  X64_CPUID_1_EDX_FPU },
+    { "tsc",       X64_CPUID_1_EDX,  X64_CPUID_1_EDX_TSC },
+    { "cx8",       X64_CPUID_1_EDX,  X64_CPUID_1_EDX_CX8 },
+    { "cmov",      X64_CPUID_1_EDX,  X64_CPUID_1_EDX_CMOV },
+    { "clflush",   X64_CPUID_1_EDX,  X64_CPUID_1_EDX_CLFSH },
+    { "mmx",       X64_CPUID_1_EDX,  X64_CPUID_1_EDX_MMX },
+    { "fxsr",      X64_CPUID_1_EDX,  X64_CPUID_1_EDX_FXSR },
+    { "sse",       X64_CPUID_1_EDX,  X64_CPUID_1_EDX_SSE },
+    { "sse2",      X64_CPUID_1_EDX,  X64_CPUID_1_EDX_SSE2 },
+    { "bmi1",      X64_CPUID_7_EBX,  X64_CPUID_7_EBX_BMI1 },
+    { "avx2",      X64_CPUID_7_EBX,  X64_CPUID_7_EBX_AVX2 },
+    { "bmi2",      X64_CPUID_7_EBX,  X64_CPUID_7_EBX_BMI2 },
+    { "erms",      X64_CPUID_7_EBX,  X64_CPUID_7_EBX_ERMS },
+    { "sha_ni",    X64_CPUID_7_EBX,  X64_CPUID_7_EBX_SHA },
+    { "fsrm",      X64_CPUID_7_EDX,  X64_CPUID_7_EDX_FSRM },
+    { "lahf_lm",   X64_CPUID_81_ECX, X64_CPUID_81_ECX_LAHF },
+    { "abm",       X64_CPUID_81_ECX, X64_CPUID_81_ECX_LZCNT },
+    { "3dnowprefetch", X64_CPUID_81_ECX, X64_CPUID_81_ECX_PREFETCHW },
+    { "syscall",   X64_CPUID_81_EDX, X64_CPUID_81_EDX_SYSCALL },
+    { "nx",        X64_CPUID_81_EDX, X64_CPUID_81_EDX_NX },
+    { "lm",        X64_CPUID_81_EDX, X64_CPUID_81_EDX_LM },
+};
+
+/* Features and the one they extend, which must not go while they stay. */
+static const struct {
+    uint8_t     word;
+    uint32_t    bit;
+    uint8_t     needs_word;
+    uint32_t    needs_bit;
+} cpuid_deps[] = {
+    { X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE2,      X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE3,      X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE2 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSSE3,     X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE3 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE41,     X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSSE3 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE42,     X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE41 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_PCLMULQDQ, X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE2 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_AES,       X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE2 },
+    { X64_CPUID_7_EBX, X64_CPUID_7_EBX_SHA,       X64_CPUID_1_EDX, X64_CPUID_1_EDX_SSE2 },
+    /* OSXSAVE and the AVX state of XCR0 follow AVX. */
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_AVX,       X64_CPUID_1_ECX, X64_CPUID_1_ECX_SSE42 },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_FMA,       X64_CPUID_1_ECX, X64_CPUID_1_ECX_AVX },
+    { X64_CPUID_1_ECX, X64_CPUID_1_ECX_F16C,      X64_CPUID_1_ECX, X64_CPUID_1_ECX_AVX },
+    { X64_CPUID_7_EBX, X64_CPUID_7_EBX_AVX2,      X64_CPUID_1_ECX, X64_CPUID_1_ECX_AVX },
+};
+
+/* Highest basic and extended leaves. */
+#define CPUID_MAX_LEAF     0x0000000D
+#define CPUID_MAX_EXT_LEAF 0x80000008
+
+/* Family 6, model 0x3C, stepping 3. */
+#define CPUID_SIGNATURE 0x000306C3
+
+static const char cpuid_vendor[12] = "GenuineIntel";
+static const char cpuid_brand[48] = "flux64 virtual x86-64 CPU";
+
+/* Caches of leaf 4, each private to the single logical processor. */
+static const struct {
+    uint8_t  type;   /* 1 data, 2 instruction, 3 unified */
+    uint8_t  level;
+    uint16_t ways;
+    uint32_t sets;
+} cpuid_caches[] = {
+    { 1, 1, 8,  64 },       /* 32 KiB */
+    { 2, 1, 8,  64 },       /* 32 KiB */
+    { 3, 2, 8,  512 },      /* 256 KiB */
+    { 3, 3, 16, 8192 },     /* 8 MiB */
+};
+
+#define CPUID_LINE 64
+
+/* XSAVE area: legacy region and header, then the AVX state. */
+#define CPUID_XSAVE_AVX_OFFSET 576
+#define CPUID_XSAVE_AVX_SIZE   256
+
+bool x64cpuid_preset(x64cpuid_t *cpuid, const char *name) {
+    for (size_t i = 0; i < sizeof(cpuid_presets) / sizeof(cpuid_presets[0]); i++) {
+        if (strcmp(cpuid_presets[i].name, name)) continue;
+        for (int w = 0; w < X64_CPUID_WORDS; w++)
+            cpuid->features[w] = cpuid_presets[i].features[w] & cpuid_implemented[w];
+        return true;
+    }
+    log_err("Unknown CPU preset %s", name);
+    return false;
+}
+
+/** @return the override name of feature `bit` in `word`. */
+static const char *cpuid_name(uint8_t word, uint32_t bit) {
+    for (size_t i = 0; i < sizeof(cpuid_names) / sizeof(cpuid_names[0]); i++) {
+        if (cpuid_names[i].word == word && cpuid_names[i].bit == bit)
+            return cpuid_names[i].name;
+    }
+    return "?";
+}
+
+/** Disable feature `bit` in `word` and every feature built on it. */
+static void cpuid_disable(x64cpuid_t *cpuid, uint8_t word, uint32_t bit) {
+    cpuid->features[word] &= ~bit;
+    for (size_t i = 0; i < sizeof(cpuid_deps) / sizeof(cpuid_deps[0]); i++) {
+        if (cpuid_deps[i].needs_word == word && cpuid_deps[i].needs_bit == bit &&
+                (cpuid->features[cpuid_deps[i].word] & cpuid_deps[i].bit))
+            cpuid_disable(cpuid, cpuid_deps[i].word, cpuid_deps[i].bit);
+    }
+}
+
+/** Enable feature `bit` in `word`, false if a feature it needs is not there. */
+static bool cpuid_enable(x64cpuid_t *cpuid, uint8_t word, uint32_t bit) {
+    for (size_t i = 0; i < sizeof(cpuid_deps) / sizeof(cpuid_deps[0]); i++) {
+        if (cpuid_deps[i].word != word || cpuid_deps[i].bit != bit) continue;
+        if (!(cpuid->features[cpuid_deps[i].needs_word] & cpuid_deps[i].needs_bit)) {
+            log_err("CPU feature %s needs %s", cpuid_name(word, bit),
+                    cpuid_name(cpuid_deps[i].needs_word, cpuid_deps[i].needs_bit));
+            return false;
+        }
+    }
+    cpuid->features[word] |= bit;
+    return true;
+}
+
+bool x64cpuid_override(x64cpuid_t *cpuid, const char *list) {
+    while (*list) {
+        const char *end = strchr(list, ',');
+        size_t len = end ? (size_t)(end - list) : strlen(list);
+        size_t i;
+
+        if (len < 2 || (*list != '+' && *list != '-')) {
+            log_err("CPU features are +feature or -feature, not %.*s", (int)len, list);
+            return false;
+        }
+        for (i = 0; i < sizeof(cpuid_names) / sizeof(cpuid_names[0]); i++) {
+            if (strlen(cpuid_names[i].name) == len - 1 && !strncmp(cpuid_names[i].name, list + 1, len - 1))
+                break;
+        }
+        if (i == sizeof(cpuid_names) / sizeof(cpuid_names[0])) {
+            log_err("Unknown CPU feature %.*s", (int)len - 1, list + 1);
+            return false;
+        }
+        if (*list == '-') {
+            cpuid_disable(cpuid, cpuid_names[i].word, cpuid_names[i].bit);
+        } else if (cpuid_implemented[cpuid_names[i].word] & cpuid_names[i].bit) {
+            if (!cpuid_enable(cpuid, cpuid_names[i].word, cpuid_names[i].bit))
+                return false;
+        } else {
+            log_err("CPU feature %s is not implemented", cpuid_names[i].name);
+            return false;
+        }
+        list += end ? len + 1 : len;
+    }
+    return true;
+}
+
+uint64_t x64cpuid_xcr0(const x64cpuid_t *cpuid) {
+    if (cpuid->features[X64_CPUID_1_ECX] & X64_CPUID_1_ECX_AVX)
+        return X64_XCR0_X87 | X64_XCR0_SSE | X64_XCR0_AVX;
+    return X64_XCR0_X87 | X64_XCR0_SSE;
+}
+
+/** Deterministic cache parameters of leaf 4, EAX 0 past the last cache. */
+static void cpuid_cache(uint32_t subleaf, uint32_t regs[4]) {
+    if (subleaf >= sizeof(cpuid_caches) / sizeof(cpuid_caches[0]))
+        return;
+    /* Self initializing, sharing and core count fields 0 for one thread. */
+    regs[0] = cpuid_caches[subleaf].type | cpuid_caches[subleaf].level << 5 | 1 << 8;
+    regs[1] = (CPUID_LINE - 1) | (uint32_t)(cpuid_caches[subleaf].ways - 1) << 22;
+    regs[2] = cpuid_caches[subleaf].sets - 1;
+}
+
+void x64cpuid_query(const x64cpuid_t *cpuid, uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    bool avx = cpuid->features[X64_CPUID_1_ECX] & X64_CPUID_1_ECX_AVX;
+
+    /* Leaves past the highest ones and those not listed read as zeros. */
+    memset(regs, 0, 4 * sizeof(regs[0]));
+
+    switch (leaf) {
+        case 0x0:
+            regs[0] = CPUID_MAX_LEAF;
+            memcpy(&regs[1], cpuid_vendor, 4);
+            memcpy(&regs[3], cpuid_vendor + 4, 4);
+            memcpy(&regs[2], cpuid_vendor + 8, 4);
+            break;
+
+        case 0x1:
+            regs[0] = CPUID_SIGNATURE;
+            /* One logical processor, CLFLUSH line size in qwords. */
+            regs[1] = 1 << 16 | (CPUID_LINE / 8) << 8;
+            regs[2] = cpuid->features[X64_CPUID_1_ECX];
+            regs[3] = cpuid->features[X64_CPUID_1_EDX];
+            /* XGETBV is there to check the AVX state is enabled. */
+            if (avx) regs[2] |= X64_CPUID_1_ECX_OSXSAVE;
+            break;
+
+        case 0x2:
+            /* One round, descriptor 0xFF: see leaf 4. */
+            regs[0] = 0xFF01;
+            break;
+
+        case 0x4:
+            cpuid_cache(subleaf, regs);
+            break;
+
+        case 0x7:
+            if (subleaf != 0) break;
+            regs[1] = cpuid->features[X64_CPUID_7_EBX];
+            regs[3] = cpuid->features[X64_CPUID_7_EDX];
+            break;
+
+        case 0xB:
+            /* x2APIC topology: an SMT and a core level of one processor each. */
+            regs[2] = subleaf & 0xFF;
+            if (subleaf < 2) {
+                regs[1] = 1;
+                regs[2] |= (subleaf + 1) << 8;
+            }
+            break;
+
+        case 0xD:
+            if (subleaf == 0) {
+                regs[0] = (uint32_t)x64cpuid_xcr0(cpuid);
+                regs[1] = regs[2] = CPUID_XSAVE_AVX_OFFSET + (avx ? CPUID_XSAVE_AVX_SIZE : 0);
+            } else if (subleaf == 2 && avx) {
+                regs[0] = CPUID_XSAVE_AVX_SIZE;
+                regs[1] = CPUID_XSAVE_AVX_OFFSET;
+            }
+            break;
+
+        case 0x80000000:
+            regs[0] = CPUID_MAX_EXT_LEAF;
+            break;
+
+        case 0x80000001:
+            regs[2] = cpuid->features[X64_CPUID_81_ECX];
+            regs[3] = cpuid->features[X64_CPUID_81_EDX];
+            break;
+
+        case 0x80000002 ... 0x80000004:
+            memcpy(regs, cpuid_brand + (leaf - 0x80000002) * 16, 16);
+            break;
+
+        case 0x80000006:
+            /* L2 size in KiB, 8-way (6), line size. */
+            regs[2] = (cpuid_caches[2].ways * cpuid_caches[2].sets * CPUID_LINE / 1024) << 16 | 6 << 12 | CPUID_LINE;
+            break;
+
+        case 0x80000008:
+            /* 39 bit physical, 48 bit virtual addresses. */
+            regs[0] = 48 << 8 | 39;
+            break;
+    }
+}
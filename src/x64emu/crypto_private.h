@@ -0,0 +1,404 @@
+#ifndef __X64CRYPTO_PRIVATE_H_
+#define __X64CRYPTO_PRIVATE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "x64regs.h"
+
+#include "simd_private.h"
+
+/*
+ * Kernels of CRC32 (SSE4.2), AES-NI, PCLMULQDQ and SHA-NI. They run the
+ * host instructions when the build targets them, table driven code
+ * otherwise: a byte table for CRC32C, the S-boxes with (Inv)MixColumns
+ * on host vectors for AES, and products of 4 bit windows for carry-less
+ * multiplication. SHA has no tables to speak of, its fallback is the
+ * round function of the standard.
+ *
+ * State and message words are dwords of the operands, the first of
+ * the standard in the most significant one.
+ */
+
+/* Vector types of the host builtins. */
+typedef long long crypto_v2di_t __attribute__((vector_size(16)));
+typedef int       crypto_v4si_t __attribute__((vector_size(16)));
+
+
+/* CRC32 */
+
+#if defined(__SSE4_2__)
+
+/** CRC-32C of the `size` low bytes of `v` appended to `crc`, no inversion. */
+static inline uint32_t crypto_crc32(uint32_t crc, uint64_t v, unsigned size) {
+    switch (size) {
+        case 1:  return __builtin_ia32_crc32qi(crc, v);
+        case 2:  return __builtin_ia32_crc32hi(crc, v);
+        case 4:  return __builtin_ia32_crc32si(crc, v);
+        default: return __builtin_ia32_crc32di(crc, v);
+    }
+}
+
+#else
+
+/** CRC-32C of each byte, reflected polynomial 0x82F63B78. */
+static const uint32_t crypto_crc32c_table[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+    0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+    0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+    0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+    0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+    0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+    0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+    0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+    0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+    0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+    0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+    0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+    0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+    0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+    0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+    0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+    0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+    0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+    0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+    0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+    0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+    0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+    0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+    0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+    0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+    0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+    0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+    0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+    0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+    0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+    0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+    0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+    0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+/** CRC-32C of the `size` low bytes of `v` appended to `crc`, no inversion. */
+static inline uint32_t crypto_crc32(uint32_t crc, uint64_t v, unsigned size) {
+    for (unsigned i = 0; i < size; i++, v >>= 8)
+        crc = crypto_crc32c_table[(crc ^ v) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#endif /* __SSE4_2__ */
+
+
+/* AES */
+
+#if defined(__AES__)
+
+static inline simd_t crypto_aesenc(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_aesenc128((crypto_v2di_t)a, (crypto_v2di_t)b);
+}
+
+static inline simd_t crypto_aesenclast(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_aesenclast128((crypto_v2di_t)a, (crypto_v2di_t)b);
+}
+
+static inline simd_t crypto_aesdec(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_aesdec128((crypto_v2di_t)a, (crypto_v2di_t)b);
+}
+
+static inline simd_t crypto_aesdeclast(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_aesdeclast128((crypto_v2di_t)a, (crypto_v2di_t)b);
+}
+
+static inline simd_t crypto_aesimc(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_aesimc128((crypto_v2di_t)b);
+}
+
+/** The builtin takes a constant round constant, it is XORed in afterwards. */
+static inline simd_t crypto_aeskeygenassist(simd_t a, simd_t b, uint8_t imm) {
+    simd_u32_t r = (simd_u32_t)__builtin_ia32_aeskeygenassist128((crypto_v2di_t)b, 0);
+    return (simd_t)(r ^ (simd_u32_t){ 0, imm, 0, imm });
+}
+
+#else
+
+static const uint8_t crypto_aes_sbox[256] = {
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
+
+static const uint8_t crypto_aes_inv_sbox[256] = {
+    0x52, 0x09, 0x6A, 0xD5, 0x30, 0x36, 0xA5, 0x38, 0xBF, 0x40, 0xA3, 0x9E, 0x81, 0xF3, 0xD7, 0xFB,
+    0x7C, 0xE3, 0x39, 0x82, 0x9B, 0x2F, 0xFF, 0x87, 0x34, 0x8E, 0x43, 0x44, 0xC4, 0xDE, 0xE9, 0xCB,
+    0x54, 0x7B, 0x94, 0x32, 0xA6, 0xC2, 0x23, 0x3D, 0xEE, 0x4C, 0x95, 0x0B, 0x42, 0xFA, 0xC3, 0x4E,
+    0x08, 0x2E, 0xA1, 0x66, 0x28, 0xD9, 0x24, 0xB2, 0x76, 0x5B, 0xA2, 0x49, 0x6D, 0x8B, 0xD1, 0x25,
+    0x72, 0xF8, 0xF6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xD4, 0xA4, 0x5C, 0xCC, 0x5D, 0x65, 0xB6, 0x92,
+    0x6C, 0x70, 0x48, 0x50, 0xFD, 0xED, 0xB9, 0xDA, 0x5E, 0x15, 0x46, 0x57, 0xA7, 0x8D, 0x9D, 0x84,
+    0x90, 0xD8, 0xAB, 0x00, 0x8C, 0xBC, 0xD3, 0x0A, 0xF7, 0xE4, 0x58, 0x05, 0xB8, 0xB3, 0x45, 0x06,
+    0xD0, 0x2C, 0x1E, 0x8F, 0xCA, 0x3F, 0x0F, 0x02, 0xC1, 0xAF, 0xBD, 0x03, 0x01, 0x13, 0x8A, 0x6B,
+    0x3A, 0x91, 0x11, 0x41, 0x4F, 0x67, 0xDC, 0xEA, 0x97, 0xF2, 0xCF, 0xCE, 0xF0, 0xB4, 0xE6, 0x73,
+    0x96, 0xAC, 0x74, 0x22, 0xE7, 0xAD, 0x35, 0x85, 0xE2, 0xF9, 0x37, 0xE8, 0x1C, 0x75, 0xDF, 0x6E,
+    0x47, 0xF1, 0x1A, 0x71, 0x1D, 0x29, 0xC5, 0x89, 0x6F, 0xB7, 0x62, 0x0E, 0xAA, 0x18, 0xBE, 0x1B,
+    0xFC, 0x56, 0x3E, 0x4B, 0xC6, 0xD2, 0x79, 0x20, 0x9A, 0xDB, 0xC0, 0xFE, 0x78, 0xCD, 0x5A, 0xF4,
+    0x1F, 0xDD, 0xA8, 0x33, 0x88, 0x07, 0xC7, 0x31, 0xB1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xEC, 0x5F,
+    0x60, 0x51, 0x7F, 0xA9, 0x19, 0xB5, 0x4A, 0x0D, 0x2D, 0xE5, 0x7A, 0x9F, 0x93, 0xC9, 0x9C, 0xEF,
+    0xA0, 0xE0, 0x3B, 0x4D, 0xAE, 0x2A, 0xF5, 0xB0, 0xC8, 0xEB, 0xBB, 0x3C, 0x83, 0x53, 0x99, 0x61,
+    0x17, 0x2B, 0x04, 0x7E, 0xBA, 0x77, 0xD6, 0x26, 0xE1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0C, 0x7D,
+};
+
+/* Bytes of the state are column-major, row r of column c is byte r + 4c. */
+
+/** ShiftRows and InvShiftRows as byte selectors. */
+static const simd_u8_t crypto_aes_shift = { 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11 };
+static const simd_u8_t crypto_aes_inv_shift = { 0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3 };
+
+/** `box` applied to the bytes of `a` picked by `shift`. */
+static inline simd_u8_t crypto_aes_sub(simd_t a, const uint8_t *box, simd_u8_t shift) {
+    simd_u8_t s = __builtin_shuffle((simd_u8_t)a, shift);
+    for (int i = 0; i < 16; i++)
+        s[i] = box[s[i]];
+    return s;
+}
+
+/** Each byte times x in GF(2^8). */
+static inline simd_u8_t crypto_aes_xtime(simd_u8_t a) {
+    return (a << 1) ^ ((simd_u8_t)((simd_s8_t)a >> 7) & 0x1B);
+}
+
+/** Bytes of each column rotated up by `n` rows. */
+#define CRYPTO_AES_ROT(a, n) __builtin_shuffle(a, (simd_u8_t){ \
+    (0 + n) & 3, (1 + n) & 3, (2 + n) & 3, (3 + n) & 3, \
+    4 + ((0 + n) & 3), 4 + ((1 + n) & 3), 4 + ((2 + n) & 3), 4 + ((3 + n) & 3), \
+    8 + ((0 + n) & 3), 8 + ((1 + n) & 3), 8 + ((2 + n) & 3), 8 + ((3 + n) & 3), \
+    12 + ((0 + n) & 3), 12 + ((1 + n) & 3), 12 + ((2 + n) & 3), 12 + ((3 + n) & 3) })
+
+/** MixColumns, 2a0 ^ 3a1 ^ a2 ^ a3 is x(a0 ^ a1) ^ a1 ^ a2 ^ a3. */
+static inline simd_u8_t crypto_aes_mix(simd_u8_t a) {
+    simd_u8_t r1 = CRYPTO_AES_ROT(a, 1);
+    return crypto_aes_xtime(a ^ r1) ^ r1 ^ CRYPTO_AES_ROT(a, 2) ^ CRYPTO_AES_ROT(a, 3);
+}
+
+/** InvMixColumns, MixColumns of a0 ^ x^2(a0 ^ a2) and so on. */
+static inline simd_u8_t crypto_aes_inv_mix(simd_u8_t a) {
+    return crypto_aes_mix(a ^ crypto_aes_xtime(crypto_aes_xtime(a ^ CRYPTO_AES_ROT(a, 2))));
+}
+
+static inline simd_t crypto_aesenc(simd_t a, simd_t b) {
+    return (simd_t)crypto_aes_mix(crypto_aes_sub(a, crypto_aes_sbox, crypto_aes_shift)) ^ b;
+}
+
+static inline simd_t crypto_aesenclast(simd_t a, simd_t b) {
+    return (simd_t)crypto_aes_sub(a, crypto_aes_sbox, crypto_aes_shift) ^ b;
+}
+
+static inline simd_t crypto_aesdec(simd_t a, simd_t b) {
+    return (simd_t)crypto_aes_inv_mix(crypto_aes_sub(a, crypto_aes_inv_sbox, crypto_aes_inv_shift)) ^ b;
+}
+
+static inline simd_t crypto_aesdeclast(simd_t a, simd_t b) {
+    return (simd_t)crypto_aes_sub(a, crypto_aes_inv_sbox, crypto_aes_inv_shift) ^ b;
+}
+
+static inline simd_t crypto_aesimc(simd_t a, simd_t b) {
+    return (simd_t)crypto_aes_inv_mix((simd_u8_t)b);
+}
+
+/** SubWord(RotWord(x)) ^ rcon, SubWord(x) of dwords 1 and 3. */
+static inline simd_t crypto_aeskeygenassist(simd_t a, simd_t b, uint8_t imm) {
+    simd_u32_t s = (simd_u32_t)crypto_aes_sub(b, crypto_aes_sbox, (simd_u8_t){
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 });
+    return (simd_t)((simd_u32_t){ s[1], (s[1] >> 8 | s[1] << 24) ^ imm,
+                                  s[3], (s[3] >> 8 | s[3] << 24) ^ imm });
+}
+
+#undef CRYPTO_AES_ROT
+
+#endif /* __AES__ */
+
+
+/* PCLMULQDQ */
+
+#if defined(__PCLMUL__)
+
+static inline simd_t crypto_clmul64(uint64_t a, uint64_t b) {
+    return (simd_t)__builtin_ia32_pclmulqdq128((crypto_v2di_t){ (long long)a, 0 }, (crypto_v2di_t){ (long long)b, 0 }, 0);
+}
+
+#else
+
+/** Carry-less product, `b` taken 4 bits at a time against multiples of `a`. */
+static inline simd_t crypto_clmul64(uint64_t a, uint64_t b) {
+    uint128_t tab[16], r = 0;
+
+    tab[0] = 0;
+    tab[1] = a;
+    for (int i = 2; i < 16; i += 2) {
+        tab[i] = tab[i / 2] << 1;
+        tab[i + 1] = tab[i] ^ a;
+    }
+    for (int i = 60; i >= 0; i -= 4)
+        r = (r << 4) ^ tab[(b >> i) & 0xF];
+    return (simd_t){ (uint64_t)r, (uint64_t)(r >> 64) };
+}
+
+#endif /* __PCLMUL__ */
+
+/** Carry-less product of the qwords of `a` and `b` picked by `imm` bits 0 and 4, PCLMULQDQ. */
+static inline simd_t crypto_clmul(simd_t a, simd_t b, uint8_t imm) {
+    return crypto_clmul64(a[imm & 1], b[(imm >> 4) & 1]);
+}
+
+
+/* SHA */
+
+#if defined(__SHA__)
+
+/** The builtin takes a constant function selector. */
+static inline simd_t crypto_sha1rnds4(simd_t a, simd_t b, uint8_t imm) {
+    crypto_v4si_t x = (crypto_v4si_t)a, y = (crypto_v4si_t)b;
+    switch (imm & 3) {
+        case 0:  return (simd_t)__builtin_ia32_sha1rnds4(x, y, 0);
+        case 1:  return (simd_t)__builtin_ia32_sha1rnds4(x, y, 1);
+        case 2:  return (simd_t)__builtin_ia32_sha1rnds4(x, y, 2);
+        default: return (simd_t)__builtin_ia32_sha1rnds4(x, y, 3);
+    }
+}
+
+static inline simd_t crypto_sha1nexte(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_sha1nexte((crypto_v4si_t)a, (crypto_v4si_t)b);
+}
+
+static inline simd_t crypto_sha1msg1(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_sha1msg1((crypto_v4si_t)a, (crypto_v4si_t)b);
+}
+
+static inline simd_t crypto_sha1msg2(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_sha1msg2((crypto_v4si_t)a, (crypto_v4si_t)b);
+}
+
+static inline simd_t crypto_sha256rnds2(simd_t a, simd_t b, simd_t k) {
+    return (simd_t)__builtin_ia32_sha256rnds2((crypto_v4si_t)a, (crypto_v4si_t)b, (crypto_v4si_t)k);
+}
+
+static inline simd_t crypto_sha256msg1(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_sha256msg1((crypto_v4si_t)a, (crypto_v4si_t)b);
+}
+
+static inline simd_t crypto_sha256msg2(simd_t a, simd_t b) {
+    return (simd_t)__builtin_ia32_sha256msg2((crypto_v4si_t)a, (crypto_v4si_t)b);
+}
+
+#else
+
+static inline uint32_t crypto_rol32(uint32_t x, unsigned n) { return x << n | x >> (32 - n); }
+static inline uint32_t crypto_ror32(uint32_t x, unsigned n) { return x >> n | x << (32 - n); }
+
+/** Four SHA-1 rounds of function and constant `imm` & 3, state A..D in `a`, W0 + E..W3 in `b`. */
+static inline simd_t crypto_sha1rnds4(simd_t a, simd_t b, uint8_t imm) {
+    static const uint32_t k[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    simd_u32_t s = (simd_u32_t)a, w = (simd_u32_t)b;
+    uint32_t A = s[3], B = s[2], C = s[1], D = s[0], E = 0, f, t;
+
+    for (int i = 0; i < 4; i++) {
+        switch (imm & 3) {
+            case 0:  f = (B & C) ^ (~B & D); break;
+            case 2:  f = (B & C) ^ (B & D) ^ (C & D); break;
+            default: f = B ^ C ^ D; break;
+        }
+        t = f + crypto_rol32(A, 5) + w[3 - i] + E + k[imm & 3];
+        E = D;
+        D = C;
+        C = crypto_rol32(B, 30);
+        B = A;
+        A = t;
+    }
+    return (simd_t)(simd_u32_t){ D, C, B, A };
+}
+
+/** Next E, rotated A of `a`, added to W0 of `b`. */
+static inline simd_t crypto_sha1nexte(simd_t a, simd_t b) {
+    simd_u32_t w = (simd_u32_t)b;
+    w[3] += crypto_rol32(((simd_u32_t)a)[3], 30);
+    return (simd_t)w;
+}
+
+/** W0..W3 of `a` XORed with W2..W5 of `a` and `b`. */
+static inline simd_t crypto_sha1msg1(simd_t a, simd_t b) {
+    simd_u32_t x = (simd_u32_t)a, y = (simd_u32_t)b;
+    return (simd_t)(x ^ (simd_u32_t){ y[2], y[3], x[0], x[1] });
+}
+
+/** W16..W19 from W13..W15 of `b` and the partial sums of `a`. */
+static inline simd_t crypto_sha1msg2(simd_t a, simd_t b) {
+    simd_u32_t x = (simd_u32_t)a, y = (simd_u32_t)b, r;
+    r[3] = crypto_rol32(x[3] ^ y[2], 1);
+    r[2] = crypto_rol32(x[2] ^ y[1], 1);
+    r[1] = crypto_rol32(x[1] ^ y[0], 1);
+    r[0] = crypto_rol32(x[0] ^ r[3], 1);
+    return (simd_t)r;
+}
+
+/** Two SHA-256 rounds, C, D, G, H in `a`, A, B, E, F in `b`, message plus constant in dwords 0 and 1 of `k`. */
+static inline simd_t crypto_sha256rnds2(simd_t a, simd_t b, simd_t k) {
+    simd_u32_t x = (simd_u32_t)a, y = (simd_u32_t)b, wk = (simd_u32_t)k;
+    uint32_t A = y[3], B = y[2], C = x[3], D = x[2], E = y[1], F = y[0], G = x[1], H = x[0], t, u;
+
+    for (int i = 0; i < 2; i++) {
+        t = ((E & F) ^ (~E & G)) + (crypto_ror32(E, 6) ^ crypto_ror32(E, 11) ^ crypto_ror32(E, 25)) + wk[i] + H;
+        u = ((A & B) ^ (A & C) ^ (B & C)) + (crypto_ror32(A, 2) ^ crypto_ror32(A, 13) ^ crypto_ror32(A, 22));
+        H = G;
+        G = F;
+        F = E;
+        E = t + D;
+        D = C;
+        C = B;
+        B = A;
+        A = t + u;
+    }
+    return (simd_t)(simd_u32_t){ F, E, B, A };
+}
+
+/** W0..W3 of `a` plus sigma0 of W1..W4 of `a` and `b`. */
+static inline simd_t crypto_sha256msg1(simd_t a, simd_t b) {
+    simd_u32_t x = (simd_u32_t)a, w = { x[1], x[2], x[3], ((simd_u32_t)b)[0] };
+    return (simd_t)(x + ((w >> 7 | w << 25) ^ (w >> 18 | w << 14) ^ (w >> 3)));
+}
+
+/** W16..W19 from the partial sums of `a` and sigma1 of W14, W15 of `b`. */
+static inline simd_t crypto_sha256msg2(simd_t a, simd_t b) {
+    simd_u32_t x = (simd_u32_t)a, y = (simd_u32_t)b;
+    uint32_t w[4] = { y[2], y[3] };
+
+    for (int i = 0; i < 4; i++) {
+        uint32_t s = w[i];   /* W14 + i */
+        x[i] += crypto_ror32(s, 17) ^ crypto_ror32(s, 19) ^ (s >> 10);
+        if (i < 2) w[i + 2] = x[i];
+    }
+    return (simd_t)x;
+}
+
+#endif /* __SHA__ */
+
+#endif /* __X64CRYPTO_PRIVATE_H_ */
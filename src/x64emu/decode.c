@@ -188,7 +188,8 @@ bool x64decode(x64emu_t *emu, x64instr_t *ins) {
             FETCH_IMM_16_32()
             break;
 
-        case 0xAA ... 0xAB:   /* STOS m8/16/32/64 */
+        case 0xA4 ... 0xA7:   /* MOVS, CMPS m8/16/32/64 */
+        case 0xAA ... 0xAF:   /* STOS, LODS, SCAS m8/16/32/64 */
             break;
 
         case 0xB0 ... 0xB7:   /* MOV+r8 imm8 */
@@ -211,6 +212,11 @@ bool x64decode(x64emu_t *emu, x64instr_t *ins) {
         case 0xC3:            /* RET */
             break;
 
+        case 0xC4 ... 0xC5:   /* VEX */
+            if (!x64decode_vex(emu, ins))
+                return false;
+            break;
+
         case 0xC6:            /* MOV r/m8,imm8 */
             x64modrm_fetch(emu, ins);
             FETCH_IMM_8()
@@ -262,5 +268,9 @@ bool x64decode(x64emu_t *emu, x64instr_t *ins) {
             return false;
     }
 
-    return true;
+    /* Resolve the handler once, including opcode extension,
+       so executing it later needs no dispatch on the opcode. */
+    ins->handler = x64execute_resolve(ins);
+
+    return ins->handler != NULL;
 }
@@ -15,6 +15,10 @@ bool x64decode_0f(x64emu_t *emu, x64instr_t *ins) {
     ins->opcode[1] = fetch_8(emu, ins);
 
     switch (ins->opcode[1]) {
+        case 0x01:            /* XGETBV */
+            x64modrm_fetch(emu, ins);
+            break;
+
         case 0x05:            /* SYSCALL */
             break;
 
@@ -31,6 +35,17 @@ bool x64decode_0f(x64emu_t *emu, x64instr_t *ins) {
             x64modrm_fetch(emu, ins);
             break;
 
+        case 0x38:            /* Three-byte opcodes 0F 38, all with ModR/M */
+            ins->opcode[2] = fetch_8(emu, ins);
+            x64modrm_fetch(emu, ins);
+            break;
+
+        case 0x3A:            /* Three-byte opcodes 0F 3A, all with ModR/M and imm8 */
+            ins->opcode[2] = fetch_8(emu, ins);
+            x64modrm_fetch(emu, ins);
+            FETCH_IMM_8()
+            break;
+
         case 0x40 ... 0x4F:   /* CMOVcc r16/32/64,r/m16/32/64 */
         case 0x50 ... 0x6F:   /* sse1/sse2/mmx opcodes. */
             x64modrm_fetch(emu, ins);
@@ -45,6 +60,9 @@ bool x64decode_0f(x64emu_t *emu, x64instr_t *ins) {
             x64modrm_fetch(emu, ins);
             break;
 
+        case 0x77:            /* EMMS */
+            break;
+
         case 0x7C ... 0x7F:   /* sse2/sse3/mmx opcodes. */
             x64modrm_fetch(emu, ins);
             break;
@@ -60,7 +78,35 @@ bool x64decode_0f(x64emu_t *emu, x64instr_t *ins) {
         case 0xA2:            /* CPUID */
             break;
 
+        case 0xAE:            /* LDMXCSR, STMXCSR, fences */
+            x64modrm_fetch(emu, ins);
+            break;
+
+        case 0xA3:            /* BT r/m,r */
+        case 0xAB:            /* BTS r/m,r */
+        case 0xB3:            /* BTR r/m,r */
+        case 0xBB:            /* BTC r/m,r */
+            x64modrm_fetch(emu, ins);
+            break;
+
         case 0xB6 ... 0xB7:   /* MOVZX r16/32/64,r/m8 / r16/32/64,r/m16 */
+        case 0xB8:            /* POPCNT */
+        case 0xBC ... 0xBD:   /* BSF/TZCNT, BSR/LZCNT */
+            x64modrm_fetch(emu, ins);
+            break;
+
+        case 0xBA:            /* BT, BTS, BTR, BTC r/m,imm8 */
+            x64modrm_fetch(emu, ins);
+            FETCH_IMM_8()
+            break;
+
+        case 0xC2:            /* CMPPS/CMPPD/CMPSS/CMPSD */
+        case 0xC4 ... 0xC6:   /* PINSRW, PEXTRW, SHUFPS/SHUFPD */
+            x64modrm_fetch(emu, ins);
+            FETCH_IMM_8()
+            break;
+
+        case 0xD0 ... 0xFF:   /* sse2/sse3/mmx opcodes. */
             x64modrm_fetch(emu, ins);
             break;
 
@@ -70,3 +116,54 @@ bool x64decode_0f(x64emu_t *emu, x64instr_t *ins) {
     }
     return true;
 }
+
+bool x64decode_vex(x64emu_t *emu, x64instr_t *ins) {
+    uint8_t map = 1, byte;
+
+    /* Other prefixes are not allowed before VEX. */
+    if (ins->rex.byte || ins->operand_sz || ins->rep) {
+        log_err("Prefix before VEX");
+        return false;
+    }
+
+    /* R, X, B and vvvv are stored inverted. */
+    byte = fetch_8(emu, ins);
+    ins->rex.r = !(byte & 0x80);
+    if (ins->opcode[0] == 0xC4) {
+        ins->rex.x = !(byte & 0x40);
+        ins->rex.b = !(byte & 0x20);
+        map = byte & 0x1F;
+        byte = fetch_8(emu, ins);
+        ins->rex.w = byte >> 7;
+    }
+    ins->vex.v = (~byte >> 3) & 0xF;
+    ins->vex.l = (byte >> 2) & 1;
+    switch (byte & 3) {
+        case 1: ins->operand_sz = true; break;
+        case 2: ins->rep = 0xF3; break;
+        case 3: ins->rep = 0xF2; break;
+    }
+    ins->opcode[0] = 0xC4;
+
+    switch (map) {
+        case 1:               /* 0F, three-byte opcodes have maps of their own */
+            if (!x64decode_0f(emu, ins))
+                return false;
+            return ins->opcode[1] != 0x38 && ins->opcode[1] != 0x3A;
+
+        case 2:               /* 0F 38, all with ModR/M */
+            ins->opcode[1] = 0x38;
+            ins->opcode[2] = fetch_8(emu, ins);
+            x64modrm_fetch(emu, ins);
+            return true;
+
+        case 3:               /* 0F 3A, all with ModR/M and imm8 */
+            ins->opcode[1] = 0x3A;
+            ins->opcode[2] = fetch_8(emu, ins);
+            x64modrm_fetch(emu, ins);
+            FETCH_IMM_8()
+            return true;
+    }
+    log_err("Unhandled VEX opcode map %u", map);
+    return false;
+}
@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <signal.h>
 
 #include "debug.h"
 
@@ -8,18 +9,80 @@ SET_DEBUG_CHANNEL("X64EMU")
 
 #include "x64emu.h"
 #include "x64instr.h"
+#include "x64block.h"
+#include "x64cache.h"
+#include "x64jit.h"
 #include "regs_private.h"
 #include "flags_private.h"
 #include "x64stack.h"
 #include "x64flags.h"
+#include "x64mxcsr.h"
+
+/* Emulator the SIGSEGV handler works on, there is only one. */
+static x64emu_t *x64emu_current;
+
+/**
+ * Catch guest writes to write-protected code pages, drop the blocks of the page
+ * and resume the write. Blocks of the page running at the moment finish as decoded.
+ */
+static void x64emu_segv(int sig, siginfo_t *info, void *ucontext) {
+    x64emu_t *emu = x64emu_current;
+    uint64_t addr = (uintptr_t)info->si_addr;
+    (void)ucontext;
+
+    if (emu && info->si_code == SEGV_ACCERR && x64smc_unprotect(&emu->smc, addr)) {
+        uint64_t page = addr & ~(emu->smc.page_size - 1);
+        x64emu_invalidate(emu, page, page + emu->smc.page_size);
+        return;
+    }
+
+    /* A genuine fault, let it kill the process once it runs again. */
+    signal(sig, SIG_DFL);
+}
+
+void x64emu_invalidate(x64emu_t *emu, uint64_t start, uint64_t end) {
+    if (x64cache_invalidate(&emu->cache, start, end))
+        x64shadow_reset(&emu->shadow);
+}
 
 bool x64emu_init(x64emu_t *emu, x64context_t *ctx) {
     if (!emu || !ctx) return false;
 
     emu->ctx = ctx;
 
+    /* The JIT gets half of the budget for its code. */
+    size_t blocks_size = emu->engine == X64_ENGINE_JIT ? emu->cache_size / 2 : emu->cache_size;
+    if (!x64cache_init(&emu->cache, blocks_size)) return false;
+    memset(&emu->shadow, 0, sizeof(x64shadow_t));
+    if (!x64smc_init(&emu->smc, ctx->page_size)) return false;
+
+    struct sigaction sa = { 0 };
+    sa.sa_sigaction = x64emu_segv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL) != 0) {
+        log_err("Failed to install SIGSEGV handler");
+        return false;
+    }
+    x64emu_current = emu;
+
+    if (emu->cache_dir && !x64tcache_open(&emu->tcache, emu->cache_dir, ctx))
+        log_warn("Translation cache is disabled");
+
+    if (emu->engine == X64_ENGINE_JIT) {
+#ifdef HAVE_JIT
+        if (!x64jit_init(&emu->jit, emu->jit_threshold, emu->jit_opt_threshold,
+                         emu->cache_size - blocks_size))
+            return false;
+#else
+        log_err("JIT engine is not supported on this host");
+        return false;
+#endif
+    }
+
     r_eflags |= 2; /* set the reserved second bit. */
     f_IOPL = 3;    /* userspace privileges. */
+    x64mxcsr_load(emu, X64_MXCSR_DEFAULT);
 
     r_rsp = (uintptr_t)ctx->stack.base + ctx->stack.size; /* top of the stack */
     x64stack_setup(emu);
@@ -34,15 +97,23 @@ bool x64emu_init(x64emu_t *emu, x64context_t *ctx) {
 }
 
 #ifdef HAVE_TRACE
-static inline void print_emu_state(x64emu_t *emu, x64instr_t *ins, uint64_t rip) {
+/* Every register and flag may change between two traced instructions, see `x64emu_trace`. */
+#define TRACE_CHANGES_LEN (16 * sizeof("r15: 0x0123456789abcdef   ") + sizeof("rflags: [ ]   ") + 17 * sizeof("IOPL "))
+
+void x64emu_trace(x64emu_t *emu, x64instr_t *ins, uint64_t rip) {
     static x64emu_t emu_saved = { 0 };
 
-    char changes[256] = { 0 };
-    char *target = changes;
+    char changes[TRACE_CHANGES_LEN] = { 0 };
+    size_t len = 0;
+
+    x64flags_materialize(emu);
 
+    /* Appends stop at the end of the buffer rather than past it. */
+#define ADD(...) \
+    if (len < sizeof(changes)) len += snprintf(changes + len, sizeof(changes) - len, __VA_ARGS__);
 #define ADD_REG(reg) \
     if (r_ ## reg != emu_saved.regs[_ ## reg].uq[0]) { \
-        target += sprintf(target, "%s: 0x%016lx   ", #reg, r_ ## reg); \
+        ADD("%s: 0x%016lx   ", #reg, r_ ## reg) \
         emu_saved.regs[_ ## reg].uq[0] = r_ ## reg; \
     }
     ADD_REG(rax) ADD_REG(rcx) ADD_REG(rdx) ADD_REG(rbx)
@@ -52,48 +123,152 @@ static inline void print_emu_state(x64emu_t *emu, x64instr_t *ins, uint64_t rip)
 #undef ADD_REG
 
     if (r_flags != emu_saved.flags.uq[0]) {
-        target += sprintf(target, "rflags: [ ");
-#define ADD_FLAG(flag) if (f_ ## flag) target += sprintf(target, "%s ", #flag);
+        ADD("rflags: [ ")
+#define ADD_FLAG(flag) if (f_ ## flag) ADD("%s ", #flag)
         ADD_FLAG(CF)   ADD_FLAG(PF)   ADD_FLAG(AF)   ADD_FLAG(ZF)
         ADD_FLAG(SF)   ADD_FLAG(TF)   ADD_FLAG(IF)   ADD_FLAG(DF)
         ADD_FLAG(OF)   ADD_FLAG(IOPL) ADD_FLAG(NT)   ADD_FLAG(RF)
         ADD_FLAG(VM)   ADD_FLAG(AC)   ADD_FLAG(VIF)  ADD_FLAG(VIP)
         ADD_FLAG(ID)
 #undef ADD_FLAG
-        target += sprintf(target, "]   ");
+        ADD("]   ")
         emu_saved.flags.uq[0] = r_flags;
     }
+#undef ADD
 
     char instr_str[48] = { 0 };
     for (uint8_t i = 0; i < ins->desc.bytes_len; i++) {
         sprintf(instr_str + i * 3, "%02X ", ins->desc.bytes[i]);
     }
 
-    log_dump("%lx: %-32s %s", rip, instr_str, changes);
+    /* Changes shown are since the previous trace, fused instructions have none of their own. */
+    if (ins->fused)
+        log_dump("%lx: %-32s %s(+%u fused, not traced)", rip, instr_str, changes, ins->fused);
+    else
+        log_dump("%lx: %-32s %s", rip, instr_str, changes);
 }
-#else /* !HAVE_TRACE */
-static inline void print_emu_state(x64emu_t *emu, x64instr_t *ins, uint64_t rip) { }
-#endif
+#endif /* HAVE_TRACE */
 
 void x64emu_run(x64emu_t *emu) {
     if (!emu) return;
+
+    /* Block left last through a direct exit, linked to the next one. */
+    x64block_t *prev = NULL;
+
     while (1) {
-        x64instr_t instr = { 0 };
+        /* The oldest blocks make room for one more once the cache is full. */
+        x64cache_reserve(&emu->cache);
 
-        uint64_t start_rip = r_rip;
+#ifdef HAVE_JIT
+        if (emu->engine == X64_ENGINE_JIT) {
+            /* So does their code once the code buffer is. */
+            if (x64jit_full(&emu->jit))
+                x64cache_evict_code(&emu->cache, x64jit_reclaim(&emu->jit));
+            /* The compiler thread must let go of blocks about to be freed. */
+            if (emu->cache.retired)
+                x64jit_forget(&emu->jit, emu->cache.retired);
+            /* Switch blocks compiled in the background over to their code. */
+            if (x64jit_ready(&emu->jit))
+                x64jit_install(&emu->jit);
+        }
+#endif
 
-        if (!x64decode(emu, &instr))
-            return;
+        /* Nothing runs between blocks, whatever got invalidated can go. */
+        if (x64cache_free_retired(&emu->cache)) {
+            x64shadow_reset(&emu->shadow);
+            prev = NULL;
+        }
+
+        x64block_t *block = prev ? x64block_successor(prev, r_rip) : NULL;
+
+        if (!block) {
+            if (!(block = x64cache_lookup(&emu->cache, r_rip))) {
+                if (!(block = x64tcache_get(&emu->tcache, &emu->cache, r_rip))) {
+                    if (!(block = x64block_build(emu, r_rip)))
+                        return;
+                    x64tcache_add(&emu->tcache, block);
+                }
+                x64cache_insert(&emu->cache, block);
+                x64smc_protect(&emu->smc, block->rip, block->end);
+            }
+
+#ifdef HAVE_JIT
+            /* Link after translating, so the exit jumps to the code. */
+            if (emu->engine == X64_ENGINE_JIT && !block->code && !emu->jit.threshold)
+                x64jit_compile(&emu->jit, block);
+#endif
+            if (prev) x64block_link(prev, block);
+        }
+
+        emu->flags_dead += block->flags_dead;
+
+#ifdef HAVE_JIT
+        /* Blocks the JIT has no room for are interpreted. */
+        if (block->code) {
+#ifdef HAVE_TRACE
+            /* Compiled code, chained blocks included, does not trace, the next trace shows what changed meanwhile. */
+            log_dump("%lx: compiled code, instructions not traced until it exits", r_rip);
+#endif
+            emu->jit_exit = NULL;
+            if (!block->code(emu, 0))
+                return;
+            prev = emu->jit_exit;
 
-        print_emu_state(emu, &instr, start_rip);
+            /* Baseline code of a hot block returned to have it optimized. */
+            if (emu->jit_hot) {
+                x64jit_queue(&emu->jit, emu->jit_hot);
+                emu->jit_hot = NULL;
+            }
+            continue;
+        }
 
-        if (!x64execute(emu, &instr))
+        /* Cold blocks stay interpreted, hot ones keep being so until their code is ready. */
+        if (emu->engine == X64_ENGINE_JIT && emu->jit.threshold && block->tier == X64_TIER_COLD &&
+                ++block->hits >= emu->jit.threshold)
+            x64jit_queue(&emu->jit, block);
+#endif
+
+        if (!x64execute(emu, block->instrs))
             return;
+        prev = block;
+
+        /* Translated calls and returns use the shadow stack themselves. */
+        if (block->call) {
+            x64shadow_push(&emu->shadow, block->end, block, NULL);
+        } else if (block->ret) {
+            /* Continue through the return exit of the calling block. */
+            x64shadow_entry_t *entry = x64shadow_pop(&emu->shadow, r_rip);
+            if (entry) prev = entry->caller;
+        }
     }
 }
 
 bool x64emu_free(x64emu_t *emu) {
     if (!emu) return true;
+
+#ifdef HAVE_JIT
+    /* The compiler thread reads blocks freed below. */
+    if (emu->engine == X64_ENGINE_JIT)
+        x64jit_stop(&emu->jit);
+#endif
+
+    x64cache_dump_stats(&emu->cache);
+    log_debug("Shadow stack: %lu returns predicted, %lu mispredicted",
+              emu->shadow.hits, emu->shadow.misses);
+    log_debug("Flag liveness: %lu flag computations eliminated", emu->flags_dead);
+    log_debug("Self-modifying code: %lu writes to cached code", emu->smc.faults);
+    x64tcache_close(&emu->tcache, &emu->cache);
+    x64cache_free(&emu->cache);
+    x64smc_free(&emu->smc);
+    x64emu_current = NULL;
+
+#ifdef HAVE_JIT
+    if (emu->engine == X64_ENGINE_JIT) {
+        x64jit_dump_stats(&emu->jit);
+        x64jit_free(&emu->jit);
+    }
+#endif
+
     if (!x64context_free(emu->ctx))
         return false;
     return true;
@@ -2,12 +2,15 @@
 #include <stdint.h>
 
 #include "debug.h"
+#include "x64cpuid.h"
 #include "x64emu.h"
 #include "x64instr.h"
 #include "x64modrm.h"
 
 #include "regs_private.h"
+#include "flags_private.h"
 #include "execute_private.h"
+#include "simd_private.h"
 
 SET_DEBUG_CHANNEL("X64EXECUTE_0F")
 
@@ -19,265 +22,253 @@ SET_DEBUG_CHANNEL("X64EXECUTE_0F")
     reg128_t *dest = (reg128_t *)x64modrm_get_xmm_m(emu, ins); \
     reg128_t *src = (reg128_t *)x64modrm_get_xmm(emu, ins);
 
-#define DEST_MMX_SRC_MMX_M() \
-    reg64_t *dest = (reg64_t *)x64modrm_get_mmx(emu, ins); \
-    reg64_t *src = (reg64_t *)x64modrm_get_mmx_m(emu, ins);
+X64_HANDLER(x64execute_0f_05) { /* SYSCALL */
+    r_rip = x64instr_next(ins, r_rip);
+    return x64syscall(emu);
+}
 
-#define DEST_MMX_M_SRC_MMX() \
-    reg64_t *dest = (reg64_t *)x64modrm_get_mmx_m(emu, ins); \
-    reg64_t *src = (reg64_t *)x64modrm_get_mmx(emu, ins);
+X64_HANDLER(x64execute_0f_0d) { /* NOP r/m16/32 */
+    return true;
+}
 
-#define OP_INTERLEAVE_LOW(op_type, times) \
-    for (int i = 0; i < times; i++) { \
-        dest->u ## op_type[i * 2] = dest->u ## op_type[i]; \
-        dest->u ## op_type[i * 2 + 1] = src->u ## op_type[i]; \
-    }
+X64_HANDLER(x64execute_0f_10) { /* xmm,xmm/m */
+    DEST_XMM_SRC_XMM_M()
+    if (ins->rep == 0xF3)                      /* MOVSS xmm,xmm/m32 */
+        if (ins->modrm.mod == 3) dest->ud[0] = src->ud[0];
+        else                     dest->uo[0] = (uint128_t)src->ud[0];
+    else if (ins->rep == 0xF2)                 /* MOVSD xmm,xmm/m64 */
+        if (ins->modrm.mod == 3) dest->uq[0] = src->uq[0];
+        else                     dest->uo[0] = (uint128_t)src->uq[0];
+    else                                       /* MOVUPS/MOVUPD xmm,xmm/m128 */
+        simd_store(dest, simd_load(src));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_11) { /* xmm/m,xmm */
+    DEST_XMM_M_SRC_XMM()
+    if (ins->rep == 0xF3)                      /* MOVSS xmm/m32,xmm */
+        dest->ud[0] = src->ud[0];
+    else if (ins->rep == 0xF2)                 /* MOVSD xmm/m64,xmm */
+        dest->uq[0] = src->uq[0];
+    else                                       /* MOVUPS/MOVUPD xmm/m128,xmm */
+        simd_store(dest, simd_load(src));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_12) { /* xmm,xmm/m */
+    DEST_XMM_SRC_XMM_M()
+    if (ins->rep == 0xF3) {                    /* MOVSLDUP xmm,xmm/m128 */
+        dest->ud[0] = dest->ud[1] = src->ud[0];
+        dest->ud[2] = dest->ud[3] = src->ud[2];
+    } else if (ins->rep == 0xF2) {             /* MOVDDUP xmm,xmm/m64 */
+        dest->uq[0] = dest->uq[1] = src->uq[0];
+    } else if (ins->operand_sz) {              /* MOVLPD xmm,m64 */
+        /* FIXME: This is not xmm/m64. */
+        dest->uq[0] = src->uq[0];
+    } else                                     /* MOVLPS/MOVHLPS xmm,xmm/m64 */
+        dest->uq[0] = src->uq[ins->modrm.mod == 3];
+    return true;
+}
 
-#define OP_INTERLEAVE_HIGH(op_type, times) \
-    for (int i = 0; i < times; i++) { \
-        dest->u ## op_type[i * 2] = dest->u ## op_type[i + times]; \
-        dest->u ## op_type[i * 2 + 1] = src->u ## op_type[i + times]; \
+X64_HANDLER(x64execute_0f_13) { /* MOVLPS/MOVLPD m64,xmm */
+    /* FIXME: this is not xmm/m64. */
+    DEST_XMM_M_SRC_XMM()
+    dest->uq[0] = src->uq[0];
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_14) { /* xmm,xmm/m */
+    DEST_XMM_SRC_XMM_M()
+    if (ins->operand_sz)                       /* UNPCKLPD xmm,xmm/m128 */
+        simd_store(dest, simd_unpacklo64(simd_load(dest), simd_load(src)));
+    else                                       /* UNPCKLPS xmm,xmm/m128 */
+        simd_store(dest, simd_unpacklo32(simd_load(dest), simd_load(src)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_15) { /* xmm,xmm/m */
+    DEST_XMM_SRC_XMM_M()
+    if (ins->operand_sz)                       /* UNPCKHPD xmm,xmm/m128 */
+        simd_store(dest, simd_unpackhi64(simd_load(dest), simd_load(src)));
+    else                                       /* UNPCKHPS xmm,xmm/m128 */
+        simd_store(dest, simd_unpackhi32(simd_load(dest), simd_load(src)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_16) { /* xmm,xmm/m */
+    DEST_XMM_SRC_XMM_M()
+    if (ins->rep == 0xF3) {                    /* MOVSHDUP xmm,xmm/m128 */
+        dest->ud[0] = dest->ud[1] = src->ud[1];
+        dest->ud[2] = dest->ud[3] = src->ud[3];
+    } else if (ins->operand_sz) {              /* MOVHPD xmm,m64 */
+        /* FIXME: This is not xmm/m. */
+        dest->uq[0] = src->uq[1];
+    } else {                                   /* MOVLHPS/MOVHPS xmm,xmm/m64 */
+        dest->uq[1] = src->uq[0];
     }
+    return true;
+}
 
-bool x64execute_0f(x64emu_t *emu, x64instr_t *ins) {
-    uint8_t op = ins->opcode[1];
+X64_HANDLER(x64execute_0f_17) { /* MOVHPS/MOVHPD m64,xmm */
+    /* FIXME: this is not xmm/m. */
+    DEST_XMM_M_SRC_XMM()
+    dest->uq[1] = src->uq[0];
+    return true;
+}
 
-    switch (op) {
-        case 0x05:            /* SYSCALL */
-            if (!x64syscall(emu))
-                return false;
-            break;
-
-        case 0x0D:            /* NOP r/m16/32 */
-            break;
-
-        case 0x10: {          /* xmm,xmm/m */
-            DEST_XMM_SRC_XMM_M()
-            if (ins->rep == 0xF3)                      /* MOVSS xmm,xmm/m32 */
-                if (ins->modrm.mod == 3) dest->ud[0] = src->ud[0];
-                else                     dest->uo[0] = (uint128_t)src->ud[0];
-            else if (ins->rep == 0xF2)                 /* MOVSD xmm,xmm/m64 */
-                if (ins->modrm.mod == 3) dest->uq[0] = src->uq[0];
-                else                     dest->uo[0] = (uint128_t)src->uq[0];
-            else                                       /* MOVUPS/MOVUPD xmm,xmm/m128 */
-                dest->uo[0] = src->uo[0];
-            break;
-        }
-
-        case 0x11: {          /* xmm/m,xmm */
-            DEST_XMM_M_SRC_XMM()
-            if (ins->rep == 0xF3)                      /* MOVSS xmm/m32,xmm */
-                dest->ud[0] = src->ud[0];
-            else if (ins->rep == 0xF2)                 /* MOVSD xmm/m64,xmm */
-                dest->uq[0] = src->uq[0];
-            else                                       /* MOVUPS/MOVUPD xmm/m128,xmm */
-                dest->uo[0] = src->uo[0];
-            break;
-        }
-
-        case 0x12: {          /* xmm,xmm/m */
-            DEST_XMM_SRC_XMM_M()
-            if (ins->rep == 0xF3) {                    /* MOVSLDUP xmm,xmm/m64 */
-                dest->ud[0] = dest->ud[1] = src->ud[0];
-                dest->ud[2] = dest->ud[3] = src->ud[1];
-            } else if (ins->rep == 0xF2) {             /* MOVDDUP xmm,xmm/m64 */
-                dest->uq[0] = dest->uq[1] = src->uq[0];
-            } else if (ins->operand_sz) {              /* MOVLPD xmm,m64 */
-                /* FIXME: This is not xmm/m64. */
-                dest->uq[0] = src->uq[0];
-            } else                                     /* MOVLPS/MOVHLPS xmm,xmm/m64 */
-                dest->uq[0] = src->uq[ins->modrm.mod == 3];
-            break;
-        }
-
-        case 0x13: {          /* MOVLPS/MOVLPD m64,xmm */
-            /* FIXME: this is not xmm/m64. */
-            DEST_XMM_M_SRC_XMM()
-            dest->uq[0] = src->uq[0];
-            break;
-        }
-
-        case 0x14: {          /* xmm,xmm/m */
-            DEST_XMM_SRC_XMM_M()
-            if (ins->operand_sz) {                     /* UNPCKLPD xmm,xmm/m128 */
-                OP_INTERLEAVE_LOW(q, 1)
-            } else {                                   /* UNPCKLPS xmm,xmm/m128 */
-                OP_INTERLEAVE_LOW(d, 2)
-            }
-            break;
-        }
-
-        case 0x15: {          /* xmm,xmm/m */
-            DEST_XMM_SRC_XMM_M()
-            if (ins->operand_sz) {                     /* UNPCKHPD xmm,xmm/m128 */
-                OP_INTERLEAVE_HIGH(q, 1)
-            } else {                                   /* UNPCKHPS xmm,xmm/m128 */
-                OP_INTERLEAVE_HIGH(d, 2)
-            }
-            break;
-        }
-
-        case 0x16: {          /* xmm,xmm/m */
-            DEST_XMM_SRC_XMM_M()
-            if (ins->rep == 0xF3) {                    /* MOVSHDUP xmm,xmm/m64 */
-                dest->ud[0] = dest->ud[1] = src->ud[1];
-                dest->ud[2] = dest->ud[3] = src->ud[3];
-            } else if (ins->operand_sz) {              /* MOVHPD xmm,m64 */
-                /* FIXME: This is not xmm/m. */
-                dest->uq[0] = src->uq[1];
-            } else {                                   /* MOVLHPS/MOVHPS xmm,xmm/m64 */
-                dest->uq[1] = src->uq[0];
-            }
-            break;
-        }
-
-        case 0x17: {          /* MOVHPS/MOVHPD m64,xmm */
-            /* FIXME: this is not xmm/m. */
-            DEST_XMM_M_SRC_XMM()
-            dest->uq[1] = src->uq[0];
-            break;
-        }
+X64_HANDLER(x64execute_0f_hint_nop) { /* HINT_NOP */
+    return true;
+}
 
-        case 0x18 ... 0x1F:   /* HINT_NOP */
-            break;
-
-        case 0x28: {          /* MOVAPS/MOVAPD xmm,xmm/m128 */
-            DEST_XMM_SRC_XMM_M()
-            dest->uo[0] = src->uo[0];
-            break;
-        }
-
-        case 0x29: {          /* MOVAPS/MOVAPD xmm/m128,xmm */
-            DEST_XMM_M_SRC_XMM()
-            dest->uo[0] = src->uo[0];
-            break;
-        }
-
-        case 0x2B: {          /* MOVNTPS/MOVNTPD m128,xmm */
-            /* FIXME: this is not xmm/m */
-            DEST_XMM_M_SRC_XMM()
-            dest->uo[0] = src->uo[0];
-            break;
-        }
+X64_HANDLER(x64execute_0f_28) { /* MOVAPS/MOVAPD xmm,xmm/m128 */
+    DEST_XMM_SRC_XMM_M()
+    simd_store(dest, simd_load(src));
+    return true;
+}
 
-        case 0x40 ... 0x4F:   /* CMOVcc r16/32/64,r/m16/32/64 */
-            if (x64execute_jmp_cond(emu, ins, op))
-                OP2_16_32_64(REG, R_M, OP_U_MOV, U_64)
-            break;
-
-        case 0x60: {          /* PUNPCKLBW */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_LOW(b, 8)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_LOW(b, 4)
-            }
-            break;
-        }
-
-        case 0x61: {          /* PUNPCKLWD */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_LOW(w, 4)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_LOW(w, 2)
-            }
-            break;
-        }
-
-        case 0x62: {          /* PUNPCKLDQ */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_LOW(d, 2)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_LOW(d, 1)
-            }
-            break;
-        }
-
-        case 0x68: {          /* PUNPCKHBW */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_HIGH(b, 8)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_HIGH(b, 4)
-            }
-            break;
-        }
-
-        case 0x69: {          /* PUNPCKHWD */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_HIGH(w, 4)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_HIGH(w, 2)
-            }
-            break;
-        }
-
-        case 0x6A: {          /* PUNPCKHDQ */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                OP_INTERLEAVE_HIGH(d, 2)
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                OP_INTERLEAVE_HIGH(d, 1)
-            }
-            break;
-        }
-
-        case 0x6E:            /* MOVD/MOVQ */
-            if (ins->operand_sz) {                     /* xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                dest->uo[0] = (ins->rex.w) ? (uint128_t)src->uq[0] : (uint128_t)src->ud[0];
-            } else {                                   /* mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                dest->uq[0] = (ins->rex.w) ? src->uq[0] : (uint64_t)src->ud[0];
-            }
-            break;
-
-        case 0x6F:            /*  */
-            if (ins->operand_sz || ins->rep == 0xF3) { /* MOVDQA/MOVDQU xmm,xmm/m */
-                DEST_XMM_SRC_XMM_M()
-                dest->uo[0] = src->uo[0];
-            } else {                                   /* MOVQ mmx,mmx/m */
-                DEST_MMX_SRC_MMX_M()
-                dest->uq[0] = src->uq[0];
-            }
-            break;
+X64_HANDLER(x64execute_0f_29) { /* MOVAPS/MOVAPD xmm/m128,xmm */
+    DEST_XMM_M_SRC_XMM()
+    simd_store(dest, simd_load(src));
+    return true;
+}
 
-        case 0x80 ... 0x8F:   /* Jcc rel16/32 */
-            if (x64execute_jmp_cond(emu, ins, op))
-                r_rip += (ins->operand_sz) ? (int64_t)ins->imm.sw[0] : (int64_t)ins->imm.sd[0];
-            break;
+X64_HANDLER(x64execute_0f_2b) { /* MOVNTPS/MOVNTPD m128,xmm */
+    /* FIXME: this is not xmm/m */
+    DEST_XMM_M_SRC_XMM()
+    simd_store(dest, simd_load(src));
+    return true;
+}
+
+#define CMOVCC(cc) \
+    if (x64execute_jmp_cond(emu, ins, cc)) \
+        OP2_16_32_64(REG, R_M, OP_U_MOV, U_64) \
+    return true;
+X64_HANDLER_CC(x64execute_cmovcc, CMOVCC)   /* CMOVcc r16/32/64,r/m16/32/64 */
+#undef CMOVCC
+
+#define JCC_REL32(cc) \
+    r_rip = x64instr_next(ins, r_rip); \
+    if (x64execute_jmp_cond(emu, ins, cc)) \
+        r_rip += (ins->operand_sz) ? (int64_t)ins->imm.sw[0] : (int64_t)ins->imm.sd[0]; \
+    return true;
+X64_HANDLER_CC(x64execute_jcc_rel32, JCC_REL32)   /* Jcc rel16/32 */
+#undef JCC_REL32
+
+#define SETCC(cc) \
+    void *dest = x64modrm_get_r_m(emu, ins); \
+    *(uint8_t *)dest = x64execute_jmp_cond(emu, ins, cc) ? 1 : 0; \
+    return true;
+X64_HANDLER_CC(x64execute_setcc, SETCC)   /* SETcc r/m8 */
+#undef SETCC
+
+X64_HANDLER(x64execute_0f_01_d0) { /* XGETBV */
+    if (r_ecx != 0) {
+        log_err("XGETBV of XCR%u", r_ecx);
+        return false;
+    }
+    uint64_t xcr0 = x64cpuid_xcr0(&emu->cpuid);
+    r_rax = (uint32_t)xcr0;
+    r_rdx = xcr0 >> 32;
+    return true;
+}
 
-        case 0x90 ... 0x9F: { /* SETcc r/m8 */
-            void *dest = x64modrm_get_r_m(emu, ins);
-            *(uint8_t *)dest = x64execute_jmp_cond(emu, ins, op) ? 1 : 0;
-            break;
-        }
+X64_HANDLER(x64execute_0f_a2) { /* CPUID */
+    uint32_t regs[4];
+    x64cpuid_query(&emu->cpuid, r_eax, r_ecx, regs);
+    r_rax = regs[0];
+    r_rbx = regs[1];
+    r_rcx = regs[2];
+    r_rdx = regs[3];
+    return true;
+}
 
-        case 0xA2:            /* CPUID */
-            /* FIXME: implement that. */
-            r_eax = r_ebx = r_ecx = r_edx = 0;
-            break;
+X64_HANDLER(x64execute_0f_b6) { /* MOVZX r16/32/64,r/m8 */
+    OP2_16_32_64(REG, R_M, OP_U_MOV, U_8)
+    return true;
+}
 
-        case 0xB6:            /* MOVZX r16/32/64,r/m8 */
-            OP2_16_32_64(REG, R_M, OP_U_MOV, U_8)
-            break;
+X64_HANDLER(x64execute_0f_b7) { /* MOVZX r16/32/64,r/m16 */
+    OP2_16_32_64(REG, R_M, OP_U_MOV, U_16)
+    return true;
+}
 
-        case 0xB7:            /* MOVZX r16/32/64,r/m16 */
-            OP2_16_32_64(REG, R_M, OP_U_MOV, U_16)
-            break;
+x64handler_t x64execute_resolve_0f(x64instr_t *ins) {
+    uint8_t op = ins->opcode[1];
+    x64handler_t handler;
+
+    switch (op) {
+        case 0x01:
+            if (ins->modrm.byte == 0xD0) return x64execute_0f_01_d0;
+            log_err("Unimplemented opcode 0F 01 %02X", ins->modrm.byte);
+            return NULL;
+        case 0x05: return x64execute_0f_05;
+        case 0x0D: return x64execute_0f_0d;
+        case 0x10: return x64execute_0f_10;
+        case 0x11: return x64execute_0f_11;
+        case 0x12: return x64execute_0f_12;
+        case 0x13: return x64execute_0f_13;
+        case 0x14: return x64execute_0f_14;
+        case 0x15: return x64execute_0f_15;
+        case 0x16: return x64execute_0f_16;
+        case 0x17: return x64execute_0f_17;
+        case 0x18 ... 0x1F:   /* HINT_NOP */
+            return x64execute_0f_hint_nop;
+        case 0x28: return x64execute_0f_28;
+        case 0x29: return x64execute_0f_29;
+        case 0x2B: return x64execute_0f_2b;
+        case 0x38:            /* Three-byte opcodes */
+            if (!(handler = x64execute_resolve_0f38(ins)))
+                log_err("Unimplemented opcode 0F 38 %02X", ins->opcode[2]);
+            return handler;
+        case 0x3A:
+            if (!(handler = x64execute_resolve_0f3a(ins)))
+                log_err("Unimplemented opcode 0F 3A %02X", ins->opcode[2]);
+            return handler;
+        case 0x40 ... 0x4F:   /* CMOVcc r16/32/64,r/m16/32/64 */
+            return x64execute_cmovcc[op & 0xF];
+        case 0x80 ... 0x8F:   /* Jcc rel16/32 */
+            return x64execute_jcc_rel32[op & 0xF];
+        case 0x90 ... 0x9F:   /* SETcc r/m8 */
+            return x64execute_setcc[op & 0xF];
+        case 0xA2: return x64execute_0f_a2;
+        case 0xB6: return x64execute_0f_b6;
+        case 0xB7: return x64execute_0f_b7;
+
+        case 0xA3:
+        case 0xAB:
+        case 0xB3:
+        case 0xBA ... 0xBB:   /* BT, BTS, BTR, BTC */
+        case 0xB8:
+        case 0xBC ... 0xBD:   /* POPCNT, BSF/TZCNT, BSR/LZCNT */
+            if (!(handler = x64execute_resolve_bmi(ins)))
+                log_err("Unimplemented opcode 0F %02X", op);
+            return handler;
+
+        case 0x2A:
+        case 0x2C ... 0x2F:
+        case 0x50 ... 0x53:
+        case 0x58 ... 0x5F:
+        case 0x7C ... 0x7D:
+        case 0xAE:
+        case 0xC2:
+        case 0xD0:
+        case 0xE6:            /* SSE floating point, MXCSR */
+            if (!(handler = x64execute_resolve_fp(ins)))
+                log_err("Unimplemented opcode 0F %02X", op);
+            return handler;
+
+        case 0x54 ... 0x57:   /* SSE bitwise */
+        case 0x60 ... 0x7B:   /* MMX/SSE2 integer */
+        case 0x7E ... 0x7F:
+        case 0xC4 ... 0xC6:
+        case 0xD1 ... 0xE5:
+        case 0xE7 ... 0xFF:
+            if (!(handler = x64execute_resolve_sse(ins)))
+                log_err("Unimplemented opcode 0F %02X", op);
+            return handler;
 
         default:
             log_err("Unimplemented opcode 0F %02X", op);
-            return false;
+            return NULL;
     }
-    return true;
 }
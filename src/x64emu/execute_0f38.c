@@ -0,0 +1,406 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "execute_private.h"
+#include "simd_private.h"
+#include "fp_private.h"
+#include "pcmpstr_private.h"
+#include "crypto_private.h"
+
+/*
+ * Three-byte opcode maps 0F 38 and 0F 3A, the third byte is `opcode[2]`.
+ * Every instruction of both has ModR/M, those of 0F 3A an imm8 as well.
+ * SSSE3 and SSE4 instructions work on xmm,xmm/m128 with 66 prefix and run
+ * the kernels of simd_private.h, their VEX forms in execute_avx_0f38.c
+ * share them. CRC32, AES, PCLMULQDQ and SHA run those of crypto_private.h,
+ * SHA without prefix and CRC32 with F2.
+ */
+
+/** `kernel(dest, src)` to dest. */
+#define SSE_0F38(op, kernel) \
+    X64_HANDLER(x64execute_66_0f38_ ## op) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)))); \
+        return true; \
+    }
+
+/** `kernel(dest, src, imm8)` to dest. */
+#define SSE_0F3A(op, kernel) \
+    X64_HANDLER(x64execute_66_0f3a_ ## op) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)), ins->imm.ub[0])); \
+        return true; \
+    }
+
+/** `kernel(dest, src, xmm0)` to dest, the mask register is implied. */
+#define SSE_BLENDV(op, kernel) \
+    X64_HANDLER(x64execute_66_0f38_ ## op) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_t src = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        simd_store(dest, kernel(simd_load(dest), src, simd_load(&emu->xmm[0]))); \
+        return true; \
+    }
+
+/** PMOVSX/PMOVZX, reading `size` bytes of xmm/m. */
+#define SSE_EXTEND(op, kernel, size) \
+    X64_HANDLER(x64execute_66_0f38_ ## op) { \
+        simd_t v = { 0, 0 }; \
+        memcpy(&v, x64modrm_get_xmm_m(emu, ins), size); \
+        simd_store(x64modrm_get_xmm(emu, ins), kernel(v, v)); \
+        return true; \
+    }
+
+SSE_0F38(00, simd_shuffle8)                 /* PSHUFB */
+SSE_0F38(01, simd_hadd16)                   /* PHADDW */
+SSE_0F38(02, simd_hadd32)                   /* PHADDD */
+SSE_0F38(03, simd_hadds16)                  /* PHADDSW */
+SSE_0F38(04, simd_maddubs16)                /* PMADDUBSW */
+SSE_0F38(05, simd_hsub16)                   /* PHSUBW */
+SSE_0F38(06, simd_hsub32)                   /* PHSUBD */
+SSE_0F38(07, simd_hsubs16)                  /* PHSUBSW */
+SSE_0F38(08, simd_sign8)                    /* PSIGNB */
+SSE_0F38(09, simd_sign16)                   /* PSIGNW */
+SSE_0F38(0a, simd_sign32)                   /* PSIGND */
+SSE_0F38(0b, simd_mulhrs16)                 /* PMULHRSW */
+SSE_BLENDV(10, simd_blendv8)                /* PBLENDVB */
+SSE_BLENDV(14, simd_blendv32)               /* BLENDVPS */
+SSE_BLENDV(15, simd_blendv64)               /* BLENDVPD */
+SSE_0F38(1c, simd_abs8)                     /* PABSB */
+SSE_0F38(1d, simd_abs16)                    /* PABSW */
+SSE_0F38(1e, simd_abs32)                    /* PABSD */
+SSE_EXTEND(20, simd_movsx8to16,  8)         /* PMOVSXBW */
+SSE_EXTEND(21, simd_movsx8to32,  4)         /* PMOVSXBD */
+SSE_EXTEND(22, simd_movsx8to64,  2)         /* PMOVSXBQ */
+SSE_EXTEND(23, simd_movsx16to32, 8)         /* PMOVSXWD */
+SSE_EXTEND(24, simd_movsx16to64, 4)         /* PMOVSXWQ */
+SSE_EXTEND(25, simd_movsx32to64, 8)         /* PMOVSXDQ */
+SSE_0F38(28, simd_muls32)                   /* PMULDQ */
+SSE_0F38(29, simd_cmpeq64)                  /* PCMPEQQ */
+SSE_0F38(2b, simd_packus32)                 /* PACKUSDW */
+SSE_EXTEND(30, simd_movzx8to16,  8)         /* PMOVZXBW */
+SSE_EXTEND(31, simd_movzx8to32,  4)         /* PMOVZXBD */
+SSE_EXTEND(32, simd_movzx8to64,  2)         /* PMOVZXBQ */
+SSE_EXTEND(33, simd_movzx16to32, 8)         /* PMOVZXWD */
+SSE_EXTEND(34, simd_movzx16to64, 4)         /* PMOVZXWQ */
+SSE_EXTEND(35, simd_movzx32to64, 8)         /* PMOVZXDQ */
+SSE_0F38(37, simd_cmpgt64)                  /* PCMPGTQ */
+SSE_0F38(38, simd_mins8)                    /* PMINSB */
+SSE_0F38(39, simd_mins32)                   /* PMINSD */
+SSE_0F38(3a, simd_minu16)                   /* PMINUW */
+SSE_0F38(3b, simd_minu32)                   /* PMINUD */
+SSE_0F38(3c, simd_maxs8)                    /* PMAXSB */
+SSE_0F38(3d, simd_maxs32)                   /* PMAXSD */
+SSE_0F38(3e, simd_maxu16)                   /* PMAXUW */
+SSE_0F38(3f, simd_maxu32)                   /* PMAXUD */
+SSE_0F38(40, simd_mullo32)                  /* PMULLD */
+SSE_0F38(41, simd_minpos16)                 /* PHMINPOSUW */
+SSE_0F38(db, crypto_aesimc)                 /* AESIMC */
+SSE_0F38(dc, crypto_aesenc)                 /* AESENC */
+SSE_0F38(dd, crypto_aesenclast)             /* AESENCLAST */
+SSE_0F38(de, crypto_aesdec)                 /* AESDEC */
+SSE_0F38(df, crypto_aesdeclast)             /* AESDECLAST */
+
+X64_HANDLER(x64execute_66_0f38_17) { /* PTEST xmm,xmm/m128 */
+    simd_t a = simd_load(x64modrm_get_xmm(emu, ins)), b = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_t and = a & b, andn = ~a & b;
+
+    x64flags_materialize(emu);
+    r_eflags &= ~X64_FLAGS_STATUS;
+    if (!(and[0] | and[1]))   r_eflags |= X64_FLAG_ZF;
+    if (!(andn[0] | andn[1])) r_eflags |= X64_FLAG_CF;
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f38_2a) { /* MOVNTDQA xmm,m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), simd_load(x64modrm_get_indirect(emu, ins)));
+    return true;
+}
+
+/** `kernel(dest, src)` to dest, without prefix. */
+#define SHA_0F38(op, kernel) \
+    X64_HANDLER(x64execute_0f38_ ## op) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)))); \
+        return true; \
+    }
+
+SHA_0F38(c8, crypto_sha1nexte)              /* SHA1NEXTE */
+SHA_0F38(c9, crypto_sha1msg1)               /* SHA1MSG1 */
+SHA_0F38(ca, crypto_sha1msg2)               /* SHA1MSG2 */
+SHA_0F38(cc, crypto_sha256msg1)             /* SHA256MSG1 */
+SHA_0F38(cd, crypto_sha256msg2)             /* SHA256MSG2 */
+
+X64_HANDLER(x64execute_0f38_cb) { /* SHA256RNDS2 xmm1,xmm2/m128,<XMM0> */
+    void *dest = x64modrm_get_xmm(emu, ins);
+    simd_t src = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(dest, crypto_sha256rnds2(simd_load(dest), src, simd_load(&emu->xmm[0])));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f3a_cc) { /* SHA1RNDS4 xmm1,xmm2/m128,imm8 */
+    void *dest = x64modrm_get_xmm(emu, ins);
+    simd_store(dest, crypto_sha1rnds4(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)), ins->imm.ub[0]));
+    return true;
+}
+
+/* CRC32 accumulates in the low dword of a 32 or 64 bit register, the result zero-extends. */
+
+X64_HANDLER(x64execute_f2_0f38_f0) { /* CRC32 r32/64,r/m8 */
+    uint64_t *dest = x64modrm_get_reg(emu, ins);
+    *dest = crypto_crc32(*dest, *(uint8_t *)x64modrm_get_r_m(emu, ins), 1);
+    return true;
+}
+
+X64_HANDLER(x64execute_f2_0f38_f1) { /* CRC32 r32/64,r/m16/32/64 */
+    uint64_t *dest = x64modrm_get_reg(emu, ins);
+    void *src = x64modrm_get_r_m(emu, ins);
+
+    if      (ins->rex.w)      *dest = crypto_crc32(*dest, *(uint64_t *)src, 8);
+    else if (ins->operand_sz) *dest = crypto_crc32(*dest, *(uint16_t *)src, 2);
+    else                      *dest = crypto_crc32(*dest, *(uint32_t *)src, 4);
+    return true;
+}
+
+SSE_0F3A(0c, simd_blend32)                  /* BLENDPS */
+SSE_0F3A(0d, simd_blend64)                  /* BLENDPD */
+SSE_0F3A(0e, simd_blend16)                  /* PBLENDW */
+SSE_0F3A(0f, simd_alignr)                   /* PALIGNR */
+SSE_0F3A(40, fp_dpps)                       /* DPPS */
+SSE_0F3A(41, fp_dppd)                       /* DPPD */
+SSE_0F3A(42, simd_mpsad8)                   /* MPSADBW */
+SSE_0F3A(44, crypto_clmul)                  /* PCLMULQDQ */
+SSE_0F3A(df, crypto_aeskeygenassist)        /* AESKEYGENASSIST */
+
+X64_HANDLER(x64execute_66_0f3a_08) { /* ROUNDPS xmm,xmm/m128,imm8 */
+    simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(x64modrm_get_xmm(emu, ins), fp_roundps(v, ins->imm.ub[0], emu->mxcsr));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_09) { /* ROUNDPD xmm,xmm/m128,imm8 */
+    simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(x64modrm_get_xmm(emu, ins), fp_roundpd(v, ins->imm.ub[0], emu->mxcsr));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_0a) { /* ROUNDSS xmm,xmm/m32,imm8 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    float v;
+    memcpy(&v, x64modrm_get_xmm_m(emu, ins), 4);
+    dest->ud[0] = fp_bits32(fp_round32(v, ins->imm.ub[0], emu->mxcsr));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_0b) { /* ROUNDSD xmm,xmm/m64,imm8 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    double v;
+    memcpy(&v, x64modrm_get_xmm_m(emu, ins), 8);
+    dest->uq[0] = fp_bits64(fp_round64(v, ins->imm.ub[0], emu->mxcsr));
+    return true;
+}
+
+/** Element `v` of `size` bytes to r/m, registers take it zero-extended. */
+static inline void sse_extract(x64emu_t *emu, x64instr_t *ins, uint64_t v, size_t size) {
+    if (ins->amode == X64_AMODE_REG)
+        emu->regs[ins->ea_base].uq[0] = v;
+    else
+        memcpy(x64modrm_get_indirect(emu, ins), &v, size);
+}
+
+X64_HANDLER(x64execute_66_0f3a_14) { /* PEXTRB r32/m8,xmm,imm8 */
+    reg128_t *src = x64modrm_get_xmm(emu, ins);
+    sse_extract(emu, ins, src->ub[ins->imm.ub[0] & 15], 1);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_15) { /* PEXTRW r32/m16,xmm,imm8 */
+    reg128_t *src = x64modrm_get_xmm(emu, ins);
+    sse_extract(emu, ins, src->uw[ins->imm.ub[0] & 7], 2);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_16) { /* PEXTRD/PEXTRQ r/m32/64,xmm,imm8 */
+    reg128_t *src = x64modrm_get_xmm(emu, ins);
+    if (ins->rex.w)
+        sse_extract(emu, ins, src->uq[ins->imm.ub[0] & 1], 8);
+    else
+        sse_extract(emu, ins, src->ud[ins->imm.ub[0] & 3], 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_17) { /* EXTRACTPS r/m32,xmm,imm8 */
+    reg128_t *src = x64modrm_get_xmm(emu, ins);
+    sse_extract(emu, ins, src->ud[ins->imm.ub[0] & 3], 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_20) { /* PINSRB xmm,r32/m8,imm8 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    dest->ub[ins->imm.ub[0] & 15] = *(uint8_t *)x64modrm_get_r_m(emu, ins);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_21) { /* INSERTPS xmm,xmm/m32,imm8 */
+    void *dest = x64modrm_get_xmm(emu, ins);
+    uint8_t imm = ins->imm.ub[0];
+    simd_t src = { 0, 0 };
+
+    if (ins->amode == X64_AMODE_REG) {
+        src = simd_load(x64modrm_get_xmm_m(emu, ins));
+    } else {
+        memcpy(&src, x64modrm_get_indirect(emu, ins), 4);
+        imm &= 0x3F;
+    }
+    simd_store(dest, simd_insertps(simd_load(dest), src, imm));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_22) { /* PINSRD/PINSRQ xmm,r/m32/64,imm8 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    void *src = x64modrm_get_r_m(emu, ins);
+    if (ins->rex.w)
+        dest->uq[ins->imm.ub[0] & 1] = *(uint64_t *)src;
+    else
+        dest->ud[ins->imm.ub[0] & 3] = *(uint32_t *)src;
+    return true;
+}
+
+/** PCMPESTRx, lengths of the operands are in EAX and EDX, RAX and RDX with REX.W. */
+static inline pcmpstr_t pcmpestr(x64emu_t *emu, x64instr_t *ins) {
+    uint8_t imm = ins->imm.ub[0];
+    bool words = imm & PCMPSTR_WORDS;
+    int64_t len_a = ins->rex.w ? (int64_t)r_rax : (int32_t)r_eax;
+    int64_t len_b = ins->rex.w ? (int64_t)r_rdx : (int32_t)r_edx;
+
+    return pcmpstr(simd_load(x64modrm_get_xmm(emu, ins)), simd_load(x64modrm_get_xmm_m(emu, ins)),
+                   pcmpstr_explicit(len_a, words), pcmpstr_explicit(len_b, words), imm);
+}
+
+/** PCMPISTRx, the operands are null-terminated. */
+static inline pcmpstr_t pcmpistr(x64emu_t *emu, x64instr_t *ins) {
+    uint8_t imm = ins->imm.ub[0];
+    bool words = imm & PCMPSTR_WORDS;
+    simd_t a = simd_load(x64modrm_get_xmm(emu, ins));
+    simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins));
+
+    return pcmpstr(a, b, pcmpstr_implicit(a, words), pcmpstr_implicit(b, words), imm);
+}
+
+/**
+ * CF: any result bit is set, ZF/SF: the second/first operand ends early,
+ * OF: the first result bit. AF and PF are cleared.
+ */
+static inline void pcmpstr_flags(x64emu_t *emu, pcmpstr_t r) {
+    x64flags_materialize(emu);
+    r_eflags &= ~X64_FLAGS_STATUS;
+    if (r.res)           r_eflags |= X64_FLAG_CF;
+    if (r.len_b < r.n)   r_eflags |= X64_FLAG_ZF;
+    if (r.len_a < r.n)   r_eflags |= X64_FLAG_SF;
+    if (r.res & 1)       r_eflags |= X64_FLAG_OF;
+}
+
+X64_HANDLER(x64execute_66_0f3a_60) { /* PCMPESTRM xmm1,xmm2/m128,imm8 */
+    pcmpstr_t r = pcmpestr(emu, ins);
+    simd_store(&emu->xmm[0], pcmpstr_mask(r, ins->imm.ub[0]));
+    if (ins->opcode[0] == 0xC4)     /* VEX.128 clears the upper half. */
+        simd_store(&emu->ymmh[0], (simd_t){ 0, 0 });
+    pcmpstr_flags(emu, r);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_61) { /* PCMPESTRI xmm1,xmm2/m128,imm8 */
+    pcmpstr_t r = pcmpestr(emu, ins);
+    r_rcx = pcmpstr_index(r, ins->imm.ub[0]);
+    pcmpstr_flags(emu, r);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_62) { /* PCMPISTRM xmm1,xmm2/m128,imm8 */
+    pcmpstr_t r = pcmpistr(emu, ins);
+    simd_store(&emu->xmm[0], pcmpstr_mask(r, ins->imm.ub[0]));
+    if (ins->opcode[0] == 0xC4)     /* VEX.128 clears the upper half. */
+        simd_store(&emu->ymmh[0], (simd_t){ 0, 0 });
+    pcmpstr_flags(emu, r);
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f3a_63) { /* PCMPISTRI xmm1,xmm2/m128,imm8 */
+    pcmpstr_t r = pcmpistr(emu, ins);
+    r_rcx = pcmpstr_index(r, ins->imm.ub[0]);
+    pcmpstr_flags(emu, r);
+    return true;
+}
+
+x64handler_t x64execute_resolve_0f38(x64instr_t *ins) {
+    if (ins->rep == 0xF2) {       /* CRC32 */
+        if (ins->opcode[2] == 0xF0) return x64execute_f2_0f38_f0;
+        if (ins->opcode[2] == 0xF1) return x64execute_f2_0f38_f1;
+        return NULL;
+    }
+    if (ins->opcode[2] >= 0xF0)   /* MOVBE */
+        return x64execute_resolve_bmi(ins);
+    if (!ins->operand_sz && !ins->rep) {
+        switch (ins->opcode[2]) {
+            case 0xC8: return x64execute_0f38_c8;
+            case 0xC9: return x64execute_0f38_c9;
+            case 0xCA: return x64execute_0f38_ca;
+            case 0xCB: return x64execute_0f38_cb;
+            case 0xCC: return x64execute_0f38_cc;
+            case 0xCD: return x64execute_0f38_cd;
+        }
+    }
+    if (!ins->operand_sz)
+        return NULL;
+
+#define SSE_CASE(code, name) case code: return x64execute_66_0f38_ ## name;
+    switch (ins->opcode[2]) {
+        SSE_CASE(0x00, 00) SSE_CASE(0x01, 01) SSE_CASE(0x02, 02) SSE_CASE(0x03, 03)
+        SSE_CASE(0x04, 04) SSE_CASE(0x05, 05) SSE_CASE(0x06, 06) SSE_CASE(0x07, 07)
+        SSE_CASE(0x08, 08) SSE_CASE(0x09, 09) SSE_CASE(0x0A, 0a) SSE_CASE(0x0B, 0b)
+        SSE_CASE(0x10, 10) SSE_CASE(0x14, 14) SSE_CASE(0x15, 15) SSE_CASE(0x17, 17)
+        SSE_CASE(0x1C, 1c) SSE_CASE(0x1D, 1d) SSE_CASE(0x1E, 1e)
+        SSE_CASE(0x20, 20) SSE_CASE(0x21, 21) SSE_CASE(0x22, 22) SSE_CASE(0x23, 23)
+        SSE_CASE(0x24, 24) SSE_CASE(0x25, 25)
+        SSE_CASE(0x28, 28) SSE_CASE(0x29, 29) SSE_CASE(0x2B, 2b)
+        SSE_CASE(0x30, 30) SSE_CASE(0x31, 31) SSE_CASE(0x32, 32) SSE_CASE(0x33, 33)
+        SSE_CASE(0x34, 34) SSE_CASE(0x35, 35) SSE_CASE(0x37, 37)
+        SSE_CASE(0x38, 38) SSE_CASE(0x39, 39) SSE_CASE(0x3A, 3a) SSE_CASE(0x3B, 3b)
+        SSE_CASE(0x3C, 3c) SSE_CASE(0x3D, 3d) SSE_CASE(0x3E, 3e) SSE_CASE(0x3F, 3f)
+        SSE_CASE(0x40, 40) SSE_CASE(0x41, 41)
+        SSE_CASE(0xDB, db) SSE_CASE(0xDC, dc) SSE_CASE(0xDD, dd) SSE_CASE(0xDE, de) SSE_CASE(0xDF, df)
+
+        case 0x2A: return ins->amode != X64_AMODE_REG ? x64execute_66_0f38_2a : NULL;
+    }
+#undef SSE_CASE
+
+    return NULL;
+}
+
+x64handler_t x64execute_resolve_0f3a(x64instr_t *ins) {
+    if (ins->opcode[2] == 0xCC && !ins->operand_sz && !ins->rep)
+        return x64execute_0f3a_cc;
+    if (!ins->operand_sz)
+        return NULL;
+
+#define SSE_CASE(code, name) case code: return x64execute_66_0f3a_ ## name;
+    switch (ins->opcode[2]) {
+        SSE_CASE(0x08, 08) SSE_CASE(0x09, 09) SSE_CASE(0x0A, 0a) SSE_CASE(0x0B, 0b)
+        SSE_CASE(0x0C, 0c) SSE_CASE(0x0D, 0d) SSE_CASE(0x0E, 0e) SSE_CASE(0x0F, 0f)
+        SSE_CASE(0x14, 14) SSE_CASE(0x15, 15) SSE_CASE(0x16, 16) SSE_CASE(0x17, 17)
+        SSE_CASE(0x20, 20) SSE_CASE(0x21, 21) SSE_CASE(0x22, 22)
+        SSE_CASE(0x40, 40) SSE_CASE(0x41, 41) SSE_CASE(0x42, 42)
+        SSE_CASE(0x44, 44)
+        SSE_CASE(0x60, 60) SSE_CASE(0x61, 61) SSE_CASE(0x62, 62) SSE_CASE(0x63, 63)
+        SSE_CASE(0xDF, df)
+    }
+#undef SSE_CASE
+
+    return NULL;
+}
@@ -0,0 +1,691 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "debug.h"
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+#include "x64mxcsr.h"
+
+#include "regs_private.h"
+#include "execute_private.h"
+#include "simd_private.h"
+#include "fp_private.h"
+#include "avx_private.h"
+
+SET_DEBUG_CHANNEL("X64EXECUTE_AVX")
+
+/*
+ * VEX encoded instructions of the 0F map. The implied prefix tells the
+ * forms apart as it does for SSE, VEX.L picks the 128 or 256 bit handler
+ * when resolving. Most take a second source in VEX.vvvv where the SSE form
+ * reads its destination. Instructions whose VEX form writes no XMM register
+ * share the handlers of the SSE one.
+ */
+
+/** `kernel(src1, count)`, count is the low qword of xmm/m128 in both forms. */
+#define AVX_SHIFT(op, kernel) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        uint64_t count = simd_load(x64modrm_get_xmm_m(emu, ins))[0]; \
+        avx_store_xmm(emu, avx_reg(ins), kernel(avx_load_vex(emu, ins), count)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        uint64_t count = simd_load(x64modrm_get_xmm_m(emu, ins))[0]; \
+        simd256_t a = avx_load_ymm(emu, ins->vex.v); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(avx_lo(a), count), kernel(avx_hi(a), count))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+/** `kernel(src, imm8)` of the r/m register to the VEX.vvvv one, 0F 71..73 /reg. */
+#define AVX_SHIFT_IMM(op, kernel) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        avx_store_xmm(emu, ins->vex.v, kernel(simd_load(&emu->xmm[ins->ea_base]), ins->imm.ub[0])); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t a = avx_load_ymm(emu, ins->ea_base); \
+        avx_store_ymm(emu, ins->vex.v, avx_join(kernel(avx_lo(a), ins->imm.ub[0]), \
+                                                kernel(avx_hi(a), ins->imm.ub[0]))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+/* Packed integer and bitwise. */
+
+AVX_BINARY(0f_54, simd_and)                 /* VANDPS/VANDPD */
+AVX_BINARY(0f_55, simd_andn)                /* VANDNPS/VANDNPD */
+AVX_BINARY(0f_56, simd_or)                  /* VORPS/VORPD */
+AVX_BINARY(0f_57, simd_xor)                 /* VXORPS/VXORPD */
+AVX_BINARY(0f_14_ps, simd_unpacklo32)       /* VUNPCKLPS */
+AVX_BINARY(0f_14_pd, simd_unpacklo64)       /* VUNPCKLPD */
+AVX_BINARY(0f_15_ps, simd_unpackhi32)       /* VUNPCKHPS */
+AVX_BINARY(0f_15_pd, simd_unpackhi64)       /* VUNPCKHPD */
+
+AVX_BINARY(0f_60, simd_unpacklo8)           /* VPUNPCKLBW */
+AVX_BINARY(0f_61, simd_unpacklo16)          /* VPUNPCKLWD */
+AVX_BINARY(0f_62, simd_unpacklo32)          /* VPUNPCKLDQ */
+AVX_BINARY(0f_63, simd_packss16)            /* VPACKSSWB */
+AVX_BINARY(0f_64, simd_cmpgt8)              /* VPCMPGTB */
+AVX_BINARY(0f_65, simd_cmpgt16)             /* VPCMPGTW */
+AVX_BINARY(0f_66, simd_cmpgt32)             /* VPCMPGTD */
+AVX_BINARY(0f_67, simd_packus16)            /* VPACKUSWB */
+AVX_BINARY(0f_68, simd_unpackhi8)           /* VPUNPCKHBW */
+AVX_BINARY(0f_69, simd_unpackhi16)          /* VPUNPCKHWD */
+AVX_BINARY(0f_6a, simd_unpackhi32)          /* VPUNPCKHDQ */
+AVX_BINARY(0f_6b, simd_packss32)            /* VPACKSSDW */
+AVX_BINARY(0f_6c, simd_unpacklo64)          /* VPUNPCKLQDQ */
+AVX_BINARY(0f_6d, simd_unpackhi64)          /* VPUNPCKHQDQ */
+AVX_BINARY(0f_74, simd_cmpeq8)              /* VPCMPEQB */
+AVX_BINARY(0f_75, simd_cmpeq16)             /* VPCMPEQW */
+AVX_BINARY(0f_76, simd_cmpeq32)             /* VPCMPEQD */
+
+AVX_SHIFT_IMM(0f_71_2, simd_srl16)          /* VPSRLW */
+AVX_SHIFT_IMM(0f_71_4, simd_sra16)          /* VPSRAW */
+AVX_SHIFT_IMM(0f_71_6, simd_sll16)          /* VPSLLW */
+AVX_SHIFT_IMM(0f_72_2, simd_srl32)          /* VPSRLD */
+AVX_SHIFT_IMM(0f_72_4, simd_sra32)          /* VPSRAD */
+AVX_SHIFT_IMM(0f_72_6, simd_sll32)          /* VPSLLD */
+AVX_SHIFT_IMM(0f_73_2, simd_srl64)          /* VPSRLQ */
+AVX_SHIFT_IMM(0f_73_3, simd_srldq)          /* VPSRLDQ */
+AVX_SHIFT_IMM(0f_73_6, simd_sll64)          /* VPSLLQ */
+AVX_SHIFT_IMM(0f_73_7, simd_slldq)          /* VPSLLDQ */
+
+AVX_SHIFT(0f_d1, simd_srl16)                /* VPSRLW */
+AVX_SHIFT(0f_d2, simd_srl32)                /* VPSRLD */
+AVX_SHIFT(0f_d3, simd_srl64)                /* VPSRLQ */
+AVX_BINARY(0f_d4, simd_add64)               /* VPADDQ */
+AVX_BINARY(0f_d5, simd_mullo16)             /* VPMULLW */
+AVX_BINARY(0f_d8, simd_subus8)              /* VPSUBUSB */
+AVX_BINARY(0f_d9, simd_subus16)             /* VPSUBUSW */
+AVX_BINARY(0f_da, simd_minu8)               /* VPMINUB */
+AVX_BINARY(0f_db, simd_and)                 /* VPAND */
+AVX_BINARY(0f_dc, simd_addus8)              /* VPADDUSB */
+AVX_BINARY(0f_dd, simd_addus16)             /* VPADDUSW */
+AVX_BINARY(0f_de, simd_maxu8)               /* VPMAXUB */
+AVX_BINARY(0f_df, simd_andn)                /* VPANDN */
+
+AVX_BINARY(0f_e0, simd_avgu8)               /* VPAVGB */
+AVX_SHIFT(0f_e1, simd_sra16)                /* VPSRAW */
+AVX_SHIFT(0f_e2, simd_sra32)                /* VPSRAD */
+AVX_BINARY(0f_e3, simd_avgu16)              /* VPAVGW */
+AVX_BINARY(0f_e4, simd_mulhu16)             /* VPMULHUW */
+AVX_BINARY(0f_e5, simd_mulhs16)             /* VPMULHW */
+AVX_BINARY(0f_e8, simd_subs8)               /* VPSUBSB */
+AVX_BINARY(0f_e9, simd_subs16)              /* VPSUBSW */
+AVX_BINARY(0f_ea, simd_mins16)              /* VPMINSW */
+AVX_BINARY(0f_eb, simd_or)                  /* VPOR */
+AVX_BINARY(0f_ec, simd_adds8)               /* VPADDSB */
+AVX_BINARY(0f_ed, simd_adds16)              /* VPADDSW */
+AVX_BINARY(0f_ee, simd_maxs16)              /* VPMAXSW */
+AVX_BINARY(0f_ef, simd_xor)                 /* VPXOR */
+
+AVX_SHIFT(0f_f1, simd_sll16)                /* VPSLLW */
+AVX_SHIFT(0f_f2, simd_sll32)                /* VPSLLD */
+AVX_SHIFT(0f_f3, simd_sll64)                /* VPSLLQ */
+AVX_BINARY(0f_f4, simd_mulu32)              /* VPMULUDQ */
+AVX_BINARY(0f_f5, simd_madd16)              /* VPMADDWD */
+AVX_BINARY(0f_f6, simd_sadu8)               /* VPSADBW */
+AVX_BINARY(0f_f8, simd_sub8)                /* VPSUBB */
+AVX_BINARY(0f_f9, simd_sub16)               /* VPSUBW */
+AVX_BINARY(0f_fa, simd_sub32)               /* VPSUBD */
+AVX_BINARY(0f_fb, simd_sub64)               /* VPSUBQ */
+AVX_BINARY(0f_fc, simd_add8)                /* VPADDB */
+AVX_BINARY(0f_fd, simd_add16)               /* VPADDW */
+AVX_BINARY(0f_fe, simd_add32)               /* VPADDD */
+
+AVX_UNARY_IMM(66_0f_70, simd_shuffle32, 0)  /* VPSHUFD */
+AVX_UNARY_IMM(f3_0f_70, simd_shufflehi16, 0)/* VPSHUFHW */
+AVX_UNARY_IMM(f2_0f_70, simd_shufflelo16, 0)/* VPSHUFLW */
+
+static inline simd_t avx_sldup(simd_t a, uint8_t imm) { (void)imm; return simd_shuffle32(a, 0xA0); }
+static inline simd_t avx_shdup(simd_t a, uint8_t imm) { (void)imm; return simd_shuffle32(a, 0xF5); }
+static inline simd_t avx_ddup(simd_t a, uint8_t imm)  { (void)imm; return simd_unpacklo64(a, a); }
+
+AVX_UNARY_IMM(f3_0f_12, avx_sldup, 0)       /* VMOVSLDUP */
+AVX_UNARY_IMM(f3_0f_16, avx_shdup, 0)       /* VMOVSHDUP */
+AVX_UNARY_IMM(f2_0f_12, avx_ddup, 0)        /* VMOVDDUP, the 128 bit form reads m64 */
+
+AVX_BINARY_IMM(0f_c6_ps, simd_shuffle2x32, 0)    /* VSHUFPS */
+AVX_BINARY_IMM(0f_c6_pd, simd_shuffle2x64, 2)    /* VSHUFPD, two bits of imm8 per half */
+
+/* Moves. */
+
+X64_HANDLER(x64execute_vex_0f_10_128) { /* VMOVUPS/VMOVUPD/VMOVAPS/VMOVDQA/VMOVDQU... xmm,xmm/m128 */
+    avx_store_xmm(emu, avx_reg(ins), simd_load(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_10_256) { /* ... ymm,ymm/m256 */
+    avx_store_ymm(emu, avx_reg(ins), avx_load_m(emu, ins));
+    return true;
+}
+
+AVX_FORMS(0f_10)
+
+X64_HANDLER(x64execute_vex_0f_11_128) { /* VMOVUPS/VMOVUPD/VMOVAPS/VMOVNTPS/VMOVDQA/VMOVDQU... xmm/m128,xmm */
+    avx_store_xmm_m(emu, ins, simd_load(&emu->xmm[avx_reg(ins)]));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_11_256) { /* ... ymm/m256,ymm */
+    avx_store_m(emu, ins, avx_load_ymm(emu, avx_reg(ins)));
+    return true;
+}
+
+AVX_FORMS(0f_11)
+
+/*
+ * VMOVSS and VMOVSD merge the register source into VEX.vvvv, 0F 10 into
+ * the reg register and 0F 11 into the r/m one. Loads zero-extend.
+ */
+
+X64_HANDLER(x64execute_vex_f3_0f_10) { /* VMOVSS xmm,xmm,xmm / xmm,m32 */
+    if (ins->amode == X64_AMODE_REG) {
+        simd_t v = avx_load_vex(emu, ins);
+        simd_t s = simd_load(&emu->xmm[ins->ea_base]);
+        avx_store_xmm(emu, avx_reg(ins), simd_blend32(v, s, 1));
+    } else {
+        avx_store_xmm(emu, avx_reg(ins), avx_load_part(emu, ins, 4));
+    }
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f_10) { /* VMOVSD xmm,xmm,xmm / xmm,m64 */
+    if (ins->amode == X64_AMODE_REG) {
+        simd_t v = avx_load_vex(emu, ins);
+        simd_t s = simd_load(&emu->xmm[ins->ea_base]);
+        avx_store_xmm(emu, avx_reg(ins), (simd_t){ s[0], v[1] });
+    } else {
+        avx_store_xmm(emu, avx_reg(ins), simd_load64(x64modrm_get_xmm_m(emu, ins)));
+    }
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f3_0f_11) { /* VMOVSS xmm,xmm,xmm / m32,xmm */
+    simd_t s = simd_load(&emu->xmm[avx_reg(ins)]);
+    if (ins->amode == X64_AMODE_REG)
+        avx_store_xmm(emu, ins->ea_base, simd_blend32(avx_load_vex(emu, ins), s, 1));
+    else
+        memcpy(x64modrm_get_indirect(emu, ins), &s, 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f_11) { /* VMOVSD xmm,xmm,xmm / m64,xmm */
+    simd_t s = simd_load(&emu->xmm[avx_reg(ins)]);
+    if (ins->amode == X64_AMODE_REG)
+        avx_store_xmm(emu, ins->ea_base, (simd_t){ s[0], avx_load_vex(emu, ins)[1] });
+    else
+        simd_store64(x64modrm_get_indirect(emu, ins), s);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_12) { /* VMOVLPS/VMOVLPD xmm,xmm,m64 / VMOVHLPS xmm,xmm,xmm */
+    simd_t v = avx_load_vex(emu, ins);
+    simd_t s = ins->amode == X64_AMODE_REG ? (simd_t){ emu->xmm[ins->ea_base].uq[1], 0 }
+                                           : simd_load64(x64modrm_get_indirect(emu, ins));
+    avx_store_xmm(emu, avx_reg(ins), (simd_t){ s[0], v[1] });
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_16) { /* VMOVHPS/VMOVHPD xmm,xmm,m64 / VMOVLHPS xmm,xmm,xmm */
+    simd_t v = avx_load_vex(emu, ins);
+    simd_t s = simd_load64(x64modrm_get_xmm_m(emu, ins));
+    avx_store_xmm(emu, avx_reg(ins), (simd_t){ v[0], s[0] });
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_13) { /* VMOVLPS/VMOVLPD m64,xmm */
+    simd_store64(x64modrm_get_indirect(emu, ins), simd_load(&emu->xmm[avx_reg(ins)]));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_17) { /* VMOVHPS/VMOVHPD m64,xmm */
+    memcpy(x64modrm_get_indirect(emu, ins), &emu->xmm[avx_reg(ins)].uq[1], 8);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f_12_m64) { /* VMOVDDUP xmm,xmm/m64 */
+    simd_t v = simd_load64(x64modrm_get_xmm_m(emu, ins));
+    avx_store_xmm(emu, avx_reg(ins), simd_unpacklo64(v, v));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_66_0f_6e) { /* VMOVD/VMOVQ xmm,r/m32/64 */
+    void *src = x64modrm_get_r_m(emu, ins);
+    avx_store_xmm(emu, avx_reg(ins), (simd_t){ ins->rex.w ? *(uint64_t *)src : *(uint32_t *)src, 0 });
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f3_0f_7e) { /* VMOVQ xmm,xmm/m64 */
+    avx_store_xmm(emu, avx_reg(ins), simd_load64(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_66_0f_d6) { /* VMOVQ xmm/m64,xmm */
+    simd_t v = simd_load64(&emu->xmm[avx_reg(ins)]);
+    if (ins->amode == X64_AMODE_REG)
+        avx_store_xmm(emu, ins->ea_base, v);
+    else
+        simd_store64(x64modrm_get_indirect(emu, ins), v);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_66_0f_c4) { /* VPINSRW xmm,xmm,r32/m16,imm8 */
+    reg128_t v;
+    simd_store(&v, avx_load_vex(emu, ins));
+    v.uw[ins->imm.ub[0] & 7] = *(uint16_t *)x64modrm_get_r_m(emu, ins);
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&v));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_50_ps_256) { /* VMOVMSKPS r32,ymm */
+    simd256_t v = avx_load_m(emu, ins);
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = fp_movmskps(avx_lo(v)) | fp_movmskps(avx_hi(v)) << 4;
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_50_pd_256) { /* VMOVMSKPD r32,ymm */
+    simd256_t v = avx_load_m(emu, ins);
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = fp_movmskpd(avx_lo(v)) | fp_movmskpd(avx_hi(v)) << 2;
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_66_0f_d7_256) { /* VPMOVMSKB r32,ymm */
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = avx_movmsk8(avx_load_m(emu, ins));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_77_128) { /* VZEROUPPER */
+    memset(emu->ymmh, 0, sizeof(emu->ymmh));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f_77_256) { /* VZEROALL */
+    memset(emu->xmm, 0, sizeof(emu->xmm));
+    memset(emu->ymmh, 0, sizeof(emu->ymmh));
+    return true;
+}
+
+AVX_FORMS(0f_77)
+
+/* Floating point. */
+
+enum { AVX_PS, AVX_PD, AVX_SS, AVX_SD };
+
+static inline uint8_t avx_form(x64instr_t *ins) {
+    if (ins->rep == 0xF3) return AVX_SS;
+    if (ins->rep == 0xF2) return AVX_SD;
+    return ins->operand_sz ? AVX_PD : AVX_PS;
+}
+
+/** Low lane of VEX.vvvv replaced by `lo`, upper lanes from there too. */
+static inline void avx_store_ss(x64emu_t *emu, x64instr_t *ins, uint32_t lo) {
+    reg128_t v;
+    simd_store(&v, avx_load_vex(emu, ins));
+    v.ud[0] = lo;
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&v));
+}
+
+static inline void avx_store_sd(x64emu_t *emu, x64instr_t *ins, uint64_t lo) {
+    avx_store_xmm(emu, avx_reg(ins), (simd_t){ lo, avx_load_vex(emu, ins)[1] });
+}
+
+#define AVX_SCALAR32(op, name) \
+    X64_HANDLER(x64execute_vex_0f_ ## op ## _ss) { \
+        float a = fp_float32(emu->xmm[ins->vex.v].ud[0]); \
+        avx_store_ss(emu, ins, fp_bits32(fp_ ## name ## ss(a, avx_src32(emu, ins)))); \
+        return true; \
+    }
+
+#define AVX_SCALAR64(op, name) \
+    X64_HANDLER(x64execute_vex_0f_ ## op ## _sd) { \
+        double a = fp_float64(emu->xmm[ins->vex.v].uq[0]); \
+        avx_store_sd(emu, ins, fp_bits64(fp_ ## name ## sd(a, avx_src64(emu, ins)))); \
+        return true; \
+    }
+
+/** Handlers of `op` by form and VEX.L, scalar forms ignore VEX.L. */
+#define AVX_FP_FORMS(op, ps, pd, ss, sd) \
+    static const x64handler_t x64execute_vex_0f_ ## op[4][2] = { \
+        { ps ## _128, ps ## _256 }, { pd ## _128, pd ## _256 }, { ss, ss }, { sd, sd }, \
+    };
+
+#define AVX_FP_ARITH(op, name) \
+    AVX_BINARY_HANDLERS(0f_ ## op ## _ps, fp_ ## name ## ps) \
+    AVX_BINARY_HANDLERS(0f_ ## op ## _pd, fp_ ## name ## pd) \
+    AVX_SCALAR32(op, name) \
+    AVX_SCALAR64(op, name) \
+    AVX_FP_FORMS(op, x64execute_vex_0f_ ## op ## _ps, x64execute_vex_0f_ ## op ## _pd, \
+                 x64execute_vex_0f_ ## op ## _ss, x64execute_vex_0f_ ## op ## _sd)
+
+AVX_FP_ARITH(51, sqrt)    /* VSQRTPS/VSQRTPD/VSQRTSS/VSQRTSD */
+AVX_FP_ARITH(58, add)     /* VADDPS/VADDPD/VADDSS/VADDSD */
+AVX_FP_ARITH(59, mul)     /* VMULPS/VMULPD/VMULSS/VMULSD */
+AVX_FP_ARITH(5c, sub)     /* VSUBPS/VSUBPD/VSUBSS/VSUBSD */
+AVX_FP_ARITH(5d, min)     /* VMINPS/VMINPD/VMINSS/VMINSD */
+AVX_FP_ARITH(5e, div)     /* VDIVPS/VDIVPD/VDIVSS/VDIVSD */
+AVX_FP_ARITH(5f, max)     /* VMAXPS/VMAXPD/VMAXSS/VMAXSD */
+
+/* Single precision only. */
+AVX_BINARY(0f_52_ps, fp_rsqrtps) AVX_SCALAR32(52, rsqrt)   /* VRSQRTPS/VRSQRTSS */
+AVX_BINARY(0f_53_ps, fp_rcpps)   AVX_SCALAR32(53, rcp)     /* VRCPPS/VRCPSS */
+
+/* Single precision forms take F2. */
+AVX_BINARY(0f_7c_ps, fp_haddps)   AVX_BINARY(0f_7c_pd, fp_haddpd)     /* VHADDPS/VHADDPD */
+AVX_BINARY(0f_7d_ps, fp_hsubps)   AVX_BINARY(0f_7d_pd, fp_hsubpd)     /* VHSUBPS/VHSUBPD */
+AVX_BINARY(0f_d0_ps, fp_addsubps) AVX_BINARY(0f_d0_pd, fp_addsubpd)   /* VADDSUBPS/VADDSUBPD */
+
+/* VCMPccPS/PD/SS/SD, one handler per predicate. */
+#define AVX_CMP(pred) \
+    AVX_BINARY_HANDLERS(0f_c2_ps_ ## pred, fp_vcmpps, pred) \
+    AVX_BINARY_HANDLERS(0f_c2_pd_ ## pred, fp_vcmppd, pred) \
+    X64_HANDLER(x64execute_vex_0f_c2_ss_ ## pred) { \
+        float a = fp_float32(emu->xmm[ins->vex.v].ud[0]); \
+        avx_store_ss(emu, ins, fp_vcmpss(a, avx_src32(emu, ins), pred) ? UINT32_MAX : 0); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_0f_c2_sd_ ## pred) { \
+        double a = fp_float64(emu->xmm[ins->vex.v].uq[0]); \
+        avx_store_sd(emu, ins, fp_vcmpsd(a, avx_src64(emu, ins), pred) ? UINT64_MAX : 0); \
+        return true; \
+    }
+
+AVX_CMP(0)  AVX_CMP(1)  AVX_CMP(2)  AVX_CMP(3)  AVX_CMP(4)  AVX_CMP(5)  AVX_CMP(6)  AVX_CMP(7)
+AVX_CMP(8)  AVX_CMP(9)  AVX_CMP(10) AVX_CMP(11) AVX_CMP(12) AVX_CMP(13) AVX_CMP(14) AVX_CMP(15)
+AVX_CMP(16) AVX_CMP(17) AVX_CMP(18) AVX_CMP(19) AVX_CMP(20) AVX_CMP(21) AVX_CMP(22) AVX_CMP(23)
+AVX_CMP(24) AVX_CMP(25) AVX_CMP(26) AVX_CMP(27) AVX_CMP(28) AVX_CMP(29) AVX_CMP(30) AVX_CMP(31)
+
+#define AVX_CMP_FORMS(pred) { \
+        { x64execute_vex_0f_c2_ps_ ## pred ## _128, x64execute_vex_0f_c2_ps_ ## pred ## _256 }, \
+        { x64execute_vex_0f_c2_pd_ ## pred ## _128, x64execute_vex_0f_c2_pd_ ## pred ## _256 }, \
+        { x64execute_vex_0f_c2_ss_ ## pred, x64execute_vex_0f_c2_ss_ ## pred }, \
+        { x64execute_vex_0f_c2_sd_ ## pred, x64execute_vex_0f_c2_sd_ ## pred }, \
+    }
+
+static const x64handler_t x64execute_vex_0f_c2[32][4][2] = {
+    AVX_CMP_FORMS(0),  AVX_CMP_FORMS(1),  AVX_CMP_FORMS(2),  AVX_CMP_FORMS(3),
+    AVX_CMP_FORMS(4),  AVX_CMP_FORMS(5),  AVX_CMP_FORMS(6),  AVX_CMP_FORMS(7),
+    AVX_CMP_FORMS(8),  AVX_CMP_FORMS(9),  AVX_CMP_FORMS(10), AVX_CMP_FORMS(11),
+    AVX_CMP_FORMS(12), AVX_CMP_FORMS(13), AVX_CMP_FORMS(14), AVX_CMP_FORMS(15),
+    AVX_CMP_FORMS(16), AVX_CMP_FORMS(17), AVX_CMP_FORMS(18), AVX_CMP_FORMS(19),
+    AVX_CMP_FORMS(20), AVX_CMP_FORMS(21), AVX_CMP_FORMS(22), AVX_CMP_FORMS(23),
+    AVX_CMP_FORMS(24), AVX_CMP_FORMS(25), AVX_CMP_FORMS(26), AVX_CMP_FORMS(27),
+    AVX_CMP_FORMS(28), AVX_CMP_FORMS(29), AVX_CMP_FORMS(30), AVX_CMP_FORMS(31),
+};
+
+/* Conversions, the 256 bit forms that change the lane width read or write an xmm. */
+
+X64_HANDLER(x64execute_vex_f3_0f_2a) { /* VCVTSI2SS xmm,xmm,r/m32/64 */
+    void *src = x64modrm_get_r_m(emu, ins);
+    int64_t v = ins->rex.w ? *(int64_t *)src : *(int32_t *)src;
+    avx_store_ss(emu, ins, fp_bits32((float)v));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f_2a) { /* VCVTSI2SD xmm,xmm,r/m32/64 */
+    void *src = x64modrm_get_r_m(emu, ins);
+    int64_t v = ins->rex.w ? *(int64_t *)src : *(int32_t *)src;
+    avx_store_sd(emu, ins, fp_bits64((double)v));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f3_0f_5a) { /* VCVTSS2SD xmm,xmm,xmm/m32 */
+    avx_store_sd(emu, ins, fp_bits64((double)avx_src32(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f_5a) { /* VCVTSD2SS xmm,xmm,xmm/m64 */
+    avx_store_ss(emu, ins, fp_bits32((float)avx_src64(emu, ins)));
+    return true;
+}
+
+/** Widening xmm/m64 or xmm/m128 to xmm or ymm, VCVTPS2PD and VCVTDQ2PD. */
+#define AVX_CVT_WIDEN(op, kernel) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        avx_store_xmm(emu, avx_reg(ins), kernel(simd_load64(x64modrm_get_xmm_m(emu, ins)))); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(v), kernel(simd_srldq(v, 8)))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+/** Narrowing xmm/m128 or ymm/m256 to xmm, VCVTPD2PS, VCVTPD2DQ and VCVTTPD2DQ. */
+#define AVX_CVT_NARROW(op, kernel, ...) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        avx_store_xmm(emu, avx_reg(ins), kernel(simd_load(x64modrm_get_xmm_m(emu, ins)), ##__VA_ARGS__)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t v = avx_load_m(emu, ins); \
+        simd_t lo = kernel(avx_lo(v), ##__VA_ARGS__), hi = kernel(avx_hi(v), ##__VA_ARGS__); \
+        avx_store_xmm(emu, avx_reg(ins), simd_unpacklo64(lo, hi)); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+static inline simd_t avx_cvtdq2ps(simd_t a, simd_t b)  { (void)a; return fp_cvtdq2ps(b); }
+static inline simd_t avx_cvtps2dq(simd_t a, simd_t b)  { (void)a; return fp_cvtps2dq(b, false); }
+static inline simd_t avx_cvttps2dq(simd_t a, simd_t b) { (void)a; return fp_cvtps2dq(b, true); }
+
+AVX_CVT_WIDEN(0f_5a_ps, fp_cvtps2pd)                 /* VCVTPS2PD */
+AVX_CVT_NARROW(0f_5a_pd, fp_cvtpd2ps)                /* VCVTPD2PS */
+AVX_BINARY(0f_5b_ps, avx_cvtdq2ps)                   /* VCVTDQ2PS */
+AVX_BINARY(0f_5b_pd, avx_cvtps2dq)                   /* VCVTPS2DQ */
+AVX_BINARY(0f_5b_ss, avx_cvttps2dq)                  /* VCVTTPS2DQ */
+AVX_CVT_WIDEN(0f_e6_ss, fp_cvtdq2pd)                 /* VCVTDQ2PD */
+AVX_CVT_NARROW(0f_e6_pd, fp_cvtpd2dq, true)          /* VCVTTPD2DQ */
+AVX_CVT_NARROW(0f_e6_sd, fp_cvtpd2dq, false)         /* VCVTPD2DQ */
+
+x64handler_t x64execute_resolve_avx(x64instr_t *ins) {
+    uint8_t op = ins->opcode[1];
+    uint8_t form = avx_form(ins);
+    bool l = ins->vex.l;
+    x64handler_t handler = NULL;
+
+    switch (op) {
+        case 0x38:
+            if (!(handler = x64execute_resolve_avx_0f38(ins)))
+                log_err("Unimplemented VEX opcode 0F 38 %02X", ins->opcode[2]);
+            return handler;
+        case 0x3A:
+            if (!(handler = x64execute_resolve_avx_0f3a(ins)))
+                log_err("Unimplemented VEX opcode 0F 3A %02X", ins->opcode[2]);
+            return handler;
+    }
+
+#define AVX_CASE_66(code, name) case code: if (ins->operand_sz) handler = x64execute_vex_0f_ ## name[l]; break;
+#define AVX_CASE_FP(code, name) case code: handler = x64execute_vex_0f_ ## name[form][l]; break;
+    switch (op) {
+        case 0x10:
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_10;
+            else if (form == AVX_SD) handler = x64execute_vex_f2_0f_10;
+            else handler = x64execute_vex_0f_10[l];
+            break;
+        case 0x11:
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_11;
+            else if (form == AVX_SD) handler = x64execute_vex_f2_0f_11;
+            else handler = x64execute_vex_0f_11[l];
+            break;
+        case 0x12:
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_12[l];
+            else if (form == AVX_SD) handler = l ? x64execute_vex_f2_0f_12[1] : x64execute_vex_f2_0f_12_m64;
+            else if (!l) handler = x64execute_vex_0f_12;
+            break;
+        case 0x13:
+        case 0x17:
+            if (form <= AVX_PD && !l && ins->amode != X64_AMODE_REG)
+                handler = op == 0x13 ? x64execute_vex_0f_13 : x64execute_vex_0f_17;
+            break;
+        case 0x14:
+            if (form <= AVX_PD) handler = form == AVX_PS ? x64execute_vex_0f_14_ps[l] : x64execute_vex_0f_14_pd[l];
+            break;
+        case 0x15:
+            if (form <= AVX_PD) handler = form == AVX_PS ? x64execute_vex_0f_15_ps[l] : x64execute_vex_0f_15_pd[l];
+            break;
+        case 0x16:
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_16[l];
+            else if (form <= AVX_PD && !l) handler = x64execute_vex_0f_16;
+            break;
+        case 0x28:            /* VMOVAPS/VMOVAPD */
+            if (form <= AVX_PD) handler = x64execute_vex_0f_10[l];
+            break;
+        case 0x29:
+        case 0x2B:            /* VMOVAPS/VMOVAPD, VMOVNTPS/VMOVNTPD */
+            if (form <= AVX_PD) handler = x64execute_vex_0f_11[l];
+            break;
+        case 0x2A:
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_2a;
+            if (form == AVX_SD) handler = x64execute_vex_f2_0f_2a;
+            break;
+        case 0x2C ... 0x2F:   /* VCVT(T)SS/SD2SI, V(U)COMISS/SD write no XMM register. */
+            handler = x64execute_resolve_fp(ins);
+            break;
+        case 0x50:
+            if (ins->amode != X64_AMODE_REG) break;
+            if (!l) handler = x64execute_resolve_fp(ins);
+            else if (form == AVX_PS) handler = x64execute_vex_0f_50_ps_256;
+            else if (form == AVX_PD) handler = x64execute_vex_0f_50_pd_256;
+            break;
+
+        AVX_CASE_FP(0x51, 51) AVX_CASE_FP(0x58, 58) AVX_CASE_FP(0x59, 59)
+        AVX_CASE_FP(0x5C, 5c) AVX_CASE_FP(0x5D, 5d) AVX_CASE_FP(0x5E, 5e) AVX_CASE_FP(0x5F, 5f)
+        case 0x52:
+            if (form == AVX_PS) handler = x64execute_vex_0f_52_ps[l];
+            if (form == AVX_SS) handler = x64execute_vex_0f_52_ss;
+            break;
+        case 0x53:
+            if (form == AVX_PS) handler = x64execute_vex_0f_53_ps[l];
+            if (form == AVX_SS) handler = x64execute_vex_0f_53_ss;
+            break;
+        case 0x54 ... 0x57:
+            if (form > AVX_PD) break;
+            if (op == 0x54) handler = x64execute_vex_0f_54[l];
+            if (op == 0x55) handler = x64execute_vex_0f_55[l];
+            if (op == 0x56) handler = x64execute_vex_0f_56[l];
+            if (op == 0x57) handler = x64execute_vex_0f_57[l];
+            break;
+        case 0x5A:
+            if (form == AVX_PS) handler = x64execute_vex_0f_5a_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_5a_pd[l];
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_5a;
+            if (form == AVX_SD) handler = x64execute_vex_f2_0f_5a;
+            break;
+        case 0x5B:
+            if (form == AVX_PS) handler = x64execute_vex_0f_5b_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_5b_pd[l];
+            if (form == AVX_SS) handler = x64execute_vex_0f_5b_ss[l];
+            break;
+        case 0xE6:
+            if (form == AVX_PD) handler = x64execute_vex_0f_e6_pd[l];
+            if (form == AVX_SS) handler = x64execute_vex_0f_e6_ss[l];
+            if (form == AVX_SD) handler = x64execute_vex_0f_e6_sd[l];
+            break;
+        case 0xC2:
+            handler = x64execute_vex_0f_c2[ins->imm.ub[0] & 0x1F][form][l];
+            break;
+        case 0xC6:
+            if (form == AVX_PS) handler = x64execute_vex_0f_c6_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_c6_pd[l];
+            break;
+
+        AVX_CASE_66(0x60, 60) AVX_CASE_66(0x61, 61) AVX_CASE_66(0x62, 62) AVX_CASE_66(0x63, 63)
+        AVX_CASE_66(0x64, 64) AVX_CASE_66(0x65, 65) AVX_CASE_66(0x66, 66) AVX_CASE_66(0x67, 67)
+        AVX_CASE_66(0x68, 68) AVX_CASE_66(0x69, 69) AVX_CASE_66(0x6A, 6a) AVX_CASE_66(0x6B, 6b)
+        AVX_CASE_66(0x6C, 6c) AVX_CASE_66(0x6D, 6d)
+        AVX_CASE_66(0x74, 74) AVX_CASE_66(0x75, 75) AVX_CASE_66(0x76, 76)
+        AVX_CASE_66(0xD1, d1) AVX_CASE_66(0xD2, d2) AVX_CASE_66(0xD3, d3) AVX_CASE_66(0xD4, d4)
+        AVX_CASE_66(0xD5, d5)
+        AVX_CASE_66(0xD8, d8) AVX_CASE_66(0xD9, d9) AVX_CASE_66(0xDA, da) AVX_CASE_66(0xDB, db)
+        AVX_CASE_66(0xDC, dc) AVX_CASE_66(0xDD, dd) AVX_CASE_66(0xDE, de) AVX_CASE_66(0xDF, df)
+        AVX_CASE_66(0xE0, e0) AVX_CASE_66(0xE1, e1) AVX_CASE_66(0xE2, e2) AVX_CASE_66(0xE3, e3)
+        AVX_CASE_66(0xE4, e4) AVX_CASE_66(0xE5, e5)
+        AVX_CASE_66(0xE8, e8) AVX_CASE_66(0xE9, e9) AVX_CASE_66(0xEA, ea) AVX_CASE_66(0xEB, eb)
+        AVX_CASE_66(0xEC, ec) AVX_CASE_66(0xED, ed) AVX_CASE_66(0xEE, ee) AVX_CASE_66(0xEF, ef)
+        AVX_CASE_66(0xF1, f1) AVX_CASE_66(0xF2, f2) AVX_CASE_66(0xF3, f3) AVX_CASE_66(0xF4, f4)
+        AVX_CASE_66(0xF5, f5) AVX_CASE_66(0xF6, f6)
+        AVX_CASE_66(0xF8, f8) AVX_CASE_66(0xF9, f9) AVX_CASE_66(0xFA, fa) AVX_CASE_66(0xFB, fb)
+        AVX_CASE_66(0xFC, fc) AVX_CASE_66(0xFD, fd) AVX_CASE_66(0xFE, fe)
+
+        case 0x6E:
+            if (ins->operand_sz && !l) handler = x64execute_vex_66_0f_6e;
+            break;
+        case 0x6F:            /* VMOVDQA/VMOVDQU */
+            if (ins->operand_sz || form == AVX_SS) handler = x64execute_vex_0f_10[l];
+            break;
+        case 0x7F:
+        case 0xE7:            /* VMOVDQA/VMOVDQU, VMOVNTDQ */
+            if (ins->operand_sz || (op == 0x7F && form == AVX_SS)) handler = x64execute_vex_0f_11[l];
+            break;
+        case 0xF0:            /* VLDDQU */
+            if (form == AVX_SD && ins->amode != X64_AMODE_REG) handler = x64execute_vex_0f_10[l];
+            break;
+        case 0x70:
+            if (ins->operand_sz) handler = x64execute_vex_66_0f_70[l];
+            if (form == AVX_SS) handler = x64execute_vex_f3_0f_70[l];
+            if (form == AVX_SD) handler = x64execute_vex_f2_0f_70[l];
+            break;
+        case 0x71 ... 0x73:
+            if (!ins->operand_sz || ins->amode != X64_AMODE_REG) break;
+            switch (op << 4 | ins->modrm.reg) {
+                case 0x712: handler = x64execute_vex_0f_71_2[l]; break;
+                case 0x714: handler = x64execute_vex_0f_71_4[l]; break;
+                case 0x716: handler = x64execute_vex_0f_71_6[l]; break;
+                case 0x722: handler = x64execute_vex_0f_72_2[l]; break;
+                case 0x724: handler = x64execute_vex_0f_72_4[l]; break;
+                case 0x726: handler = x64execute_vex_0f_72_6[l]; break;
+                case 0x732: handler = x64execute_vex_0f_73_2[l]; break;
+                case 0x733: handler = x64execute_vex_0f_73_3[l]; break;
+                case 0x736: handler = x64execute_vex_0f_73_6[l]; break;
+                case 0x737: handler = x64execute_vex_0f_73_7[l]; break;
+            }
+            break;
+        case 0x77:            /* VZEROUPPER/VZEROALL */
+            if (form == AVX_PS) handler = x64execute_vex_0f_77[l];
+            break;
+        case 0x7C:
+            if (form == AVX_SD) handler = x64execute_vex_0f_7c_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_7c_pd[l];
+            break;
+        case 0x7D:
+            if (form == AVX_SD) handler = x64execute_vex_0f_7d_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_7d_pd[l];
+            break;
+        case 0x7E:
+            if (form == AVX_SS && !l) handler = x64execute_vex_f3_0f_7e;
+            else if (ins->operand_sz && !l) handler = x64execute_resolve_sse(ins);   /* VMOVD/VMOVQ r/m,xmm */
+            break;
+        case 0xAE:            /* VLDMXCSR, VSTMXCSR */
+            if (form == AVX_PS && !l && ins->modrm.mod != 3 && (ins->modrm.reg == 2 || ins->modrm.reg == 3))
+                handler = x64execute_resolve_fp(ins);
+            break;
+        case 0xC4:
+            if (ins->operand_sz && !l) handler = x64execute_vex_66_0f_c4;
+            break;
+        case 0xC5:            /* VPEXTRW r32,xmm,imm8 */
+            if (ins->operand_sz && !l && ins->amode == X64_AMODE_REG) handler = x64execute_resolve_sse(ins);
+            break;
+        case 0xD0:
+            if (form == AVX_SD) handler = x64execute_vex_0f_d0_ps[l];
+            if (form == AVX_PD) handler = x64execute_vex_0f_d0_pd[l];
+            break;
+        case 0xD6:
+            if (ins->operand_sz && !l) handler = x64execute_vex_66_0f_d6;
+            break;
+        case 0xD7:
+            if (!ins->operand_sz || ins->amode != X64_AMODE_REG) break;
+            handler = l ? x64execute_vex_66_0f_d7_256 : x64execute_resolve_sse(ins);
+            break;
+    }
+#undef AVX_CASE_66
+#undef AVX_CASE_FP
+
+    if (!handler)
+        log_err("Unimplemented VEX opcode 0F %02X", op);
+    return handler;
+}
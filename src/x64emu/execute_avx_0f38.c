@@ -0,0 +1,623 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "execute_private.h"
+#include "simd_private.h"
+#include "fp_private.h"
+#include "avx_private.h"
+#include "crypto_private.h"
+
+/*
+ * VEX encoded instructions of the 0F 38 and 0F 3A maps, all of them with
+ * the implied 66 prefix. VEX.W picks the element size where the legacy
+ * form has a REX.W one. Forms writing no XMM register share the handlers
+ * of execute_0f38.c, the BMI1/BMI2 opcodes from F0 up are in execute_bmi.c.
+ */
+
+/* 0F 38 */
+
+AVX_BINARY(0f38_00, simd_shuffle8)          /* VPSHUFB */
+AVX_BINARY(0f38_01, simd_hadd16)            /* VPHADDW */
+AVX_BINARY(0f38_02, simd_hadd32)            /* VPHADDD */
+AVX_BINARY(0f38_03, simd_hadds16)           /* VPHADDSW */
+AVX_BINARY(0f38_04, simd_maddubs16)         /* VPMADDUBSW */
+AVX_BINARY(0f38_05, simd_hsub16)            /* VPHSUBW */
+AVX_BINARY(0f38_06, simd_hsub32)            /* VPHSUBD */
+AVX_BINARY(0f38_07, simd_hsubs16)           /* VPHSUBSW */
+AVX_BINARY(0f38_08, simd_sign8)             /* VPSIGNB */
+AVX_BINARY(0f38_09, simd_sign16)            /* VPSIGNW */
+AVX_BINARY(0f38_0a, simd_sign32)            /* VPSIGND */
+AVX_BINARY(0f38_0b, simd_mulhrs16)          /* VPMULHRSW */
+AVX_BINARY(0f38_0c, simd_permil32)          /* VPERMILPS */
+AVX_BINARY(0f38_0d, simd_permil64)          /* VPERMILPD */
+AVX_BINARY(0f38_1c, simd_abs8)              /* VPABSB */
+AVX_BINARY(0f38_1d, simd_abs16)             /* VPABSW */
+AVX_BINARY(0f38_1e, simd_abs32)             /* VPABSD */
+AVX_BINARY(0f38_28, simd_muls32)            /* VPMULDQ */
+AVX_BINARY(0f38_29, simd_cmpeq64)           /* VPCMPEQQ */
+AVX_BINARY(0f38_2b, simd_packus32)          /* VPACKUSDW */
+AVX_BINARY(0f38_37, simd_cmpgt64)           /* VPCMPGTQ */
+AVX_BINARY(0f38_38, simd_mins8)             /* VPMINSB */
+AVX_BINARY(0f38_39, simd_mins32)            /* VPMINSD */
+AVX_BINARY(0f38_3a, simd_minu16)            /* VPMINUW */
+AVX_BINARY(0f38_3b, simd_minu32)            /* VPMINUD */
+AVX_BINARY(0f38_3c, simd_maxs8)             /* VPMAXSB */
+AVX_BINARY(0f38_3d, simd_maxs32)            /* VPMAXSD */
+AVX_BINARY(0f38_3e, simd_maxu16)            /* VPMAXUW */
+AVX_BINARY(0f38_3f, simd_maxu32)            /* VPMAXUD */
+AVX_BINARY(0f38_40, simd_mullo32)           /* VPMULLD */
+AVX_BINARY(0f38_45_d, simd_srlv32)          /* VPSRLVD */
+AVX_BINARY(0f38_45_q, simd_srlv64)          /* VPSRLVQ */
+AVX_BINARY(0f38_46, simd_srav32)            /* VPSRAVD */
+AVX_BINARY(0f38_47_d, simd_sllv32)          /* VPSLLVD */
+AVX_BINARY(0f38_47_q, simd_sllv64)          /* VPSLLVQ */
+AVX_BINARY(0f38_db, crypto_aesimc)          /* VAESIMC */
+AVX_BINARY(0f38_dc, crypto_aesenc)          /* VAESENC */
+AVX_BINARY(0f38_dd, crypto_aesenclast)      /* VAESENCLAST */
+AVX_BINARY(0f38_de, crypto_aesdec)          /* VAESDEC */
+AVX_BINARY(0f38_df, crypto_aesdeclast)      /* VAESDECLAST */
+
+X64_HANDLER(x64execute_vex_0f38_41) { /* VPHMINPOSUW xmm,xmm/m128 */
+    avx_store_xmm(emu, avx_reg(ins), simd_minpos16(avx_load_vex(emu, ins), simd_load(x64modrm_get_xmm_m(emu, ins))));
+    return true;
+}
+
+/**
+ * VPTEST and VTESTPS/VTESTPD, ZF: no bit of `mask` set in both,
+ * CF: none set in the source but clear in the destination.
+ */
+static inline void avx_test(x64emu_t *emu, simd256_t a, simd256_t b, simd_t mask) {
+    simd_t and = ((a.lo & b.lo) | (a.hi & b.hi)) & mask;
+    simd_t andn = ((~a.lo & b.lo) | (~a.hi & b.hi)) & mask;
+
+    x64flags_materialize(emu);
+    r_eflags &= ~X64_FLAGS_STATUS;
+    if (!(and[0] | and[1]))   r_eflags |= X64_FLAG_ZF;
+    if (!(andn[0] | andn[1])) r_eflags |= X64_FLAG_CF;
+}
+
+#define AVX_TEST(op, lane) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t a = simd_load(&emu->xmm[avx_reg(ins)]), b = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        avx_test(emu, avx_join(a, (simd_t){ 0, 0 }), avx_join(b, (simd_t){ 0, 0 }), (simd_t){ lane, lane }); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        avx_test(emu, avx_load_ymm(emu, avx_reg(ins)), avx_load_m(emu, ins), (simd_t){ lane, lane }); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+AVX_TEST(0f38_0e, 0x8000000080000000ull)    /* VTESTPS */
+AVX_TEST(0f38_0f, 0x8000000000000000ull)    /* VTESTPD */
+AVX_TEST(0f38_17, UINT64_MAX)               /* VPTEST */
+
+X64_HANDLER(x64execute_vex_0f38_36) { /* VPERMD/VPERMPS ymm,ymm,ymm/m256 */
+    avx_store_ymm(emu, avx_reg(ins), avx_permd(avx_load_m(emu, ins), avx_load_ymm(emu, ins->vex.v)));
+    return true;
+}
+
+/** Low `size` bytes of xmm/m repeated, VBROADCAST and VPBROADCAST. */
+#define AVX_BROADCAST(op, size, v_type, e_type) \
+    static inline simd_t x64execute_vex_ ## op ## _src(x64emu_t *emu, x64instr_t *ins) { \
+        simd_t v = avx_load_part(emu, ins, size); \
+        return (simd_t)((v_type){ 0 } + (e_type)v[0]); \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        avx_store_xmm(emu, avx_reg(ins), x64execute_vex_ ## op ## _src(emu, ins)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd_t v = x64execute_vex_ ## op ## _src(emu, ins); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(v, v)); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+AVX_BROADCAST(0f38_78, 1, simd_u8_t,  uint8_t)      /* VPBROADCASTB */
+AVX_BROADCAST(0f38_79, 2, simd_u16_t, uint16_t)     /* VPBROADCASTW */
+AVX_BROADCAST(0f38_58, 4, simd_u32_t, uint32_t)     /* VBROADCASTSS/VPBROADCASTD */
+AVX_BROADCAST(0f38_59, 8, simd_u64_t, uint64_t)     /* VBROADCASTSD/VPBROADCASTQ */
+
+X64_HANDLER(x64execute_vex_0f38_5a) { /* VBROADCASTF128/VBROADCASTI128 ymm,m128 */
+    simd_t v = simd_load(x64modrm_get_indirect(emu, ins));
+    avx_store_ymm(emu, avx_reg(ins), avx_join(v, v));
+    return true;
+}
+
+/**
+ * VPMOVSX/VPMOVZX, `size` is what the 128 bit form reads of xmm/m,
+ * the 256 bit one reads twice as much.
+ */
+#define AVX_EXTEND(op, kernel, size) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t v = avx_load_part(emu, ins, size); \
+        avx_store_xmm(emu, avx_reg(ins), kernel(v, v)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd_t v = avx_load_part(emu, ins, (size) * 2); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(v, v), kernel(v, simd_srldq(v, size)))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+AVX_EXTEND(0f38_20, simd_movsx8to16,  8)    /* VPMOVSXBW */
+AVX_EXTEND(0f38_21, simd_movsx8to32,  4)    /* VPMOVSXBD */
+AVX_EXTEND(0f38_22, simd_movsx8to64,  2)    /* VPMOVSXBQ */
+AVX_EXTEND(0f38_23, simd_movsx16to32, 8)    /* VPMOVSXWD */
+AVX_EXTEND(0f38_24, simd_movsx16to64, 4)    /* VPMOVSXWQ */
+AVX_EXTEND(0f38_25, simd_movsx32to64, 8)    /* VPMOVSXDQ */
+AVX_EXTEND(0f38_30, simd_movzx8to16,  8)    /* VPMOVZXBW */
+AVX_EXTEND(0f38_31, simd_movzx8to32,  4)    /* VPMOVZXBD */
+AVX_EXTEND(0f38_32, simd_movzx8to64,  2)    /* VPMOVZXBQ */
+AVX_EXTEND(0f38_33, simd_movzx16to32, 8)    /* VPMOVZXWD */
+AVX_EXTEND(0f38_34, simd_movzx16to64, 4)    /* VPMOVZXWQ */
+AVX_EXTEND(0f38_35, simd_movzx32to64, 8)    /* VPMOVZXDQ */
+
+X64_HANDLER(x64execute_vex_0f38_2a_128) { /* VMOVNTDQA xmm,m128 */
+    avx_store_xmm(emu, avx_reg(ins), simd_load(x64modrm_get_indirect(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_2a_256) { /* VMOVNTDQA ymm,m256 */
+    avx_store_ymm(emu, avx_reg(ins), avx_load_m(emu, ins));
+    return true;
+}
+
+AVX_FORMS(0f38_2a)
+
+/*
+ * VMASKMOV and VPMASKMOV, elements whose mask in VEX.vvvv has the top bit
+ * clear are not accessed at all and may lie on unmapped pages. Loads
+ * zero them.
+ */
+
+static inline void avx_maskmov_load(x64emu_t *emu, x64instr_t *ins, size_t size) {
+    simd256_t m = avx_load_ymm(emu, ins->vex.v), r = { 0 };
+    uint8_t *src = x64modrm_get_indirect(emu, ins);
+    size_t len = ins->vex.l ? 32 : 16;
+
+    for (size_t i = 0; i < len; i += size)
+        if (((uint8_t *)&m)[i + size - 1] & 0x80)
+            memcpy((uint8_t *)&r + i, src + i, size);
+    if (ins->vex.l)
+        avx_store_ymm(emu, avx_reg(ins), r);
+    else
+        avx_store_xmm(emu, avx_reg(ins), avx_lo(r));
+}
+
+static inline void avx_maskmov_store(x64emu_t *emu, x64instr_t *ins, size_t size) {
+    simd256_t m = avx_load_ymm(emu, ins->vex.v), v = avx_load_ymm(emu, avx_reg(ins));
+    uint8_t *dest = x64modrm_get_indirect(emu, ins);
+    size_t len = ins->vex.l ? 32 : 16;
+
+    for (size_t i = 0; i < len; i += size)
+        if (((uint8_t *)&m)[i + size - 1] & 0x80)
+            memcpy(dest + i, (uint8_t *)&v + i, size);
+}
+
+X64_HANDLER(x64execute_vex_0f38_2c) { /* VMASKMOVPS/VPMASKMOVD x,x,m */
+    avx_maskmov_load(emu, ins, 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_2d) { /* VMASKMOVPD/VPMASKMOVQ x,x,m */
+    avx_maskmov_load(emu, ins, 8);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_2e) { /* VMASKMOVPS/VPMASKMOVD m,x,x */
+    avx_maskmov_store(emu, ins, 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_2f) { /* VMASKMOVPD/VPMASKMOVQ m,x,x */
+    avx_maskmov_store(emu, ins, 8);
+    return true;
+}
+
+/*
+ * Gathers. The SIB index selects a vector register of dword or qword
+ * indices, elements are loaded where their mask in VEX.vvvv has the top
+ * bit set, then the whole mask register is cleared. Destination bits
+ * past the gathered elements are cleared too.
+ */
+static inline void avx_gather(x64emu_t *emu, x64instr_t *ins, size_t index_size, size_t size) {
+    simd256_t idx = avx_load_ymm(emu, ins->ea_index), m = avx_load_ymm(emu, ins->vex.v);
+    simd256_t r = avx_load_ymm(emu, avx_reg(ins));
+    bool has_base = ins->modrm.mod != 0 || ins->sib.base != 5;
+    uint64_t base = (has_base ? emu->regs[ins->ea_base].uq[0] : 0) + ins->displ.sq[0];
+    size_t n = (ins->vex.l ? 32 : 16) / (index_size > size ? index_size : size);
+    uint8_t in[32], mask[32], out[32];
+
+    memcpy(in, &idx, sizeof(in));
+    memcpy(mask, &m, sizeof(mask));
+    memcpy(out, &r, sizeof(out));
+    for (size_t i = 0; i < n; i++) {
+        int32_t index32;
+        int64_t index;
+        if (!(mask[i * size + size - 1] & 0x80))
+            continue;
+        if (index_size == 4) {
+            memcpy(&index32, in + i * 4, 4);
+            index = index32;
+        } else {
+            memcpy(&index, in + i * 8, 8);
+        }
+        memcpy(out + i * size, (void *)(base + ((uint64_t)index << ins->sib.scale)), size);
+    }
+    memset(out + n * size, 0, sizeof(out) - n * size);
+    memcpy(&r, out, sizeof(r));
+    avx_store_ymm(emu, avx_reg(ins), r);
+    avx_store_ymm(emu, ins->vex.v, (simd256_t){ 0 });
+}
+
+X64_HANDLER(x64execute_vex_0f38_gather_dd) { /* VPGATHERDD/VGATHERDPS */
+    avx_gather(emu, ins, 4, 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_gather_dq) { /* VPGATHERDQ/VGATHERDPD */
+    avx_gather(emu, ins, 4, 8);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_gather_qd) { /* VPGATHERQD/VGATHERQPS */
+    avx_gather(emu, ins, 8, 4);
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_gather_qq) { /* VPGATHERQQ/VGATHERQPD */
+    avx_gather(emu, ins, 8, 8);
+    return true;
+}
+
+/*
+ * FMA3. The digits of the form give the operands multiplied and added,
+ * 1 is the destination, 2 VEX.vvvv and 3 xmm/m.
+ */
+
+#define AVX_FMA_132(d, v, m) d, m, v
+#define AVX_FMA_213(d, v, m) v, d, m
+#define AVX_FMA_231(d, v, m) v, m, d
+
+#define AVX_FMA_PACKED(order, name, type, neg, sub) \
+    X64_HANDLER(x64execute_vex_fma ## order ## _ ## name ## _ ## type ## _128) { \
+        simd_t d = simd_load(&emu->xmm[avx_reg(ins)]), v = avx_load_vex(emu, ins); \
+        simd_t m = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        simd_t s[3] = { AVX_FMA_ ## order(d, v, m) }; \
+        avx_store_xmm(emu, avx_reg(ins), fp_fma ## type(s[0], s[1], s[2], neg, sub)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_fma ## order ## _ ## name ## _ ## type ## _256) { \
+        simd256_t d = avx_load_ymm(emu, avx_reg(ins)), v = avx_load_ymm(emu, ins->vex.v); \
+        simd256_t m = avx_load_m(emu, ins); \
+        simd256_t s[3] = { AVX_FMA_ ## order(d, v, m) }; \
+        simd_t lo = fp_fma ## type(avx_lo(s[0]), avx_lo(s[1]), avx_lo(s[2]), neg, sub); \
+        simd_t hi = fp_fma ## type(avx_hi(s[0]), avx_hi(s[1]), avx_hi(s[2]), neg, sub); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(lo, hi)); \
+        return true; \
+    }
+
+/* Scalar forms keep the upper lanes of the destination. */
+#define AVX_FMA_SCALAR(order, name, neg, sub) \
+    X64_HANDLER(x64execute_vex_fma ## order ## _ ## name ## _ss) { \
+        reg128_t r = emu->xmm[avx_reg(ins)]; \
+        float s[3] = { AVX_FMA_ ## order(fp_float32(r.ud[0]), fp_float32(emu->xmm[ins->vex.v].ud[0]), \
+                                         avx_src32(emu, ins)) }; \
+        r.ud[0] = fp_bits32(fp_fma32(s[0], s[1], s[2], neg, sub)); \
+        avx_store_xmm(emu, avx_reg(ins), simd_load(&r)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_fma ## order ## _ ## name ## _sd) { \
+        reg128_t r = emu->xmm[avx_reg(ins)]; \
+        double s[3] = { AVX_FMA_ ## order(fp_float64(r.uq[0]), fp_float64(emu->xmm[ins->vex.v].uq[0]), \
+                                          avx_src64(emu, ins)) }; \
+        r.uq[0] = fp_bits64(fp_fma64(s[0], s[1], s[2], neg, sub)); \
+        avx_store_xmm(emu, avx_reg(ins), simd_load(&r)); \
+        return true; \
+    }
+
+/* FMADDSUB subtracts in even lanes, FMSUBADD in odd ones. */
+#define AVX_FMA_ORDER(order) \
+    AVX_FMA_PACKED(order, addsub, ps, false, 1) AVX_FMA_PACKED(order, addsub, pd, false, 1) \
+    AVX_FMA_PACKED(order, subadd, ps, false, 2) AVX_FMA_PACKED(order, subadd, pd, false, 2) \
+    AVX_FMA_PACKED(order, add, ps, false, 0)    AVX_FMA_PACKED(order, add, pd, false, 0) \
+    AVX_FMA_PACKED(order, sub, ps, false, 3)    AVX_FMA_PACKED(order, sub, pd, false, 3) \
+    AVX_FMA_PACKED(order, nadd, ps, true, 0)    AVX_FMA_PACKED(order, nadd, pd, true, 0) \
+    AVX_FMA_PACKED(order, nsub, ps, true, 3)    AVX_FMA_PACKED(order, nsub, pd, true, 3) \
+    AVX_FMA_SCALAR(order, add, false, false)    AVX_FMA_SCALAR(order, sub, false, true) \
+    AVX_FMA_SCALAR(order, nadd, true, false)    AVX_FMA_SCALAR(order, nsub, true, true)
+
+AVX_FMA_ORDER(132)
+AVX_FMA_ORDER(213)
+AVX_FMA_ORDER(231)
+
+#define AVX_FMA_P(order, name) { \
+        { x64execute_vex_fma ## order ## _ ## name ## _ps_128, x64execute_vex_fma ## order ## _ ## name ## _ps_256 }, \
+        { x64execute_vex_fma ## order ## _ ## name ## _pd_128, x64execute_vex_fma ## order ## _ ## name ## _pd_256 }, \
+    }
+#define AVX_FMA_S(order, name) { \
+        { x64execute_vex_fma ## order ## _ ## name ## _ss, x64execute_vex_fma ## order ## _ ## name ## _ss }, \
+        { x64execute_vex_fma ## order ## _ ## name ## _sd, x64execute_vex_fma ## order ## _ ## name ## _sd }, \
+    }
+#define AVX_FMA_FORMS(order) { \
+        AVX_FMA_P(order, addsub), AVX_FMA_P(order, subadd), \
+        AVX_FMA_P(order, add),  AVX_FMA_S(order, add),  AVX_FMA_P(order, sub),  AVX_FMA_S(order, sub), \
+        AVX_FMA_P(order, nadd), AVX_FMA_S(order, nadd), AVX_FMA_P(order, nsub), AVX_FMA_S(order, nsub), \
+    }
+
+/** By form (9x, Ax, Bx), low opcode nibble from 6, VEX.W and VEX.L. */
+static const x64handler_t x64execute_vex_0f38_fma[3][10][2][2] = {
+    AVX_FMA_FORMS(132), AVX_FMA_FORMS(213), AVX_FMA_FORMS(231),
+};
+
+/* 0F 3A */
+
+X64_HANDLER(x64execute_vex_0f3a_00) { /* VPERMQ/VPERMPD ymm,ymm/m256,imm8 */
+    avx_store_ymm(emu, avx_reg(ins), avx_permq(avx_load_m(emu, ins), ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_06) { /* VPERM2F128/VPERM2I128 ymm,ymm,ymm/m256,imm8 */
+    simd256_t a = avx_load_ymm(emu, ins->vex.v), b = avx_load_m(emu, ins);
+    avx_store_ymm(emu, avx_reg(ins), avx_perm2x128(a, b, ins->imm.ub[0]));
+    return true;
+}
+
+static inline simd_t avx_permilpd(simd_t a, uint8_t imm) { return simd_shuffle2x64(a, a, imm); }
+
+AVX_UNARY_IMM(0f3a_04, simd_shuffle32, 0)   /* VPERMILPS */
+AVX_UNARY_IMM(0f3a_05, avx_permilpd, 2)     /* VPERMILPD */
+
+AVX_BINARY_IMM(0f3a_02, simd_blend32, 4)    /* VPBLENDD */
+AVX_BINARY_IMM(0f3a_0c, simd_blend32, 4)    /* VBLENDPS */
+AVX_BINARY_IMM(0f3a_0d, simd_blend64, 2)    /* VBLENDPD */
+AVX_BINARY_IMM(0f3a_0e, simd_blend16, 0)    /* VPBLENDW */
+AVX_BINARY_IMM(0f3a_0f, simd_alignr, 0)     /* VPALIGNR */
+AVX_BINARY_IMM(0f3a_40, fp_dpps, 0)         /* VDPPS */
+AVX_BINARY_IMM(0f3a_42, simd_mpsad8, 3)     /* VMPSADBW */
+AVX_BINARY_IMM(0f3a_44, crypto_clmul, 0)    /* VPCLMULQDQ */
+AVX_BINARY_IMM(0f3a_df, crypto_aeskeygenassist, 0) /* VAESKEYGENASSIST */
+
+X64_HANDLER(x64execute_vex_0f3a_41) { /* VDPPD xmm,xmm,xmm/m128,imm8 */
+    simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins));
+    avx_store_xmm(emu, avx_reg(ins), fp_dppd(avx_load_vex(emu, ins), b, ins->imm.ub[0]));
+    return true;
+}
+
+/** VROUNDPS/VROUNDPD, the rounding mode may come from MXCSR. */
+#define AVX_ROUND(op, kernel) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        avx_store_xmm(emu, avx_reg(ins), kernel(v, ins->imm.ub[0], emu->mxcsr)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t v = avx_load_m(emu, ins); \
+        simd_t lo = kernel(avx_lo(v), ins->imm.ub[0], emu->mxcsr); \
+        simd_t hi = kernel(avx_hi(v), ins->imm.ub[0], emu->mxcsr); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(lo, hi)); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+AVX_ROUND(0f3a_08, fp_roundps)              /* VROUNDPS */
+AVX_ROUND(0f3a_09, fp_roundpd)              /* VROUNDPD */
+
+X64_HANDLER(x64execute_vex_0f3a_0a) { /* VROUNDSS xmm,xmm,xmm/m32,imm8 */
+    reg128_t r;
+    simd_store(&r, avx_load_vex(emu, ins));
+    r.ud[0] = fp_bits32(fp_round32(avx_src32(emu, ins), ins->imm.ub[0], emu->mxcsr));
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&r));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_0b) { /* VROUNDSD xmm,xmm,xmm/m64,imm8 */
+    reg128_t r;
+    simd_store(&r, avx_load_vex(emu, ins));
+    r.uq[0] = fp_bits64(fp_round64(avx_src64(emu, ins), ins->imm.ub[0], emu->mxcsr));
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&r));
+    return true;
+}
+
+/* VPINSRB/VPINSRD/VPINSRQ, VINSERTPS: VEX.vvvv with one element replaced. */
+
+X64_HANDLER(x64execute_vex_0f3a_20) { /* VPINSRB xmm,xmm,r32/m8,imm8 */
+    reg128_t r;
+    simd_store(&r, avx_load_vex(emu, ins));
+    r.ub[ins->imm.ub[0] & 15] = *(uint8_t *)x64modrm_get_r_m(emu, ins);
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&r));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_21) { /* VINSERTPS xmm,xmm,xmm/m32,imm8 */
+    uint8_t imm = ins->imm.ub[0];
+    simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins));
+    if (ins->amode != X64_AMODE_REG) {
+        b = avx_load_part(emu, ins, 4);
+        imm &= 0x3F;
+    }
+    avx_store_xmm(emu, avx_reg(ins), simd_insertps(avx_load_vex(emu, ins), b, imm));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_22) { /* VPINSRD/VPINSRQ xmm,xmm,r/m32/64,imm8 */
+    reg128_t r;
+    void *src = x64modrm_get_r_m(emu, ins);
+    simd_store(&r, avx_load_vex(emu, ins));
+    if (ins->rex.w)
+        r.uq[ins->imm.ub[0] & 1] = *(uint64_t *)src;
+    else
+        r.ud[ins->imm.ub[0] & 3] = *(uint32_t *)src;
+    avx_store_xmm(emu, avx_reg(ins), simd_load(&r));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_18) { /* VINSERTF128/VINSERTI128 ymm,ymm,xmm/m128,imm8 */
+    simd256_t a = avx_load_ymm(emu, ins->vex.v);
+    simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins));
+    avx_store_ymm(emu, avx_reg(ins), ins->imm.ub[0] & 1 ? avx_join(avx_lo(a), b) : avx_join(b, avx_hi(a)));
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f3a_19) { /* VEXTRACTF128/VEXTRACTI128 xmm/m128,ymm,imm8 */
+    simd256_t a = avx_load_ymm(emu, avx_reg(ins));
+    avx_store_xmm_m(emu, ins, ins->imm.ub[0] & 1 ? avx_hi(a) : avx_lo(a));
+    return true;
+}
+
+/** VBLENDVPS/VBLENDVPD/VPBLENDVB, the mask register is in imm8 bits 7:4. */
+#define AVX_BLENDV(op, kernel) \
+    X64_HANDLER(x64execute_vex_ ## op ## _128) { \
+        simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins)); \
+        simd_t m = simd_load(&emu->xmm[ins->imm.ub[0] >> 4]); \
+        avx_store_xmm(emu, avx_reg(ins), kernel(avx_load_vex(emu, ins), b, m)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_vex_ ## op ## _256) { \
+        simd256_t a = avx_load_ymm(emu, ins->vex.v), b = avx_load_m(emu, ins); \
+        simd256_t m = avx_load_ymm(emu, ins->imm.ub[0] >> 4); \
+        avx_store_ymm(emu, avx_reg(ins), avx_join(kernel(avx_lo(a), avx_lo(b), avx_lo(m)), \
+                                                  kernel(avx_hi(a), avx_hi(b), avx_hi(m)))); \
+        return true; \
+    } \
+    AVX_FORMS(op)
+
+AVX_BLENDV(0f3a_4a, simd_blendv32)          /* VBLENDVPS */
+AVX_BLENDV(0f3a_4b, simd_blendv64)          /* VBLENDVPD */
+AVX_BLENDV(0f3a_4c, simd_blendv8)           /* VPBLENDVB */
+
+x64handler_t x64execute_resolve_avx_0f38(x64instr_t *ins) {
+    uint8_t op = ins->opcode[2];
+    bool l = ins->vex.l, w = ins->rex.w;
+    bool mem = ins->amode != X64_AMODE_REG;
+
+    if (op >= 0xF0)           /* BMI1/BMI2 */
+        return x64execute_resolve_bmi(ins);
+    if (!ins->operand_sz)
+        return NULL;
+
+#define AVX_CASE(code, name) case code: return x64execute_vex_0f38_ ## name[l];
+    switch (op) {
+        AVX_CASE(0x00, 00) AVX_CASE(0x01, 01) AVX_CASE(0x02, 02) AVX_CASE(0x03, 03)
+        AVX_CASE(0x04, 04) AVX_CASE(0x05, 05) AVX_CASE(0x06, 06) AVX_CASE(0x07, 07)
+        AVX_CASE(0x08, 08) AVX_CASE(0x09, 09) AVX_CASE(0x0A, 0a) AVX_CASE(0x0B, 0b)
+        AVX_CASE(0x1C, 1c) AVX_CASE(0x1D, 1d) AVX_CASE(0x1E, 1e)
+        AVX_CASE(0x20, 20) AVX_CASE(0x21, 21) AVX_CASE(0x22, 22) AVX_CASE(0x23, 23)
+        AVX_CASE(0x24, 24) AVX_CASE(0x25, 25)
+        AVX_CASE(0x28, 28) AVX_CASE(0x29, 29) AVX_CASE(0x2B, 2b)
+        AVX_CASE(0xDC, dc) AVX_CASE(0xDD, dd) AVX_CASE(0xDE, de) AVX_CASE(0xDF, df)
+        AVX_CASE(0x30, 30) AVX_CASE(0x31, 31) AVX_CASE(0x32, 32) AVX_CASE(0x33, 33)
+        AVX_CASE(0x34, 34) AVX_CASE(0x35, 35) AVX_CASE(0x37, 37)
+        AVX_CASE(0x38, 38) AVX_CASE(0x39, 39) AVX_CASE(0x3A, 3a) AVX_CASE(0x3B, 3b)
+        AVX_CASE(0x3C, 3c) AVX_CASE(0x3D, 3d) AVX_CASE(0x3E, 3e) AVX_CASE(0x3F, 3f)
+        AVX_CASE(0x40, 40)
+        AVX_CASE(0x17, 17)
+
+        case 0x0C: return w ? NULL : x64execute_vex_0f38_0c[l];
+        case 0x0D: return w ? NULL : x64execute_vex_0f38_0d[l];
+        case 0x0E: return w ? NULL : x64execute_vex_0f38_0e[l];
+        case 0x0F: return w ? NULL : x64execute_vex_0f38_0f[l];
+        case 0x16:            /* VPERMPS */
+        case 0x36:            /* VPERMD */
+            return l && !w ? x64execute_vex_0f38_36 : NULL;
+        case 0x18:            /* VBROADCASTSS */
+        case 0x58:            /* VPBROADCASTD */
+            return w ? NULL : x64execute_vex_0f38_58[l];
+        case 0x19:            /* VBROADCASTSD */
+            return l && !w ? x64execute_vex_0f38_59[1] : NULL;
+        case 0x59:            /* VPBROADCASTQ */
+            return w ? NULL : x64execute_vex_0f38_59[l];
+        case 0x1A:            /* VBROADCASTF128 */
+        case 0x5A:            /* VBROADCASTI128 */
+            return l && !w && mem ? x64execute_vex_0f38_5a : NULL;
+        case 0x78: return w ? NULL : x64execute_vex_0f38_78[l];
+        case 0x79: return w ? NULL : x64execute_vex_0f38_79[l];
+        case 0x2A: return mem ? x64execute_vex_0f38_2a[l] : NULL;
+        case 0x2C: return mem && !w ? x64execute_vex_0f38_2c : NULL;
+        case 0x2D: return mem && !w ? x64execute_vex_0f38_2d : NULL;
+        case 0x2E: return mem && !w ? x64execute_vex_0f38_2e : NULL;
+        case 0x2F: return mem && !w ? x64execute_vex_0f38_2f : NULL;
+        case 0x8C: return mem ? (w ? x64execute_vex_0f38_2d : x64execute_vex_0f38_2c) : NULL;
+        case 0x8E: return mem ? (w ? x64execute_vex_0f38_2f : x64execute_vex_0f38_2e) : NULL;
+        case 0x41: return l ? NULL : x64execute_vex_0f38_41;
+        case 0x45: return w ? x64execute_vex_0f38_45_q[l] : x64execute_vex_0f38_45_d[l];
+        case 0x46: return w ? NULL : x64execute_vex_0f38_46[l];
+        case 0x47: return w ? x64execute_vex_0f38_47_q[l] : x64execute_vex_0f38_47_d[l];
+        case 0xDB: return l ? NULL : x64execute_vex_0f38_db[0];
+
+        case 0x90 ... 0x93:   /* Gathers take a SIB byte and no 32 bit addressing. */
+            if (!mem || ins->modrm.rm != 4 || ins->address_sz)
+                return NULL;
+            if (op & 1)
+                return w ? x64execute_vex_0f38_gather_qq : x64execute_vex_0f38_gather_qd;
+            return w ? x64execute_vex_0f38_gather_dq : x64execute_vex_0f38_gather_dd;
+
+        case 0x96 ... 0x9F:
+        case 0xA6 ... 0xAF:
+        case 0xB6 ... 0xBF:
+            return x64execute_vex_0f38_fma[(op >> 4) - 9][(op & 0xF) - 6][w][l];
+    }
+#undef AVX_CASE
+
+    return NULL;
+}
+
+x64handler_t x64execute_resolve_avx_0f3a(x64instr_t *ins) {
+    uint8_t op = ins->opcode[2];
+    bool l = ins->vex.l, w = ins->rex.w;
+
+    if (op >= 0xF0)           /* RORX */
+        return x64execute_resolve_bmi(ins);
+    if (!ins->operand_sz)
+        return NULL;
+
+#define AVX_CASE(code, name) case code: return x64execute_vex_0f3a_ ## name[l];
+    switch (op) {
+        AVX_CASE(0x08, 08) AVX_CASE(0x09, 09)
+        AVX_CASE(0x0C, 0c) AVX_CASE(0x0D, 0d) AVX_CASE(0x0E, 0e) AVX_CASE(0x0F, 0f)
+        AVX_CASE(0x40, 40) AVX_CASE(0x42, 42) AVX_CASE(0x44, 44)
+
+        case 0x00:            /* VPERMQ */
+        case 0x01:            /* VPERMPD */
+            return l && w ? x64execute_vex_0f3a_00 : NULL;
+        case 0x02: return w ? NULL : x64execute_vex_0f3a_02[l];
+        case 0x04: return w ? NULL : x64execute_vex_0f3a_04[l];
+        case 0x05: return w ? NULL : x64execute_vex_0f3a_05[l];
+        case 0x06:            /* VPERM2F128 */
+        case 0x46:            /* VPERM2I128 */
+            return l && !w ? x64execute_vex_0f3a_06 : NULL;
+        case 0x0A: return x64execute_vex_0f3a_0a;
+        case 0x0B: return x64execute_vex_0f3a_0b;
+        case 0x18:            /* VINSERTF128 */
+        case 0x38:            /* VINSERTI128 */
+            return l && !w ? x64execute_vex_0f3a_18 : NULL;
+        case 0x19:            /* VEXTRACTF128 */
+        case 0x39:            /* VEXTRACTI128 */
+            return l && !w ? x64execute_vex_0f3a_19 : NULL;
+        case 0x20: return l ? NULL : x64execute_vex_0f3a_20;
+        case 0x21: return l ? NULL : x64execute_vex_0f3a_21;
+        case 0x22: return l ? NULL : x64execute_vex_0f3a_22;
+        case 0x41: return l ? NULL : x64execute_vex_0f3a_41;
+        case 0x4A: return w ? NULL : x64execute_vex_0f3a_4a[l];
+        case 0x4B: return w ? NULL : x64execute_vex_0f3a_4b[l];
+        case 0x4C: return w ? NULL : x64execute_vex_0f3a_4c[l];
+        case 0xDF: return l ? NULL : x64execute_vex_0f3a_df[0];
+
+        case 0x14 ... 0x17:   /* VPEXTRB/VPEXTRW/VPEXTRD/VPEXTRQ/VEXTRACTPS */
+        case 0x60 ... 0x63:   /* VPCMPESTRM/VPCMPESTRI/VPCMPISTRM/VPCMPISTRI */
+            return l ? NULL : x64execute_resolve_0f3a(ins);
+    }
+#undef AVX_CASE
+
+    return NULL;
+}
@@ -0,0 +1,520 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "execute_private.h"
+
+/*
+ * Bit manipulation: bit scans and counts, the BT group, MOVBE and the VEX
+ * encoded BMI1/BMI2 general purpose register instructions. They run on
+ * host builtins, PDEP/PEXT on the host instructions when the build
+ * targets BMI2 and on nibble tables otherwise.
+ */
+
+/** Set the status flags directly, OF, PF and AF are cleared. */
+#define SET_BIT_FLAGS(cf, zf, sf) \
+    if (FLAGS_LIVE) { \
+        emu->lazy.kind = X64_LAZY_NONE; \
+        f_CF = (cf); \
+        f_ZF = (zf); \
+        f_SF = (sf); \
+        f_OF = 0; \
+        f_PF = 0; \
+        f_AF = 0; \
+    }
+
+#define TYPE_BITS(type) (sizeof(type) * 8)
+#define TYPE_MSB(type, x) ((type)(x) >> (TYPE_BITS(type) - 1))
+
+
+/* Bit scans and counts */
+
+/** `*dest` = index of the lowest set bit of `operand`, unchanged if there is none. Updates ZF. */
+#define OP_BSF(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    if (_src) { \
+        *(u_type *)dest = __builtin_ctzll(_src); \
+        ZEXT_DEST(u_type) \
+    } \
+    SET_BIT_FLAGS(0, _src == 0, 0) \
+}
+
+/** `*dest` = index of the highest set bit of `operand`, unchanged if there is none. Updates ZF. */
+#define OP_BSR(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    if (_src) { \
+        *(u_type *)dest = 63 - __builtin_clzll(_src); \
+        ZEXT_DEST(u_type) \
+    } \
+    SET_BIT_FLAGS(0, _src == 0, 0) \
+}
+
+/** `*dest` = number of trailing zeros of `operand`. Updates CF (operand is 0), ZF. */
+#define OP_TZCNT(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    *(u_type *)dest = _src ? (u_type)__builtin_ctzll(_src) : TYPE_BITS(u_type); \
+    SET_BIT_FLAGS(_src == 0, *(u_type *)dest == 0, 0) \
+    ZEXT_DEST(u_type) \
+}
+
+/** `*dest` = number of leading zeros of `operand`. Updates CF (operand is 0), ZF. */
+#define OP_LZCNT(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    *(u_type *)dest = _src ? (u_type)(__builtin_clzll(_src) - (64 - TYPE_BITS(u_type))) : TYPE_BITS(u_type); \
+    SET_BIT_FLAGS(_src == 0, *(u_type *)dest == 0, 0) \
+    ZEXT_DEST(u_type) \
+}
+
+/** `*dest` = number of set bits of `operand`. Updates ZF (operand is 0). */
+#define OP_POPCNT(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    *(u_type *)dest = __builtin_popcountll(_src); \
+    SET_BIT_FLAGS(0, _src == 0, 0) \
+    ZEXT_DEST(u_type) \
+}
+
+X64_HANDLER(x64execute_0f_bc) { /* BSF r16/32/64,r/m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_BSF, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_bd) { /* BSR r16/32/64,r/m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_BSR, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_b8) { /* POPCNT r16/32/64,r/m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_POPCNT, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_bc) { /* TZCNT r16/32/64,r/m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_TZCNT, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_bd) { /* LZCNT r16/32/64,r/m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_LZCNT, U_64)
+    return true;
+}
+
+
+/* Bit tests */
+
+/*
+ * CF = bit `operand` of `*dest`, then `update` it. The offset of a register
+ * is taken modulo its size, that of memory selects a bit of the string
+ * at `dest`, negative ones below it. Immediate offsets are masked by the
+ * handlers. Other status flags are unchanged.
+ */
+#define IMPL_BT(s_type, u_type, operand, update) { \
+    s_type _off = (operand); \
+    u_type _bit; \
+    if (!DEST_IS_GPR) dest = (u_type *)dest + ((int64_t)_off >> __builtin_ctz(TYPE_BITS(u_type))); \
+    _bit = (u_type)1 << (_off & (TYPE_BITS(u_type) - 1)); \
+    x64flags_materialize(emu); \
+    f_CF = (*(u_type *)dest & _bit) != 0; \
+    update \
+}
+
+#define OP_BT(s_type, u_type, operand) \
+    IMPL_BT(s_type, u_type, operand, )
+
+#define OP_BTS(s_type, u_type, operand) \
+    IMPL_BT(s_type, u_type, operand, *(u_type *)dest |= _bit; ZEXT_DEST(u_type))
+
+#define OP_BTR(s_type, u_type, operand) \
+    IMPL_BT(s_type, u_type, operand, *(u_type *)dest &= ~_bit; ZEXT_DEST(u_type))
+
+#define OP_BTC(s_type, u_type, operand) \
+    IMPL_BT(s_type, u_type, operand, *(u_type *)dest ^= _bit; ZEXT_DEST(u_type))
+
+X64_HANDLER(x64execute_0f_a3) { /* BT r/m16/32/64,r16/32/64 */
+    OP2_16_32_64(R_M, REG, OP_BT, S_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ab) { /* BTS r/m16/32/64,r16/32/64 */
+    OP2_16_32_64(R_M, REG, OP_BTS, S_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_b3) { /* BTR r/m16/32/64,r16/32/64 */
+    OP2_16_32_64(R_M, REG, OP_BTR, S_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_bb) { /* BTC r/m16/32/64,r16/32/64 */
+    OP2_16_32_64(R_M, REG, OP_BTC, S_64)
+    return true;
+}
+
+#define BT_IMM(oper) { \
+    uint8_t imm = ins->imm.ub[0]; \
+    GET_OP_DEST_R_M \
+    DEST_OP2_16_32_64(oper, imm & 63, imm & 15, imm & 31) \
+}
+
+X64_HANDLER(x64execute_0f_ba_4) { /* BT r/m16/32/64,imm8 */
+    BT_IMM(OP_BT)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ba_5) { /* BTS r/m16/32/64,imm8 */
+    BT_IMM(OP_BTS)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ba_6) { /* BTR r/m16/32/64,imm8 */
+    BT_IMM(OP_BTR)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ba_7) { /* BTC r/m16/32/64,imm8 */
+    BT_IMM(OP_BTC)
+    return true;
+}
+
+#undef BT_IMM
+
+
+/* MOVBE */
+
+/** `*dest` = `operand` with its bytes reversed. */
+#define OP_MOVBE(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    if      (sizeof(u_type) == 2) *(u_type *)dest = __builtin_bswap16(_src); \
+    else if (sizeof(u_type) == 4) *(u_type *)dest = __builtin_bswap32(_src); \
+    else                          *(u_type *)dest = __builtin_bswap64(_src); \
+    ZEXT_DEST(u_type) \
+}
+
+X64_HANDLER(x64execute_0f38_f0) { /* MOVBE r16/32/64,m16/32/64 */
+    OP2_16_32_64(REG, R_M, OP_MOVBE, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_0f38_f1) { /* MOVBE m16/32/64,r16/32/64 */
+    OP2_16_32_64(R_M, REG, OP_MOVBE, U_64)
+    return true;
+}
+
+
+/* PDEP/PEXT */
+
+#ifdef __BMI2__
+
+static inline uint64_t bmi_pdep(uint64_t src, uint64_t mask) {
+    return __builtin_ia32_pdep_di(src, mask);
+}
+
+static inline uint64_t bmi_pext(uint64_t src, uint64_t mask) {
+    return __builtin_ia32_pext_di(src, mask);
+}
+
+#else
+
+/** PDEP of the low nibble of `src`, indexed by it and a mask nibble. */
+static const uint8_t bmi_pdep4[16][16] = {
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },
+    { 0x0, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x1, 0x8, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x1 },
+    { 0x0, 0x0, 0x0, 0x2, 0x0, 0x4, 0x4, 0x2, 0x0, 0x8, 0x8, 0x2, 0x8, 0x4, 0x4, 0x2 },
+    { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x3, 0x8, 0x9, 0xA, 0x3, 0xC, 0x5, 0x6, 0x3 },
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x4, 0x0, 0x0, 0x0, 0x8, 0x0, 0x8, 0x8, 0x4 },
+    { 0x0, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x5, 0x8, 0x1, 0x2, 0x9, 0x4, 0x9, 0xA, 0x5 },
+    { 0x0, 0x0, 0x0, 0x2, 0x0, 0x4, 0x4, 0x6, 0x0, 0x8, 0x8, 0xA, 0x8, 0xC, 0xC, 0x6 },
+    { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0x7 },
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x8 },
+    { 0x0, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x1, 0x8, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x9 },
+    { 0x0, 0x0, 0x0, 0x2, 0x0, 0x4, 0x4, 0x2, 0x0, 0x8, 0x8, 0x2, 0x8, 0x4, 0x4, 0xA },
+    { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x3, 0x8, 0x9, 0xA, 0x3, 0xC, 0x5, 0x6, 0xB },
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x4, 0x0, 0x0, 0x0, 0x8, 0x0, 0x8, 0x8, 0xC },
+    { 0x0, 0x1, 0x2, 0x1, 0x4, 0x1, 0x2, 0x5, 0x8, 0x1, 0x2, 0x9, 0x4, 0x9, 0xA, 0xD },
+    { 0x0, 0x0, 0x0, 0x2, 0x0, 0x4, 0x4, 0x6, 0x0, 0x8, 0x8, 0xA, 0x8, 0xC, 0xC, 0xE },
+    { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF },
+};
+
+/** PEXT of a nibble, indexed by it and a mask nibble. */
+static const uint8_t bmi_pext4[16][16] = {
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 },
+    { 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1 },
+    { 0x0, 0x0, 0x1, 0x2, 0x0, 0x0, 0x1, 0x2, 0x0, 0x0, 0x1, 0x2, 0x0, 0x0, 0x1, 0x2 },
+    { 0x0, 0x1, 0x1, 0x3, 0x0, 0x1, 0x1, 0x3, 0x0, 0x1, 0x1, 0x3, 0x0, 0x1, 0x1, 0x3 },
+    { 0x0, 0x0, 0x0, 0x0, 0x1, 0x2, 0x2, 0x4, 0x0, 0x0, 0x0, 0x0, 0x1, 0x2, 0x2, 0x4 },
+    { 0x0, 0x1, 0x0, 0x1, 0x1, 0x3, 0x2, 0x5, 0x0, 0x1, 0x0, 0x1, 0x1, 0x3, 0x2, 0x5 },
+    { 0x0, 0x0, 0x1, 0x2, 0x1, 0x2, 0x3, 0x6, 0x0, 0x0, 0x1, 0x2, 0x1, 0x2, 0x3, 0x6 },
+    { 0x0, 0x1, 0x1, 0x3, 0x1, 0x3, 0x3, 0x7, 0x0, 0x1, 0x1, 0x3, 0x1, 0x3, 0x3, 0x7 },
+    { 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x1, 0x2, 0x2, 0x4, 0x2, 0x4, 0x4, 0x8 },
+    { 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x0, 0x1, 0x1, 0x3, 0x2, 0x5, 0x2, 0x5, 0x4, 0x9 },
+    { 0x0, 0x0, 0x1, 0x2, 0x0, 0x0, 0x1, 0x2, 0x1, 0x2, 0x3, 0x6, 0x2, 0x4, 0x5, 0xA },
+    { 0x0, 0x1, 0x1, 0x3, 0x0, 0x1, 0x1, 0x3, 0x1, 0x3, 0x3, 0x7, 0x2, 0x5, 0x5, 0xB },
+    { 0x0, 0x0, 0x0, 0x0, 0x1, 0x2, 0x2, 0x4, 0x1, 0x2, 0x2, 0x4, 0x3, 0x6, 0x6, 0xC },
+    { 0x0, 0x1, 0x0, 0x1, 0x1, 0x3, 0x2, 0x5, 0x1, 0x3, 0x2, 0x5, 0x3, 0x7, 0x6, 0xD },
+    { 0x0, 0x0, 0x1, 0x2, 0x1, 0x2, 0x3, 0x6, 0x1, 0x2, 0x3, 0x6, 0x3, 0x6, 0x7, 0xE },
+    { 0x0, 0x1, 0x1, 0x3, 0x1, 0x3, 0x3, 0x7, 0x1, 0x3, 0x3, 0x7, 0x3, 0x7, 0x7, 0xF },
+};
+
+/* A nibble of the mask per step, nibbles without mask bits are skipped. */
+
+static inline uint64_t bmi_pdep(uint64_t src, uint64_t mask) {
+    uint64_t res = 0;
+    unsigned pos = 0, skip, m;
+
+    while (mask) {
+        skip = __builtin_ctzll(mask) & ~3u;
+        mask >>= skip;
+        pos += skip;
+        m = mask & 0xF;
+        res |= (uint64_t)bmi_pdep4[src & 0xF][m] << pos;
+        src >>= __builtin_popcount(m);
+        mask >>= 4;
+        pos += 4;
+    }
+    return res;
+}
+
+static inline uint64_t bmi_pext(uint64_t src, uint64_t mask) {
+    uint64_t res = 0;
+    unsigned pos = 0, skip, m;
+
+    while (mask) {
+        skip = __builtin_ctzll(mask) & ~3u;
+        mask >>= skip;
+        src >>= skip;
+        m = mask & 0xF;
+        res |= (uint64_t)bmi_pext4[src & 0xF][m] << pos;
+        pos += __builtin_popcount(m);
+        mask >>= 4;
+        src >>= 4;
+    }
+    return res;
+}
+
+#endif /* __BMI2__ */
+
+
+/* VEX encoded BMI1/BMI2 */
+
+/*
+ * Operands are 32 or 64 bit by VEX.W, `operand` is r/m, the register of
+ * VEX.vvvv is read by VEX_SRC. Results always go to a general purpose
+ * register and zero-extend.
+ */
+#define VEX_SRC(u_type) ((u_type)emu->regs[ins->vex.v].uq[0])
+#define VEX_DEST(u_type, value) (*(uint64_t *)dest = (u_type)(value))
+
+/** `*dest = ~vvvv & operand`. Updates ZF, SF, clears CF, OF. */
+#define OP_ANDN(s_type, u_type, operand) { \
+    u_type _res = ~VEX_SRC(u_type) & (operand); \
+    VEX_DEST(u_type, _res); \
+    SET_LAZY_FLAGS(X64_LAZY_LOGIC, u_type, 0, 0, _res) \
+}
+
+/** `*dest = operand & (operand - 1)`. Updates ZF, SF, CF (operand is 0). */
+#define OP_BLSR(s_type, u_type, operand) { \
+    u_type _src = (operand), _res = _src & (_src - 1); \
+    VEX_DEST(u_type, _res); \
+    SET_BIT_FLAGS(_src == 0, _res == 0, TYPE_MSB(u_type, _res)) \
+}
+
+/** `*dest = operand ^ (operand - 1)`. Updates ZF, SF, CF (operand is 0). */
+#define OP_BLSMSK(s_type, u_type, operand) { \
+    u_type _src = (operand), _res = _src ^ (_src - 1); \
+    VEX_DEST(u_type, _res); \
+    SET_BIT_FLAGS(_src == 0, _res == 0, TYPE_MSB(u_type, _res)) \
+}
+
+/** `*dest = operand & -operand`. Updates ZF, SF, CF (operand is not 0). */
+#define OP_BLSI(s_type, u_type, operand) { \
+    u_type _src = (operand), _res = _src & -_src; \
+    VEX_DEST(u_type, _res); \
+    SET_BIT_FLAGS(_src != 0, _res == 0, TYPE_MSB(u_type, _res)) \
+}
+
+/** `*dest` = operand with bits from vvvv[7:0] up cleared. Updates ZF, SF, CF (index out of range). */
+#define OP_BZHI(s_type, u_type, operand) { \
+    uint8_t _n = VEX_SRC(uint8_t); \
+    u_type _res = (operand); \
+    if (_n < TYPE_BITS(u_type)) _res &= ((u_type)1 << _n) - 1; \
+    VEX_DEST(u_type, _res); \
+    SET_BIT_FLAGS(_n >= TYPE_BITS(u_type), _res == 0, TYPE_MSB(u_type, _res)) \
+}
+
+/** `*dest` = vvvv[15:8] bits of operand from bit vvvv[7:0]. Updates ZF, clears CF, OF. */
+#define OP_BEXTR(s_type, u_type, operand) { \
+    uint8_t _start = VEX_SRC(uint16_t), _len = VEX_SRC(uint16_t) >> 8; \
+    u_type _res = _start < TYPE_BITS(u_type) ? (u_type)(operand) >> _start : 0; \
+    if (_len < TYPE_BITS(u_type)) _res &= ((u_type)1 << _len) - 1; \
+    VEX_DEST(u_type, _res); \
+    SET_LAZY_FLAGS(X64_LAZY_LOGIC, u_type, 0, 0, _res) \
+}
+
+/** `*dest` = low bits of vvvv deposited at the set bits of operand. */
+#define OP_PDEP(s_type, u_type, operand) \
+    VEX_DEST(u_type, bmi_pdep(VEX_SRC(u_type), (u_type)(operand)));
+
+/** `*dest` = bits of vvvv at the set bits of operand, packed. */
+#define OP_PEXT(s_type, u_type, operand) \
+    VEX_DEST(u_type, bmi_pext(VEX_SRC(u_type), (u_type)(operand)));
+
+/** vvvv, `*dest` = low and high half of rDX * operand, the high half wins if they are the same. */
+#define OP_MULX(s_type, u_type, operand) { \
+    uint128_t _prod = (uint128_t)(u_type)r_rdx * (u_type)(operand); \
+    emu->regs[ins->vex.v].uq[0] = (u_type)_prod; \
+    VEX_DEST(u_type, _prod >> TYPE_BITS(u_type)); \
+}
+
+#define IMPL_VEX_COUNT(u_type) (VEX_SRC(u_type) & (TYPE_BITS(u_type) - 1))
+
+/** `*dest = operand << vvvv`. */
+#define OP_SHLX(s_type, u_type, operand) \
+    VEX_DEST(u_type, (u_type)(operand) << IMPL_VEX_COUNT(u_type));
+
+/** `*dest = operand >> vvvv`. */
+#define OP_SHRX(s_type, u_type, operand) \
+    VEX_DEST(u_type, (u_type)(operand) >> IMPL_VEX_COUNT(u_type));
+
+/* FIXME: signed type shifts are implementation-defined. */
+/** Signed `*dest = operand >> vvvv`. */
+#define OP_SARX(s_type, u_type, operand) \
+    VEX_DEST(u_type, (s_type)(operand) >> IMPL_VEX_COUNT(u_type));
+
+/** `*dest` = operand rotated right by imm8. */
+#define OP_RORX(s_type, u_type, operand) { \
+    u_type _src = (operand); \
+    uint8_t _n = ins->imm.ub[0] & (TYPE_BITS(u_type) - 1); \
+    VEX_DEST(u_type, _n ? (_src >> _n) | (_src << (TYPE_BITS(u_type) - _n)) : _src); \
+}
+
+X64_HANDLER(x64execute_vex_0f38_f2) { /* ANDN r32/64,r32/64,r/m32/64 */
+    OP_32_64(REG, R_M, OP_ANDN, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_f3_1) { /* BLSR r32/64,r/m32/64 */
+    OP_32_64(GPR(ins->vex.v), R_M, OP_BLSR, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_f3_2) { /* BLSMSK r32/64,r/m32/64 */
+    OP_32_64(GPR(ins->vex.v), R_M, OP_BLSMSK, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_f3_3) { /* BLSI r32/64,r/m32/64 */
+    OP_32_64(GPR(ins->vex.v), R_M, OP_BLSI, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_f5) { /* BZHI r32/64,r/m32/64,r32/64 */
+    OP_32_64(REG, R_M, OP_BZHI, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f3_0f38_f5) { /* PEXT r32/64,r32/64,r/m32/64 */
+    OP_32_64(REG, R_M, OP_PEXT, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f38_f5) { /* PDEP r32/64,r32/64,r/m32/64 */
+    OP_32_64(REG, R_M, OP_PDEP, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f38_f6) { /* MULX r32/64,r32/64,r/m32/64 */
+    OP_32_64(REG, R_M, OP_MULX, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_0f38_f7) { /* BEXTR r32/64,r/m32/64,r32/64 */
+    OP_32_64(REG, R_M, OP_BEXTR, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_66_0f38_f7) { /* SHLX r32/64,r/m32/64,r32/64 */
+    OP_32_64(REG, R_M, OP_SHLX, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f3_0f38_f7) { /* SARX r32/64,r/m32/64,r32/64 */
+    OP_32_64(REG, R_M, OP_SARX, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f38_f7) { /* SHRX r32/64,r/m32/64,r32/64 */
+    OP_32_64(REG, R_M, OP_SHRX, U_64)
+    return true;
+}
+
+X64_HANDLER(x64execute_vex_f2_0f3a_f0) { /* RORX r32/64,r/m32/64,imm8 */
+    OP_32_64(REG, R_M, OP_RORX, U_64)
+    return true;
+}
+
+
+x64handler_t x64execute_resolve_bmi(x64instr_t *ins) {
+    bool vex = ins->opcode[0] == 0xC4;
+    bool mem = ins->amode != X64_AMODE_REG;
+    uint8_t rep = ins->rep;
+
+    if (vex) {
+        /* VEX.L must be 0, 66 picks SHLX only. */
+        if (ins->vex.l || (ins->operand_sz && ins->opcode[2] != 0xF7))
+            return NULL;
+
+        if (ins->opcode[1] == 0x3A)
+            return ins->opcode[2] == 0xF0 && rep == 0xF2 ? x64execute_vex_f2_0f3a_f0 : NULL;
+
+        switch (ins->opcode[2]) {
+            case 0xF2: return rep ? NULL : x64execute_vex_0f38_f2;
+            case 0xF3:
+                if (rep) return NULL;
+                switch (ins->modrm.reg) {
+                    case 1: return x64execute_vex_0f38_f3_1;
+                    case 2: return x64execute_vex_0f38_f3_2;
+                    case 3: return x64execute_vex_0f38_f3_3;
+                }
+                return NULL;
+            case 0xF5:
+                if (rep == 0xF3) return x64execute_vex_f3_0f38_f5;
+                if (rep == 0xF2) return x64execute_vex_f2_0f38_f5;
+                return x64execute_vex_0f38_f5;
+            case 0xF6: return rep == 0xF2 ? x64execute_vex_f2_0f38_f6 : NULL;
+            case 0xF7:
+                if (ins->operand_sz) return x64execute_vex_66_0f38_f7;
+                if (rep == 0xF3) return x64execute_vex_f3_0f38_f7;
+                if (rep == 0xF2) return x64execute_vex_f2_0f38_f7;
+                return x64execute_vex_0f38_f7;
+        }
+        return NULL;
+    }
+
+    switch (ins->opcode[1]) {
+        case 0x38:            /* MOVBE, F2 is CRC32 */
+            if (rep == 0xF2 || !mem) return NULL;
+            if (ins->opcode[2] == 0xF0) return x64execute_0f38_f0;
+            if (ins->opcode[2] == 0xF1) return x64execute_0f38_f1;
+            return NULL;
+        case 0xA3: return x64execute_0f_a3;
+        case 0xAB: return x64execute_0f_ab;
+        case 0xB3: return x64execute_0f_b3;
+        case 0xBB: return x64execute_0f_bb;
+        case 0xBA:
+            switch (ins->modrm.reg) {
+                case 4: return x64execute_0f_ba_4;
+                case 5: return x64execute_0f_ba_5;
+                case 6: return x64execute_0f_ba_6;
+                case 7: return x64execute_0f_ba_7;
+            }
+            return NULL;
+        case 0xB8: return rep == 0xF3 ? x64execute_f3_0f_b8 : NULL;
+        case 0xBC: return rep == 0xF3 ? x64execute_f3_0f_bc : x64execute_0f_bc;
+        case 0xBD: return rep == 0xF3 ? x64execute_f3_0f_bd : x64execute_0f_bd;
+    }
+    return NULL;
+}
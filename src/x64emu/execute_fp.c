@@ -0,0 +1,348 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+#include "x64mxcsr.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "execute_private.h"
+#include "fp_private.h"
+
+/*
+ * SSE to SSE3 floating point instructions. Most come in four forms told apart
+ * by the prefix when resolving: PS without one, PD with 66, SS with F3 and
+ * SD with F2. Scalar forms read 32 or 64 bits of their memory source and
+ * leave the upper lanes of the destination alone.
+ */
+
+enum { FP_PS, FP_PD, FP_SS, FP_SD };
+
+static inline uint8_t fp_form(x64instr_t *ins) {
+    if (ins->rep == 0xF3) return FP_SS;
+    if (ins->rep == 0xF2) return FP_SD;
+    return ins->operand_sz ? FP_PD : FP_PS;
+}
+
+/** Low float of xmm/m32. */
+static inline float fp_src32(x64emu_t *emu, x64instr_t *ins) {
+    float f;
+    memcpy(&f, x64modrm_get_xmm_m(emu, ins), 4);
+    return f;
+}
+
+/** Low double of xmm/m64. */
+static inline double fp_src64(x64emu_t *emu, x64instr_t *ins) {
+    double d;
+    memcpy(&d, x64modrm_get_xmm_m(emu, ins), 8);
+    return d;
+}
+
+/** Integer source r/m32/64 of CVTSI2SS/SD. */
+static inline int64_t fp_src_int(x64emu_t *emu, x64instr_t *ins) {
+    void *src = x64modrm_get_r_m(emu, ins);
+    return ins->rex.w ? *(int64_t *)src : *(int32_t *)src;
+}
+
+/** `fp_<name>ps/pd/ss/sd(dest, src)` to dest. */
+#define FP_PACKED(op, form, name) \
+    X64_HANDLER(x64execute_0f_ ## op ## _ ## form) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, fp_ ## name ## form(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)))); \
+        return true; \
+    }
+
+#define FP_SCALAR32(op, name) \
+    X64_HANDLER(x64execute_0f_ ## op ## _ss) { \
+        reg128_t *dest = x64modrm_get_xmm(emu, ins); \
+        dest->ud[0] = fp_bits32(fp_ ## name ## ss(fp_float32(dest->ud[0]), fp_src32(emu, ins))); \
+        return true; \
+    }
+
+#define FP_SCALAR64(op, name) \
+    X64_HANDLER(x64execute_0f_ ## op ## _sd) { \
+        reg128_t *dest = x64modrm_get_xmm(emu, ins); \
+        dest->uq[0] = fp_bits64(fp_ ## name ## sd(fp_float64(dest->uq[0]), fp_src64(emu, ins))); \
+        return true; \
+    }
+
+#define FP_ARITH(op, name) \
+    FP_PACKED(op, ps, name) FP_PACKED(op, pd, name) FP_SCALAR32(op, name) FP_SCALAR64(op, name) \
+    static const x64handler_t x64execute_0f_ ## op[4] = { \
+        x64execute_0f_ ## op ## _ps, x64execute_0f_ ## op ## _pd, \
+        x64execute_0f_ ## op ## _ss, x64execute_0f_ ## op ## _sd, \
+    };
+
+FP_ARITH(51, sqrt)    /* SQRTPS/SQRTPD/SQRTSS/SQRTSD */
+FP_ARITH(58, add)     /* ADDPS/ADDPD/ADDSS/ADDSD */
+FP_ARITH(59, mul)     /* MULPS/MULPD/MULSS/MULSD */
+FP_ARITH(5c, sub)     /* SUBPS/SUBPD/SUBSS/SUBSD */
+FP_ARITH(5d, min)     /* MINPS/MINPD/MINSS/MINSD */
+FP_ARITH(5e, div)     /* DIVPS/DIVPD/DIVSS/DIVSD */
+FP_ARITH(5f, max)     /* MAXPS/MAXPD/MAXSS/MAXSD */
+
+/* Single precision only. */
+FP_PACKED(52, ps, rsqrt) FP_SCALAR32(52, rsqrt)   /* RSQRTPS/RSQRTSS */
+FP_PACKED(53, ps, rcp)   FP_SCALAR32(53, rcp)     /* RCPPS/RCPSS */
+
+static const x64handler_t x64execute_0f_52[4] = { x64execute_0f_52_ps, NULL, x64execute_0f_52_ss, NULL };
+static const x64handler_t x64execute_0f_53[4] = { x64execute_0f_53_ps, NULL, x64execute_0f_53_ss, NULL };
+
+/* SSE3, the single precision forms take F2 and so resolve as SD. */
+FP_PACKED(7c, ps, hadd) FP_PACKED(7c, pd, hadd)       /* HADDPS/HADDPD */
+FP_PACKED(7d, ps, hsub) FP_PACKED(7d, pd, hsub)       /* HSUBPS/HSUBPD */
+FP_PACKED(d0, ps, addsub) FP_PACKED(d0, pd, addsub)   /* ADDSUBPS/ADDSUBPD */
+
+static const x64handler_t x64execute_0f_7c[4] = { NULL, x64execute_0f_7c_pd, NULL, x64execute_0f_7c_ps };
+static const x64handler_t x64execute_0f_7d[4] = { NULL, x64execute_0f_7d_pd, NULL, x64execute_0f_7d_ps };
+static const x64handler_t x64execute_0f_d0[4] = { NULL, x64execute_0f_d0_pd, NULL, x64execute_0f_d0_ps };
+
+/* CMPccPS/PD/SS/SD xmm,xmm/m,imm8, one handler per predicate. */
+#define FP_CMP(pred) \
+    X64_HANDLER(x64execute_0f_c2_ps_ ## pred) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, fp_cmpps(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)), pred)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_0f_c2_pd_ ## pred) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, fp_cmppd(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)), pred)); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_0f_c2_ss_ ## pred) { \
+        reg128_t *dest = x64modrm_get_xmm(emu, ins); \
+        dest->ud[0] = fp_cmpss(fp_float32(dest->ud[0]), fp_src32(emu, ins), pred) ? UINT32_MAX : 0; \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_0f_c2_sd_ ## pred) { \
+        reg128_t *dest = x64modrm_get_xmm(emu, ins); \
+        dest->uq[0] = fp_cmpsd(fp_float64(dest->uq[0]), fp_src64(emu, ins), pred) ? UINT64_MAX : 0; \
+        return true; \
+    }
+
+FP_CMP(0) FP_CMP(1) FP_CMP(2) FP_CMP(3) FP_CMP(4) FP_CMP(5) FP_CMP(6) FP_CMP(7)
+
+#define FP_CMP_FORMS(pred) { \
+        x64execute_0f_c2_ps_ ## pred, x64execute_0f_c2_pd_ ## pred, \
+        x64execute_0f_c2_ss_ ## pred, x64execute_0f_c2_sd_ ## pred, \
+    }
+
+static const x64handler_t x64execute_0f_c2[8][4] = {
+    FP_CMP_FORMS(0), FP_CMP_FORMS(1), FP_CMP_FORMS(2), FP_CMP_FORMS(3),
+    FP_CMP_FORMS(4), FP_CMP_FORMS(5), FP_CMP_FORMS(6), FP_CMP_FORMS(7),
+};
+
+/**
+ * Status flags of (U)COMISS/SD: ZF, PF and CF tell unordered, less and
+ * equal apart, OF, SF and AF are cleared.
+ */
+static inline void fp_compare_flags(x64emu_t *emu, bool unordered, bool less, bool equal) {
+    x64flags_materialize(emu);
+    r_eflags &= ~X64_FLAGS_STATUS;
+    if (unordered)  r_eflags |= X64_FLAG_ZF | X64_FLAG_PF | X64_FLAG_CF;
+    else if (less)  r_eflags |= X64_FLAG_CF;
+    else if (equal) r_eflags |= X64_FLAG_ZF;
+}
+
+/* UCOMIS raise IE on signaling NaNs only, as the quiet C compares do, COMIS on any. */
+
+X64_HANDLER(x64execute_0f_2e_ps) { /* UCOMISS xmm,xmm/m32 */
+    float a = fp_float32(((reg128_t *)x64modrm_get_xmm(emu, ins))->ud[0]), b = fp_src32(emu, ins);
+    fp_compare_flags(emu, __builtin_isunordered(a, b), __builtin_isless(a, b), a == b);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_2e_pd) { /* UCOMISD xmm,xmm/m64 */
+    double a = fp_float64(((reg128_t *)x64modrm_get_xmm(emu, ins))->uq[0]), b = fp_src64(emu, ins);
+    fp_compare_flags(emu, __builtin_isunordered(a, b), __builtin_isless(a, b), a == b);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_2f_ps) { /* COMISS xmm,xmm/m32 */
+    float a = fp_float32(((reg128_t *)x64modrm_get_xmm(emu, ins))->ud[0]), b = fp_src32(emu, ins);
+    bool unordered = __builtin_isunordered(a, b);
+    if (unordered) feraiseexcept(FE_INVALID);
+    fp_compare_flags(emu, unordered, __builtin_isless(a, b), a == b);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_2f_pd) { /* COMISD xmm,xmm/m64 */
+    double a = fp_float64(((reg128_t *)x64modrm_get_xmm(emu, ins))->uq[0]), b = fp_src64(emu, ins);
+    bool unordered = __builtin_isunordered(a, b);
+    if (unordered) feraiseexcept(FE_INVALID);
+    fp_compare_flags(emu, unordered, __builtin_isless(a, b), a == b);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_50_ps) { /* MOVMSKPS r32,xmm */
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = fp_movmskps(simd_load(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_50_pd) { /* MOVMSKPD r32,xmm */
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = fp_movmskpd(simd_load(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+/* Conversions. */
+
+X64_HANDLER(x64execute_0f_2a_ss) { /* CVTSI2SS xmm,r/m32/64 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    dest->ud[0] = fp_bits32((float)fp_src_int(emu, ins));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_2a_sd) { /* CVTSI2SD xmm,r/m32/64 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    dest->uq[0] = fp_bits64((double)fp_src_int(emu, ins));
+    return true;
+}
+
+/*
+ * CVT(T)SS2SI and CVT(T)SD2SI, 64 bit forms are handlers of their own,
+ * GCC may run both conversions of a conditional and raise IE for the other.
+ */
+#define FP_CVT2SI(op, form, src, trunc) \
+    X64_HANDLER(x64execute_0f_ ## op ## _ ## form) { \
+        *(uint64_t *)x64modrm_get_reg(emu, ins) = (uint32_t)fp_cvt ## form ## 2si(src(emu, ins), trunc); \
+        return true; \
+    } \
+    X64_HANDLER(x64execute_0f_ ## op ## _ ## form ## 64) { \
+        *(int64_t *)x64modrm_get_reg(emu, ins) = fp_cvt ## form ## 2si64(src(emu, ins), trunc); \
+        return true; \
+    }
+
+FP_CVT2SI(2c, ss, fp_src32, true)    /* CVTTSS2SI r32/64,xmm/m32 */
+FP_CVT2SI(2c, sd, fp_src64, true)    /* CVTTSD2SI r32/64,xmm/m64 */
+FP_CVT2SI(2d, ss, fp_src32, false)   /* CVTSS2SI r32/64,xmm/m32 */
+FP_CVT2SI(2d, sd, fp_src64, false)   /* CVTSD2SI r32/64,xmm/m64 */
+
+X64_HANDLER(x64execute_0f_5a_ps) { /* CVTPS2PD xmm,xmm/m64 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtps2pd(simd_load64(x64modrm_get_xmm_m(emu, ins))));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5a_pd) { /* CVTPD2PS xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtpd2ps(simd_load(x64modrm_get_xmm_m(emu, ins))));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5a_ss) { /* CVTSS2SD xmm,xmm/m32 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    dest->uq[0] = fp_bits64((double)fp_src32(emu, ins));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5a_sd) { /* CVTSD2SS xmm,xmm/m64 */
+    reg128_t *dest = x64modrm_get_xmm(emu, ins);
+    dest->ud[0] = fp_bits32((float)fp_src64(emu, ins));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5b_ps) { /* CVTDQ2PS xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtdq2ps(simd_load(x64modrm_get_xmm_m(emu, ins))));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5b_pd) { /* CVTPS2DQ xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtps2dq(simd_load(x64modrm_get_xmm_m(emu, ins)), false));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_5b_ss) { /* CVTTPS2DQ xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtps2dq(simd_load(x64modrm_get_xmm_m(emu, ins)), true));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_e6_pd) { /* CVTTPD2DQ xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtpd2dq(simd_load(x64modrm_get_xmm_m(emu, ins)), true));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_e6_ss) { /* CVTDQ2PD xmm,xmm/m64 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtdq2pd(simd_load64(x64modrm_get_xmm_m(emu, ins))));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_e6_sd) { /* CVTPD2DQ xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), fp_cvtpd2dq(simd_load(x64modrm_get_xmm_m(emu, ins)), false));
+    return true;
+}
+
+/* The MMX forms CVTPI2PS/PD, CVTPS/PD2PI and CVTTPS/PD2PI are left out. */
+
+static const x64handler_t x64execute_0f_2a[4] = { NULL, NULL, x64execute_0f_2a_ss, x64execute_0f_2a_sd };
+static const x64handler_t x64execute_0f_2c[2][4] = {
+    { NULL, NULL, x64execute_0f_2c_ss, x64execute_0f_2c_sd },
+    { NULL, NULL, x64execute_0f_2c_ss64, x64execute_0f_2c_sd64 },
+};
+static const x64handler_t x64execute_0f_2d[2][4] = {
+    { NULL, NULL, x64execute_0f_2d_ss, x64execute_0f_2d_sd },
+    { NULL, NULL, x64execute_0f_2d_ss64, x64execute_0f_2d_sd64 },
+};
+static const x64handler_t x64execute_0f_2e[4] = { x64execute_0f_2e_ps, x64execute_0f_2e_pd, NULL, NULL };
+static const x64handler_t x64execute_0f_2f[4] = { x64execute_0f_2f_ps, x64execute_0f_2f_pd, NULL, NULL };
+static const x64handler_t x64execute_0f_50[4] = { x64execute_0f_50_ps, x64execute_0f_50_pd, NULL, NULL };
+static const x64handler_t x64execute_0f_5a[4] = {
+    x64execute_0f_5a_ps, x64execute_0f_5a_pd, x64execute_0f_5a_ss, x64execute_0f_5a_sd,
+};
+static const x64handler_t x64execute_0f_5b[4] = { x64execute_0f_5b_ps, x64execute_0f_5b_pd, x64execute_0f_5b_ss, NULL };
+static const x64handler_t x64execute_0f_e6[4] = { NULL, x64execute_0f_e6_pd, x64execute_0f_e6_ss, x64execute_0f_e6_sd };
+
+/* 0F AE group, the fences have nothing to order against in a single guest thread. */
+
+X64_HANDLER(x64execute_0f_ae_2) { /* LDMXCSR m32 */
+    x64mxcsr_load(emu, *(uint32_t *)x64modrm_get_r_m(emu, ins));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ae_3) { /* STMXCSR m32 */
+    *(uint32_t *)x64modrm_get_r_m(emu, ins) = x64mxcsr_store(emu);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_ae_fence) { /* LFENCE, MFENCE, SFENCE */
+    return true;
+}
+
+x64handler_t x64execute_resolve_fp(x64instr_t *ins) {
+    uint8_t form = fp_form(ins);
+
+    switch (ins->opcode[1]) {
+        case 0x2A: return x64execute_0f_2a[form];
+        case 0x2C: return x64execute_0f_2c[ins->rex.w][form];
+        case 0x2D: return x64execute_0f_2d[ins->rex.w][form];
+        case 0x2E: return x64execute_0f_2e[form];
+        case 0x2F: return x64execute_0f_2f[form];
+        case 0x50: return ins->amode == X64_AMODE_REG ? x64execute_0f_50[form] : NULL;
+        case 0x51: return x64execute_0f_51[form];
+        case 0x52: return x64execute_0f_52[form];
+        case 0x53: return x64execute_0f_53[form];
+        case 0x58: return x64execute_0f_58[form];
+        case 0x59: return x64execute_0f_59[form];
+        case 0x5A: return x64execute_0f_5a[form];
+        case 0x5B: return x64execute_0f_5b[form];
+        case 0x5C: return x64execute_0f_5c[form];
+        case 0x5D: return x64execute_0f_5d[form];
+        case 0x5E: return x64execute_0f_5e[form];
+        case 0x5F: return x64execute_0f_5f[form];
+        case 0x7C: return x64execute_0f_7c[form];
+        case 0x7D: return x64execute_0f_7d[form];
+        case 0xC2: return x64execute_0f_c2[ins->imm.ub[0] & 7][form];
+        case 0xD0: return x64execute_0f_d0[form];
+        case 0xE6: return x64execute_0f_e6[form];
+
+        case 0xAE:
+            if (ins->modrm.mod != 3) {
+                if (ins->modrm.reg == 2) return x64execute_0f_ae_2;
+                if (ins->modrm.reg == 3) return x64execute_0f_ae_3;
+            } else if (ins->modrm.reg >= 5) {
+                return x64execute_0f_ae_fence;
+            }
+            break;
+    }
+    return NULL;
+}
@@ -0,0 +1,253 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "x64instr.h"
+#include "x64emu.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "modrm_private.h"
+#include "execute_private.h"
+
+/*
+ * CMP/SUB/TEST/DEC fused with following Jcc, CMOVcc or SETcc.
+ * The condition is evaluated on the operands and the result,
+ * flags are recorded only if something reads them after the pair.
+ */
+
+#undef FLAGS_LIVE
+#define FLAGS_LIVE (ins[1].flags_live != 0)
+
+/* Operands of the first instruction, `dest` and `b`. */
+#define FUSED_OPS_rm_r(u_type) \
+    u_type *dest = x64modrm_ea(emu, ins); \
+    u_type b = *(u_type *)x64modrm_reg(emu, ins);
+#define FUSED_OPS_r_rm(u_type) \
+    u_type *dest = x64modrm_reg(emu, ins); \
+    u_type b = *(u_type *)x64modrm_ea(emu, ins);
+#define FUSED_OPS_rm_imm(u_type) \
+    u_type *dest = x64modrm_ea(emu, ins); \
+    u_type b = ins->imm.sq[0];
+#define FUSED_OPS_ax_imm(u_type) \
+    u_type *dest = (u_type *)(emu->regs + _rax); \
+    u_type b = ins->imm.sq[0];
+#define FUSED_OPS_rm_one(u_type) \
+    u_type *dest = x64modrm_ea(emu, ins); \
+    u_type b = 1;
+
+/* Operation of the first instruction, leaves `a - b` or `a & b` in `r`. */
+#define FUSED_KIND_cmp(s_type, u_type) \
+    u_type a = *dest; \
+    u_type r = a - b; \
+    SET_LAZY_FLAGS(X64_LAZY_SUB, u_type, a, b, r)
+#define FUSED_KIND_sub(s_type, u_type) \
+    FUSED_KIND_cmp(s_type, u_type) \
+    *dest = r; \
+    ZEXT_DEST(u_type)
+#define FUSED_KIND_dec(s_type, u_type) \
+    u_type a = *dest; \
+    u_type r = a - b; \
+    if (FLAGS_LIVE) f_CF = x64flags_get_CF(emu); \
+    SET_LAZY_FLAGS(X64_LAZY_DEC, u_type, a, b, r) \
+    *dest = r; \
+    ZEXT_DEST(u_type)
+/* Flags of `r & b` are the same as of `r - 0`, with CF clear. */
+#define FUSED_KIND_test(s_type, u_type) \
+    u_type r = *dest & b; \
+    u_type a = r; \
+    b = 0; \
+    SET_LAZY_FLAGS(X64_LAZY_LOGIC, u_type, 0, 0, r)
+
+/* CF of the first instruction, DEC keeps the previous one. */
+#define FUSED_CF_cmp  (a < b)
+#define FUSED_CF_sub  (a < b)
+#define FUSED_CF_test false
+#define FUSED_CF_dec  x64flags_get_CF(emu)
+
+/* Condition code `cc` after `r = a - b`. */
+#define FUSED_COND(cc, s_type, kind) (((cc) & 1) ^ ( \
+    ((cc) >> 1) == 0 ? (s_type)((a ^ b) & (a ^ r)) < 0 :   /* O  */ \
+    ((cc) >> 1) == 1 ? FUSED_CF_ ## kind :                  /* B  */ \
+    ((cc) >> 1) == 2 ? r == 0 :                             /* E  */ \
+    ((cc) >> 1) == 3 ? FUSED_CF_ ## kind || r == 0 :        /* BE */ \
+    ((cc) >> 1) == 4 ? (s_type)r < 0 :                      /* S  */ \
+    ((cc) >> 1) == 5 ? get_byte_parity(r) :                 /* P  */ \
+    ((cc) >> 1) == 6 ? (s_type)a < (s_type)b :              /* L  */ \
+                       (s_type)a <= (s_type)b))             /* LE */
+
+#define FUSED_FIRST(kind, form, w) \
+    FUSED_OPS_ ## form(uint ## w ## _t) \
+    FUSED_KIND_ ## kind(int ## w ## _t, uint ## w ## _t)
+
+/* Jcc, displacement is sign-extended by the resolver. */
+#define FUSED_JCC(cc, kind, form, w) \
+    FUSED_FIRST(kind, form, w) \
+    r_rip = x64instr_next(ins + 1, r_rip); \
+    if (FUSED_COND(cc, int ## w ## _t, kind)) \
+        r_rip += ins[1].imm.sq[0]; \
+    return true;
+
+/* CMOVcc or SETcc, condition code is taken from the instruction. */
+#define FUSED_CC_HANDLER(kind, form, w) \
+    X64_FUSED_HANDLER(x64execute_fused_ ## kind ## _ ## form ## w ## _cc) { \
+        FUSED_FIRST(kind, form, w) \
+        x64instr_t *next = ins + 1; \
+        uint8_t cc = next->opcode[1] & 0xF; \
+        bool cond = FUSED_COND(cc, int ## w ## _t, kind); \
+        if (next->opcode[1] >= 0x90) \
+            *(uint8_t *)x64modrm_get_r_m(emu, next) = cond; \
+        else if (cond) \
+            fused_cmov(emu, next); \
+        return true; \
+    }
+
+/** MOV part of CMOVcc r16/32/64,r/m16/32/64. */
+static inline void fused_cmov(x64emu_t *emu, x64instr_t *ins) {
+    void *src = x64modrm_get_r_m(emu, ins);
+    void *dest = x64modrm_get_reg(emu, ins);
+    if (ins->rex.w)
+        *(uint64_t *)dest = *(uint64_t *)src;
+    else if (ins->operand_sz)
+        *(uint16_t *)dest = *(uint16_t *)src;
+    else
+        *(uint64_t *)dest = *(uint32_t *)src;
+}
+
+#define FUSED_WIDTH(kind, form, w) \
+    X64_HANDLERS_CC(X64_FUSED_HANDLER, x64execute_fused_ ## kind ## _ ## form ## w ## _jcc, \
+                    FUSED_JCC, kind, form, w) \
+    FUSED_CC_HANDLER(kind, form, w)
+
+/* Tables `x64execute_fused_<kind>_<form>_jcc` indexed with width and condition code,
+   `x64execute_fused_<kind>_<form>_cc` indexed with width. */
+#define FUSED_HANDLERS(kind, form) \
+    FUSED_WIDTH(kind, form, 8) \
+    FUSED_WIDTH(kind, form, 16) \
+    FUSED_WIDTH(kind, form, 32) \
+    FUSED_WIDTH(kind, form, 64) \
+    static const x64handler_t *const x64execute_fused_ ## kind ## _ ## form ## _jcc[4] = { \
+        x64execute_fused_ ## kind ## _ ## form ## 8_jcc,  x64execute_fused_ ## kind ## _ ## form ## 16_jcc, \
+        x64execute_fused_ ## kind ## _ ## form ## 32_jcc, x64execute_fused_ ## kind ## _ ## form ## 64_jcc, \
+    }; \
+    static const x64handler_t x64execute_fused_ ## kind ## _ ## form ## _cc[4] = { \
+        x64execute_fused_ ## kind ## _ ## form ## 8_cc,  x64execute_fused_ ## kind ## _ ## form ## 16_cc, \
+        x64execute_fused_ ## kind ## _ ## form ## 32_cc, x64execute_fused_ ## kind ## _ ## form ## 64_cc, \
+    };
+
+FUSED_HANDLERS(cmp,  rm_r)
+FUSED_HANDLERS(cmp,  r_rm)
+FUSED_HANDLERS(cmp,  rm_imm)
+FUSED_HANDLERS(cmp,  ax_imm)
+FUSED_HANDLERS(sub,  rm_r)
+FUSED_HANDLERS(sub,  r_rm)
+FUSED_HANDLERS(sub,  rm_imm)
+FUSED_HANDLERS(sub,  ax_imm)
+FUSED_HANDLERS(test, rm_r)
+FUSED_HANDLERS(test, rm_imm)
+FUSED_HANDLERS(test, ax_imm)
+FUSED_HANDLERS(dec,  rm_one)
+
+#undef FUSED_HANDLERS
+#undef FUSED_WIDTH
+#undef FUSED_CC_HANDLER
+
+/** @return Row of the tables for operand width of the instruction. */
+static inline uint8_t fused_width(x64instr_t *ins, bool byte_op) {
+    if (byte_op)         return 0;
+    if (ins->rex.w)      return 3;
+    if (ins->operand_sz) return 1;
+    return 2;
+}
+
+/** Sign-extend imm8 or imm16/32 of the first instruction. */
+static inline void fused_imm(x64instr_t *ins, bool imm8) {
+    if (imm8)
+        ins->imm.sq[0] = ins->imm.sb[0];
+    else
+        ins->imm.sq[0] = ins->operand_sz ? ins->imm.sw[0] : ins->imm.sd[0];
+}
+
+x64handler_t x64execute_resolve_fused(x64instr_t *ins) {
+    x64instr_t *next = ins + 1;
+    uint8_t op = ins->opcode[0];
+    uint8_t w;
+    bool jcc;
+    uint8_t cc;
+
+    if (next->opcode[0] >= 0x70 && next->opcode[0] <= 0x7F) {
+        jcc = true;
+        cc = next->opcode[0] & 0xF;
+    } else if (next->opcode[0] == 0x0F) {
+        switch (next->opcode[1]) {
+            case 0x80 ... 0x8F: jcc = true;  break;
+            case 0x40 ... 0x4F:
+            case 0x90 ... 0x9F: jcc = false; break;
+            default: return NULL;
+        }
+        cc = next->opcode[1] & 0xF;
+    } else {
+        return NULL;
+    }
+
+    /* Forms with ModR/M operand. */
+    switch (op) {
+        case 0x28 ... 0x2B:
+        case 0x38 ... 0x3B:
+        case 0x80 ... 0x85:
+        case 0xF6 ... 0xF7:
+        case 0xFE ... 0xFF:
+            if (ins->amode >= X64_AMODE_GENERIC) return NULL;
+            break;
+    }
+
+#define FUSED_PICK(kind, form) \
+    handler = jcc ? x64execute_fused_ ## kind ## _ ## form ## _jcc[w][cc] \
+                  : x64execute_fused_ ## kind ## _ ## form ## _cc[w]; \
+    break;
+
+    x64handler_t handler;
+    switch (op) {
+        case 0x28 ... 0x29: w = fused_width(ins, op == 0x28); FUSED_PICK(sub, rm_r)
+        case 0x2A ... 0x2B: w = fused_width(ins, op == 0x2A); FUSED_PICK(sub, r_rm)
+        case 0x2C ... 0x2D: w = fused_width(ins, op == 0x2C); fused_imm(ins, op == 0x2C); FUSED_PICK(sub, ax_imm)
+        case 0x38 ... 0x39: w = fused_width(ins, op == 0x38); FUSED_PICK(cmp, rm_r)
+        case 0x3A ... 0x3B: w = fused_width(ins, op == 0x3A); FUSED_PICK(cmp, r_rm)
+        case 0x3C ... 0x3D: w = fused_width(ins, op == 0x3C); fused_imm(ins, op == 0x3C); FUSED_PICK(cmp, ax_imm)
+        case 0x84 ... 0x85: w = fused_width(ins, op == 0x84); FUSED_PICK(test, rm_r)
+        case 0xA8 ... 0xA9: w = fused_width(ins, op == 0xA8); fused_imm(ins, op == 0xA8); FUSED_PICK(test, ax_imm)
+
+        case 0x80:
+        case 0x81:
+        case 0x83:
+            w = fused_width(ins, op == 0x80);
+            fused_imm(ins, op != 0x81);
+            if (ins->modrm.reg == 5) { FUSED_PICK(sub, rm_imm) }
+            if (ins->modrm.reg == 7) { FUSED_PICK(cmp, rm_imm) }
+            return NULL;
+
+        case 0xF6 ... 0xF7:
+            if (ins->modrm.reg > 1) return NULL;
+            w = fused_width(ins, op == 0xF6);
+            fused_imm(ins, op == 0xF6);
+            FUSED_PICK(test, rm_imm)
+
+        case 0xFE ... 0xFF:
+            if (ins->modrm.reg != 1) return NULL;
+            w = fused_width(ins, op == 0xFE);
+            FUSED_PICK(dec, rm_one)
+
+        default:
+            return NULL;
+    }
+
+#undef FUSED_PICK
+
+    if (jcc) {
+        if (next->opcode[0] == 0x0F)
+            fused_imm(next, false);
+        else
+            fused_imm(next, true);
+    }
+    return handler;
+}
@@ -3,18 +3,18 @@
 
 #include <stdint.h>
 
-static inline uint8_t get_byte_parity(uint8_t x) {
-    x ^= x >> 4;
-    x ^= x >> 2;
-    x ^= x >> 1;
-    return (~x) & 1;
-}
 
-/* Set SF, ZF, PF. */
-#define SET_RESULT_FLAGS(x) \
-    f_SF = (x) < 0; \
-    f_ZF = (x) == 0; \
-    f_PF = get_byte_parity(x);
+#include "flags_private.h"
+
+/** Whether dest points to a general purpose register. */
+#define DEST_IS_GPR \
+    ((reg64_t *)dest >= emu->regs && (reg64_t *)dest < emu->regs + 16)
+
+/* Writing 32 bit general purpose register zeroes its upper half. */
+#define ZEXT_DEST(type) \
+    if (sizeof(type) == 4 && DEST_IS_GPR) ((uint32_t *)dest)[1] = 0;
+
+/* Rotates update only CF and OF, so they work on materialized flags. */
 
 /* CF (shift>0) = last bit shifted out,
    OF (shift=1) = CF xor MSB of dest. */
@@ -33,21 +33,10 @@ static inline uint8_t get_byte_parity(uint8_t x) {
                                 (*(u_type *)dest >> (type_len - 1)); \
     }
 
-/* Same as rotating, but sets SF, ZF, PF. */
-
-#define IMPL_SHL_FLAG(s_type, u_type, operand) \
+/* Shifts record CF, OF, SF, ZF, PF lazily, flags are unchanged if shift is 0. */
+#define IMPL_SHIFT_FLAG(lazy_kind, u_type) \
     if (shift > 0) { \
-        f_CF = (tdest >> (type_len - shift)) & 1; \
-        SET_RESULT_FLAGS(*(s_type *)dest) \
-        if (shift == 1) f_OF = f_CF ^ (*(u_type *)dest >> (type_len - 1)); \
-    }
-
-#define IMPL_SHR_FLAG(s_type, u_type, operand) \
-    if (shift > 0) { \
-        f_CF = (tdest >> (shift - 1)) & 1; \
-        SET_RESULT_FLAGS(*(s_type *)dest) \
-        if (shift == 1) f_OF = ((*(u_type *)dest >> (type_len - 2)) & 1) ^ \
-                                (*(u_type *)dest >> (type_len - 1)); \
+        SET_LAZY_FLAGS(lazy_kind, u_type, tdest, shift, *(u_type *)dest) \
     }
 
 #define IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
@@ -58,68 +47,78 @@ static inline uint8_t get_byte_parity(uint8_t x) {
 
 /** Rotate left. Updates CF(shift>0), OF(shift=1). Operand is unsigned. */
 #define OP_ROL(s_type, u_type, operand) { \
+    x64flags_materialize(emu); \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest = (tdest << shift) | (tdest >> (type_len - shift)); \
     IMPL_ROL_FLAG(s_type, u_type, operand) \
+    ZEXT_DEST(u_type) \
 }
 
 /** Rotate right. Updates CF(shift>0), OF(shift=1). Operand is unsigned. */
 #define OP_ROR(s_type, u_type, operand) { \
+    x64flags_materialize(emu); \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest = (tdest >> shift) | (tdest << (type_len - shift)); \
     IMPL_ROR_FLAG(s_type, u_type, operand) \
+    ZEXT_DEST(u_type) \
 }
 
 /** Rotate left with carry. Updates CF(shift>0), OF(shift=1). Operand is unsigned. */
 #define OP_RCL(s_type, u_type, operand) { \
+    x64flags_materialize(emu); \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest = (tdest << shift) | (tdest >> (type_len + 1 - shift)) | \
                       ((shift) ? (f_CF << (shift - 1)) : 0); \
     IMPL_ROL_FLAG(s_type, u_type, operand) \
+    ZEXT_DEST(u_type) \
 }
 
 /** Rotate right with carry. Updates CF(shift>0), OF(shift=1). Operand is unsigned */
 #define OP_RCR(s_type, u_type, operand) { \
+    x64flags_materialize(emu); \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest = (tdest >> shift) | (tdest << (type_len + 1 - shift)) | \
                       (f_CF << (type_len - shift)); \
     IMPL_ROR_FLAG(s_type, u_type, operand) \
+    ZEXT_DEST(u_type) \
 }
 
 /** `*dest <<= operand`; updates CF(shift>0), OF(shift=1), SF, ZF, PF; operand is unsigned. */
 #define OP_SHL(s_type, u_type, operand) { \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest <<= shift; \
-    IMPL_SHL_FLAG(s_type, u_type, operand) \
+    IMPL_SHIFT_FLAG(X64_LAZY_SHL, u_type) \
+    ZEXT_DEST(u_type) \
 }
 
 /** `*dest >>= operand`; updates CF(shift>0), OF(shift=1), SF, ZF, PF; operand is unsigned. */
 #define OP_SHR(s_type, u_type, operand) { \
     IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(u_type *)dest >>= shift; \
-    IMPL_SHR_FLAG(s_type, u_type, operand) \
+    IMPL_SHIFT_FLAG(X64_LAZY_SHR, u_type) \
+    ZEXT_DEST(u_type) \
 }
 
 /* FIXME: signed type shifts are implementation-defined. */
 /** Signed `*dest >>= operand`; updates CF(shift>0), OF(shift=1), SF, ZF, PF; operand is unsigned. */
 #define OP_SAR(s_type, u_type, operand) { \
-    IMPL_SHIFT_PROLOGUE(s_type, s_type, operand) \
+    IMPL_SHIFT_PROLOGUE(s_type, u_type, operand) \
     *(s_type *)dest >>= shift; \
-    IMPL_SHR_FLAG(s_type, u_type, operand) \
+    IMPL_SHIFT_FLAG(X64_LAZY_SAR, u_type) \
+    ZEXT_DEST(u_type) \
 }
 
 
 /* NOTE: state of AF is undefined. */
 #define IMPL_OP_S_BITWISE(oper, s_type, u_type, operand) { \
     *(s_type *)dest oper ## = (operand); \
-    SET_RESULT_FLAGS(*(s_type *)dest) \
-    f_CF = f_OF = 0; \
+    SET_LAZY_FLAGS(X64_LAZY_LOGIC, u_type, 0, 0, *(s_type *)dest) \
+    ZEXT_DEST(s_type) \
 }
 
 #define IMPL_OP_S_TEST(oper, s_type, u_type, operand) { \
     s_type _res = (*(s_type *)dest) oper (operand); \
-    SET_RESULT_FLAGS(_res) \
-    f_CF = f_OF = 0; \
+    SET_LAZY_FLAGS(X64_LAZY_LOGIC, u_type, 0, 0, _res) \
 }
 
 
@@ -143,137 +142,94 @@ static inline uint8_t get_byte_parity(uint8_t x) {
     IMPL_OP_S_BITWISE(|, s_type, u_type, operand)
 
 /** `*dest = ~(*dest)`. */
-#define OP_S_NOT(s_type, u_type, operand) \
-    *(s_type *)dest = ~(*(s_type *)dest);
+#define OP_S_NOT(s_type, u_type, operand) { \
+    *(s_type *)dest = ~(*(s_type *)dest); \
+    ZEXT_DEST(s_type) \
+}
 
-/** `*dest = -(*dest)`, signed. */
-#define OP_S_NEG(s_type, u_type, operand) \
-    *(s_type *)dest = -(*(s_type *)dest);
+/** `*dest = -(*dest)`, signed. Updates flags as `0 - *dest`. */
+#define OP_S_NEG(s_type, u_type, operand) { \
+    u_type _sav = *(u_type *)dest; \
+    *(u_type *)dest = -_sav; \
+    SET_LAZY_FLAGS(X64_LAZY_SUB, u_type, 0, _sav, -_sav) \
+    ZEXT_DEST(s_type) \
+}
 
 
-#define IMPL_S_ADD(s_type, u_type, operand) \
-    s_type _sav = *(s_type *)dest; \
-    s_type _res = _sav + (operand); \
-    SET_RESULT_FLAGS(_res) \
-    /* CF is set in other macro */ \
-    f_AF = (uint8_t)_res < (uint8_t)_sav; \
-    f_OF = ((operand) <  0 && _sav <  0 && _res >= 0) || \
-           ((operand) >= 0 && _sav >= 0 && _res <  0);
+/* Source is read before dest is written, they may be the same register. */
+#define IMPL_S_ARITH(lazy_kind, oper, s_type, u_type, operand, carry) \
+    u_type _sav = *(u_type *)dest; \
+    u_type _src = (u_type)(operand); \
+    u_type _res = _sav oper _src oper (carry); \
+    SET_LAZY_FLAGS(lazy_kind, u_type, _sav, _src, _res)
 
 
 /** `*dest += operand`. Updates AF, OF, CF, ZF, PF, SF. Operands are signed. */
 #define OP_S_ADD(s_type, u_type, operand) { \
-    IMPL_S_ADD(s_type, u_type, operand) \
-    f_CF = (u_type)_res < (u_type)_sav; \
-    *(s_type *)dest = _res; \
+    IMPL_S_ARITH(X64_LAZY_ADD, +, s_type, u_type, operand, 0) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
 /** `*dest += operand`. Updates AF, OF, ZF, PF, SF. Operands are signed. */
 #define OP_S_INC(s_type, u_type, operand) { \
-    IMPL_S_ADD(s_type, u_type, operand) \
-    *(s_type *)dest = _res; \
+    f_CF = x64flags_get_CF(emu); \
+    IMPL_S_ARITH(X64_LAZY_INC, +, s_type, u_type, operand, 0) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
-/* Probably bad. */
-
 /** `*dest += CF + operand`. Updates AF, OF, CF, ZF, PF, SF. Operands are signed. */
 #define OP_S_ADC(s_type, u_type, operand) { \
-    s_type _sav; \
-    s_type _res; \
-    if (f_CF) { \
-        _sav = *(s_type *)dest; \
-        _res = _sav + 1; \
-        f_CF = (u_type)_res < (u_type)_sav; \
-        f_AF = (uint8_t)_res < (uint8_t)_sav; \
-        f_OF = _sav >= 0 && _res < 0; \
-    } \
-    _sav = *(s_type *)dest; \
-    _res = _sav + (operand); \
-    SET_RESULT_FLAGS(_res) \
-    f_CF |= (u_type)_res < (u_type)_sav; \
-    f_AF |= (uint8_t)_res < (uint8_t)_sav; \
-    f_OF |= ((operand) <  0 && _sav <  0 && _res >= 0) || \
-            ((operand) >= 0 && _sav >= 0 && _res <  0); \
-    *(s_type *)dest = _res; \
+    bool _cf = x64flags_get_CF(emu); \
+    IMPL_S_ARITH(_cf ? X64_LAZY_ADC : X64_LAZY_ADD, +, s_type, u_type, operand, _cf) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
 
-#define IMPL_S_CMP(s_type, u_type, operand) \
-    s_type _sav = *(s_type *)dest; \
-    s_type _res = _sav - (operand); \
-    SET_RESULT_FLAGS(_res) \
-    /* CF is set in other macro */ \
-    f_AF = (uint8_t)_res > (uint8_t)_sav; \
-    f_OF = ((operand) >= 0 && _sav <  0 && _res >= 0) || \
-           ((operand) <  0 && _sav >= 0 && _res <  0);
-
-
 /** Updates AF, OF, CF, ZF, SF, PF with result of `*dest - operand`. Operands are signed. */
 #define OP_S_CMP(s_type, u_type, operand) { \
-    IMPL_S_CMP(s_type, u_type, operand) \
-    f_CF = (u_type)_res > (u_type)_sav; \
+    IMPL_S_ARITH(X64_LAZY_SUB, -, s_type, u_type, operand, 0) \
 }
 
 /** `*dest -= operand`. Updates AF, OF, CF, ZF, SF, PF. Operands are signed. */
 #define OP_S_SUB(s_type, u_type, operand) { \
-    IMPL_S_CMP(s_type, u_type, operand) \
-    f_CF = (u_type)_res > (u_type)_sav; \
-    *(s_type *)dest = _res; \
+    IMPL_S_ARITH(X64_LAZY_SUB, -, s_type, u_type, operand, 0) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
 /** `*dest -= operand`. Updates AF, OF, ZF, SF, PF. Operands are signed. */
 #define OP_S_DEC(s_type, u_type, operand) { \
-    IMPL_S_CMP(s_type, u_type, operand) \
-    *(s_type *)dest = _res; \
+    f_CF = x64flags_get_CF(emu); \
+    IMPL_S_ARITH(X64_LAZY_DEC, -, s_type, u_type, operand, 0) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
 /** `*dest -= CF + operand`. Updates AF, OF, CF, ZF, PF, SF. Operands are signed. */
 #define OP_S_SBB(s_type, u_type, operand) { \
-    s_type _sav; \
-    s_type _res; \
-    if (f_CF) { \
-        _sav = *(s_type *)dest; \
-        _res = _sav - 1; \
-        f_CF = (u_type)_res > (u_type)_sav; \
-        f_AF = (uint8_t)_res > (uint8_t)_sav; \
-        f_OF = _sav <  0 && _res >= 0; \
-    } \
-    _sav = *(s_type *)dest; \
-    _res = _sav - (operand); \
-    SET_RESULT_FLAGS(_res) \
-    f_CF |= (u_type)_res > (u_type)_sav; \
-    f_AF |= (uint8_t)_res > (uint8_t)_sav; \
-    f_OF |= ((operand) >= 0 && _sav <  0 && _res >= 0) || \
-           ((operand) <  0 && _sav >= 0 && _res <  0); \
-    *(s_type *)dest = _res; \
+    bool _cf = x64flags_get_CF(emu); \
+    IMPL_S_ARITH(_cf ? X64_LAZY_SBB : X64_LAZY_SUB, -, s_type, u_type, operand, _cf) \
+    *(u_type *)dest = _res; \
+    ZEXT_DEST(s_type) \
 }
 
 /** `*dest = operand`. Operands are signed. */
 #define OP_S_MOV(s_type, u_type, operand) { \
     *(s_type *)dest = operand; \
+    ZEXT_DEST(s_type) \
 }
 
 
 /** `*dest = operand`. Operands are unsigned. */
 #define OP_U_MOV(s_type, u_type, operand) { \
     *(u_type *)dest = operand; \
+    ZEXT_DEST(u_type) \
 }
 
 
-/** `*dest = operand`, RCX/ECX times if rep specified. */
-#define OP_U_MOV_REP(s_type, u_type, operand) { \
-    u_type *tdest = (u_type *)dest; \
-    if (!ins->rep) *tdest = operand; \
-    else if (ins->address_sz) \
-        for (; r_ecx; r_ecx--) \
-            if (f_DF) *(tdest--) = operand; \
-            else      *(tdest++) = operand; \
-    else \
-        for (; r_rcx; r_rcx--) \
-            if (f_DF) *(tdest--) = operand; \
-            else      *(tdest++) = operand; \
-}
-
 /* Get the first src operand for operation. */
 #define GET_OP_SRC1_REG      void *src = x64modrm_get_reg(emu, ins);
 #define GET_OP_SRC1_R_M      void *src = x64modrm_get_r_m(emu, ins);
@@ -355,6 +311,9 @@ static inline uint8_t get_byte_parity(uint8_t x) {
     u_type _sav = *(u_type *)dest; \
     *(u_type *)dest = *(u_type *)src; \
     *(u_type *)src = _sav; \
+    ZEXT_DEST(u_type) \
+    if (sizeof(u_type) == 4 && (reg64_t *)src >= emu->regs && (reg64_t *)src < emu->regs + 16) \
+        ((uint32_t *)src)[1] = 0; \
 }
 
 #define PP_OP2_16_32_64(desttype, srctype, operation) { \
@@ -417,29 +376,112 @@ static inline uint8_t get_byte_parity(uint8_t x) {
 #include "x64emu.h"
 #include "x64instr.h"
 
-#include "flags_private.h"
-
+/* Flags are computed only for the condition being tested. */
 static inline bool x64execute_jmp_cond(x64emu_t *emu, x64instr_t *ins, uint8_t op) {
-    bool ret = false;
     switch (op & 0xF) {
-        case 0x0: ret =  f_OF;                 break;
-        case 0x1: ret = !f_OF;                 break;
-        case 0x2: ret =  f_CF;                 break;
-        case 0x3: ret = !f_CF;                 break;
-        case 0x4: ret =  f_ZF;                 break;
-        case 0x5: ret = !f_ZF;                 break;
-        case 0x6: ret =  f_CF ||  f_ZF;        break;
-        case 0x7: ret = !f_CF && !f_ZF;        break;
-        case 0x8: ret =  f_SF;                 break;
-        case 0x9: ret = !f_SF;                 break;
-        case 0xA: ret =  f_PF;                 break;
-        case 0xB: ret = !f_PF;                 break;
-        case 0xC: ret =  f_SF != f_OF;         break;
-        case 0xD: ret =  f_SF == f_OF;         break;
-        case 0xE: ret =  f_ZF || f_SF != f_OF; break;
-        case 0xF: ret = !f_ZF && f_SF == f_OF; break;
+        case 0x0: return  x64flags_get_OF(emu);
+        case 0x1: return !x64flags_get_OF(emu);
+        case 0x2: return  x64flags_get_CF(emu);
+        case 0x3: return !x64flags_get_CF(emu);
+        case 0x4: return  x64flags_get_ZF(emu);
+        case 0x5: return !x64flags_get_ZF(emu);
+        case 0x6: return  x64flags_get_CF(emu) ||  x64flags_get_ZF(emu);
+        case 0x7: return !x64flags_get_CF(emu) && !x64flags_get_ZF(emu);
+        case 0x8: return  x64flags_get_SF(emu);
+        case 0x9: return !x64flags_get_SF(emu);
+        case 0xA: return  x64flags_get_PF(emu);
+        case 0xB: return !x64flags_get_PF(emu);
+        case 0xC: return  x64flags_get_SF(emu) != x64flags_get_OF(emu);
+        case 0xD: return  x64flags_get_SF(emu) == x64flags_get_OF(emu);
+        case 0xE: return  x64flags_get_ZF(emu) || x64flags_get_SF(emu) != x64flags_get_OF(emu);
+        case 0xF: return !x64flags_get_ZF(emu) && x64flags_get_SF(emu) == x64flags_get_OF(emu);
     }
-    return ret;
+    return false;
 }
 
+
+/* Threaded dispatch */
+
+#ifdef __has_attribute
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifndef MUSTTAIL
+#define MUSTTAIL /* sibling call optimization does the job with -O2. */
+#endif
+
+#ifdef HAVE_TRACE
+#define TRACE_INSTR() x64emu_trace(emu, ins, x64instr_next(ins, r_rip) - ins->len);
+#else
+#define TRACE_INSTR()
+#endif
+
+/**
+ * Define handler `name`, followed by the body executing one instruction.
+ * Body returns false on failure, otherwise the handler jumps straight
+ * to the handler of the next one, so every handler has its own dispatch branch.
+ * r_rip stays at the start of the block, bodies of instructions which leave it
+ * set r_rip, see `x64instr_next`. Nothing is written back per instruction.
+ */
+#define X64_HANDLER(name) \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins); \
+    static bool name(x64emu_t *emu, x64instr_t *ins) { \
+        TRACE_INSTR() \
+        if (!name ## _body(emu, ins)) return false; \
+        ins++; \
+        MUSTTAIL return ins->handler(emu, ins); \
+    } \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins)
+
+/**
+ * Define handler `name` of two fused instructions, the body executes both.
+ * Execution continues with the instruction after the pair.
+ */
+#define X64_FUSED_HANDLER(name) \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins); \
+    static bool name(x64emu_t *emu, x64instr_t *ins) { \
+        TRACE_INSTR() \
+        if (!name ## _body(emu, ins)) return false; \
+        ins += 2; \
+        MUSTTAIL return ins->handler(emu, ins); \
+    } \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins)
+
+/**
+ * Define handler `name` of a run of instructions, `fused` more follow
+ * the first one. The body executes all of them.
+ */
+#define X64_RUN_HANDLER(name) \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins); \
+    static bool name(x64emu_t *emu, x64instr_t *ins) { \
+        TRACE_INSTR() \
+        x64instr_t *next = ins + 1 + ins->fused; \
+        if (!name ## _body(emu, ins)) return false; \
+        MUSTTAIL return next->handler(emu, next); \
+    } \
+    static inline bool name ## _body(x64emu_t *emu, x64instr_t *ins)
+
+/* Define 16 handlers `name_0`..`name_F` with `handler` macro,
+   condition code and the rest of arguments are passed to `body` macro. */
+#define X64_HANDLERS_CC(handler, name, body, ...) \
+    handler(name ## _0) { body(0x0, ##__VA_ARGS__) } handler(name ## _1) { body(0x1, ##__VA_ARGS__) } \
+    handler(name ## _2) { body(0x2, ##__VA_ARGS__) } handler(name ## _3) { body(0x3, ##__VA_ARGS__) } \
+    handler(name ## _4) { body(0x4, ##__VA_ARGS__) } handler(name ## _5) { body(0x5, ##__VA_ARGS__) } \
+    handler(name ## _6) { body(0x6, ##__VA_ARGS__) } handler(name ## _7) { body(0x7, ##__VA_ARGS__) } \
+    handler(name ## _8) { body(0x8, ##__VA_ARGS__) } handler(name ## _9) { body(0x9, ##__VA_ARGS__) } \
+    handler(name ## _A) { body(0xA, ##__VA_ARGS__) } handler(name ## _B) { body(0xB, ##__VA_ARGS__) } \
+    handler(name ## _C) { body(0xC, ##__VA_ARGS__) } handler(name ## _D) { body(0xD, ##__VA_ARGS__) } \
+    handler(name ## _E) { body(0xE, ##__VA_ARGS__) } handler(name ## _F) { body(0xF, ##__VA_ARGS__) } \
+    static const x64handler_t name[16] = { \
+        name ## _0, name ## _1, name ## _2, name ## _3, \
+        name ## _4, name ## _5, name ## _6, name ## _7, \
+        name ## _8, name ## _9, name ## _A, name ## _B, \
+        name ## _C, name ## _D, name ## _E, name ## _F, \
+    };
+
+/* Define 16 handlers `name_0`..`name_F`, condition code is passed to `body` macro. */
+#define X64_HANDLER_CC(name, body) X64_HANDLERS_CC(X64_HANDLER, name, body)
+
 #endif /* __X64EXECUTE_PRIVATE_H_ */
\ No newline at end of file
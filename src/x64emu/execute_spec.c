@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "x64instr.h"
+#include "x64emu.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "modrm_private.h"
+#include "execute_private.h"
+
+/*
+ * Handlers specialized by operand width and ModR/M addressing form.
+ * OP_* macros are expanded with fixed types and effective address helper,
+ * so no size or addressing decision is left for run time.
+ */
+
+/* Whether the destination is a register and whether the flags are read
+   afterwards is known for every handler. */
+#undef DEST_IS_GPR
+#define DEST_IS_GPR dest_is_gpr
+#undef FLAGS_LIVE
+#define FLAGS_LIVE flags_live
+
+#define SPEC_IS_REG_reg        true
+#define SPEC_IS_REG_base       false
+#define SPEC_IS_REG_base_index false
+#define SPEC_IS_REG_index      false
+#define SPEC_IS_REG_abs        false
+#define SPEC_IS_REG_rip        false
+
+/* r/m,r */
+#define SPEC_HANDLER_rm_r(name, oper, live, w, am) \
+    X64_HANDLER(x64execute_spec_ ## name ## _rm_r ## w ## _ ## am) { \
+        void *src = x64modrm_reg(emu, ins); \
+        void *dest = x64modrm_ea_ ## am(emu, ins); \
+        const bool dest_is_gpr = SPEC_IS_REG_ ## am; \
+        (void)dest_is_gpr; \
+        const bool flags_live = live; \
+        (void)flags_live; \
+        oper(int ## w ## _t, uint ## w ## _t, *(int ## w ## _t *)src) \
+        return true; \
+    }
+
+/* r,r/m */
+#define SPEC_HANDLER_r_rm(name, oper, live, w, am) \
+    X64_HANDLER(x64execute_spec_ ## name ## _r_rm ## w ## _ ## am) { \
+        void *src = x64modrm_ea_ ## am(emu, ins); \
+        void *dest = x64modrm_reg(emu, ins); \
+        const bool dest_is_gpr = true; \
+        (void)dest_is_gpr; \
+        const bool flags_live = live; \
+        (void)flags_live; \
+        oper(int ## w ## _t, uint ## w ## _t, *(int ## w ## _t *)src) \
+        return true; \
+    }
+
+/* r/m,imm, immediate is sign-extended to 64 bit by the resolver. */
+#define SPEC_HANDLER_rm_imm(name, oper, live, w, am) \
+    X64_HANDLER(x64execute_spec_ ## name ## _rm_imm ## w ## _ ## am) { \
+        void *dest = x64modrm_ea_ ## am(emu, ins); \
+        const bool dest_is_gpr = SPEC_IS_REG_ ## am; \
+        (void)dest_is_gpr; \
+        const bool flags_live = live; \
+        (void)flags_live; \
+        oper(int ## w ## _t, uint ## w ## _t, (int ## w ## _t)ins->imm.sq[0]) \
+        return true; \
+    }
+
+/* One handler per addressing form, in X64_AMODE_* order. */
+#define SPEC_AMODES(dir, name, oper, live, w) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, reg) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, base) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, base_index) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, index) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, abs) \
+    SPEC_HANDLER_ ## dir(name, oper, live, w, rip)
+
+#define SPEC_ROW(dir, name, w) { \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _reg, \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _base, \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _base_index, \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _index, \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _abs, \
+        x64execute_spec_ ## name ## _ ## dir ## w ## _rip, \
+    }
+
+/* Table `x64execute_spec_<name>_<dir>` is indexed with width (8/16/32/64) and amode. */
+#define SPEC_HANDLERS(dir, name, oper, live) \
+    SPEC_AMODES(dir, name, oper, live, 8) \
+    SPEC_AMODES(dir, name, oper, live, 16) \
+    SPEC_AMODES(dir, name, oper, live, 32) \
+    SPEC_AMODES(dir, name, oper, live, 64) \
+    static const x64handler_t x64execute_spec_ ## name ## _ ## dir[4][X64_AMODE_GENERIC] = { \
+        SPEC_ROW(dir, name, 8),  SPEC_ROW(dir, name, 16), \
+        SPEC_ROW(dir, name, 32), SPEC_ROW(dir, name, 64), \
+    };
+
+/* Flag writing operations get `_nf` variants for instructions with dead flags. */
+#define SPEC_FLAG_HANDLERS(dir, name, oper) \
+    SPEC_HANDLERS(dir, name, oper, true) \
+    SPEC_HANDLERS(dir, name ## _nf, oper, false)
+
+#define SPEC_ALU(dir) \
+    SPEC_FLAG_HANDLERS(dir, add, OP_S_ADD) \
+    SPEC_FLAG_HANDLERS(dir, or,  OP_S_OR) \
+    SPEC_FLAG_HANDLERS(dir, adc, OP_S_ADC) \
+    SPEC_FLAG_HANDLERS(dir, sbb, OP_S_SBB) \
+    SPEC_FLAG_HANDLERS(dir, and, OP_S_AND) \
+    SPEC_FLAG_HANDLERS(dir, sub, OP_S_SUB) \
+    SPEC_FLAG_HANDLERS(dir, xor, OP_S_XOR) \
+    SPEC_FLAG_HANDLERS(dir, cmp, OP_S_CMP) \
+    SPEC_HANDLERS(dir, mov, OP_S_MOV, true)
+
+SPEC_ALU(rm_r)
+SPEC_ALU(r_rm)
+SPEC_ALU(rm_imm)
+SPEC_FLAG_HANDLERS(rm_r,   test, OP_S_TEST_AND)
+SPEC_FLAG_HANDLERS(rm_imm, test, OP_S_TEST_AND)
+
+#undef SPEC_ALU
+#undef SPEC_FLAG_HANDLERS
+#undef SPEC_HANDLERS
+#undef SPEC_ROW
+#undef SPEC_AMODES
+
+typedef const x64handler_t (*spec_table_t)[X64_AMODE_GENERIC];
+
+/* Indexed with whether flags are live, then ALU opcode bits 3..5
+   or ModR/M reg field of group 1. */
+#define SPEC_ALU_ROW(dir, nf) { \
+        x64execute_spec_add ## nf ## _ ## dir, x64execute_spec_or  ## nf ## _ ## dir, \
+        x64execute_spec_adc ## nf ## _ ## dir, x64execute_spec_sbb ## nf ## _ ## dir, \
+        x64execute_spec_and ## nf ## _ ## dir, x64execute_spec_sub ## nf ## _ ## dir, \
+        x64execute_spec_xor ## nf ## _ ## dir, x64execute_spec_cmp ## nf ## _ ## dir, \
+    }
+#define SPEC_ALU_TABLE(dir) { SPEC_ALU_ROW(dir, _nf), SPEC_ALU_ROW(dir, ) }
+
+static const spec_table_t spec_alu_rm_r[2][8]   = SPEC_ALU_TABLE(rm_r);
+static const spec_table_t spec_alu_r_rm[2][8]   = SPEC_ALU_TABLE(r_rm);
+static const spec_table_t spec_alu_rm_imm[2][8] = SPEC_ALU_TABLE(rm_imm);
+
+#undef SPEC_ALU_TABLE
+#undef SPEC_ALU_ROW
+
+/** @return Row of the table for operand width of the instruction. */
+static inline uint8_t spec_width(x64instr_t *ins, bool byte_op) {
+    if (byte_op)         return 0;
+    if (ins->rex.w)      return 3;
+    if (ins->operand_sz) return 1;
+    return 2;
+}
+
+/** Sign-extend imm16/32 of 81, C7 and F7 opcodes. */
+static inline void spec_imm_16_32(x64instr_t *ins) {
+    ins->imm.sq[0] = ins->operand_sz ? ins->imm.sw[0] : ins->imm.sd[0];
+}
+
+/**
+ * @param live Whether flags written by the instruction are read afterwards,
+ *             MOV has no variant for dead flags.
+ */
+static x64handler_t spec_resolve(x64instr_t *ins, bool live) {
+    uint8_t op = ins->opcode[0];
+    uint8_t amode = ins->amode;
+    spec_table_t table;
+
+    if (amode >= X64_AMODE_GENERIC)
+        return NULL;
+
+    switch (op) {
+        case 0x00 ... 0x3F:   /* ALU r/m,r and r,r/m */
+            if ((op & 7) > 3) return NULL;
+            table = (op & 2) ? spec_alu_r_rm[live][op >> 3] : spec_alu_rm_r[live][op >> 3];
+            return table[spec_width(ins, !(op & 1))][amode];
+
+        case 0x80:            /* ALU r/m8,imm8 */
+        case 0x83:            /* ALU r/m16/32/64,imm8 */
+            ins->imm.sq[0] = ins->imm.sb[0];
+            return spec_alu_rm_imm[live][ins->modrm.reg][spec_width(ins, op == 0x80)][amode];
+
+        case 0x81:            /* ALU r/m16/32/64,imm16/32 */
+            spec_imm_16_32(ins);
+            return spec_alu_rm_imm[live][ins->modrm.reg][spec_width(ins, false)][amode];
+
+        case 0x84 ... 0x85:   /* TEST r/m,r */
+            table = live ? x64execute_spec_test_rm_r : x64execute_spec_test_nf_rm_r;
+            return table[spec_width(ins, op == 0x84)][amode];
+
+        case 0x88 ... 0x89:   /* MOV r/m,r */
+            if (!live) return NULL;
+            return x64execute_spec_mov_rm_r[spec_width(ins, op == 0x88)][amode];
+
+        case 0x8A ... 0x8B:   /* MOV r,r/m */
+            if (!live) return NULL;
+            return x64execute_spec_mov_r_rm[spec_width(ins, op == 0x8A)][amode];
+
+        case 0xC6:            /* MOV r/m8,imm8 */
+            if (!live || ins->modrm.reg != 0) return NULL;
+            ins->imm.sq[0] = ins->imm.sb[0];
+            return x64execute_spec_mov_rm_imm[0][amode];
+
+        case 0xC7:            /* MOV r/m16/32/64,imm16/32 */
+            if (!live || ins->modrm.reg != 0) return NULL;
+            spec_imm_16_32(ins);
+            return x64execute_spec_mov_rm_imm[spec_width(ins, false)][amode];
+
+        case 0xF6:            /* TEST r/m8,imm8 */
+            if (ins->modrm.reg > 1) return NULL;
+            ins->imm.sq[0] = ins->imm.sb[0];
+            table = live ? x64execute_spec_test_rm_imm : x64execute_spec_test_nf_rm_imm;
+            return table[0][amode];
+
+        case 0xF7:            /* TEST r/m16/32/64,imm16/32 */
+            if (ins->modrm.reg > 1) return NULL;
+            spec_imm_16_32(ins);
+            table = live ? x64execute_spec_test_rm_imm : x64execute_spec_test_nf_rm_imm;
+            return table[spec_width(ins, false)][amode];
+    }
+    return NULL;
+}
+
+x64handler_t x64execute_resolve_spec(x64instr_t *ins) {
+    return spec_resolve(ins, true);
+}
+
+x64handler_t x64execute_resolve_spec_nf(x64instr_t *ins) {
+    return spec_resolve(ins, false);
+}
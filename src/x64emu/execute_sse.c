@@ -0,0 +1,370 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+#include "execute_private.h"
+#include "simd_private.h"
+
+/*
+ * MMX and SSE2 packed integer instructions, 0F 60..7F and 0F C4..FE,
+ * and the bitwise SSE ones. Each runs a kernel of simd_private.h
+ * on xmm,xmm/m128 with 66 prefix or on mm,mm/m64 without.
+ * Forms are told apart by their prefixes when resolving.
+ */
+
+/** `xmm_kernel(dest, src)` or `mmx_kernel(dest, src)` to dest. */
+#define SSE_PACKED(op, xmm_kernel, mmx_kernel) \
+    X64_HANDLER(x64execute_0f_ ## op) { \
+        if (ins->operand_sz) { \
+            void *dest = x64modrm_get_xmm(emu, ins); \
+            simd_store(dest, xmm_kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)))); \
+        } else { \
+            void *dest = x64modrm_get_mmx(emu, ins); \
+            simd_store64(dest, mmx_kernel(simd_load64(dest), simd_load64(x64modrm_get_mmx_m(emu, ins)))); \
+        } \
+        return true; \
+    }
+
+/** `kernel(dest, src)` to dest, xmm,xmm/m128 only. */
+#define SSE_PACKED_XMM(op, kernel) \
+    X64_HANDLER(x64execute_0f_ ## op) { \
+        void *dest = x64modrm_get_xmm(emu, ins); \
+        simd_store(dest, kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins)))); \
+        return true; \
+    }
+
+/** `kernel(dest, count)`, count is the low qword of the source. */
+#define SSE_SHIFT(op, kernel) \
+    X64_HANDLER(x64execute_0f_ ## op) { \
+        if (ins->operand_sz) { \
+            void *dest = x64modrm_get_xmm(emu, ins); \
+            simd_store(dest, kernel(simd_load(dest), simd_load(x64modrm_get_xmm_m(emu, ins))[0])); \
+        } else { \
+            void *dest = x64modrm_get_mmx(emu, ins); \
+            simd_store64(dest, kernel(simd_load64(dest), simd_load64(x64modrm_get_mmx_m(emu, ins))[0])); \
+        } \
+        return true; \
+    }
+
+/** `kernel(dest, imm8)` on the r/m register, 0F 71..73 /reg. */
+#define SSE_SHIFT_IMM(op, reg, kernel) \
+    X64_HANDLER(x64execute_0f_ ## op ## _ ## reg) { \
+        if (ins->operand_sz) { \
+            void *dest = x64modrm_get_xmm_m(emu, ins); \
+            simd_store(dest, kernel(simd_load(dest), ins->imm.ub[0])); \
+        } else { \
+            void *dest = x64modrm_get_mmx_m(emu, ins); \
+            simd_store64(dest, kernel(simd_load64(dest), ins->imm.ub[0])); \
+        } \
+        return true; \
+    }
+
+SSE_PACKED_XMM(54, simd_and)                        /* ANDPS/ANDPD */
+SSE_PACKED_XMM(55, simd_andn)                       /* ANDNPS/ANDNPD */
+SSE_PACKED_XMM(56, simd_or)                         /* ORPS/ORPD */
+SSE_PACKED_XMM(57, simd_xor)                        /* XORPS/XORPD */
+
+SSE_PACKED(60, simd_unpacklo8,  simd_unpacklo8)     /* PUNPCKLBW */
+SSE_PACKED(61, simd_unpacklo16, simd_unpacklo16)    /* PUNPCKLWD */
+SSE_PACKED(62, simd_unpacklo32, simd_unpacklo32)    /* PUNPCKLDQ */
+SSE_PACKED(63, simd_packss16,   simd_mmx_packss16)  /* PACKSSWB */
+SSE_PACKED(64, simd_cmpgt8,     simd_cmpgt8)        /* PCMPGTB */
+SSE_PACKED(65, simd_cmpgt16,    simd_cmpgt16)       /* PCMPGTW */
+SSE_PACKED(66, simd_cmpgt32,    simd_cmpgt32)       /* PCMPGTD */
+SSE_PACKED(67, simd_packus16,   simd_mmx_packus16)  /* PACKUSWB */
+SSE_PACKED(68, simd_unpackhi8,  simd_mmx_unpackhi8) /* PUNPCKHBW */
+SSE_PACKED(69, simd_unpackhi16, simd_mmx_unpackhi16)/* PUNPCKHWD */
+SSE_PACKED(6a, simd_unpackhi32, simd_mmx_unpackhi32)/* PUNPCKHDQ */
+SSE_PACKED(6b, simd_packss32,   simd_mmx_packss32)  /* PACKSSDW */
+SSE_PACKED_XMM(6c, simd_unpacklo64)                 /* PUNPCKLQDQ */
+SSE_PACKED_XMM(6d, simd_unpackhi64)                 /* PUNPCKHQDQ */
+SSE_PACKED(74, simd_cmpeq8,     simd_cmpeq8)        /* PCMPEQB */
+SSE_PACKED(75, simd_cmpeq16,    simd_cmpeq16)       /* PCMPEQW */
+SSE_PACKED(76, simd_cmpeq32,    simd_cmpeq32)       /* PCMPEQD */
+
+SSE_SHIFT_IMM(71, 2, simd_srl16)                    /* PSRLW */
+SSE_SHIFT_IMM(71, 4, simd_sra16)                    /* PSRAW */
+SSE_SHIFT_IMM(71, 6, simd_sll16)                    /* PSLLW */
+SSE_SHIFT_IMM(72, 2, simd_srl32)                    /* PSRLD */
+SSE_SHIFT_IMM(72, 4, simd_sra32)                    /* PSRAD */
+SSE_SHIFT_IMM(72, 6, simd_sll32)                    /* PSLLD */
+SSE_SHIFT_IMM(73, 2, simd_srl64)                    /* PSRLQ */
+SSE_SHIFT_IMM(73, 3, simd_srldq)                    /* PSRLDQ, xmm only */
+SSE_SHIFT_IMM(73, 6, simd_sll64)                    /* PSLLQ */
+SSE_SHIFT_IMM(73, 7, simd_slldq)                    /* PSLLDQ, xmm only */
+
+SSE_SHIFT(d1, simd_srl16)                           /* PSRLW */
+SSE_SHIFT(d2, simd_srl32)                           /* PSRLD */
+SSE_SHIFT(d3, simd_srl64)                           /* PSRLQ */
+SSE_PACKED(d4, simd_add64,      simd_add64)         /* PADDQ */
+SSE_PACKED(d5, simd_mullo16,    simd_mullo16)       /* PMULLW */
+SSE_PACKED(d8, simd_subus8,     simd_subus8)        /* PSUBUSB */
+SSE_PACKED(d9, simd_subus16,    simd_subus16)       /* PSUBUSW */
+SSE_PACKED(da, simd_minu8,      simd_minu8)         /* PMINUB */
+SSE_PACKED(db, simd_and,        simd_and)           /* PAND */
+SSE_PACKED(dc, simd_addus8,     simd_addus8)        /* PADDUSB */
+SSE_PACKED(dd, simd_addus16,    simd_addus16)       /* PADDUSW */
+SSE_PACKED(de, simd_maxu8,      simd_maxu8)         /* PMAXUB */
+SSE_PACKED(df, simd_andn,       simd_andn)          /* PANDN */
+
+SSE_PACKED(e0, simd_avgu8,      simd_avgu8)         /* PAVGB */
+SSE_SHIFT(e1, simd_sra16)                           /* PSRAW */
+SSE_SHIFT(e2, simd_sra32)                           /* PSRAD */
+SSE_PACKED(e3, simd_avgu16,     simd_avgu16)        /* PAVGW */
+SSE_PACKED(e4, simd_mulhu16,    simd_mulhu16)       /* PMULHUW */
+SSE_PACKED(e5, simd_mulhs16,    simd_mulhs16)       /* PMULHW */
+SSE_PACKED(e8, simd_subs8,      simd_subs8)         /* PSUBSB */
+SSE_PACKED(e9, simd_subs16,     simd_subs16)        /* PSUBSW */
+SSE_PACKED(ea, simd_mins16,     simd_mins16)        /* PMINSW */
+SSE_PACKED(eb, simd_or,         simd_or)            /* POR */
+SSE_PACKED(ec, simd_adds8,      simd_adds8)         /* PADDSB */
+SSE_PACKED(ed, simd_adds16,     simd_adds16)        /* PADDSW */
+SSE_PACKED(ee, simd_maxs16,     simd_maxs16)        /* PMAXSW */
+SSE_PACKED(ef, simd_xor,        simd_xor)           /* PXOR */
+
+SSE_SHIFT(f1, simd_sll16)                           /* PSLLW */
+SSE_SHIFT(f2, simd_sll32)                           /* PSLLD */
+SSE_SHIFT(f3, simd_sll64)                           /* PSLLQ */
+SSE_PACKED(f4, simd_mulu32,     simd_mulu32)        /* PMULUDQ */
+SSE_PACKED(f5, simd_madd16,     simd_madd16)        /* PMADDWD */
+SSE_PACKED(f6, simd_sadu8,      simd_sadu8)         /* PSADBW */
+SSE_PACKED(f8, simd_sub8,       simd_sub8)          /* PSUBB */
+SSE_PACKED(f9, simd_sub16,      simd_sub16)         /* PSUBW */
+SSE_PACKED(fa, simd_sub32,      simd_sub32)         /* PSUBD */
+SSE_PACKED(fb, simd_sub64,      simd_sub64)         /* PSUBQ */
+SSE_PACKED(fc, simd_add8,       simd_add8)          /* PADDB */
+SSE_PACKED(fd, simd_add16,      simd_add16)         /* PADDW */
+SSE_PACKED(fe, simd_add32,      simd_add32)         /* PADDD */
+
+#undef SSE_PACKED
+#undef SSE_PACKED_XMM
+#undef SSE_SHIFT
+#undef SSE_SHIFT_IMM
+
+X64_HANDLER(x64execute_0f_6e) { /* MOVD/MOVQ xmm/mm,r/m32/64 */
+    void *src = x64modrm_get_r_m(emu, ins);
+    simd_t v = { ins->rex.w ? *(uint64_t *)src : *(uint32_t *)src, 0 };
+    if (ins->operand_sz)
+        simd_store(x64modrm_get_xmm(emu, ins), v);
+    else
+        simd_store64(x64modrm_get_mmx(emu, ins), v);
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_6f_xmm) { /* MOVDQA/MOVDQU xmm,xmm/m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), simd_load(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_6f) { /* MOVQ mm,mm/m64 */
+    simd_store64(x64modrm_get_mmx(emu, ins), simd_load64(x64modrm_get_mmx_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_70) { /* PSHUFW mm,mm/m64,imm8 */
+    simd_t v = simd_load64(x64modrm_get_mmx_m(emu, ins));
+    simd_store64(x64modrm_get_mmx(emu, ins), simd_shufflelo16(v, ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f_70) { /* PSHUFD xmm,xmm/m128,imm8 */
+    simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(x64modrm_get_xmm(emu, ins), simd_shuffle32(v, ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_70) { /* PSHUFHW xmm,xmm/m128,imm8 */
+    simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(x64modrm_get_xmm(emu, ins), simd_shufflehi16(v, ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_f2_0f_70) { /* PSHUFLW xmm,xmm/m128,imm8 */
+    simd_t v = simd_load(x64modrm_get_xmm_m(emu, ins));
+    simd_store(x64modrm_get_xmm(emu, ins), simd_shufflelo16(v, ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_77) { /* EMMS */
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_7e) { /* MOVD/MOVQ r/m32/64,xmm/mm */
+    void *dest = x64modrm_get_r_m(emu, ins);
+    uint64_t v = ins->operand_sz ? *(uint64_t *)x64modrm_get_xmm(emu, ins)
+                                 : *(uint64_t *)x64modrm_get_mmx(emu, ins);
+    if (ins->rex.w || ins->amode == X64_AMODE_REG)
+        *(uint64_t *)dest = ins->rex.w ? v : (uint32_t)v;
+    else
+        *(uint32_t *)dest = v;
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_7e) { /* MOVQ xmm,xmm/m64 */
+    simd_store(x64modrm_get_xmm(emu, ins), simd_load64(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_7f_xmm) { /* MOVDQA/MOVDQU xmm/m128,xmm */
+    simd_store(x64modrm_get_xmm_m(emu, ins), simd_load(x64modrm_get_xmm(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_7f) { /* MOVQ mm/m64,mm */
+    simd_store64(x64modrm_get_mmx_m(emu, ins), simd_load64(x64modrm_get_mmx(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_c4) { /* PINSRW xmm/mm,r32/m16,imm8 */
+    uint16_t v = *(uint16_t *)x64modrm_get_r_m(emu, ins);
+    if (ins->operand_sz)
+        ((reg128_t *)x64modrm_get_xmm(emu, ins))->uw[ins->imm.ub[0] & 7] = v;
+    else
+        ((reg64_t *)x64modrm_get_mmx(emu, ins))->uw[ins->imm.ub[0] & 3] = v;
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_c5) { /* PEXTRW r32,xmm/mm,imm8 */
+    uint16_t v = ins->operand_sz ? ((reg128_t *)x64modrm_get_xmm_m(emu, ins))->uw[ins->imm.ub[0] & 7]
+                                 : ((reg64_t *)x64modrm_get_mmx_m(emu, ins))->uw[ins->imm.ub[0] & 3];
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = v;
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_c6) { /* SHUFPS/SHUFPD xmm,xmm/m128,imm8 */
+    void *dest = x64modrm_get_xmm(emu, ins);
+    simd_t a = simd_load(dest);
+    simd_t b = simd_load(x64modrm_get_xmm_m(emu, ins));
+    if (ins->operand_sz)
+        simd_store(dest, simd_shuffle2x64(a, b, ins->imm.ub[0]));
+    else
+        simd_store(dest, simd_shuffle2x32(a, b, ins->imm.ub[0]));
+    return true;
+}
+
+X64_HANDLER(x64execute_66_0f_d6) { /* MOVQ xmm/m64,xmm */
+    simd_t v = simd_load64(x64modrm_get_xmm(emu, ins));
+    if (ins->amode == X64_AMODE_REG)
+        simd_store(x64modrm_get_xmm_m(emu, ins), v);
+    else
+        simd_store64(x64modrm_get_xmm_m(emu, ins), v);
+    return true;
+}
+
+X64_HANDLER(x64execute_f3_0f_d6) { /* MOVQ2DQ xmm,mm */
+    simd_store(x64modrm_get_xmm(emu, ins), simd_load64(x64modrm_get_mmx_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_f2_0f_d6) { /* MOVDQ2Q mm,xmm */
+    simd_store64(x64modrm_get_mmx(emu, ins), simd_load64(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_d7) { /* PMOVMSKB r32,xmm/mm */
+    uint32_t mask = ins->operand_sz ? simd_movmsk8(simd_load(x64modrm_get_xmm_m(emu, ins)))
+                                    : simd_movmsk8(simd_load64(x64modrm_get_mmx_m(emu, ins)));
+    *(uint64_t *)x64modrm_get_reg(emu, ins) = mask;
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_e7) { /* MOVNTQ m64,mm / MOVNTDQ m128,xmm */
+    if (ins->operand_sz)
+        simd_store(x64modrm_get_xmm_m(emu, ins), simd_load(x64modrm_get_xmm(emu, ins)));
+    else
+        simd_store64(x64modrm_get_mmx_m(emu, ins), simd_load64(x64modrm_get_mmx(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_f2_0f_f0) { /* LDDQU xmm,m128 */
+    simd_store(x64modrm_get_xmm(emu, ins), simd_load(x64modrm_get_xmm_m(emu, ins)));
+    return true;
+}
+
+X64_HANDLER(x64execute_0f_f7) { /* MASKMOVQ mm,mm / MASKMOVDQU xmm,xmm */
+    uint8_t *dest = (uint8_t *)(uintptr_t)(ins->address_sz ? (uint64_t)r_edi : r_rdi);
+    reg128_t src, mask;
+    if (ins->operand_sz) {
+        simd_store(&src, simd_load(x64modrm_get_xmm(emu, ins)));
+        simd_store(&mask, simd_load(x64modrm_get_xmm_m(emu, ins)));
+    } else {
+        simd_store(&src, simd_load64(x64modrm_get_mmx(emu, ins)));
+        simd_store(&mask, simd_load64(x64modrm_get_mmx_m(emu, ins)));
+    }
+    /* Bytes outside of the mask are not touched at all. */
+    for (int i = 0; i < (ins->operand_sz ? 16 : 8); i++)
+        if (mask.sb[i] < 0) dest[i] = src.ub[i];
+    return true;
+}
+
+x64handler_t x64execute_resolve_sse(x64instr_t *ins) {
+    uint8_t op = ins->opcode[1];
+    uint8_t reg = ins->modrm.reg;
+
+#define SSE_CASE(code, name) case code: return x64execute_0f_ ## name;
+    switch (op) {
+        SSE_CASE(0x54, 54) SSE_CASE(0x55, 55) SSE_CASE(0x56, 56) SSE_CASE(0x57, 57)
+        SSE_CASE(0x60, 60) SSE_CASE(0x61, 61) SSE_CASE(0x62, 62) SSE_CASE(0x63, 63)
+        SSE_CASE(0x64, 64) SSE_CASE(0x65, 65) SSE_CASE(0x66, 66) SSE_CASE(0x67, 67)
+        SSE_CASE(0x68, 68) SSE_CASE(0x69, 69) SSE_CASE(0x6A, 6a) SSE_CASE(0x6B, 6b)
+        SSE_CASE(0x6C, 6c) SSE_CASE(0x6D, 6d) SSE_CASE(0x6E, 6e)
+        SSE_CASE(0x74, 74) SSE_CASE(0x75, 75) SSE_CASE(0x76, 76) SSE_CASE(0x77, 77)
+        SSE_CASE(0xC4, c4) SSE_CASE(0xC5, c5) SSE_CASE(0xC6, c6)
+        SSE_CASE(0xD1, d1) SSE_CASE(0xD2, d2) SSE_CASE(0xD3, d3) SSE_CASE(0xD4, d4)
+        SSE_CASE(0xD5, d5) SSE_CASE(0xD7, d7)
+        SSE_CASE(0xD8, d8) SSE_CASE(0xD9, d9) SSE_CASE(0xDA, da) SSE_CASE(0xDB, db)
+        SSE_CASE(0xDC, dc) SSE_CASE(0xDD, dd) SSE_CASE(0xDE, de) SSE_CASE(0xDF, df)
+        SSE_CASE(0xE0, e0) SSE_CASE(0xE1, e1) SSE_CASE(0xE2, e2) SSE_CASE(0xE3, e3)
+        SSE_CASE(0xE4, e4) SSE_CASE(0xE5, e5) SSE_CASE(0xE7, e7)
+        SSE_CASE(0xE8, e8) SSE_CASE(0xE9, e9) SSE_CASE(0xEA, ea) SSE_CASE(0xEB, eb)
+        SSE_CASE(0xEC, ec) SSE_CASE(0xED, ed) SSE_CASE(0xEE, ee) SSE_CASE(0xEF, ef)
+        SSE_CASE(0xF1, f1) SSE_CASE(0xF2, f2) SSE_CASE(0xF3, f3) SSE_CASE(0xF4, f4)
+        SSE_CASE(0xF5, f5) SSE_CASE(0xF6, f6) SSE_CASE(0xF7, f7)
+        SSE_CASE(0xF8, f8) SSE_CASE(0xF9, f9) SSE_CASE(0xFA, fa) SSE_CASE(0xFB, fb)
+        SSE_CASE(0xFC, fc) SSE_CASE(0xFD, fd) SSE_CASE(0xFE, fe)
+
+        case 0x71:            /* shift words by imm8 */
+            if (reg == 2) return x64execute_0f_71_2;
+            if (reg == 4) return x64execute_0f_71_4;
+            if (reg == 6) return x64execute_0f_71_6;
+            break;
+        case 0x72:            /* shift dwords by imm8 */
+            if (reg == 2) return x64execute_0f_72_2;
+            if (reg == 4) return x64execute_0f_72_4;
+            if (reg == 6) return x64execute_0f_72_6;
+            break;
+        case 0x73:            /* shift qwords or the whole xmm by imm8 */
+            if (reg == 2) return x64execute_0f_73_2;
+            if (reg == 6) return x64execute_0f_73_6;
+            if (reg == 3 && ins->operand_sz) return x64execute_0f_73_3;
+            if (reg == 7 && ins->operand_sz) return x64execute_0f_73_7;
+            break;
+
+        case 0x6F:
+            return ins->operand_sz || ins->rep == 0xF3 ? x64execute_0f_6f_xmm : x64execute_0f_6f;
+        case 0x7F:
+            return ins->operand_sz || ins->rep == 0xF3 ? x64execute_0f_7f_xmm : x64execute_0f_7f;
+        case 0x7E:
+            return ins->rep == 0xF3 ? x64execute_f3_0f_7e : x64execute_0f_7e;
+        case 0x70:
+            if (ins->rep == 0xF3) return x64execute_f3_0f_70;
+            if (ins->rep == 0xF2) return x64execute_f2_0f_70;
+            return ins->operand_sz ? x64execute_66_0f_70 : x64execute_0f_70;
+        case 0xD6:
+            if (ins->rep == 0xF3) return x64execute_f3_0f_d6;
+            if (ins->rep == 0xF2) return x64execute_f2_0f_d6;
+            if (ins->operand_sz)  return x64execute_66_0f_d6;
+            break;
+        case 0xF0:
+            if (ins->rep == 0xF2) return x64execute_f2_0f_f0;
+            break;
+    }
+
+#undef SSE_CASE
+
+    return NULL;
+}
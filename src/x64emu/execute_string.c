@@ -0,0 +1,377 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "x64instr.h"
+#include "x64emu.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "execute_private.h"
+
+/*
+ * MOVS, CMPS, STOS, LODS and SCAS with or without REP prefixes.
+ * A repeated instruction runs as a whole: copies and fills go to bulk kernels,
+ * compares scan for the element the guest stops at. RCX, RSI, RDI and flags
+ * are then set as if it had gone element by element.
+ * Kernels use host vectors where the order of the elements does not show,
+ * the rest, mostly DF=1, is done element by element.
+ */
+
+/** Bytes host vectors of the kernels have. */
+#define STRING_VEC_SIZE 16
+
+/** Loads of a vector must not cross a boundary of this, the guest may stop before it. */
+#define STRING_PAGE_SIZE 4096
+
+typedef uint8_t  string_vec8_t  __attribute__((vector_size(STRING_VEC_SIZE)));
+typedef uint16_t string_vec16_t __attribute__((vector_size(STRING_VEC_SIZE)));
+typedef uint32_t string_vec32_t __attribute__((vector_size(STRING_VEC_SIZE)));
+typedef uint64_t string_vec64_t __attribute__((vector_size(STRING_VEC_SIZE)));
+
+/** @return Elements to process, RCX or ECX if repeated. */
+static inline uint64_t string_count(x64emu_t *emu, x64instr_t *ins) {
+    if (!ins->rep) return 1;
+    return ins->address_sz ? r_ecx : r_rcx;
+}
+
+/** Set RCX or ECX to the elements left, if repeated. */
+static inline void string_set_count(x64emu_t *emu, x64instr_t *ins, uint64_t left) {
+    if (!ins->rep) return;
+    r_rcx = ins->address_sz ? (uint32_t)left : left;
+}
+
+/** @return Address in RSI/RDI or ESI/EDI. */
+static inline uint64_t string_addr(x64emu_t *emu, x64instr_t *ins, uint8_t reg) {
+    return ins->address_sz ? emu->regs[reg].ud[0] : emu->regs[reg].uq[0];
+}
+
+/** Move RSI/RDI or ESI/EDI past `n` elements of `size` in the direction of DF. */
+static inline void string_advance(x64emu_t *emu, x64instr_t *ins, uint8_t reg, uint64_t n, uint8_t size) {
+    uint64_t delta = n * size;
+    uint64_t addr = emu->regs[reg].uq[0] + (f_DF ? -delta : delta);
+    emu->regs[reg].uq[0] = ins->address_sz ? (uint32_t)addr : addr;
+}
+
+/** @return Lowest address of `n` elements of `size` starting at `addr` in the direction of DF. */
+static inline uint64_t string_low(x64emu_t *emu, uint64_t addr, uint64_t n, uint8_t size) {
+    return f_DF ? addr - (n - 1) * size : addr;
+}
+
+/** @return Element `i` of a string at `addr` in the direction of DF. */
+static inline uint8_t *string_elem(x64emu_t *emu, uint64_t addr, uint64_t i, uint8_t size) {
+    return (uint8_t *)(uintptr_t)(f_DF ? addr - i * size : addr + i * size);
+}
+
+/** @return Whether a vector load at `p` stays in one page. */
+static inline bool string_vec_fits(const uint8_t *p) {
+    return ((uintptr_t)p & (STRING_PAGE_SIZE - 1)) <= STRING_PAGE_SIZE - STRING_VEC_SIZE;
+}
+
+/** @return Value of `size` bytes at `p`. */
+static inline uint64_t string_load(const uint8_t *p, uint8_t size) {
+    switch (size) {
+        case 1:  return *(uint8_t *)p;
+        case 2:  return *(uint16_t *)p;
+        case 4:  return *(uint32_t *)p;
+        default: return *(uint64_t *)p;
+    }
+}
+
+/** @return `value` repeated over 64 bits. */
+static inline uint64_t string_splat(uint64_t value, uint8_t size) {
+    switch (size) {
+        case 1:  return (uint8_t)value * 0x0101010101010101ULL;
+        case 2:  return (uint16_t)value * 0x0001000100010001ULL;
+        case 4:  return (uint32_t)value * 0x0000000100000001ULL;
+        default: return value;
+    }
+}
+
+/** Fill `len` bytes at `dest` with the 64 bit `pattern`, `len` is a multiple of its period. */
+static void string_fill(uint8_t *dest, uint64_t len, uint64_t pattern) {
+    string_vec64_t vec = { pattern, pattern };
+    uint64_t i = 0;
+
+    for (; i + 4 * STRING_VEC_SIZE <= len; i += 4 * STRING_VEC_SIZE) {
+        memcpy(dest + i, &vec, STRING_VEC_SIZE);
+        memcpy(dest + i + STRING_VEC_SIZE, &vec, STRING_VEC_SIZE);
+        memcpy(dest + i + 2 * STRING_VEC_SIZE, &vec, STRING_VEC_SIZE);
+        memcpy(dest + i + 3 * STRING_VEC_SIZE, &vec, STRING_VEC_SIZE);
+    }
+    for (; i + STRING_VEC_SIZE <= len; i += STRING_VEC_SIZE)
+        memcpy(dest + i, &vec, STRING_VEC_SIZE);
+    memcpy(dest + i, &vec, len - i);
+}
+
+/**
+ * Repeat the first `period` bytes at `dest` over `len` bytes, as a forward copy
+ * from `dest` to `dest + period` does, doubling the part copied each time.
+ */
+static void string_replicate(uint8_t *dest, uint64_t len, uint64_t period) {
+    for (uint64_t done = period; done < len; done *= 2)
+        memcpy(dest + done, dest, done < len - done ? done : len - done);
+}
+
+/**
+ * Copy `n` elements of `size` from `src` to `dest` in the direction of DF.
+ * A copy the order of which shows through overlapping buffers goes
+ * element by element, unless the overlap only repeats the source.
+ */
+static void string_copy(x64emu_t *emu, uint64_t dest, uint64_t src, uint64_t n, uint8_t size) {
+    uint64_t len = n * size;
+    uint64_t dest_low = string_low(emu, dest, n, size);
+    uint64_t src_low = string_low(emu, src, n, size);
+    /* Elements overwrite the source of later ones. */
+    bool hazard = f_DF ? dest_low < src_low && dest_low + len > src_low
+                       : dest_low > src_low && dest_low < src_low + len;
+
+    if (!hazard) {
+        memmove((void *)(uintptr_t)dest_low, (void *)(uintptr_t)src_low, len);
+    } else if (!f_DF && dest - src >= size) {
+        /* Bytes from `src` on repeat every `dest - src`. */
+        string_replicate((uint8_t *)(uintptr_t)src, len + (dest - src), dest - src);
+    } else {
+        for (uint64_t i = 0; i < n; i++)
+            memmove(string_elem(emu, dest, i, size), string_elem(emu, src, i, size), size);
+    }
+}
+
+/*
+ * Search kernels, `eq` tells whether the element looked for is equal or not.
+ * @return Index of the first of `n` elements that is, `n` if there is none.
+ */
+
+#define STRING_SCAN(w) \
+    /* Elements at `a` against those at `b`. */ \
+    static uint64_t string_cmp ## w(const uint8_t *a, const uint8_t *b, uint64_t n, bool eq) { \
+        const uint64_t lanes = STRING_VEC_SIZE / sizeof(uint ## w ## _t); \
+        uint64_t i = 0; \
+        while (i + lanes <= n) { \
+            const uint8_t *pa = a + i * sizeof(uint ## w ## _t); \
+            const uint8_t *pb = b + i * sizeof(uint ## w ## _t); \
+            if (string_vec_fits(pa) && string_vec_fits(pb)) { \
+                string_vec ## w ## _t va, vb; \
+                memcpy(&va, pa, STRING_VEC_SIZE); \
+                memcpy(&vb, pb, STRING_VEC_SIZE); \
+                STRING_SCAN_MATCH(w, va == vb) \
+            } else { \
+                for (uint64_t end = i + lanes; i < end; i++) \
+                    if ((((uint ## w ## _t *)a)[i] == ((uint ## w ## _t *)b)[i]) == eq) return i; \
+            } \
+        } \
+        for (; i < n; i++) \
+            if ((((uint ## w ## _t *)a)[i] == ((uint ## w ## _t *)b)[i]) == eq) return i; \
+        return n; \
+    } \
+    /* Elements at `a` against `value`. */ \
+    static uint64_t string_scan ## w(const uint8_t *a, uint ## w ## _t value, uint64_t n, bool eq) { \
+        const uint64_t lanes = STRING_VEC_SIZE / sizeof(uint ## w ## _t); \
+        string_vec ## w ## _t vb = (string_vec ## w ## _t){ 0 } + value; \
+        uint64_t i = 0; \
+        while (i + lanes <= n) { \
+            const uint8_t *pa = a + i * sizeof(uint ## w ## _t); \
+            if (string_vec_fits(pa)) { \
+                string_vec ## w ## _t va; \
+                memcpy(&va, pa, STRING_VEC_SIZE); \
+                STRING_SCAN_MATCH(w, va == vb) \
+            } else { \
+                for (uint64_t end = i + lanes; i < end; i++) \
+                    if ((((uint ## w ## _t *)a)[i] == value) == eq) return i; \
+            } \
+        } \
+        for (; i < n; i++) \
+            if ((((uint ## w ## _t *)a)[i] == value) == eq) return i; \
+        return n; \
+    }
+
+/* Lanes of the comparison are all ones where equal, return the first one looked for. */
+#define STRING_SCAN_MATCH(w, cmp) { \
+        __typeof__(cmp) mask = (cmp); \
+        if (!eq) mask = ~mask; \
+        uint64_t lo, hi; \
+        memcpy(&lo, &mask, 8); \
+        memcpy(&hi, (uint8_t *)&mask + 8, 8); \
+        if (lo) return i + __builtin_ctzll(lo) / w; \
+        if (hi) return i + (64 + __builtin_ctzll(hi)) / w; \
+        i += lanes; \
+    }
+
+STRING_SCAN(8)
+STRING_SCAN(16)
+STRING_SCAN(32)
+STRING_SCAN(64)
+
+#undef STRING_SCAN
+#undef STRING_SCAN_MATCH
+
+/**
+ * Compare elements at `a` with those at `b` (CMPS) or with `value` (SCAS)
+ * while they are equal (REPE) or not (REPNE), up to `n` of them.
+ * @return Elements compared, the last one decides.
+ */
+static uint64_t string_compare(x64emu_t *emu, x64instr_t *ins, uint64_t a, uint64_t b,
+                               uint64_t value, uint64_t n, uint8_t size) {
+    bool cmps = ins->opcode[0] <= 0xA7;
+    bool eq = ins->rep == 0xF2;     /* REPNE stops at an equal element. */
+    uint64_t i;
+
+    if (!ins->rep || n == 1)
+        return n;
+
+    if (f_DF) {
+        for (i = 0; i < n - 1; i++) {
+            uint64_t x = string_load(string_elem(emu, a, i, size), size);
+            uint64_t y = cmps ? string_load(string_elem(emu, b, i, size), size) : value;
+            if ((x == y) == eq) break;
+        }
+        return i + 1;
+    }
+
+    const uint8_t *pa = (const uint8_t *)(uintptr_t)a;
+    const uint8_t *pb = (const uint8_t *)(uintptr_t)b;
+    switch (size) {
+        case 1:
+            if (!cmps && eq) {
+                const uint8_t *found = memchr(pa, (uint8_t)value, n);
+                i = found ? (uint64_t)(found - pa) : n;
+            } else {
+                i = cmps ? string_cmp8(pa, pb, n, eq) : string_scan8(pa, value, n, eq);
+            }
+            break;
+        case 2:  i = cmps ? string_cmp16(pa, pb, n, eq) : string_scan16(pa, value, n, eq); break;
+        case 4:  i = cmps ? string_cmp32(pa, pb, n, eq) : string_scan32(pa, value, n, eq); break;
+        default: i = cmps ? string_cmp64(pa, pb, n, eq) : string_scan64(pa, value, n, eq); break;
+    }
+    return i < n ? i + 1 : n;
+}
+
+/** MOVS m,m */
+static inline bool string_movs(x64emu_t *emu, x64instr_t *ins, uint8_t size) {
+    uint64_t n = string_count(emu, ins);
+    if (!n) return true;
+
+    string_copy(emu, string_addr(emu, ins, _rdi), string_addr(emu, ins, _rsi), n, size);
+    string_advance(emu, ins, _rsi, n, size);
+    string_advance(emu, ins, _rdi, n, size);
+    string_set_count(emu, ins, 0);
+    return true;
+}
+
+/** STOS m,rAX */
+static inline bool string_stos(x64emu_t *emu, x64instr_t *ins, uint8_t size) {
+    uint64_t n = string_count(emu, ins);
+    if (!n) return true;
+
+    /* The same value goes everywhere, the direction does not show. */
+    uint8_t *dest = (uint8_t *)(uintptr_t)string_low(emu, string_addr(emu, ins, _rdi), n, size);
+    if (size == 1)
+        memset(dest, r_al, n);
+    else
+        string_fill(dest, n * size, string_splat(r_rax, size));
+    string_advance(emu, ins, _rdi, n, size);
+    string_set_count(emu, ins, 0);
+    return true;
+}
+
+/** LODS rAX,m */
+static inline bool string_lods(x64emu_t *emu, x64instr_t *ins, uint8_t size) {
+    uint64_t n = string_count(emu, ins);
+    if (!n) return true;
+
+    /* Only the last element stays. */
+    uint64_t value = string_load(string_elem(emu, string_addr(emu, ins, _rsi), n - 1, size), size);
+    switch (size) {
+        case 1:  r_al = value;  break;
+        case 2:  r_ax = value;  break;
+        default: r_rax = value; break;  /* 32 bit zero-extended. */
+    }
+    string_advance(emu, ins, _rsi, n, size);
+    string_set_count(emu, ins, 0);
+    return true;
+}
+
+/** Flags of CMP between the last elements compared. */
+#define STRING_FLAGS(u_type, a, b) \
+    SET_LAZY_FLAGS(X64_LAZY_SUB, u_type, a, b, (u_type)((a) - (b)))
+
+/** CMPS m,m */
+#define STRING_CMPS(u_type, size) { \
+    uint64_t n = string_count(emu, ins); \
+    if (!n) return true; \
+    uint64_t src = string_addr(emu, ins, _rsi); \
+    uint64_t dest = string_addr(emu, ins, _rdi); \
+    uint64_t k = string_compare(emu, ins, src, dest, 0, n, size); \
+    u_type a = *(u_type *)string_elem(emu, src, k - 1, size); \
+    u_type b = *(u_type *)string_elem(emu, dest, k - 1, size); \
+    STRING_FLAGS(u_type, a, b) \
+    string_advance(emu, ins, _rsi, k, size); \
+    string_advance(emu, ins, _rdi, k, size); \
+    string_set_count(emu, ins, n - k); \
+    return true; \
+}
+
+/** SCAS rAX,m */
+#define STRING_SCAS(u_type, size) { \
+    uint64_t n = string_count(emu, ins); \
+    if (!n) return true; \
+    uint64_t dest = string_addr(emu, ins, _rdi); \
+    u_type a = r_rax; \
+    uint64_t k = string_compare(emu, ins, dest, 0, a, n, size); \
+    u_type b = *(u_type *)string_elem(emu, dest, k - 1, size); \
+    STRING_FLAGS(u_type, a, b) \
+    string_advance(emu, ins, _rdi, k, size); \
+    string_set_count(emu, ins, n - k); \
+    return true; \
+}
+
+#define STRING_HANDLERS(w) \
+    X64_HANDLER(x64execute_movs ## w) { return string_movs(emu, ins, w / 8); } \
+    X64_HANDLER(x64execute_stos ## w) { return string_stos(emu, ins, w / 8); } \
+    X64_HANDLER(x64execute_lods ## w) { return string_lods(emu, ins, w / 8); } \
+    X64_HANDLER(x64execute_cmps ## w) STRING_CMPS(uint ## w ## _t, w / 8) \
+    X64_HANDLER(x64execute_scas ## w) STRING_SCAS(uint ## w ## _t, w / 8)
+
+STRING_HANDLERS(8)
+STRING_HANDLERS(16)
+STRING_HANDLERS(32)
+STRING_HANDLERS(64)
+
+#undef STRING_HANDLERS
+#undef STRING_CMPS
+#undef STRING_SCAS
+#undef STRING_FLAGS
+
+/* Tables `x64execute_<name>` indexed with width. */
+#define STRING_TABLE(name) \
+    static const x64handler_t x64execute_ ## name[4] = { \
+        x64execute_ ## name ## 8,  x64execute_ ## name ## 16, \
+        x64execute_ ## name ## 32, x64execute_ ## name ## 64, \
+    };
+
+STRING_TABLE(movs)
+STRING_TABLE(cmps)
+STRING_TABLE(stos)
+STRING_TABLE(lods)
+STRING_TABLE(scas)
+
+#undef STRING_TABLE
+
+x64handler_t x64execute_resolve_string(x64instr_t *ins) {
+    uint8_t op = ins->opcode[0];
+    uint8_t w;
+
+    if (!(op & 1))            w = 0;
+    else if (ins->rex.w)      w = 3;
+    else if (ins->operand_sz) w = 1;
+    else                      w = 2;
+
+    switch (op) {
+        case 0xA4 ... 0xA5: return x64execute_movs[w];
+        case 0xA6 ... 0xA7: return x64execute_cmps[w];
+        case 0xAA ... 0xAB: return x64execute_stos[w];
+        case 0xAC ... 0xAD: return x64execute_lods[w];
+        case 0xAE ... 0xAF: return x64execute_scas[w];
+    }
+    return NULL;
+}
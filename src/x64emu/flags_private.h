@@ -1,6 +1,12 @@
 #ifndef __X64FLAGS_PRIVATE_H_
 #define __X64FLAGS_PRIVATE_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "x64emu.h"
+#include "x64flags.h"
+
 #define f_CF   emu->flags.CF    /*     0  Carry Flag */
 #define f_PF   emu->flags.PF    /*     2  Parity Flag */
 #define f_AF   emu->flags.AF    /*     4  Auxiliary Carry Flag */
@@ -19,4 +25,102 @@
 #define f_VIP  emu->flags.VIP   /*    20  Virtual Interrupt Pending */
 #define f_ID   emu->flags.ID    /*    21  ID Flag */
 
+
+/* Arithmetic flags, computed from the pending operation if there is one. */
+
+static inline uint8_t get_byte_parity(uint8_t x) {
+    x ^= x >> 4;
+    x ^= x >> 2;
+    x ^= x >> 1;
+    return (~x) & 1;
+}
+
+#define LAZY_MSB(x) (((x) >> (emu->lazy.width - 1)) & 1)
+
+static inline bool x64flags_get_CF(x64emu_t *emu) {
+    x64lazyflags_t *l = &emu->lazy;
+    switch (l->kind) {
+        case X64_LAZY_ADD:   return l->res < l->op1;
+        case X64_LAZY_ADC:   return l->res <= l->op1;
+        case X64_LAZY_SUB:   return l->op1 < l->op2;
+        case X64_LAZY_SBB:   return l->op1 <= l->op2;
+        case X64_LAZY_LOGIC: return false;
+        case X64_LAZY_SHL:   /* Counts past the width shifted all bits out, C leaves that undefined. */
+                             return l->op2 <= l->width && ((l->op1 >> (l->width - l->op2)) & 1);
+        case X64_LAZY_SHR:
+        case X64_LAZY_SAR:   return (l->op1 >> (l->op2 - 1)) & 1;
+    }
+    return f_CF; /* NONE, INC, DEC */
+}
+
+static inline bool x64flags_get_PF(x64emu_t *emu) {
+    return emu->lazy.kind == X64_LAZY_NONE ? f_PF : get_byte_parity(emu->lazy.res);
+}
+
+static inline bool x64flags_get_AF(x64emu_t *emu) {
+    x64lazyflags_t *l = &emu->lazy;
+    switch (l->kind) {
+        case X64_LAZY_NONE:  return f_AF;
+        case X64_LAZY_ADD:
+        case X64_LAZY_ADC:
+        case X64_LAZY_SUB:
+        case X64_LAZY_SBB:
+        case X64_LAZY_INC:
+        case X64_LAZY_DEC:   return ((l->op1 ^ l->op2 ^ l->res) >> 4) & 1;
+    }
+    return false; /* undefined */
+}
+
+static inline bool x64flags_get_ZF(x64emu_t *emu) {
+    return emu->lazy.kind == X64_LAZY_NONE ? f_ZF : emu->lazy.res == 0;
+}
+
+static inline bool x64flags_get_SF(x64emu_t *emu) {
+    return emu->lazy.kind == X64_LAZY_NONE ? f_SF : LAZY_MSB(emu->lazy.res);
+}
+
+static inline bool x64flags_get_OF(x64emu_t *emu) {
+    x64lazyflags_t *l = &emu->lazy;
+    switch (l->kind) {
+        case X64_LAZY_NONE:  return f_OF;
+        case X64_LAZY_ADD:
+        case X64_LAZY_ADC:
+        case X64_LAZY_INC:   return LAZY_MSB((l->op1 ^ l->res) & (l->op2 ^ l->res));
+        case X64_LAZY_SUB:
+        case X64_LAZY_SBB:
+        case X64_LAZY_DEC:   return LAZY_MSB((l->op1 ^ l->op2) & (l->op1 ^ l->res));
+        case X64_LAZY_SHL:   return x64flags_get_CF(emu) ^ LAZY_MSB(l->res);
+        case X64_LAZY_SHR:   return LAZY_MSB(l->op1);
+    }
+    return false; /* LOGIC, SAR */
+}
+
+#undef LAZY_MSB
+
+/** Compute pending arithmetic flags into RFLAGS before it is accessed directly. */
+static inline void x64flags_materialize(x64emu_t *emu) {
+    if (emu->lazy.kind == X64_LAZY_NONE) return;
+    f_CF = x64flags_get_CF(emu);
+    f_PF = x64flags_get_PF(emu);
+    f_AF = x64flags_get_AF(emu);
+    f_ZF = x64flags_get_ZF(emu);
+    f_SF = x64flags_get_SF(emu);
+    f_OF = x64flags_get_OF(emu);
+    emu->lazy.kind = X64_LAZY_NONE;
+}
+
+/* Whether flags written by the handler are read by anything,
+   handlers specialized for dead flags redefine it to false. */
+#define FLAGS_LIVE true
+
+/** Record the operation instead of computing flags, values are truncated to `u_type`. */
+#define SET_LAZY_FLAGS(lazy_kind, u_type, a, b, r) \
+    if (FLAGS_LIVE) { \
+        emu->lazy.kind = (lazy_kind); \
+        emu->lazy.width = sizeof(u_type) * 8; \
+        emu->lazy.op1 = (u_type)(a); \
+        emu->lazy.op2 = (u_type)(b); \
+        emu->lazy.res = (u_type)(r); \
+    }
+
 #endif /* __X64FLAGS_PRIVATE_H_ */
\ No newline at end of file
@@ -0,0 +1,612 @@
+#ifndef __X64FP_PRIVATE_H_
+#define __X64FP_PRIVATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fenv.h>
+
+#include "x64mxcsr.h"
+
+#include "simd_private.h"
+
+/*
+ * Kernels of SSE/SSE2 floating point instructions on host floating point.
+ * The host already rounds, flushes denormals and raises exception flags
+ * as the guest MXCSR says, see x64mxcsr.h. What it does not do the x86 way
+ * is fixed up after the host operation: which NaN comes out, the operand
+ * order of MIN/MAX and conversions of out of range values to integers.
+ *
+ * Where C has no operator of the exact semantics (square root through libm,
+ * MIN/MAX under DAZ, compares raising DE, conversions in the current rounding
+ * mode) x86-64 hosts run the instruction itself through GCC builtins.
+ *
+ * Packed kernels take and return `simd_t` like those of simd_private.h,
+ * scalar ones work on the low lane as `float` or `double`.
+ */
+
+typedef float  simd_f32_t __attribute__((vector_size(16)));
+typedef double simd_f64_t __attribute__((vector_size(16)));
+
+#define FP_F32_QUIET       0x00400000u
+#define FP_F64_QUIET       0x0008000000000000ull
+#define FP_F32_INDEFINITE  0xFFC00000u              /* default QNaN */
+#define FP_F64_INDEFINITE  0xFFF8000000000000ull
+
+static inline uint32_t fp_bits32(float f)     { uint32_t x; memcpy(&x, &f, 4); return x; }
+static inline uint64_t fp_bits64(double d)    { uint64_t x; memcpy(&x, &d, 8); return x; }
+static inline float    fp_float32(uint32_t x) { float f;    memcpy(&f, &x, 4); return f; }
+static inline double   fp_float64(uint64_t x) { double d;   memcpy(&d, &x, 8); return d; }
+
+/** Raise MXCSR exception `flags` (IE or PE) of a kernel without host operation. */
+static inline void fp_raise(uint32_t flags) {
+#if defined(__x86_64__)
+    /* Guest flags live in the host MXCSR, glibc raises PE in the x87 status word. */
+    __builtin_ia32_ldmxcsr(__builtin_ia32_stmxcsr() | flags);
+#else
+    feraiseexcept((flags & X64_MXCSR_IE ? FE_INVALID : 0) | (flags & X64_MXCSR_PE ? FE_INEXACT : 0));
+#endif
+}
+
+/*
+ * Tested on the bits, comparing would raise IE for signaling NaNs
+ * and DE for denormals, where the guest instruction raises none.
+ */
+static inline bool fp_isnan32(float f)  { return (fp_bits32(f) & 0x7FFFFFFFu) > 0x7F800000u; }
+static inline bool fp_isnan64(double d) { return (fp_bits64(d) & ~(1ull << 63)) > 0x7FF0000000000000ull; }
+
+/**
+ * NaN x86 returns for an operation on `a` and `b` that gave one: the first
+ * NaN operand quieted, or the default NaN when the operation made it up.
+ * Hosts are free to return either NaN operand, or the default one.
+ */
+static inline float fp_nan32(float a, float b) {
+    if (fp_isnan32(a)) return fp_float32(fp_bits32(a) | FP_F32_QUIET);
+    if (fp_isnan32(b)) return fp_float32(fp_bits32(b) | FP_F32_QUIET);
+    return fp_float32(FP_F32_INDEFINITE);
+}
+
+static inline double fp_nan64(double a, double b) {
+    if (fp_isnan64(a)) return fp_float64(fp_bits64(a) | FP_F64_QUIET);
+    if (fp_isnan64(b)) return fp_float64(fp_bits64(b) | FP_F64_QUIET);
+    return fp_float64(FP_F64_INDEFINITE);
+}
+
+/** `r` with its NaN lanes replaced as `fp_nan32` of the lanes of `a` and `b`. */
+static inline simd_t fp_fixnan32(simd_f32_t r, simd_f32_t a, simd_f32_t b) {
+    simd_t m = (simd_t)(((simd_u32_t)r & 0x7FFFFFFFu) > 0x7F800000u);
+    if (m[0] | m[1]) {
+        for (int i = 0; i < 4; i++)
+            if (fp_isnan32(r[i])) r[i] = fp_nan32(a[i], b[i]);
+    }
+    return (simd_t)r;
+}
+
+static inline simd_t fp_fixnan64(simd_f64_t r, simd_f64_t a, simd_f64_t b) {
+    simd_t m = (simd_t)(((simd_u64_t)r & ~(1ull << 63)) > 0x7FF0000000000000ull);
+    if (m[0] | m[1]) {
+        for (int i = 0; i < 2; i++)
+            if (fp_isnan64(r[i])) r[i] = fp_nan64(a[i], b[i]);
+    }
+    return (simd_t)r;
+}
+
+/* Arithmetic, `a` is the destination operand, unary ones take `b`. */
+
+#define FP_ARITH(name, op) \
+    static inline float fp_ ## name ## ss(float a, float b) { \
+        float r = a op b; \
+        return fp_isnan32(r) ? fp_nan32(a, b) : r; \
+    } \
+    static inline double fp_ ## name ## sd(double a, double b) { \
+        double r = a op b; \
+        return fp_isnan64(r) ? fp_nan64(a, b) : r; \
+    } \
+    static inline simd_t fp_ ## name ## ps(simd_t a, simd_t b) { \
+        return fp_fixnan32((simd_f32_t)a op (simd_f32_t)b, (simd_f32_t)a, (simd_f32_t)b); \
+    } \
+    static inline simd_t fp_ ## name ## pd(simd_t a, simd_t b) { \
+        return fp_fixnan64((simd_f64_t)a op (simd_f64_t)b, (simd_f64_t)a, (simd_f64_t)b); \
+    }
+
+FP_ARITH(add, +)
+FP_ARITH(sub, -)
+FP_ARITH(mul, *)
+FP_ARITH(div, /)
+#undef FP_ARITH
+
+#if defined(__SSE2__)
+
+static inline simd_t fp_sqrtps(simd_t a, simd_t b) { (void)a; return (simd_t)__builtin_ia32_sqrtps((simd_f32_t)b); }
+static inline simd_t fp_sqrtpd(simd_t a, simd_t b) { (void)a; return (simd_t)__builtin_ia32_sqrtpd((simd_f64_t)b); }
+
+#else
+
+static inline simd_t fp_sqrtps(simd_t a, simd_t b) {
+    simd_f32_t v = (simd_f32_t)b;
+    (void)a;
+    for (int i = 0; i < 4; i++)
+        v[i] = sqrtf(v[i]);
+    return fp_fixnan32(v, (simd_f32_t)b, (simd_f32_t)b);
+}
+
+static inline simd_t fp_sqrtpd(simd_t a, simd_t b) {
+    simd_f64_t v = (simd_f64_t)b;
+    (void)a;
+    for (int i = 0; i < 2; i++)
+        v[i] = sqrt(v[i]);
+    return fp_fixnan64(v, (simd_f64_t)b, (simd_f64_t)b);
+}
+
+#endif
+
+/*
+ * RCP and RSQRT are approximations whose exact bits are up to the cpu.
+ * x86 hosts run the instruction itself, others compute the exact value,
+ * which is well within the 1.5 * 2^-12 relative error x86 allows.
+ */
+
+static inline simd_t fp_rcpps(simd_t a, simd_t b) {
+    (void)a;
+#if defined(__SSE2__)
+    return (simd_t)__builtin_ia32_rcpps((simd_f32_t)b);
+#else
+    return (simd_t)(1.0f / (simd_f32_t)b);
+#endif
+}
+
+static inline simd_t fp_rsqrtps(simd_t a, simd_t b) {
+    (void)a;
+#if defined(__SSE2__)
+    return (simd_t)__builtin_ia32_rsqrtps((simd_f32_t)b);
+#else
+    simd_f32_t v = (simd_f32_t)b;
+    for (int i = 0; i < 4; i++)
+        v[i] = 1.0f / sqrtf(v[i]);
+    return (simd_t)v;
+#endif
+}
+
+/*
+ * MIN and MAX return the second operand when the operands are unordered
+ * or both zeros of any sign, which is exactly what the C conditional does.
+ * Only the instruction returns the operand flushed by DAZ though.
+ */
+
+#if defined(__SSE2__)
+static inline simd_t fp_minps(simd_t a, simd_t b) { return (simd_t)__builtin_ia32_minps((simd_f32_t)a, (simd_f32_t)b); }
+static inline simd_t fp_minpd(simd_t a, simd_t b) { return (simd_t)__builtin_ia32_minpd((simd_f64_t)a, (simd_f64_t)b); }
+static inline simd_t fp_maxps(simd_t a, simd_t b) { return (simd_t)__builtin_ia32_maxps((simd_f32_t)a, (simd_f32_t)b); }
+static inline simd_t fp_maxpd(simd_t a, simd_t b) { return (simd_t)__builtin_ia32_maxpd((simd_f64_t)a, (simd_f64_t)b); }
+#else
+static inline simd_t fp_minps(simd_t a, simd_t b) { return SIMD_SELECT((simd_f32_t)a < (simd_f32_t)b, a, b); }
+static inline simd_t fp_minpd(simd_t a, simd_t b) { return SIMD_SELECT((simd_f64_t)a < (simd_f64_t)b, a, b); }
+static inline simd_t fp_maxps(simd_t a, simd_t b) { return SIMD_SELECT((simd_f32_t)a > (simd_f32_t)b, a, b); }
+static inline simd_t fp_maxpd(simd_t a, simd_t b) { return SIMD_SELECT((simd_f64_t)a > (simd_f64_t)b, a, b); }
+#endif
+
+/*
+ * CMPPS/CMPPD predicates 0..7: EQ, LT, LE, UNORD, NEQ, NLT, NLE, ORD.
+ * `pred` is a constant in every caller, the switch folds away. The C
+ * operators signal the same way, `<` and `<=` raise IE on any NaN,
+ * the others only on signaling ones, but not DE the same way.
+ */
+
+#if defined(__SSE2__)
+#define FP_CMP(x, y, pred, m, sfx) \
+    switch (pred) { \
+        case 0:  m = __builtin_ia32_cmpeq ## sfx(x, y); break; \
+        case 1:  m = __builtin_ia32_cmplt ## sfx(x, y); break; \
+        case 2:  m = __builtin_ia32_cmple ## sfx(x, y); break; \
+        case 3:  m = __builtin_ia32_cmpunord ## sfx(x, y); break; \
+        case 4:  m = __builtin_ia32_cmpneq ## sfx(x, y); break; \
+        case 5:  m = __builtin_ia32_cmpnlt ## sfx(x, y); break; \
+        case 6:  m = __builtin_ia32_cmpnle ## sfx(x, y); break; \
+        default: m = __builtin_ia32_cmpord ## sfx(x, y); break; \
+    }
+#else
+#define FP_CMP(x, y, pred, m, sfx) \
+    switch (pred) { \
+        case 0:  m = (__typeof__(m))((x) == (y)); break; \
+        case 1:  m = (__typeof__(m))((x) < (y)); break; \
+        case 2:  m = (__typeof__(m))((x) <= (y)); break; \
+        case 3:  m = (__typeof__(m))(((x) != (x)) | ((y) != (y))); break; \
+        case 4:  m = (__typeof__(m))((x) != (y)); break; \
+        case 5:  m = (__typeof__(m))~((x) < (y)); break; \
+        case 6:  m = (__typeof__(m))~((x) <= (y)); break; \
+        default: m = (__typeof__(m))(((x) == (x)) & ((y) == (y))); break; \
+    }
+#endif
+
+static inline simd_t fp_cmpps(simd_t a, simd_t b, uint8_t pred) {
+    simd_f32_t m;
+    FP_CMP((simd_f32_t)a, (simd_f32_t)b, pred, m, ps)
+    return (simd_t)m;
+}
+
+static inline simd_t fp_cmppd(simd_t a, simd_t b, uint8_t pred) {
+    simd_f64_t m;
+    FP_CMP((simd_f64_t)a, (simd_f64_t)b, pred, m, pd)
+    return (simd_t)m;
+}
+#undef FP_CMP
+
+/*
+ * Scalar forms run the packed kernel on the low lanes, the other lanes
+ * hold zeros, which raise nothing.
+ */
+
+#define FP_SCALAR(name) \
+    static inline float fp_ ## name ## ss(float a, float b) { \
+        return ((simd_f32_t)fp_ ## name ## ps((simd_t)(simd_f32_t){ a }, (simd_t)(simd_f32_t){ b }))[0]; \
+    } \
+    static inline double fp_ ## name ## sd(double a, double b) { \
+        return ((simd_f64_t)fp_ ## name ## pd((simd_t)(simd_f64_t){ a }, (simd_t)(simd_f64_t){ b }))[0]; \
+    }
+
+FP_SCALAR(sqrt)
+FP_SCALAR(min)
+FP_SCALAR(max)
+#undef FP_SCALAR
+
+static inline float fp_rcpss(float a, float b) {
+    return ((simd_f32_t)fp_rcpps((simd_t)(simd_f32_t){ a }, (simd_t)(simd_f32_t){ b }))[0];
+}
+
+static inline float fp_rsqrtss(float a, float b) {
+    return ((simd_f32_t)fp_rsqrtps((simd_t)(simd_f32_t){ a }, (simd_t)(simd_f32_t){ b }))[0];
+}
+
+static inline bool fp_cmpss(float a, float b, uint8_t pred) {
+    return ((simd_s32_t)fp_cmpps((simd_t)(simd_f32_t){ a }, (simd_t)(simd_f32_t){ b }, pred))[0];
+}
+
+static inline bool fp_cmpsd(double a, double b, uint8_t pred) {
+    return ((simd_s64_t)fp_cmppd((simd_t)(simd_f64_t){ a }, (simd_t)(simd_f64_t){ b }, pred))[0];
+}
+
+/*
+ * Conversions to integers round as MXCSR says, or truncate with `trunc`.
+ * Values out of range and NaNs give the integer indefinite and raise IE.
+ */
+
+#if defined(__SSE2__)
+
+static inline int32_t fp_cvtss2si(float v, bool trunc) {
+    simd_f32_t x = { v };
+    return trunc ? __builtin_ia32_cvttss2si(x) : __builtin_ia32_cvtss2si(x);
+}
+
+static inline int64_t fp_cvtss2si64(float v, bool trunc) {
+    simd_f32_t x = { v };
+    return trunc ? __builtin_ia32_cvttss2si64(x) : __builtin_ia32_cvtss2si64(x);
+}
+
+static inline int32_t fp_cvtsd2si(double v, bool trunc) {
+    simd_f64_t x = { v };
+    return trunc ? __builtin_ia32_cvttsd2si(x) : __builtin_ia32_cvtsd2si(x);
+}
+
+static inline int64_t fp_cvtsd2si64(double v, bool trunc) {
+    simd_f64_t x = { v };
+    return trunc ? __builtin_ia32_cvttsd2si64(x) : __builtin_ia32_cvtsd2si64(x);
+}
+
+static inline simd_t fp_cvtps2dq(simd_t a, bool trunc) {
+    return (simd_t)(trunc ? __builtin_ia32_cvttps2dq((simd_f32_t)a) : __builtin_ia32_cvtps2dq((simd_f32_t)a));
+}
+
+/** The high half is cleared. */
+static inline simd_t fp_cvtpd2dq(simd_t a, bool trunc) {
+    return (simd_t)(trunc ? __builtin_ia32_cvttpd2dq((simd_f64_t)a) : __builtin_ia32_cvtpd2dq((simd_f64_t)a));
+}
+
+#else
+
+/* `v` is already rounded to an integer or gets truncated by the cast. */
+
+static inline int32_t fp_int32(double v) {
+    if (v > -2147483649.0 && v < 2147483648.0)
+        return (int32_t)v;
+    feraiseexcept(FE_INVALID);
+    return INT32_MIN;
+}
+
+static inline int64_t fp_int64(double v) {
+    if (v >= -9223372036854775808.0 && v < 9223372036854775808.0)
+        return (int64_t)v;
+    feraiseexcept(FE_INVALID);
+    return INT64_MIN;
+}
+
+static inline int32_t fp_cvtss2si(float v, bool trunc)    { return fp_int32(trunc ? v : rintf(v)); }
+static inline int64_t fp_cvtss2si64(float v, bool trunc)  { return fp_int64(trunc ? v : rintf(v)); }
+static inline int32_t fp_cvtsd2si(double v, bool trunc)   { return fp_int32(trunc ? v : rint(v)); }
+static inline int64_t fp_cvtsd2si64(double v, bool trunc) { return fp_int64(trunc ? v : rint(v)); }
+
+static inline simd_t fp_cvtps2dq(simd_t a, bool trunc) {
+    simd_f32_t v = (simd_f32_t)a;
+    simd_s32_t r;
+    for (int i = 0; i < 4; i++)
+        r[i] = fp_cvtss2si(v[i], trunc);
+    return (simd_t)r;
+}
+
+/** The high half is cleared. */
+static inline simd_t fp_cvtpd2dq(simd_t a, bool trunc) {
+    simd_f64_t v = (simd_f64_t)a;
+    simd_s32_t r = { 0 };
+    for (int i = 0; i < 2; i++)
+        r[i] = fp_cvtsd2si(v[i], trunc);
+    return (simd_t)r;
+}
+
+#endif
+
+static inline simd_t fp_cvtdq2ps(simd_t a) {
+    return (simd_t)__builtin_convertvector((simd_s32_t)a, simd_f32_t);
+}
+
+static inline simd_t fp_cvtdq2pd(simd_t a) {
+    simd_s32_t v = (simd_s32_t)a;
+    return (simd_t)(simd_f64_t){ v[0], v[1] };
+}
+
+static inline simd_t fp_cvtps2pd(simd_t a) {
+    simd_f32_t v = (simd_f32_t)a;
+    return (simd_t)(simd_f64_t){ v[0], v[1] };
+}
+
+static inline simd_t fp_cvtpd2ps(simd_t a) {
+    simd_f64_t v = (simd_f64_t)a;
+    return (simd_t)(simd_f32_t){ v[0], v[1], 0, 0 };
+}
+
+/** @return MOVMSKPS mask. */
+static inline uint32_t fp_movmskps(simd_t a) {
+    simd_s32_t v = (simd_s32_t)a;
+    return (uint32_t)(v[0] < 0) | (uint32_t)(v[1] < 0) << 1 | (uint32_t)(v[2] < 0) << 2 | (uint32_t)(v[3] < 0) << 3;
+}
+
+/** @return MOVMSKPD mask. */
+static inline uint32_t fp_movmskpd(simd_t a) {
+    return (uint32_t)(a[0] >> 63) | (uint32_t)(a[1] >> 63) << 1;
+}
+
+/*
+ * VCMPPS/PD/SS/SD predicates 8..31 of AVX, on top of those of CMPPS/PD.
+ * Predicates 8..15 are the complements, swaps or constants of 0..7,
+ * 16..31 are 0..15 with quiet compares made signaling and the other way
+ * round, which is what the operand fix-ups of the quiet ones are for:
+ * NaN lanes are cleared before the signaling compare and the ORD/UNORD
+ * compares put them back in, raising IE only for signaling NaNs.
+ * `pred` is a constant in every caller.
+ */
+
+/** `m`, whose computation is kept for the exceptions it raises. */
+static inline simd_t fp_keep(simd_t m) {
+    __asm__ volatile("" : "+m"(m));
+    return m;
+}
+
+#define FP_VCMP(name, cmp) \
+    static inline simd_t fp_ ## name(simd_t a, simd_t b, uint8_t pred) { \
+        bool quiet = !(pred & 0x10) ^ ((0x66 >> (pred & 7)) & 1); \
+        simd_t ord = cmp(a, b, 7), r; \
+        if (pred & 0x10 && ((0x66 >> (pred & 7)) & 1) == 0) { \
+            /* Quiet base predicate made signaling. */ \
+            fp_keep(cmp(a, b, 2)); \
+        } else if (quiet && ((0x66 >> (pred & 7)) & 1)) { \
+            /* Signaling base predicate made quiet, it compares no NaNs. */ \
+            a &= ord; \
+            b &= ord; \
+        } \
+        switch (pred & 0xF) { \
+            case 0x8: r = cmp(a, b, 0) | ~ord; break;             /* EQ_UQ */ \
+            case 0x9: r = cmp(b, a, 6); break;                    /* NGE_US */ \
+            case 0xA: r = cmp(b, a, 5); break;                    /* NGT_US */ \
+            case 0xB: r = fp_keep(ord) & 0; break;                /* FALSE_OQ */ \
+            case 0xC: r = cmp(a, b, 4) & ord; break;              /* NEQ_OQ */ \
+            case 0xD: r = cmp(b, a, 2); break;                    /* GE_OS */ \
+            case 0xE: r = cmp(b, a, 1); break;                    /* GT_OS */ \
+            case 0xF: r = fp_keep(ord) | ~(simd_t){ 0, 0 }; break; /* TRUE_UQ */ \
+            default:  r = cmp(a, b, pred & 7); break; \
+        } \
+        /* NaN lanes cleared for the compare are unordered ones. */ \
+        if (quiet && ((0x66 >> (pred & 7)) & 1)) \
+            r = ((pred & 7) >= 5) != !!(pred & 8) ? r | ~ord : r & ord; \
+        return r; \
+    }
+
+FP_VCMP(vcmpps, fp_cmpps)
+FP_VCMP(vcmppd, fp_cmppd)
+#undef FP_VCMP
+
+static inline bool fp_vcmpss(float a, float b, uint8_t pred) {
+    return ((simd_s32_t)fp_vcmpps((simd_t)(simd_f32_t){ a }, (simd_t)(simd_f32_t){ b }, pred))[0];
+}
+
+static inline bool fp_vcmpsd(double a, double b, uint8_t pred) {
+    return ((simd_s64_t)fp_vcmppd((simd_t)(simd_f64_t){ a }, (simd_t)(simd_f64_t){ b }, pred))[0];
+}
+
+/*
+ * FMA3, `a` * `b` + `c` rounded once, with the product and the addend
+ * negated for the FMSUB/FNMADD/FNMSUB forms. `sub` negates the addend of
+ * even (bit 0) and odd (bit 1) lanes, FMADDSUB and FMSUBADD alternate.
+ * NaN operands take precedence in the order `a`, `b`, `c` and come out
+ * quieted but not negated.
+ */
+
+static inline float fp_fma32(float a, float b, float c, bool neg, bool sub) {
+    float r = __builtin_fmaf(neg ? -a : a, b, sub ? -c : c);
+    if (!fp_isnan32(r)) return r;
+    return fp_isnan32(a) || fp_isnan32(b) ? fp_nan32(a, b) : fp_nan32(c, c);
+}
+
+static inline double fp_fma64(double a, double b, double c, bool neg, bool sub) {
+    double r = __builtin_fma(neg ? -a : a, b, sub ? -c : c);
+    if (!fp_isnan64(r)) return r;
+    return fp_isnan64(a) || fp_isnan64(b) ? fp_nan64(a, b) : fp_nan64(c, c);
+}
+
+static inline simd_t fp_fmaps(simd_t a, simd_t b, simd_t c, bool neg, uint8_t sub) {
+    simd_f32_t x = (simd_f32_t)a, y = (simd_f32_t)b, z = (simd_f32_t)c;
+    for (int i = 0; i < 4; i++)
+        x[i] = fp_fma32(x[i], y[i], z[i], neg, (sub >> (i & 1)) & 1);
+    return (simd_t)x;
+}
+
+static inline simd_t fp_fmapd(simd_t a, simd_t b, simd_t c, bool neg, uint8_t sub) {
+    simd_f64_t x = (simd_f64_t)a, y = (simd_f64_t)b, z = (simd_f64_t)c;
+    for (int i = 0; i < 2; i++)
+        x[i] = fp_fma64(x[i], y[i], z[i], neg, (sub >> i) & 1);
+    return (simd_t)x;
+}
+
+/*
+ * ROUNDPS/PD/SS/SD on the bits, host rounding functions may be inlined
+ * as sequences that get the sign of zero wrong in some modes. `imm` bits
+ * 1:0 give the rounding mode unless bit 2 takes the one of `mxcsr`, bit 3
+ * suppresses the precision exception.
+ */
+
+#define FP_ROUND(name, f_type, u_type, mant, bias) \
+    static inline f_type fp_ ## name(f_type v, uint8_t imm, uint32_t mxcsr) { \
+        u_type x, sign, frac, one; \
+        int e; \
+        bool up; \
+        uint8_t rc = imm & 4 ? (mxcsr & X64_MXCSR_RC) >> 13 : imm & 3; \
+        memcpy(&x, &v, sizeof(x)); \
+        sign = x & (u_type)1 << (sizeof(x) * 8 - 1); \
+        e = (int)((x & ~sign) >> mant) - (bias); \
+        if (e >= (mant)) { \
+            /* Integers already, infinities and NaNs. */ \
+            if (e == (bias) + 1 && (x & (((u_type)1 << mant) - 1))) { \
+                if (!(x & (u_type)1 << (mant - 1))) fp_raise(X64_MXCSR_IE); \
+                x |= (u_type)1 << (mant - 1); \
+            } \
+            memcpy(&v, &x, sizeof(x)); \
+            return v; \
+        } \
+        if (e < 0) { \
+            if ((mxcsr & X64_MXCSR_DAZ) && !(x & ~sign & ~(((u_type)1 << mant) - 1))) \
+                x = sign; \
+            frac = x & ~sign; \
+            one = (u_type)(bias) << mant; \
+            x = sign; \
+        } else { \
+            one = (u_type)1 << (mant - e); \
+            frac = x & (one - 1); \
+            x &= ~(one - 1); \
+        } \
+        /* Ties go to even, the lowest integer bit is the exponent one for 1. */ \
+        switch (rc) { \
+            case 0:  up = e < 0 ? frac > (u_type)((bias) - 1) << mant \
+                                 : frac > one >> 1 || (frac == one >> 1 && (x & one)); break; \
+            case 1:  up = sign && frac; break; \
+            case 2:  up = !sign && frac; break; \
+            default: up = false; break; \
+        } \
+        if (e < 0) { \
+            /* Below one the magnitude becomes 0 or 1. */ \
+            if (up) x |= one; \
+        } else if (up) { \
+            x += one; \
+        } \
+        if (frac && !(imm & 8)) fp_raise(X64_MXCSR_PE); \
+        memcpy(&v, &x, sizeof(x)); \
+        return v; \
+    }
+
+FP_ROUND(round32, float,  uint32_t, 23, 127)
+FP_ROUND(round64, double, uint64_t, 52, 1023)
+#undef FP_ROUND
+
+static inline simd_t fp_roundps(simd_t a, uint8_t imm, uint32_t mxcsr) {
+    simd_f32_t v = (simd_f32_t)a;
+    for (int i = 0; i < 4; i++)
+        v[i] = fp_round32(v[i], imm, mxcsr);
+    return (simd_t)v;
+}
+
+static inline simd_t fp_roundpd(simd_t a, uint8_t imm, uint32_t mxcsr) {
+    simd_f64_t v = (simd_f64_t)a;
+    for (int i = 0; i < 2; i++)
+        v[i] = fp_round64(v[i], imm, mxcsr);
+    return (simd_t)v;
+}
+
+/*
+ * HADD and HSUB combine adjacent lanes, those of `a` go to the low half
+ * of the result, those of `b` to the high one. ADDSUB subtracts in even
+ * lanes and adds in odd ones, x - y is x + -y to IEEE 754 in rounding and
+ * flags, only a NaN `b` must come out with its own sign.
+ */
+
+static inline simd_t fp_haddps(simd_t a, simd_t b) {
+    simd_f32_t x = (simd_f32_t)a, y = (simd_f32_t)b;
+    return fp_addps((simd_t)__builtin_shuffle(x, y, (simd_u32_t){ 0, 2, 4, 6 }),
+                    (simd_t)__builtin_shuffle(x, y, (simd_u32_t){ 1, 3, 5, 7 }));
+}
+
+static inline simd_t fp_hsubps(simd_t a, simd_t b) {
+    simd_f32_t x = (simd_f32_t)a, y = (simd_f32_t)b;
+    return fp_subps((simd_t)__builtin_shuffle(x, y, (simd_u32_t){ 0, 2, 4, 6 }),
+                    (simd_t)__builtin_shuffle(x, y, (simd_u32_t){ 1, 3, 5, 7 }));
+}
+
+static inline simd_t fp_haddpd(simd_t a, simd_t b) {
+    return fp_addpd(simd_unpacklo64(a, b), simd_unpackhi64(a, b));
+}
+
+static inline simd_t fp_hsubpd(simd_t a, simd_t b) {
+    return fp_subpd(simd_unpacklo64(a, b), simd_unpackhi64(a, b));
+}
+
+static inline simd_t fp_addsubps(simd_t a, simd_t b) {
+    simd_f32_t nb = (simd_f32_t)((simd_u32_t)b ^ (simd_u32_t){ 1u << 31, 0, 1u << 31, 0 });
+    return fp_fixnan32((simd_f32_t)a + nb, (simd_f32_t)a, (simd_f32_t)b);
+}
+
+static inline simd_t fp_addsubpd(simd_t a, simd_t b) {
+    simd_f64_t nb = (simd_f64_t)(b ^ (simd_t){ 1ull << 63, 0 });
+    return fp_fixnan64((simd_f64_t)a + nb, (simd_f64_t)a, (simd_f64_t)b);
+}
+
+/*
+ * DPPS and DPPD, products of the lanes selected by `imm` bits 7:4 summed
+ * in pairs, the sum goes to the lanes of bits 3:0, zeros to the others.
+ */
+
+static inline simd_t fp_dpps(simd_t a, simd_t b, uint8_t imm) {
+    simd_f32_t x = (simd_f32_t)a, y = (simd_f32_t)b, r;
+    float t[4];
+    for (int i = 0; i < 4; i++)
+        t[i] = imm & (0x10 << i) ? fp_mulss(x[i], y[i]) : 0.0f;
+    /*
+     * Hardware sums for each lane in an order of its own, which shows in
+     * the NaN kept of several: lane 0 takes (t1 + t0) + (t3 + t2), odd
+     * lanes swap the pairs' operands, lanes 2 and 3 the pairs.
+     */
+    for (int i = 0; i < 4; i++) {
+        int o = i & 1;
+        float lo = fp_addss(t[o ^ 1], t[o]), hi = fp_addss(t[2 + (o ^ 1)], t[2 + o]);
+        r[i] = imm & (1 << i) ? (i < 2 ? fp_addss(lo, hi) : fp_addss(hi, lo)) : 0.0f;
+    }
+    return (simd_t)r;
+}
+
+static inline simd_t fp_dppd(simd_t a, simd_t b, uint8_t imm) {
+    simd_f64_t x = (simd_f64_t)a, y = (simd_f64_t)b, r;
+    double t[2];
+    for (int i = 0; i < 2; i++)
+        t[i] = imm & (0x10 << i) ? fp_mulsd(x[i], y[i]) : 0.0;
+    /* Lane 1 adds the other way round, like the odd lanes of DPPS. */
+    for (int i = 0; i < 2; i++)
+        r[i] = imm & (1 << i) ? fp_addsd(t[i], t[i ^ 1]) : 0.0;
+    return (simd_t)r;
+}
+
+#endif /* __X64FP_PRIVATE_H_ */
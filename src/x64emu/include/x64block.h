@@ -0,0 +1,172 @@
+#ifndef __X64BLOCK_H_
+#define __X64BLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+
+/** Maximum number of instructions decoded into one block. */
+#define X64_BLOCK_MAX_INSTRS 64
+
+/**
+ * Entry of a block translated to host code, `ea` is scratch for the stencils.
+ * @return false on failure, like handlers.
+ */
+typedef bool (*x64jitcode_t)(x64emu_t *emu, uint64_t ea);
+
+/** How far the JIT got with a block. */
+enum {
+    X64_TIER_COLD,          /* Interpreted, runs are counted. */
+    X64_TIER_QUEUED,        /* Waits for the baseline compiler. */
+    X64_TIER_BASELINE,      /* Runs stencils, counted by them if the optimizer is enabled. */
+    X64_TIER_OPT_QUEUED,    /* Waits for the optimizer. */
+    X64_TIER_OPT,           /* Optimized, or the optimizer kept the baseline code. */
+};
+
+/**
+ * @return Whether the instruction may transfer control somewhere else
+ *         than to the next instruction.
+ */
+static inline bool x64block_is_end(const x64instr_t *ins) {
+    switch (ins->opcode[0]) {
+        case 0x70 ... 0x7F:   /* Jcc rel8 */
+        case 0xC2 ... 0xC3:   /* RET */
+        case 0xE8 ... 0xE9:   /* CALL/JMP rel32 */
+        case 0xEB:            /* JMP rel8 */
+            return true;
+        case 0xFF:            /* CALL/CALLF/JMP/JMPF r/m */
+            return ins->modrm.reg >= 2 && ins->modrm.reg <= 5;
+        case 0x0F:
+            switch (ins->opcode[1]) {
+                case 0x05:            /* SYSCALL */
+                case 0x80 ... 0x8F:   /* Jcc rel16/32 */
+                    return true;
+            }
+            break;
+    }
+    return false;
+}
+
+/** Branch target and fallthrough, or return address of a call. */
+#define X64_BLOCK_EXITS 2
+
+/** Exits of a block compiled as the start of a trace, which leaves from blocks it goes on to. */
+#define X64_BLOCK_TRACE_EXITS 8
+
+typedef struct x64block_exit x64block_exit_t;
+
+/**
+ * Exit of a block to a guest address known when decoding.
+ * Once the block at the address exists the exit is linked to it,
+ * and the translated code of the exit jumps straight to the one of the successor.
+ */
+struct x64block_exit {
+    uint64_t         target;    /* Guest address, 0 for an unused exit. */
+    x64block_t      *to;        /* Linked successor or `NULL`. */
+    x64block_exit_t *next_in;   /* Next exit linked to the same successor. */
+    uint8_t         *patch;     /* Writable host address the translated exit jumps through. */
+    uint64_t         unlinked;  /* Host code it jumps to when not linked. */
+};
+
+/** Blocks remembered by the inline cache of an indirect exit. */
+#define X64_BLOCK_IC 4
+
+/**
+ * Inline cache of an indirect exit (RET, CALL/JMP r/m64), the most recent
+ * target first, checked by the dispatcher. The translated exit compares
+ * with the first target ever seen and jumps straight to its code, it is not
+ * repatched afterwards so polymorphic sites do not keep writing code.
+ */
+typedef struct {
+    x64block_t      *to[X64_BLOCK_IC];
+    x64block_t      *linked;       /* Target the translated exit checks. */
+    uint8_t         *patch_target; /* Writable host address of the guest target compared with. */
+    uint8_t         *patch;        /* Writable host address the translated exit jumps through. */
+    uint64_t         unlinked;     /* Host code it jumps to on a mismatch. */
+} x64block_ic_t;
+
+/**
+ * Straight-line run of decoded instructions.
+ * Ends with a branch, call, return or syscall, or when
+ * X64_BLOCK_MAX_INSTRS is reached.
+ */
+struct x64block {
+    uint64_t        rip;        /* Guest address of the first instruction. */
+    uint64_t        end;        /* Guest address past the last instruction. */
+    x64block_t     *next;       /* Next block in the same hash bucket. */
+    uint32_t        instrs_len;
+    uint32_t        flags_dead; /* Instructions which skip writing flags. */
+    x64jitcode_t    code;       /* Translated host code or `NULL`. */
+    uint64_t        trace_rip;  /* Guest code the translated code comes from, wider than */
+    uint64_t        trace_end;  /* [rip, end) once it starts a trace. */
+    uint32_t        hits;       /* Runs in the current tier, counted for the next one. */
+    uint8_t         tier;       /* X64_TIER_* */
+    uint8_t         regions;    /* Parts of the JIT code buffer its code is in, a bit each. */
+    x64instr_t     *jit_instrs; /* Instructions the code runs handlers of. */
+    x64block_exit_t exits[X64_BLOCK_TRACE_EXITS]; /* Those past X64_BLOCK_EXITS are of the trace. */
+    x64block_exit_t *incoming;  /* Exits of other blocks linked to this one. */
+    bool            indirect;   /* Ends with an indirect branch using `ic`. */
+    bool            call;       /* Ends with CALL, the last exit is the return address. */
+    bool            ret;        /* Ends with RET. */
+    x64block_ic_t   ic;
+    x64instr_t      instrs[];   /* Followed by one terminating instruction. */
+};
+
+/** Bytes of the largest block. */
+#define X64_BLOCK_MAX_SIZE (sizeof(x64block_t) + (X64_BLOCK_MAX_INSTRS + 1) * sizeof(x64instr_t))
+
+/**
+ * Decode instructions starting at `rip` into a new block.
+ * @return `NULL` if the first instruction could not be decoded.
+ */
+x64block_t *x64block_build(x64emu_t *emu, uint64_t rip);
+
+/**
+ * @return Successor the exit of the block to `rip` is linked to, or `NULL`.
+ */
+static inline x64block_t *x64block_successor(x64block_t *block, uint64_t rip) {
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++) {
+        if (block->exits[i].target == rip)
+            return block->exits[i].to;
+    }
+    if (block->indirect) {
+        for (uint32_t i = 0; i < X64_BLOCK_IC && block->ic.to[i]; i++) {
+            if (block->ic.to[i]->rip == rip)
+                return block->ic.to[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Link unlinked exits of the block to `to->rip` with `to`, or add `to`
+ * to the inline cache if none of them leads there.
+ */
+void x64block_link(x64block_t *block, x64block_t *to);
+
+/** Point translated exits leading to and out of the block to current code. */
+void x64block_relink(x64block_t *block);
+
+/** Forget targets of the inline cache, they are about to be freed. */
+void x64block_ic_reset(x64block_t *block);
+
+/**
+ * Unlink all exits leading to and out of the block,
+ * needed before it is freed while other blocks remain.
+ */
+void x64block_unlink(x64block_t *block);
+
+/**
+ * Make a block of instructions decoded and optimized by `x64block_build` before,
+ * the terminating instruction is added. It is allocated from the cache,
+ * which has to be inserted to after `x64cache_reserve`.
+ */
+x64block_t *x64block_new(x64cache_t *cache, uint64_t rip, uint64_t end, const x64instr_t *instrs,
+                         uint32_t instrs_len, uint32_t flags_dead);
+
+/** Free what the block holds, its storage belongs to the cache. */
+void x64block_free(x64block_t *block);
+
+#endif /* __X64BLOCK_H_ */
@@ -0,0 +1,100 @@
+#ifndef __X64CACHE_H_
+#define __X64CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct x64block x64block_t;
+
+/** Slots of the direct-mapped table of recently looked up blocks. */
+#define X64_CACHE_RECENT 4096
+
+/** Bytes for decoded blocks and translated code, unless configured. */
+#define X64_CACHE_SIZE (64UL << 20)
+
+/** Parts the block storage is split into, the oldest one is emptied when all are used. */
+#define X64_CACHE_GENERATIONS 4
+
+/** Storage of blocks allocated since the generation was last emptied. */
+typedef struct {
+    size_t        used;        /* bytes from the start of the generation */
+    uint32_t      blocks;      /* allocated blocks not freed yet, retired ones included */
+} x64cache_gen_t;
+
+/**
+ * Hash table of decoded blocks keyed by guest address.
+ * Blocks are allocated from an arena of a fixed size, one generation after
+ * the other. Once the current generation has no room left for another block,
+ * all blocks of the next one are retired, and it becomes the current one
+ * as soon as they are freed. The resident memory of the cache stays within
+ * its size whatever code the guest runs.
+ */
+typedef struct {
+    x64block_t   *recent[X64_CACHE_RECENT]; /* checked before the buckets */
+    x64block_t  **buckets;
+    x64block_t   *retired;     /* invalidated blocks not freed yet */
+    uint32_t      buckets_len; /* always a power of two */
+    uint32_t      blocks_len;
+
+    uint8_t      *arena;
+    size_t        gen_size;    /* bytes of each generation */
+    x64cache_gen_t gens[X64_CACHE_GENERATIONS];
+    uint32_t      gen;         /* generation blocks are allocated from */
+
+    uint64_t      hits;        /* lookups that found a block */
+    uint64_t      misses;      /* lookups that did not */
+    uint64_t      evicted;     /* blocks retired to make room */
+} x64cache_t;
+
+/** Map the arena of `size` bytes for blocks. */
+bool x64cache_init(x64cache_t *cache, size_t size);
+
+/** Free all cached blocks, the table and the arena. */
+void x64cache_free(x64cache_t *cache);
+
+/** @return Block starting at `rip` or `NULL`. */
+x64block_t *x64cache_lookup(x64cache_t *cache, uint64_t rip);
+
+/** Add a block, the cache takes ownership of it. */
+bool x64cache_insert(x64cache_t *cache, x64block_t *block);
+
+/**
+ * @return Storage for a block of `size` bytes, at most X64_BLOCK_MAX_SIZE,
+ *         which `x64cache_reserve` made room for.
+ */
+void *x64cache_alloc(x64cache_t *cache, size_t size);
+
+/**
+ * Make room for a block to be allocated, by retiring all blocks
+ * of the oldest generation if the current one is full.
+ * @return Number of blocks retired.
+ */
+uint32_t x64cache_reserve(x64cache_t *cache);
+
+/**
+ * Retire all blocks with translated code in part `region` of the JIT code buffer,
+ * which is about to be reused.
+ * @return Number of blocks retired.
+ */
+uint32_t x64cache_evict_code(x64cache_t *cache, uint32_t region);
+
+/**
+ * Unlink and retire all blocks with instructions in [start, end), traces
+ * going through there included, the guest code there changed or went away.
+ * One of them may be running, they are freed by `x64cache_free_retired`.
+ * Does not allocate nor free, safe to call from a signal handler.
+ * @return Number of blocks retired.
+ */
+uint32_t x64cache_invalidate(x64cache_t *cache, uint64_t start, uint64_t end);
+
+/**
+ * Free retired blocks, none of them may be running.
+ * @return Whether there were any.
+ */
+bool x64cache_free_retired(x64cache_t *cache);
+
+/** Print cache statistics. */
+void x64cache_dump_stats(x64cache_t *cache);
+
+#endif /* __X64CACHE_H_ */
@@ -0,0 +1,99 @@
+#ifndef __X64CPUID_H_
+#define __X64CPUID_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Registers of CPUID leaves that hold feature bits, indices of `x64cpuid_t.features`. */
+enum {
+    X64_CPUID_1_ECX,    /* leaf 1 */
+    X64_CPUID_1_EDX,
+    X64_CPUID_7_EBX,    /* leaf 7, subleaf 0 */
+    X64_CPUID_7_EDX,
+    X64_CPUID_81_ECX,   /* leaf 0x80000001 */
+    X64_CPUID_81_EDX,
+    X64_CPUID_WORDS,
+};
+
+/* Feature bits, `X64_CPUID_<word>_<feature>`. */
+#define X64_CPUID_1_ECX_SSE3      (1u << 0)
+#define X64_CPUID_1_ECX_PCLMULQDQ (1u << 1)
+#define X64_CPUID_1_ECX_SSSE3     (1u << 9)
+#define X64_CPUID_1_ECX_FMA       (1u << 12)
+#define X64_CPUID_1_ECX_CX16      (1u << 13)
+#define X64_CPUID_1_ECX_SSE41     (1u << 19)
+#define X64_CPUID_1_ECX_SSE42     (1u << 20)
+#define X64_CPUID_1_ECX_MOVBE     (1u << 22)
+#define X64_CPUID_1_ECX_POPCNT    (1u << 23)
+#define X64_CPUID_1_ECX_AES       (1u << 25)
+#define X64_CPUID_1_ECX_XSAVE     (1u << 26)
+#define X64_CPUID_1_ECX_OSXSAVE   (1u << 27) /* XGETBV enabled, follows AVX */
+#define X64_CPUID_1_ECX_AVX       (1u << 28)
+#define X64_CPUID_1_ECX_F16C      (1u << 29)
+
+#define X64_CPUID_1_EDX_FPU       (1u << 0)
+#define X64_CPUID_1_EDX_TSC       (1u << 4)
+#define X64_CPUID_1_EDX_CX8       (1u << 8)
+#define X64_CPUID_1_EDX_CMOV      (1u << 15)
+#define X64_CPUID_1_EDX_CLFSH     (1u << 19)
+#define X64_CPUID_1_EDX_MMX       (1u << 23)
+#define X64_CPUID_1_EDX_FXSR      (1u << 24)
+#define X64_CPUID_1_EDX_SSE       (1u << 25)
+#define X64_CPUID_1_EDX_SSE2      (1u << 26)
+
+#define X64_CPUID_7_EBX_BMI1      (1u << 3)
+#define X64_CPUID_7_EBX_AVX2      (1u << 5)
+#define X64_CPUID_7_EBX_BMI2      (1u << 8)
+#define X64_CPUID_7_EBX_ERMS      (1u << 9)  /* fast REP MOVSB/STOSB */
+#define X64_CPUID_7_EBX_SHA       (1u << 29)
+
+#define X64_CPUID_7_EDX_FSRM      (1u << 4)  /* fast short REP MOVSB */
+
+#define X64_CPUID_81_ECX_LAHF     (1u << 0)  /* LAHF/SAHF in 64 bit mode */
+#define X64_CPUID_81_ECX_LZCNT    (1u << 5)
+#define X64_CPUID_81_ECX_PREFETCHW (1u << 8)
+
+#define X64_CPUID_81_EDX_SYSCALL  (1u << 11)
+#define X64_CPUID_81_EDX_NX       (1u << 20)
+#define X64_CPUID_81_EDX_LM       (1u << 29)
+
+/** XCR0 state components. */
+#define X64_XCR0_X87 (1u << 0)
+#define X64_XCR0_SSE (1u << 1)
+#define X64_XCR0_AVX (1u << 2)
+
+/** Preset of the model, unless configured. */
+#define X64_CPUID_PRESET "max"
+
+/**
+ * CPU model the guest sees through CPUID and XGETBV.
+ * Vendor, signature, brand and caches are fixed, the features are those of
+ * a preset limited to what is implemented, with optional overrides.
+ */
+typedef struct {
+    uint32_t features[X64_CPUID_WORDS];
+} x64cpuid_t;
+
+/**
+ * Set the features of preset `name`: "x86-64", "x86-64-v2" and "x86-64-v3"
+ * for the psABI levels, "max" for all implemented extensions.
+ * @return false if there is no such preset.
+ */
+bool x64cpuid_preset(x64cpuid_t *cpuid, const char *name);
+
+/**
+ * Enable or disable features from a comma separated list of `+feature`
+ * and `-feature`, names as in /proc/cpuinfo. Disabling a feature disables
+ * those built on it, like AVX2 and FMA with AVX.
+ * @return false on unknown or unimplemented features, or features enabled
+ *         without the ones they need.
+ */
+bool x64cpuid_override(x64cpuid_t *cpuid, const char *list);
+
+/** CPUID `leaf`, `subleaf` into `regs` as EAX, EBX, ECX, EDX. */
+void x64cpuid_query(const x64cpuid_t *cpuid, uint32_t leaf, uint32_t subleaf, uint32_t regs[4]);
+
+/** @return XCR0 as read by XGETBV: x87 and SSE state, AVX state with AVX. */
+uint64_t x64cpuid_xcr0(const x64cpuid_t *cpuid);
+
+#endif /* __X64CPUID_H_ */
@@ -6,6 +6,18 @@
 #include "x64flags.h"
 #include "x64regs.h"
 #include "x64context.h"
+#include "x64cpuid.h"
+#include "x64cache.h"
+#include "x64jit.h"
+#include "x64shadow.h"
+#include "x64smc.h"
+#include "x64tcache.h"
+
+/** How guest code is executed. */
+enum {
+    X64_ENGINE_INTERP,  /* threaded interpreter */
+    X64_ENGINE_JIT,     /* blocks translated to host code */
+};
 
 /**
  * Current state of the emulated cpu.
@@ -15,8 +27,25 @@ typedef struct {
     reg64_t       regs[16]; /* 16 general-purpose registers. */
     reg64_t       rip;      /* Instruction pointer. */
     x64flags_t    flags;    /* RFLAGS register. */
+    x64lazyflags_t lazy;    /* Pending arithmetic flags of RFLAGS. */
     reg64_t       mmx[16];  /* 16 MMX registers. */
     reg128_t      xmm[16];  /* 16 XMM registers. */
+    reg128_t      ymmh[16]; /* Upper halves of the 16 YMM registers. */
+    uint32_t      mxcsr;    /* MXCSR control bits and flags, see x64mxcsr.h. */
+    x64cpuid_t    cpuid;    /* CPU model, chosen before x64emu_init. */
+    x64cache_t    cache;    /* Decoded blocks. */
+    size_t        cache_size; /* Bytes for decoded blocks and translated code, chosen before x64emu_init. */
+    uint64_t      flags_dead; /* Flag computations skipped by executed blocks. */
+    uint8_t       engine;   /* X64_ENGINE_*, chosen before x64emu_init. */
+    uint32_t      jit_threshold; /* Interpreted runs before a block is compiled, chosen before x64emu_init. */
+    uint32_t      jit_opt_threshold; /* Baseline runs before a block is optimized, chosen before x64emu_init. */
+    x64jit_t      jit;      /* Translated blocks. */
+    x64block_t   *jit_exit; /* Block whose code returned through an unlinked exit. */
+    x64block_t   *jit_hot;  /* Block whose baseline code returned to be optimized. */
+    x64shadow_t   shadow;   /* Return addresses of calls. */
+    x64smc_t      smc;      /* Write-protected code pages. */
+    const char   *cache_dir; /* Persistent translation cache directory or `NULL`, chosen before x64emu_init. */
+    x64tcache_t   tcache;
 } x64emu_t;
 
 /**
@@ -30,6 +59,12 @@ bool x64emu_init(x64emu_t *emu, x64context_t *ctx);
  */
 void x64emu_run(x64emu_t *emu);
 
+/**
+ * Drop cached blocks with instructions in [start, end).
+ * Safe to call from a signal handler, see `x64cache_invalidate`.
+ */
+void x64emu_invalidate(x64emu_t *emu, uint64_t start, uint64_t end);
+
 /**
  * Free emu and context.
  */
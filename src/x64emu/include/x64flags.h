@@ -33,4 +33,40 @@ typedef union {
     };
 } x64flags_t;
 
+/* Status flags as RFLAGS bit masks. */
+#define X64_FLAG_CF      0x001
+#define X64_FLAG_PF      0x004
+#define X64_FLAG_AF      0x010
+#define X64_FLAG_ZF      0x040
+#define X64_FLAG_SF      0x080
+#define X64_FLAG_OF      0x800
+#define X64_FLAGS_STATUS 0x8D5 /* All of the above. */
+
+/** Kind of the operation recorded in `x64lazyflags_t`. */
+enum {
+    X64_LAZY_NONE,  /* Flags are up to date in RFLAGS. */
+    X64_LAZY_ADD,
+    X64_LAZY_ADC,   /* ADD with carry in. */
+    X64_LAZY_SUB,
+    X64_LAZY_SBB,   /* SUB with borrow in. */
+    X64_LAZY_INC,   /* ADD of 1, CF is kept in RFLAGS. */
+    X64_LAZY_DEC,   /* SUB of 1, CF is kept in RFLAGS. */
+    X64_LAZY_LOGIC, /* AND/OR/XOR/TEST, CF and OF are cleared. */
+    X64_LAZY_SHL,
+    X64_LAZY_SHR,
+    X64_LAZY_SAR,
+};
+
+/**
+ * Last operation which produced CF, PF, AF, ZF, SF and OF.
+ * The flags are computed from it only when something reads them.
+ */
+typedef struct {
+    uint64_t op1;   /* Destination before the operation, zero-extended. */
+    uint64_t op2;   /* Source operand or shift count, zero-extended. */
+    uint64_t res;   /* Result, zero-extended. */
+    uint8_t  kind;  /* X64_LAZY_* */
+    uint8_t  width; /* Operand width in bits. */
+} x64lazyflags_t;
+
 #endif /* __X64FLAGS_H_ */
\ No newline at end of file
@@ -50,6 +50,16 @@ typedef union {
     };
 } x64modrm_t;
 
+/**
+ * Decoded VEX prefix. Its R, X, B and W bits go to `rex` and its implied
+ * 66, F3 or F2 prefix to `operand_sz` and `rep`, the opcode bytes follow
+ * C4 as they would follow 0F, so resolvers see the legacy form.
+ */
+typedef struct {
+    uint8_t v;                /* VEX.vvvv, the extra source register, not inverted. */
+    bool    l;                /* VEX.L, 256 bit operands. */
+} x64vex_t;
+
 /**
  * Instruction debugging description.
  */
@@ -58,10 +68,18 @@ typedef struct {
     uint8_t bytes_len;
 } x64instr_desc_t;
 
+typedef struct x64instr x64instr_t;
+
+/**
+ * Executes one decoded instruction and continues with the next one
+ * in the block, returns false on failure.
+ */
+typedef bool (*x64handler_t)(x64emu_t *emu, x64instr_t *ins);
+
 /**
  * Decoded x86_64 instruction.
  */
-typedef struct {
+struct x64instr {
     uint8_t         rep;            /* REP/LOCK prefix. */
 
     x64rex_t        rex;
@@ -76,16 +94,41 @@ typedef struct {
        (64/32 bit). */
     bool            address_sz;
 
+    /* opcode[0] is C4 for both VEX forms. */
     uint8_t         opcode[3];
 
+    x64vex_t        vex;
+
     x64modrm_t      modrm;          /* ModR/M byte. */
     x64sib_t        sib;            /* SIB byte. */
-    reg64_t         displ;          /* Address displacement. */
+    reg64_t         displ;          /* Address displacement, sign-extended. */
+
+    uint8_t         amode;          /* ModR/M addressing form. */
+    uint8_t         ea_base;        /* Base (or r/m) register number. */
+    uint8_t         ea_index;       /* Index register number. */
+
     reg64_t         imm;            /* Immediate data. */
+
+    uint8_t         len;            /* Instruction length in bytes. */
+
+    uint16_t        flags_live;     /* Status flags read after the instruction. */
+    uint8_t         fused;          /* Following instructions the handler executes too. */
+    uint16_t        end;            /* Offset past the instruction from the start of its block. */
+
+    x64handler_t    handler;        /* Resolved once during decoding. */
 #ifdef HAVE_TRACE
     x64instr_desc_t desc;
 #endif /* HAVE_TRACE */
-} x64instr_t;
+};
+
+/**
+ * @return Guest address past the instruction. r_rip is not moved past every
+ *         instruction, it stays at `rip`, the start of the block, until
+ *         the instruction leaving the block sets it.
+ */
+static inline uint64_t x64instr_next(const x64instr_t *ins, uint64_t rip) {
+    return rip + ins->end;
+}
 
 /* fetch N bits of instruction. */
 
@@ -101,16 +144,85 @@ uint64_t fetch_64(x64emu_t *emu, x64instr_t *ins);
 #define fetch_64(emu, ins) (*(uint64_t *)(r_rip += 8, r_rip - 8))
 #endif
 
-/** Execute decoded instruction. */
+/**
+ * Execute decoded instructions starting at `ins`,
+ * until the end of the block is reached.
+ */
 bool x64execute(x64emu_t *emu, x64instr_t *ins);
 
-bool x64execute_0f(x64emu_t *emu, x64instr_t *ins);
+/** @return Handler of the decoded instruction or `NULL` if unimplemented. */
+x64handler_t x64execute_resolve(x64instr_t *ins);
+
+x64handler_t x64execute_resolve_0f(x64instr_t *ins);
+
+/** @return Handler of a three-byte 0F 38 or 0F 3A opcode, or `NULL`. */
+x64handler_t x64execute_resolve_0f38(x64instr_t *ins);
+x64handler_t x64execute_resolve_0f3a(x64instr_t *ins);
+
+/** @return Handler of a VEX encoded AVX/AVX2/FMA instruction, or `NULL`. */
+x64handler_t x64execute_resolve_avx(x64instr_t *ins);
+x64handler_t x64execute_resolve_avx_0f38(x64instr_t *ins);
+x64handler_t x64execute_resolve_avx_0f3a(x64instr_t *ins);
+
+/**
+ * @return Handler of a bit scan, count or test, MOVBE or VEX encoded
+ *         BMI1/BMI2 instruction, or `NULL`.
+ */
+x64handler_t x64execute_resolve_bmi(x64instr_t *ins);
+
+/** @return Handler of a MMX/SSE packed integer or bitwise instruction, or `NULL`. */
+x64handler_t x64execute_resolve_sse(x64instr_t *ins);
+
+/** @return Handler of a SSE/SSE2 floating point or MXCSR instruction, or `NULL`. */
+x64handler_t x64execute_resolve_fp(x64instr_t *ins);
+
+/**
+ * @return Handler specialized for operand width and addressing form
+ *         of the instruction, or `NULL` if there is none.
+ */
+x64handler_t x64execute_resolve_spec(x64instr_t *ins);
+
+/**
+ * @return Specialized handler that does not record flags, for instructions
+ *         whose flags are overwritten before being read, or `NULL`.
+ */
+x64handler_t x64execute_resolve_spec_nf(x64instr_t *ins);
+
+/**
+ * Fuse CMP/SUB/TEST/DEC instruction with the following Jcc, CMOVcc or SETcc.
+ * `ins + 1` must be decoded and have `flags_live` set.
+ * @return Handler executing both instructions, or `NULL`.
+ */
+x64handler_t x64execute_resolve_fused(x64instr_t *ins);
+
+/**
+ * @return Handler executing a run of PUSH+r64 or POP+r64 from `ins` on, if it
+ *         may be part of one, or `NULL`. Instructions of one run resolve alike.
+ */
+x64handler_t x64execute_resolve_run(x64instr_t *ins);
+
+/** @return Handler of MOVS, CMPS, STOS, LODS or SCAS, or `NULL`. */
+x64handler_t x64execute_resolve_string(x64instr_t *ins);
+
+/** Handler of the terminating instruction appended to blocks whose last instruction sets r_rip. */
+bool x64execute_block_end(x64emu_t *emu, x64instr_t *ins);
+
+/** Handler of the terminating instruction of other blocks, moves r_rip past them. */
+bool x64execute_block_next(x64emu_t *emu, x64instr_t *ins);
 
 /** Fetch instruction. */
 bool x64decode(x64emu_t *emu, x64instr_t *ins);
 
 bool x64decode_0f(x64emu_t *emu, x64instr_t *ins);
 
+/** Fetch the rest of the VEX prefix starting with `opcode[0]` and the instruction. */
+bool x64decode_vex(x64emu_t *emu, x64instr_t *ins);
+
 bool x64syscall(x64emu_t *emu);
 
+#ifdef HAVE_TRACE
+/** Dump the instruction and registers changed since the previous call. */
+void x64emu_trace(x64emu_t *emu, x64instr_t *ins, uint64_t rip);
+#endif /* HAVE_TRACE */
+
 #endif /* __X64INSTR_H_ */
\ No newline at end of file
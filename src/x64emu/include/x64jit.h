@@ -0,0 +1,124 @@
+#ifndef __X64JIT_H_
+#define __X64JIT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/** Interpreted runs of a block before it is compiled, unless configured. */
+#define X64JIT_THRESHOLD 64
+
+/** Baseline runs of a block before it is optimized, unless configured. */
+#define X64JIT_OPT_THRESHOLD 4096
+
+/** Parts the code buffer is split into, the oldest one is reused when all are full. */
+#define X64JIT_REGIONS 4
+
+typedef struct x64block x64block_t;
+typedef struct x64jit_job x64jit_job_t;
+
+/**
+ * Baseline JIT, translates blocks into host code by copying stencils
+ * and patching their holes, see jit_private.h.
+ * The code buffer is mapped twice, writable and executable.
+ *
+ * Blocks start interpreted. Once one has run `threshold` times it is queued
+ * to the compiler thread, which emits its code while the interpreter goes on,
+ * and the dispatcher installs the code between blocks.
+ * With `threshold` 0 blocks are compiled before they first run, without the thread.
+ *
+ * Baseline code counts its runs. Once a block has run `opt_threshold` times
+ * it returns to the dispatcher, which queues it for the optimizer, see jit_opt.c,
+ * together with the blocks it goes on with most as a trace.
+ * The optimized code replaces the baseline one, whose entry jumps to it from then on.
+ *
+ * Code is emitted into one part of the buffer after the other. Once a block
+ * does not fit in the current part the compiler thread waits, and the dispatcher
+ * reuses the oldest part, retiring the blocks with code there.
+ */
+typedef struct {
+    uint8_t      *rw;        /* writable view of the code buffer */
+    uint8_t      *rx;        /* executable view of the same memory */
+    size_t        size;
+    size_t        region_size;
+    uint32_t      region;    /* part of the buffer code is emitted into */
+    size_t        limit;     /* end of that part */
+    size_t        used;      /* owned by the compiler thread while it runs */
+    bool          full;      /* a block did not fit, nothing is translated until `x64jit_reclaim` */
+
+    uint32_t      threshold; /* interpreted runs before a block is queued */
+    uint32_t      opt_threshold; /* baseline runs before a block is optimized, 0 disables it */
+    bool          threaded;  /* the compiler thread runs */
+    bool          stop;
+    pthread_t     thread;
+    pthread_mutex_t lock;    /* guards the lists and `compiling` */
+    pthread_cond_t  wake;    /* jobs were queued or the thread is to stop */
+    pthread_cond_t  idle;    /* the thread finished a job */
+    x64jit_job_t *queue;     /* blocks to compile, oldest first */
+    x64jit_job_t *queue_tail;
+    x64jit_job_t *done;      /* compiled blocks waiting to be installed */
+    x64block_t   *compiling; /* block the thread works on or `NULL` */
+
+    uint64_t      blocks;    /* translated blocks */
+    uint64_t      bytes;     /* of code emitted for them and optimized ones */
+    uint64_t      reclaimed; /* parts of the buffer reused */
+    uint64_t      queued;    /* blocks handed to the compiler thread */
+    uint64_t      native;    /* instructions translated to stencils */
+    uint64_t      interp;    /* instructions left to interpreter handlers */
+    uint64_t      optimized; /* blocks whose code the optimizer replaced */
+    uint64_t      opt_native; /* instructions of them lowered to host code */
+    uint64_t      traced;    /* blocks the optimized ones went on with */
+} x64jit_t;
+
+/** Map the code buffer of `size` bytes, start the compiler thread unless `threshold` is 0. */
+bool x64jit_init(x64jit_t *jit, uint32_t threshold, uint32_t opt_threshold, size_t size);
+
+/** Stop the compiler thread, queued blocks stay interpreted. */
+void x64jit_stop(x64jit_t *jit);
+
+/** Unmap the code buffer, translated blocks must not run afterwards. */
+void x64jit_free(x64jit_t *jit);
+
+/**
+ * Translate the block and set its `code`.
+ * @return false if the code buffer is full, or the block is too large for it.
+ */
+bool x64jit_compile(x64jit_t *jit, x64block_t *block);
+
+/**
+ * Hand the block to the compiler thread, to the optimizer if it has baseline code.
+ * Its `code` is set by `x64jit_install`, right away for the optimizer without the thread.
+ */
+void x64jit_queue(x64jit_t *jit, x64block_t *block);
+
+/** @return true if compiled blocks wait for `x64jit_install`. */
+static inline bool x64jit_ready(x64jit_t *jit) {
+    return __atomic_load_n(&jit->done, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/** Set `code` of blocks the compiler thread finished, and link them. No block may be running. */
+void x64jit_install(x64jit_t *jit);
+
+/** @return true if the current part of the code buffer is full. */
+static inline bool x64jit_full(x64jit_t *jit) {
+    return __atomic_load_n(&jit->full, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Move on to the oldest part of the code buffer and let the compiler thread go on.
+ * Blocks with code there have to be retired before any block runs again.
+ * @return The part reused.
+ */
+uint32_t x64jit_reclaim(x64jit_t *jit);
+
+/**
+ * Take retired blocks, linked through `next`, away from the compiler thread,
+ * waiting for it if it works on one of them.
+ */
+void x64jit_forget(x64jit_t *jit, x64block_t *retired);
+
+/** Print JIT statistics. */
+void x64jit_dump_stats(x64jit_t *jit);
+
+#endif /* __X64JIT_H_ */
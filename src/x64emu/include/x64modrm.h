@@ -4,6 +4,21 @@
 #include "x64emu.h"
 #include "x64instr.h"
 
+/**
+ * Addressing form of the ModR/M operand, classified once by `x64modrm_fetch`.
+ * `ea_base`, `ea_index` and sign-extended `displ` of the instruction
+ * hold everything needed to compute the address.
+ */
+enum {
+    X64_AMODE_REG,        /* Register-direct, register number in `ea_base`. */
+    X64_AMODE_BASE,       /* [base + disp] */
+    X64_AMODE_BASE_INDEX, /* [base + index * scale + disp] */
+    X64_AMODE_INDEX,      /* [index * scale + disp32] */
+    X64_AMODE_ABS,        /* [disp32] */
+    X64_AMODE_RIP,        /* [RIP + disp32] */
+    X64_AMODE_GENERIC,    /* Not classified, e.g. 32 bit addressing. */
+};
+
 /**
  * Decode ModR/M byte of the current instruction.
  */
@@ -0,0 +1,42 @@
+#ifndef __X64MXCSR_H_
+#define __X64MXCSR_H_
+
+#include <stdint.h>
+
+#include "x64emu.h"
+
+/* MXCSR fields. */
+#define X64_MXCSR_IE      0x0001 /* Invalid operation flag */
+#define X64_MXCSR_DE      0x0002 /* Denormal flag */
+#define X64_MXCSR_ZE      0x0004 /* Divide-by-zero flag */
+#define X64_MXCSR_OE      0x0008 /* Overflow flag */
+#define X64_MXCSR_UE      0x0010 /* Underflow flag */
+#define X64_MXCSR_PE      0x0020 /* Precision flag */
+#define X64_MXCSR_FLAGS   0x003F /* All of the above. */
+#define X64_MXCSR_DAZ     0x0040 /* Denormals are zeros */
+#define X64_MXCSR_MASKS   0x1F80 /* Exception masks */
+#define X64_MXCSR_RC      0x6000 /* Rounding control */
+#define X64_MXCSR_FTZ     0x8000 /* Flush to zero */
+#define X64_MXCSR_DEFAULT 0x1F80 /* After reset: all masked, round to nearest. */
+
+/* Rounding control values. */
+#define X64_MXCSR_RC_NEAREST 0x0000
+#define X64_MXCSR_RC_DOWN    0x2000
+#define X64_MXCSR_RC_UP      0x4000
+#define X64_MXCSR_RC_ZERO    0x6000
+
+/**
+ * Set the guest MXCSR (LDMXCSR).
+ * Guest floating point runs on host floating point, so the rounding mode
+ * and FTZ/DAZ are mirrored to the host here, once, rather than switched
+ * around each instruction. Host exceptions stay masked.
+ */
+void x64mxcsr_load(x64emu_t *emu, uint32_t mxcsr);
+
+/**
+ * Get the guest MXCSR (STMXCSR).
+ * @return Control bits last loaded with the exception flags raised since.
+ */
+uint32_t x64mxcsr_store(x64emu_t *emu);
+
+#endif /* __X64MXCSR_H_ */
@@ -0,0 +1,60 @@
+#ifndef __X64SHADOW_H_
+#define __X64SHADOW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct x64block x64block_t;
+
+/** Entries of the shadow stack, deeper calls overwrite the oldest ones. */
+#define X64_SHADOW_LEN 64
+
+/**
+ * Return address pushed by CALL along with where to continue when RET
+ * pops it, see x64block_t `exits`.
+ */
+typedef struct {
+    uint64_t        rip;        /* Guest return address. */
+    x64block_t     *caller;     /* Block ending with the CALL. */
+    void           *code;       /* Host code to continue with, or `NULL` if interpreted. */
+} x64shadow_entry_t;
+
+/**
+ * Host side copy of guest return addresses, lets RET continue
+ * without looking the address up. Guest code is free to return elsewhere,
+ * entries are only a prediction checked against the popped address.
+ */
+typedef struct {
+    x64shadow_entry_t entries[X64_SHADOW_LEN];
+    uint32_t          top;      /* Wraps around, only the low bits index. */
+
+    uint64_t          hits;     /* RET to the predicted address */
+    uint64_t          misses;
+} x64shadow_t;
+
+static inline void x64shadow_push(x64shadow_t *shadow, uint64_t rip, x64block_t *caller, void *code) {
+    x64shadow_entry_t *entry = shadow->entries + (shadow->top++ & (X64_SHADOW_LEN - 1));
+    entry->rip = rip;
+    entry->caller = caller;
+    entry->code = code;
+}
+
+/** @return Top entry if it predicts the return to `rip`, or `NULL`. Pops it either way. */
+static inline x64shadow_entry_t *x64shadow_pop(x64shadow_t *shadow, uint64_t rip) {
+    x64shadow_entry_t *entry = shadow->entries + (--shadow->top & (X64_SHADOW_LEN - 1));
+    if (entry->rip != rip) {
+        shadow->misses++;
+        return NULL;
+    }
+    entry->rip = 0;
+    shadow->hits++;
+    return entry;
+}
+
+/** Forget all entries, blocks they point to are about to be freed. */
+static inline void x64shadow_reset(x64shadow_t *shadow) {
+    memset(shadow->entries, 0, sizeof(shadow->entries));
+}
+
+#endif /* __X64SHADOW_H_ */
@@ -0,0 +1,50 @@
+#ifndef __X64SMC_H_
+#define __X64SMC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Buckets of the table of guest pages holding cached code. */
+#define X64_SMC_BUCKETS 1024
+
+typedef struct x64smc_page x64smc_page_t;
+
+/**
+ * Self-modifying code detection.
+ * Guest pages which cached blocks were decoded from are write-protected,
+ * a write to one of them faults and invalidates the blocks of the page.
+ * Pages are only added outside of signal handlers, so the fault path
+ * never allocates.
+ */
+typedef struct {
+    x64smc_page_t *buckets[X64_SMC_BUCKETS];
+    uint64_t       page_size;
+
+    uint64_t       faults;    /* writes to cached code caught */
+} x64smc_t;
+
+bool x64smc_init(x64smc_t *smc, uint64_t page_size);
+
+/** Forget all pages, leaving their protection as is. */
+void x64smc_free(x64smc_t *smc);
+
+/**
+ * Write-protect pages of [start, end), code was cached from them.
+ * Pages the guest cannot write to are only recorded.
+ */
+bool x64smc_protect(x64smc_t *smc, uint64_t start, uint64_t end);
+
+/**
+ * Give the guest its write access back to the page containing `addr`.
+ * Safe to call from a signal handler.
+ * @return false if the page is not write-protected by `x64smc_protect`.
+ */
+bool x64smc_unprotect(x64smc_t *smc, uint64_t addr);
+
+/**
+ * Forget pages of [start, end), the guest changes their mapping.
+ * Their protection is left to the guest.
+ */
+void x64smc_forget(x64smc_t *smc, uint64_t start, uint64_t end);
+
+#endif /* __X64SMC_H_ */
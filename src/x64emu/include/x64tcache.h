@@ -0,0 +1,53 @@
+#ifndef __X64TCACHE_H_
+#define __X64TCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "x64context.h"
+#include "x64cache.h"
+
+typedef struct x64block x64block_t;
+
+/**
+ * Persistent translation cache, decoded blocks of a binary saved
+ * to a file in the cache directory between runs.
+ * The file is named after a hash of the loaded segments and their addresses,
+ * it is mapped read-only at startup and rewritten at exit if new blocks
+ * were decoded. Files of other flux64 builds or format versions are ignored.
+ */
+typedef struct {
+    char           *path;      /* cache file of the binary, `NULL` when disabled */
+    uint64_t        key;       /* hash of the loaded segments */
+    uint8_t        *map;       /* mapped cache file or `NULL` */
+    size_t          map_size;
+    uint32_t        records_len;
+    bool            dirty;     /* blocks missing in the file were decoded, save at exit */
+
+    x64context_t   *ctx;       /* segments blocks are saved from */
+
+    uint64_t        loaded;    /* blocks taken from the file */
+    uint64_t        rejected;  /* records whose code did not match memory */
+} x64tcache_t;
+
+/**
+ * Open the cache file of the loaded binary in directory `dir`.
+ * Missing or stale files only leave the cache empty.
+ * @return false if the cache cannot be used at all.
+ */
+bool x64tcache_open(x64tcache_t *tcache, const char *dir, x64context_t *ctx);
+
+/**
+ * @return Block at `rip` made from the cache file and allocated from `cache`, or `NULL`.
+ *         The caller inserts it to `cache`.
+ */
+x64block_t *x64tcache_get(x64tcache_t *tcache, x64cache_t *cache, uint64_t rip);
+
+/** Note a newly decoded block, the file is rewritten at exit if it is missing there. */
+void x64tcache_add(x64tcache_t *tcache, x64block_t *block);
+
+/** Save blocks of the loaded segments if any were decoded, unmap the file. */
+void x64tcache_close(x64tcache_t *tcache, x64cache_t *cache);
+
+#endif /* __X64TCACHE_H_ */
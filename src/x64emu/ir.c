@@ -0,0 +1,1025 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+#include "x64block.h"
+#include "x64flags.h"
+
+#include "regs_private.h"
+#include "ir_private.h"
+
+SET_DEBUG_CHANNEL("X64IR")
+
+/* Builder */
+
+typedef struct {
+    x64ir_t    *ir;
+    uint16_t    regs[16];   /* Current value of each GPR, X64IR_NONE while it is in memory. */
+    uint16_t    flags;      /* Last FLAGS, X64IR_NONE while they are in memory or dead. */
+    uint64_t    rip;        /* Instruction being lowered. */
+    x64instr_t *ins;
+    uint64_t    next;       /* Guest address the trace goes on at past the block, 0 in the last one. */
+    bool        full;       /* Values did not fit. */
+} ir_builder_t;
+
+/** Forget values of the guest state, it is in memory after a barrier. */
+static void ir_reset(ir_builder_t *b) {
+    for (uint32_t i = 0; i < 16; i++)
+        b->regs[i] = X64IR_NONE;
+    b->flags = X64IR_NONE;
+}
+
+static uint16_t ir_value(ir_builder_t *b, uint8_t op, uint8_t width, uint8_t aux,
+                         uint16_t a0, uint16_t a1, int64_t imm) {
+    x64ir_t *ir = b->ir;
+
+    /* The build fails, any value serves until then. */
+    if (ir->len == X64IR_MAX_VALUES) {
+        b->full = true;
+        return 0;
+    }
+
+    x64ir_value_t *v = ir->values + ir->len;
+    memset(v, 0, sizeof(x64ir_value_t));
+    v->op = op;
+    v->width = width;
+    v->aux = aux;
+    v->args[0] = a0;
+    v->args[1] = a1;
+    v->args[2] = v->args[3] = X64IR_NONE;
+    v->imm = imm;
+    v->rip = b->rip;
+    v->ins = b->ins;
+    return ir->len++;
+}
+
+static inline uint64_t ir_mask(uint8_t width) {
+    return width == 64 ? ~0UL : (1UL << width) - 1;
+}
+
+static uint16_t ir_const(ir_builder_t *b, int64_t imm, uint8_t width) {
+    return ir_value(b, X64IR_CONST, width, 0, X64IR_NONE, X64IR_NONE, imm & ir_mask(width));
+}
+
+static uint16_t ir_op1(ir_builder_t *b, uint8_t op, uint8_t width, uint16_t a, int64_t imm) {
+    return ir_value(b, op, width, 0, a, X64IR_NONE, imm);
+}
+
+static uint16_t ir_op2(ir_builder_t *b, uint8_t op, uint8_t width, uint16_t a0, uint16_t a1) {
+    return ir_value(b, op, width, 0, a0, a1, 0);
+}
+
+/** @return Upper bound of the significant bits of the value. */
+static uint8_t ir_bits(x64ir_t *ir, uint16_t v) {
+    x64ir_value_t *val = ir->values + v;
+    uint64_t imm = val->imm;
+
+    switch (val->op) {
+        case X64IR_CONST:
+            if (imm >> 32) return 64;
+            if (imm >> 16) return 32;
+            return imm >> 8 ? 16 : 8;
+        case X64IR_GET:
+        case X64IR_ADDR:
+            return 64;
+    }
+    return val->width;
+}
+
+static uint16_t ir_get(ir_builder_t *b, uint8_t reg) {
+    if (b->regs[reg] == X64IR_NONE)
+        b->regs[reg] = ir_value(b, X64IR_GET, 64, reg, X64IR_NONE, X64IR_NONE, 0);
+    return b->regs[reg];
+}
+
+/** Write the GPR, a 32 bit result clears the upper half. */
+static void ir_put(ir_builder_t *b, uint8_t reg, uint16_t v, uint8_t width) {
+    if (width == 32 && ir_bits(b->ir, v) > 32)
+        v = ir_op1(b, X64IR_ZEXT, 32, v, 0);
+    b->regs[reg] = v;
+    ir_value(b, X64IR_PUT, 64, reg, v, X64IR_NONE, 0);
+}
+
+/** Effective address of the memory operand. */
+static uint16_t ir_ea(ir_builder_t *b, x64instr_t *ins, uint64_t next_rip) {
+    uint16_t base = X64IR_NONE, index = X64IR_NONE;
+    int64_t displ = ins->displ.sq[0];
+
+    switch (ins->amode) {
+        case X64_AMODE_BASE_INDEX: base = ir_get(b, ins->ea_base); /* fallthrough */
+        case X64_AMODE_INDEX:      index = ir_get(b, ins->ea_index); break;
+        case X64_AMODE_BASE:       base = ir_get(b, ins->ea_base); break;
+        case X64_AMODE_RIP:        displ += next_rip; break;
+    }
+    return ir_value(b, X64IR_ADDR, 64, index != X64IR_NONE ? ins->sib.scale : 0, base, index, displ);
+}
+
+/** @return The r/m operand, `addr` is set to its address if it is in memory. */
+static uint16_t ir_rm(ir_builder_t *b, x64instr_t *ins, uint64_t next_rip, uint8_t width,
+                      uint16_t *addr) {
+    if (ins->amode == X64_AMODE_REG) return ir_get(b, ins->ea_base);
+
+    *addr = ir_ea(b, ins, next_rip);
+    return ir_op1(b, X64IR_LOAD, width, *addr, 0);
+}
+
+/** Write the r/m operand read by `ir_rm`. */
+static void ir_set_rm(ir_builder_t *b, x64instr_t *ins, uint16_t addr, uint16_t v, uint8_t width) {
+    if (ins->amode == X64_AMODE_REG)
+        ir_put(b, ins->ea_base, v, width);
+    else
+        ir_value(b, X64IR_STORE, width, 0, addr, v, 0);
+}
+
+/** Record flags of the instruction if anything reads them. */
+static void ir_flags(ir_builder_t *b, uint8_t kind, uint8_t width,
+                     uint16_t op1, uint16_t op2, uint16_t res, uint16_t cf) {
+    if (!b->ins->flags_live) {
+        b->flags = X64IR_NONE;
+        return;
+    }
+    b->flags = ir_value(b, X64IR_FLAGS, width, kind, op1, op2, 0);
+    b->ir->values[b->flags].args[2] = res;
+    b->ir->values[b->flags].args[3] = cf;
+}
+
+/* Flags tested by condition codes `cc` and `cc + 1`. */
+static inline bool ir_cc_reads_cf(uint8_t cc) { return (cc >> 1) == 1 || (cc >> 1) == 3; }
+static inline bool ir_cc_reads_of(uint8_t cc) { return (cc >> 1) == 0 || (cc >> 1) >= 6; }
+
+bool x64ir_cc_native(x64ir_t *ir, uint16_t flags, uint8_t cc) {
+    x64ir_value_t *f = ir->values + flags;
+
+    switch (f->aux) {
+        case X64_LAZY_ADD:
+        case X64_LAZY_SUB:
+        case X64_LAZY_LOGIC:
+            return true;
+        case X64_LAZY_INC:
+        case X64_LAZY_DEC:
+            /* CF is the one kept from before. */
+            return !ir_cc_reads_cf(cc);
+        case X64_LAZY_SHL:
+        case X64_LAZY_SHR:
+        case X64_LAZY_SAR:
+            /* Host OF is defined for shifts by 1 only. */
+            return !ir_cc_reads_of(cc) || ir->values[f->args[1]].imm == 1;
+    }
+    return false;
+}
+
+/** @return Last FLAGS if condition `cc` can be tested on them, or X64IR_NONE. */
+static uint16_t ir_cc(ir_builder_t *b, uint8_t cc) {
+    if (b->flags == X64IR_NONE || !x64ir_cc_native(b->ir, b->flags, cc))
+        return X64IR_NONE;
+    return b->flags;
+}
+
+/** @return CF before the instruction for INC/DEC to keep, X64IR_NONE if it is only in memory. */
+static uint16_t ir_cf(ir_builder_t *b) {
+    if (!(b->ins->flags_live & X64_FLAG_CF))
+        return ir_const(b, 0, 8);
+    if (b->flags == X64IR_NONE)
+        return X64IR_NONE;
+
+    x64ir_value_t *f = b->ir->values + b->flags;
+    switch (f->aux) {
+        case X64_LAZY_LOGIC: return ir_const(b, 0, 8);
+        case X64_LAZY_INC:
+        case X64_LAZY_DEC:   return f->args[3];
+    }
+    return ir_op1(b, X64IR_CF, 8, b->flags, 0);
+}
+
+/* IR operations and flag kinds of ALU opcode bits 3..5 or group 1 ModR/M reg field,
+   ADC and SBB are left out. */
+static const uint8_t ir_alu_op[8] = {
+    X64IR_ADD, X64IR_OR, X64IR_NOP, X64IR_NOP, X64IR_AND, X64IR_SUB, X64IR_XOR, X64IR_SUB,
+};
+static const uint8_t ir_alu_kind[8] = {
+    X64_LAZY_ADD, X64_LAZY_LOGIC, 0, 0, X64_LAZY_LOGIC, X64_LAZY_SUB, X64_LAZY_LOGIC, X64_LAZY_SUB,
+};
+
+/* Same for group 2 ModR/M reg field, SAL is SHL and rotates are left out. */
+static const uint8_t ir_shift_op[8] = {
+    [4] = X64IR_SHL, [5] = X64IR_SHR, [6] = X64IR_SHL, [7] = X64IR_SAR,
+};
+static const uint8_t ir_shift_kind[8] = {
+    [4] = X64_LAZY_SHL, [5] = X64_LAZY_SHR, [6] = X64_LAZY_SHL, [7] = X64_LAZY_SAR,
+};
+
+/**
+ * dest = dest op src, for CMP and TEST (`write` false) only the flags.
+ * The destination is the r/m operand if `dest_rm`, GPR `dest` otherwise.
+ */
+static void ir_alu(ir_builder_t *b, x64instr_t *ins, uint64_t next_rip, uint8_t op, uint8_t kind,
+                   uint8_t width, bool dest_rm, uint8_t dest, uint16_t src, bool write) {
+    uint16_t addr = X64IR_NONE;
+    uint16_t a = dest_rm ? ir_rm(b, ins, next_rip, width, &addr) : ir_get(b, dest);
+    uint16_t res = ir_op2(b, op, width, a, src);
+
+    if (kind == X64_LAZY_LOGIC) {
+        uint16_t zero = ir_const(b, 0, width);
+        ir_flags(b, kind, width, zero, zero, res, X64IR_NONE);
+    } else {
+        ir_flags(b, kind, width, a, src, res, X64IR_NONE);
+    }
+
+    if (!write) return;
+    if (dest_rm)
+        ir_set_rm(b, ins, addr, res, width);
+    else
+        ir_put(b, dest, res, width);
+}
+
+/** Leave the block to `target`, unless the trace goes on there. */
+static void ir_exit(ir_builder_t *b, uint64_t target) {
+    if (target != b->next)
+        ir_value(b, X64IR_EXIT, 64, 0, X64IR_NONE, X64IR_NONE, target);
+}
+
+/** Jcc, a side exit if the trace goes on either way. */
+static void ir_jcc(ir_builder_t *b, uint8_t cc, uint16_t flags, uint64_t target, uint64_t next_rip) {
+    if (target == b->next)
+        ir_value(b, X64IR_BRANCH, 64, cc ^ 1, flags, X64IR_NONE, next_rip);
+    else if (next_rip == b->next)
+        ir_value(b, X64IR_BRANCH, 64, cc, flags, X64IR_NONE, target);
+    else
+        ir_value(b, X64IR_JCC, 64, cc, flags, X64IR_NONE, target);
+}
+
+/** Sign-extended imm8 or imm32. */
+static inline int64_t ir_imm(x64instr_t *ins, bool imm8) {
+    return imm8 ? ins->imm.sb[0] : ins->imm.sd[0];
+}
+
+/**
+ * Lower the instruction at guest address `rip`.
+ * @return false, with nothing added, if it is left to the stencils.
+ */
+static bool ir_lower(ir_builder_t *b, x64instr_t *ins, uint64_t rip) {
+    uint64_t next_rip = rip + ins->len;
+    uint8_t op = ins->opcode[0];
+    uint8_t reg = ins->modrm.reg | (ins->rex.r << 3);
+    uint8_t ext = ins->modrm.reg;
+    uint8_t width = ins->rex.w ? 64 : 32;
+    uint16_t addr = X64IR_NONE, a, res, flags;
+
+    /* 8 and 16 bit operands merge into the GPR, the stencils do them. */
+    if (ins->address_sz || ins->operand_sz) return false;
+
+    /* Forms with ModR/M operand. */
+    switch (op) {
+        case 0x00 ... 0x0E:
+        case 0x10 ... 0x3B:
+            if ((op & 7) > 3) break;
+            /* fallthrough */
+        case 0x63:
+        case 0x81 ... 0x8B:
+        case 0x8D:
+        case 0xC1:
+        case 0xC7:
+        case 0xD1:
+        case 0xF7:
+        case 0xFF:
+            if (ins->amode >= X64_AMODE_GENERIC) return false;
+            break;
+        case 0x0F:
+            if ((ins->opcode[1] & 0xF0) == 0x40 || ins->opcode[1] == 0xB6 || ins->opcode[1] == 0xB7) {
+                if (ins->amode >= X64_AMODE_GENERIC) return false;
+            }
+            break;
+    }
+
+    switch (op) {
+        case 0x00 ... 0x0E:   /* ALU */
+        case 0x10 ... 0x3F:
+            if (!(op & 1) || (op & 7) > 5 || ir_alu_op[op >> 3] == X64IR_NOP) return false;
+            if ((op & 7) == 5) {
+                ir_alu(b, ins, next_rip, ir_alu_op[op >> 3], ir_alu_kind[op >> 3], width, false, _rax,
+                       ir_const(b, ir_imm(ins, false), width), (op >> 3) != 7);
+            } else if (op & 2) {
+                a = ir_rm(b, ins, next_rip, width, &addr);
+                ir_alu(b, ins, next_rip, ir_alu_op[op >> 3], ir_alu_kind[op >> 3], width, false, reg,
+                       a, (op >> 3) != 7);
+            } else {
+                ir_alu(b, ins, next_rip, ir_alu_op[op >> 3], ir_alu_kind[op >> 3], width, true, 0,
+                       ir_get(b, reg), (op >> 3) != 7);
+            }
+            return true;
+
+        case 0x50 ... 0x57:   /* PUSH+r64 */
+            a = ir_get(b, (op & 7) | (ins->rex.b << 3));
+            goto push;
+
+        case 0x68:            /* PUSH imm32 */
+        case 0x6A:            /* PUSH imm8 */
+            a = ir_const(b, ir_imm(ins, op == 0x6A), 64);
+        push:
+            res = ir_value(b, X64IR_ADDR, 64, 0, ir_get(b, _rsp), X64IR_NONE, -8);
+            ir_value(b, X64IR_STORE, 64, 0, res, a, 0);
+            ir_put(b, _rsp, res, 64);
+            return true;
+
+        case 0x58 ... 0x5F:   /* POP+r64 */
+            a = ir_get(b, _rsp);
+            res = ir_op1(b, X64IR_LOAD, 64, a, 0);
+            ir_put(b, _rsp, ir_value(b, X64IR_ADDR, 64, 0, a, X64IR_NONE, 8), 64);
+            ir_put(b, (op & 7) | (ins->rex.b << 3), res, 64);
+            return true;
+
+        case 0x63:            /* MOVSXD r64,r/m32 */
+            if (!ins->rex.w) return false;
+            a = ir_rm(b, ins, next_rip, 32, &addr);
+            ir_put(b, reg, ir_value(b, X64IR_SEXT, 64, 32, a, X64IR_NONE, 0), 64);
+            return true;
+
+        case 0x70 ... 0x7F:   /* Jcc rel8 */
+            if ((flags = ir_cc(b, op & 0xF)) == X64IR_NONE) return false;
+            ir_jcc(b, op & 0xF, flags, next_rip + ins->imm.sb[0], next_rip);
+            return true;
+
+        case 0x81:            /* ALU r/m,imm */
+        case 0x83:
+            if (ir_alu_op[ext] == X64IR_NOP) return false;
+            ir_alu(b, ins, next_rip, ir_alu_op[ext], ir_alu_kind[ext], width, true, 0,
+                   ir_const(b, ir_imm(ins, op == 0x83), width), ext != 7);
+            return true;
+
+        case 0x85:            /* TEST r/m,r */
+            ir_alu(b, ins, next_rip, X64IR_AND, X64_LAZY_LOGIC, width, true, 0, ir_get(b, reg), false);
+            return true;
+
+        case 0x89:            /* MOV r/m,r */
+            a = ir_get(b, reg);
+            if (ins->amode != X64_AMODE_REG)
+                addr = ir_ea(b, ins, next_rip);
+            ir_set_rm(b, ins, addr, a, width);
+            return true;
+
+        case 0x8B:            /* MOV r,r/m */
+            ir_put(b, reg, ir_rm(b, ins, next_rip, width, &addr), width);
+            return true;
+
+        case 0x8D:            /* LEA r32/64,m */
+            if (ins->amode == X64_AMODE_REG) return false;
+            ir_put(b, reg, ir_ea(b, ins, next_rip), width);
+            return true;
+
+        case 0x90:            /* NOP */
+            return !ins->rex.b;
+
+        case 0x98:            /* CDQE, CWDE */
+            a = ir_get(b, _rax);
+            ir_put(b, _rax, ir_value(b, X64IR_SEXT, width, width / 2, a, X64IR_NONE, 0), width);
+            return true;
+
+        case 0xA9:            /* TEST rAX,imm */
+            ir_alu(b, ins, next_rip, X64IR_AND, X64_LAZY_LOGIC, width, false, _rax,
+                   ir_const(b, ir_imm(ins, false), width), false);
+            return true;
+
+        case 0xB8 ... 0xBF:   /* MOV+r32/64 imm32/64 */
+            ir_put(b, (op & 7) | (ins->rex.b << 3), ir_const(b, ins->imm.uq[0], width), width);
+            return true;
+
+        case 0xC1:            /* shift r/m,imm8 */
+        case 0xD1:            /* shift r/m,1 */
+        {
+            uint8_t count = (op == 0xD1 ? 1 : ins->imm.ub[0]) & (width - 1);
+
+            if (!ir_shift_op[ext]) return false;
+            a = ir_rm(b, ins, next_rip, width, &addr);
+            if (!count) {
+                /* Flags stay, a 32 bit GPR is still zero-extended. */
+                if (ins->amode == X64_AMODE_REG)
+                    ir_put(b, ins->ea_base, a, width);
+                return true;
+            }
+            res = ir_op1(b, ir_shift_op[ext], width, a, count);
+            ir_flags(b, ir_shift_kind[ext], width, a, ir_const(b, count, width), res, X64IR_NONE);
+            ir_set_rm(b, ins, addr, res, width);
+            return true;
+        }
+
+        case 0xC7:            /* MOV r/m,imm32 */
+            if (ext != 0) return false;
+            if (ins->amode != X64_AMODE_REG)
+                addr = ir_ea(b, ins, next_rip);
+            ir_set_rm(b, ins, addr, ir_const(b, ir_imm(ins, false), width), width);
+            return true;
+
+        case 0xE9:            /* JMP rel32 */
+            ir_exit(b, next_rip + ins->imm.sd[0]);
+            return true;
+
+        case 0xEB:            /* JMP rel8 */
+            ir_exit(b, next_rip + ins->imm.sb[0]);
+            return true;
+
+        case 0xF7:
+            switch (ext) {
+                case 0:
+                case 1:       /* TEST r/m,imm32 */
+                    ir_alu(b, ins, next_rip, X64IR_AND, X64_LAZY_LOGIC, width, true, 0,
+                           ir_const(b, ir_imm(ins, false), width), false);
+                    return true;
+                case 2:       /* NOT, flags stay */
+                    a = ir_rm(b, ins, next_rip, width, &addr);
+                    ir_set_rm(b, ins, addr, ir_op1(b, X64IR_NOT, width, a, 0), width);
+                    return true;
+                case 3:       /* NEG, flags of 0 - a */
+                    a = ir_rm(b, ins, next_rip, width, &addr);
+                    res = ir_op1(b, X64IR_NEG, width, a, 0);
+                    ir_flags(b, X64_LAZY_SUB, width, ir_const(b, 0, width), a, res, X64IR_NONE);
+                    ir_set_rm(b, ins, addr, res, width);
+                    return true;
+            }
+            return false;
+
+        case 0xFF:            /* INC, DEC */
+        {
+            uint16_t cf = X64IR_NONE;
+
+            if (ext > 1) return false;
+            if (ins->flags_live && (cf = ir_cf(b)) == X64IR_NONE) return false;
+            a = ir_rm(b, ins, next_rip, width, &addr);
+            res = ir_op2(b, ext ? X64IR_SUB : X64IR_ADD, width, a, ir_const(b, 1, width));
+            ir_flags(b, ext ? X64_LAZY_DEC : X64_LAZY_INC, width, a, ir_const(b, 1, width), res, cf);
+            ir_set_rm(b, ins, addr, res, width);
+            return true;
+        }
+
+        case 0x0F:
+            switch (ins->opcode[1]) {
+                case 0x40 ... 0x4F:   /* CMOVcc r,r/m */
+                {
+                    uint8_t cc = ins->opcode[1] & 0xF;
+                    if ((flags = ir_cc(b, cc)) == X64IR_NONE) return false;
+                    /* The interpreter keeps the upper half of a 32 bit GPR on false conditions. */
+                    if (width == 32) return false;
+                    a = ir_rm(b, ins, next_rip, width, &addr);
+                    res = ir_value(b, X64IR_CMOV, width, cc, ir_get(b, reg), a, 0);
+                    b->ir->values[res].args[2] = flags;
+                    ir_put(b, reg, res, width);
+                    return true;
+                }
+
+                case 0x80 ... 0x8F:   /* Jcc rel32 */
+                    if ((flags = ir_cc(b, ins->opcode[1] & 0xF)) == X64IR_NONE) return false;
+                    ir_jcc(b, ins->opcode[1] & 0xF, flags, next_rip + ins->imm.sd[0], next_rip);
+                    return true;
+
+                case 0xB6:            /* MOVZX r32/64,r/m8 */
+                case 0xB7:            /* MOVZX r32/64,r/m16 */
+                {
+                    uint8_t from = ins->opcode[1] == 0xB6 ? 8 : 16;
+                    /* AH..BH without REX. */
+                    if (from == 8 && ins->amode == X64_AMODE_REG && !ins->rex.byte && ins->ea_base >= 4)
+                        return false;
+                    a = ir_rm(b, ins, next_rip, from, &addr);
+                    if (ins->amode == X64_AMODE_REG)
+                        a = ir_op1(b, X64IR_ZEXT, from, a, 0);
+                    ir_put(b, reg, a, width);
+                    return true;
+                }
+            }
+            return false;
+    }
+    return false;
+}
+
+bool x64ir_build(x64ir_t *ir, x64ir_trace_t *trace) {
+    ir_builder_t b = { .ir = ir };
+    x64instr_t *instrs = trace->instrs;
+    uint64_t end = trace->rip[0];
+
+    ir->block = trace->block;
+    ir->len = 0;
+    ir->native = 0;
+    ir_reset(&b);
+
+    for (uint32_t k = 0; k < trace->len; k++) {
+        uint32_t instrs_len = trace->instrs_len[k];
+        uint64_t rip = trace->rip[k];
+        bool native = false;   /* The last instruction of the block was lowered. */
+
+        b.next = k + 1 < trace->len ? trace->rip[k + 1] : 0;
+        end = trace->end[k];
+
+        for (uint32_t i = 0; i < instrs_len;) {
+            x64instr_t *ins = instrs + i;
+            b.rip = rip;
+            b.ins = ins;
+
+            if ((native = ir_lower(&b, ins, rip))) {
+                ir->native++;
+                rip += ins->len;
+                i++;
+                continue;
+            }
+
+            uint32_t count = 1 + ins->fused;
+            if (count > instrs_len - i) count = instrs_len - i;
+            uint16_t v = ir_value(&b, X64IR_STENCIL, 64, 0, X64IR_NONE, X64IR_NONE, instrs_len - i);
+            ir->values[v].count = count;
+            ir_reset(&b);
+
+            for (uint32_t j = 0; j < count; j++)
+                rip += ins[j].len;
+            i += count;
+        }
+        instrs += instrs_len;
+
+        /* Stencils of a branch leave either way. */
+        uint8_t last = ir->len ? ir->values[ir->len - 1].op : X64IR_NOP;
+        if (!native || last == X64IR_EXIT || last == X64IR_JCC)
+            break;
+    }
+
+    uint8_t last = ir->len ? ir->values[ir->len - 1].op : X64IR_NOP;
+    if (last != X64IR_EXIT && last != X64IR_JCC) {
+        b.rip = end;
+        b.ins = NULL;
+        b.next = 0;
+        ir_exit(&b, end);
+    }
+    return !b.full;
+}
+
+
+/* Passes */
+
+static inline bool ir_is_pure(uint8_t op) {
+    switch (op) {
+        case X64IR_CONST ... X64IR_GET:
+        case X64IR_ADD ... X64IR_LOAD:
+        case X64IR_CF ... X64IR_CMOV:
+            return true;
+    }
+    return false;
+}
+
+static inline bool ir_is_commutative(uint8_t op) {
+    return op == X64IR_ADD || op == X64IR_AND || op == X64IR_OR || op == X64IR_XOR;
+}
+
+static inline bool ir_is_const(x64ir_t *ir, uint16_t v) {
+    return v != X64IR_NONE && ir->values[v].op == X64IR_CONST;
+}
+
+/** Make value `i` a constant. */
+static void ir_set_const(x64ir_t *ir, uint16_t i, uint64_t imm) {
+    x64ir_value_t *v = ir->values + i;
+    v->op = X64IR_CONST;
+    v->imm = imm & ir_mask(v->width);
+    v->aux = 0;
+    v->args[0] = v->args[1] = v->args[2] = v->args[3] = X64IR_NONE;
+}
+
+/** Replace value `i` with `by`, which must hold the same `width` bits. */
+static void ir_replace(x64ir_t *ir, uint16_t *repl, uint16_t i, uint16_t by) {
+    x64ir_value_t *v = ir->values + i;
+
+    /* Upper bits of `by` have to be cleared still. */
+    if (ir_bits(ir, by) > v->width) {
+        v->op = X64IR_ZEXT;
+        v->args[0] = by;
+        v->args[1] = v->args[2] = v->args[3] = X64IR_NONE;
+        v->imm = 0;
+        return;
+    }
+    v->op = X64IR_NOP;
+    repl[i] = by;
+}
+
+/** Evaluate the operation of value `i` on constant operands. */
+static uint64_t ir_eval(x64ir_t *ir, x64ir_value_t *v) {
+    uint64_t a = ir->values[v->args[0]].imm;
+    uint64_t b = v->args[1] != X64IR_NONE ? ir->values[v->args[1]].imm : 0;
+    uint8_t w = v->width;
+
+    switch (v->op) {
+        case X64IR_ADD:  return a + b;
+        case X64IR_SUB:  return a - b;
+        case X64IR_AND:  return a & b;
+        case X64IR_OR:   return a | b;
+        case X64IR_XOR:  return a ^ b;
+        case X64IR_SHL:  return a << v->imm;
+        case X64IR_SHR:  return (a & ir_mask(w)) >> v->imm;
+        case X64IR_SAR:  return (uint64_t)((int64_t)(a << (64 - w)) >> (64 - w + v->imm));
+        case X64IR_NOT:  return ~a;
+        case X64IR_NEG:  return -a;
+        case X64IR_ZEXT: return a;
+        case X64IR_SEXT: return (uint64_t)((int64_t)(a << (64 - v->aux)) >> (64 - v->aux));
+    }
+    return 0;
+}
+
+/** Fold constants and nested computations into the address. */
+static void ir_fold_addr(x64ir_t *ir, uint16_t i) {
+    x64ir_value_t *v = ir->values + i;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        uint16_t base = v->args[0], index = v->args[1];
+        x64ir_value_t *b = base != X64IR_NONE ? ir->values + base : NULL;
+        x64ir_value_t *x = index != X64IR_NONE ? ir->values + index : NULL;
+
+        if (b && b->op == X64IR_CONST) {
+            v->imm += b->imm;
+            v->args[0] = X64IR_NONE;
+            changed = true;
+        } else if (b && (b->op == X64IR_ADD || b->op == X64IR_SUB) && b->width == 64 &&
+                   ir_is_const(ir, b->args[1])) {
+            v->imm += b->op == X64IR_ADD ? ir->values[b->args[1]].imm : -ir->values[b->args[1]].imm;
+            v->args[0] = b->args[0];
+            changed = true;
+        } else if (b && b->op == X64IR_ADDR && (!x || b->args[1] == X64IR_NONE)) {
+            v->imm += b->imm;
+            v->args[0] = b->args[0];
+            if (!x) {
+                v->args[1] = b->args[1];
+                v->aux = b->aux;
+            }
+            changed = true;
+        }
+
+        if (x && x->op == X64IR_CONST) {
+            v->imm += x->imm << v->aux;
+            v->args[1] = X64IR_NONE;
+            v->aux = 0;
+            changed = true;
+        } else if (x && x->op == X64IR_ADD && x->width == 64 && ir_is_const(ir, x->args[1])) {
+            v->imm += ir->values[x->args[1]].imm << v->aux;
+            v->args[1] = x->args[0];
+            changed = true;
+        } else if (x && x->op == X64IR_SHL && x->width == 64 && v->aux + x->imm <= 3) {
+            v->aux += x->imm;
+            v->args[1] = x->args[0];
+            changed = true;
+        }
+    }
+
+    /* [index] is [base]. */
+    if (v->args[0] == X64IR_NONE && v->args[1] != X64IR_NONE && v->aux == 0) {
+        v->args[0] = v->args[1];
+        v->args[1] = X64IR_NONE;
+    }
+}
+
+/** Simplify value `i` with constant operands, record it in `repl` if it is replaced. */
+static void ir_simplify(x64ir_t *ir, uint16_t *repl, uint16_t i) {
+    x64ir_value_t *v = ir->values + i;
+    uint16_t a0 = v->args[0], a1 = v->args[1];
+
+    switch (v->op) {
+        case X64IR_ADD:
+        case X64IR_SUB:
+        case X64IR_AND:
+        case X64IR_OR:
+        case X64IR_XOR:
+            /* Constants go second. */
+            if (ir_is_commutative(v->op) && (ir_is_const(ir, a0) || (!ir_is_const(ir, a1) && a0 > a1))) {
+                v->args[0] = a1;
+                v->args[1] = a0;
+                a0 = v->args[0];
+                a1 = v->args[1];
+            }
+            if (ir_is_const(ir, a0) && ir_is_const(ir, a1)) {
+                ir_set_const(ir, i, ir_eval(ir, v));
+            } else if (ir_is_const(ir, a1)) {
+                uint64_t c = ir->values[a1].imm & ir_mask(v->width);
+                if (c == 0 && v->op != X64IR_AND)
+                    ir_replace(ir, repl, i, a0);
+                else if (c == 0)
+                    ir_set_const(ir, i, 0);
+                else if (c == ir_mask(v->width) && v->op == X64IR_AND)
+                    ir_replace(ir, repl, i, a0);
+                else if (c == ir_mask(v->width) && v->op == X64IR_OR)
+                    ir_set_const(ir, i, c);
+            } else if (a0 == a1) {
+                if (v->op == X64IR_SUB || v->op == X64IR_XOR)
+                    ir_set_const(ir, i, 0);
+                else if (v->op == X64IR_AND || v->op == X64IR_OR)
+                    ir_replace(ir, repl, i, a0);
+            }
+            break;
+
+        case X64IR_SHL:
+        case X64IR_SHR:
+        case X64IR_SAR:
+        case X64IR_NOT:
+        case X64IR_NEG:
+        case X64IR_SEXT:
+            if (ir_is_const(ir, a0))
+                ir_set_const(ir, i, ir_eval(ir, v));
+            break;
+
+        case X64IR_ZEXT:
+            if (ir_is_const(ir, a0))
+                ir_set_const(ir, i, ir_eval(ir, v));
+            else if (ir_bits(ir, a0) <= v->width)
+                ir_replace(ir, repl, i, a0);
+            break;
+
+        case X64IR_CMOV:
+            if (a0 == a1)
+                ir_replace(ir, repl, i, a0);
+            break;
+
+        case X64IR_ADDR:
+            ir_fold_addr(ir, i);
+            if (v->args[0] == X64IR_NONE && v->args[1] == X64IR_NONE) {
+                v->width = 64;
+                ir_set_const(ir, i, v->imm);
+            } else if (v->args[1] == X64IR_NONE && v->imm == 0) {
+                ir_replace(ir, repl, i, v->args[0]);
+            }
+            break;
+    }
+}
+
+static inline bool ir_same(x64ir_value_t *a, x64ir_value_t *b) {
+    return a->op == b->op && a->width == b->width && a->aux == b->aux && a->imm == b->imm &&
+           !memcmp(a->args, b->args, sizeof(a->args));
+}
+
+/**
+ * Propagate constants and replaced values to their uses, simplify,
+ * and fold common subexpressions of a barrier interval.
+ */
+static void ir_propagate(x64ir_t *ir) {
+    uint16_t repl[X64IR_MAX_VALUES];
+    uint32_t interval = 0;   /* First value after the last barrier. */
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        repl[i] = i;
+        if (v->op == X64IR_NOP) continue;
+
+        for (uint32_t j = 0; j < 4; j++) {
+            if (v->args[j] != X64IR_NONE)
+                v->args[j] = repl[v->args[j]];
+        }
+
+        if (x64ir_is_barrier(v->op)) {
+            interval = i + 1;
+            continue;
+        }
+
+        ir_simplify(ir, repl, i);
+        if (v->op == X64IR_NOP || v->op == X64IR_GET || v->op == X64IR_LOAD || !ir_is_pure(v->op))
+            continue;
+
+        /* Only constants are rematerialized past barriers. */
+        for (uint32_t j = v->op == X64IR_CONST ? 0 : interval; j < i; j++) {
+            if (ir_same(ir->values + j, v)) {
+                v->op = X64IR_NOP;
+                repl[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+/** Address of a memory access split into parts compared for aliasing. */
+typedef struct {
+    uint16_t base, index;
+    uint8_t  scale;
+    int64_t  displ;
+} ir_mem_t;
+
+static ir_mem_t ir_mem(x64ir_t *ir, uint16_t addr) {
+    x64ir_value_t *a = ir->values + addr;
+
+    if (a->op == X64IR_ADDR)
+        return (ir_mem_t){ a->args[0], a->args[1], a->aux, a->imm };
+    if (a->op == X64IR_CONST)
+        return (ir_mem_t){ X64IR_NONE, X64IR_NONE, 0, a->imm };
+    return (ir_mem_t){ addr, X64IR_NONE, 0, 0 };
+}
+
+static inline bool ir_mem_same_base(ir_mem_t *a, ir_mem_t *b) {
+    return a->base == b->base && a->index == b->index && a->scale == b->scale;
+}
+
+/** @return Whether accesses of `wa` and `wb` bits may overlap. */
+static bool ir_may_alias(ir_mem_t *a, uint8_t wa, ir_mem_t *b, uint8_t wb) {
+    if (!ir_mem_same_base(a, b)) return true;
+    return a->displ < b->displ + wb / 8 && b->displ < a->displ + wa / 8;
+}
+
+/** Memory contents known within a barrier interval. */
+#define IR_MEM_KNOWN 32
+
+typedef struct {
+    ir_mem_t mem;
+    uint8_t  width;
+    uint16_t value;     /* Contents, zero-extended from `width`. */
+    uint16_t store;     /* STORE not read yet, or X64IR_NONE. */
+} ir_known_t;
+
+/**
+ * Forward stored and loaded values to later loads of the same address,
+ * drop stores overwritten before anything may read them.
+ */
+static void ir_forward(x64ir_t *ir) {
+    uint16_t repl[X64IR_MAX_VALUES];
+    ir_known_t known[IR_MEM_KNOWN];
+    uint32_t known_len = 0;
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        repl[i] = i;
+        if (v->op == X64IR_NOP) continue;
+
+        for (uint32_t j = 0; j < 4; j++) {
+            if (v->args[j] != X64IR_NONE)
+                v->args[j] = repl[v->args[j]];
+        }
+
+        if (x64ir_is_barrier(v->op)) {
+            known_len = 0;
+            continue;
+        }
+        /* Code at the side exit may read anything stored. */
+        if (v->op == X64IR_BRANCH) {
+            for (uint32_t k = 0; k < known_len; k++)
+                known[k].store = X64IR_NONE;
+            continue;
+        }
+        if (v->op != X64IR_LOAD && v->op != X64IR_STORE) continue;
+
+        ir_mem_t mem = ir_mem(ir, v->args[0]);
+        uint32_t k = 0;
+
+        if (v->op == X64IR_LOAD) {
+            for (k = 0; k < known_len; k++) {
+                ir_known_t *e = known + k;
+                if (ir_mem_same_base(&e->mem, &mem) && e->mem.displ == mem.displ &&
+                        e->width == v->width && ir_bits(ir, e->value) <= v->width)
+                    break;
+            }
+            if (k < known_len) {
+                v->op = X64IR_NOP;
+                repl[i] = known[k].value;
+                known[k].store = X64IR_NONE;
+                continue;
+            }
+            /* Whatever it may read is needed. */
+            for (k = 0; k < known_len; k++) {
+                if (ir_may_alias(&known[k].mem, known[k].width, &mem, v->width))
+                    known[k].store = X64IR_NONE;
+            }
+            if (known_len < IR_MEM_KNOWN)
+                known[known_len++] = (ir_known_t){ mem, v->width, i, X64IR_NONE };
+            continue;
+        }
+
+        /* STORE */
+        uint32_t kept = 0;
+        for (k = 0; k < known_len; k++) {
+            ir_known_t *e = known + k;
+            if (!ir_may_alias(&e->mem, e->width, &mem, v->width)) {
+                known[kept++] = *e;
+                continue;
+            }
+            /* Overwritten entirely without being read. */
+            if (e->store != X64IR_NONE && ir_mem_same_base(&e->mem, &mem) &&
+                    mem.displ <= e->mem.displ &&
+                    e->mem.displ + e->width / 8 <= mem.displ + v->width / 8)
+                ir->values[e->store].op = X64IR_NOP;
+        }
+        known_len = kept;
+        if (known_len < IR_MEM_KNOWN) {
+            uint16_t value = ir_bits(ir, v->args[1]) <= v->width ? v->args[1] : X64IR_NONE;
+            if (value != X64IR_NONE)
+                known[known_len++] = (ir_known_t){ mem, v->width, value, i };
+        }
+    }
+}
+
+/** Drop PUTs overwritten before the next exit, and PUTs of the value read. */
+static void ir_dead_puts(x64ir_t *ir) {
+    bool written[16] = { 0 };
+    uint16_t put[16];
+
+    /* Putting the value read back only restores it after another PUT,
+       like the last POP of a function putting RSP of its entry. */
+    memset(put, 0xFF, sizeof(put));
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op != X64IR_PUT) continue;
+
+        x64ir_value_t *from = ir->values + v->args[0];
+        if (from->op == X64IR_GET && from->aux == v->aux &&
+                (put[v->aux] == X64IR_NONE || put[v->aux] < v->args[0]))
+            v->op = X64IR_NOP;
+        else
+            put[v->aux] = i;
+    }
+
+    for (uint32_t i = ir->len; i-- > 0;) {
+        x64ir_value_t *v = ir->values + i;
+
+        if (x64ir_is_exit(v->op)) {
+            memset(written, 0, sizeof(written));
+        } else if (v->op == X64IR_PUT) {
+            if (written[v->aux])
+                v->op = X64IR_NOP;
+            written[v->aux] = true;
+        }
+    }
+}
+
+/** Drop FLAGS that are neither tested nor the last ones before an exit. */
+static void ir_dead_flags(x64ir_t *ir) {
+    bool tested[X64IR_MAX_VALUES] = { 0 };
+    bool stored = false;
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op == X64IR_JCC || v->op == X64IR_BRANCH || v->op == X64IR_CF) tested[v->args[0]] = true;
+        if (v->op == X64IR_CMOV) tested[v->args[2]] = true;
+    }
+
+    for (uint32_t i = ir->len; i-- > 0;) {
+        x64ir_value_t *v = ir->values + i;
+
+        if (x64ir_is_exit(v->op)) {
+            stored = false;
+        } else if (v->op == X64IR_FLAGS) {
+            if (stored && !tested[i])
+                v->op = X64IR_NOP;
+            stored = true;
+        }
+    }
+}
+
+/** Drop unused pure values, count uses of the others. */
+static void ir_dead_values(x64ir_t *ir) {
+    for (uint32_t i = 0; i < ir->len; i++)
+        ir->values[i].uses = 0;
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op == X64IR_NOP) continue;
+        for (uint32_t j = 0; j < 4; j++) {
+            if (v->args[j] != X64IR_NONE)
+                ir->values[v->args[j]].uses++;
+        }
+    }
+
+    for (uint32_t i = ir->len; i-- > 0;) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op == X64IR_NOP || v->uses || !ir_is_pure(v->op)) continue;
+
+        v->op = X64IR_NOP;
+        for (uint32_t j = 0; j < 4; j++) {
+            if (v->args[j] != X64IR_NONE)
+                ir->values[v->args[j]].uses--;
+        }
+    }
+}
+
+void x64ir_optimize(x64ir_t *ir) {
+    ir_propagate(ir);
+    ir_forward(ir);
+    ir_propagate(ir);
+    ir_dead_puts(ir);
+    ir_dead_values(ir);
+    ir_dead_flags(ir);
+    ir_dead_values(ir);
+}
+
+
+/* Debugging */
+
+static const char *const ir_names[] = {
+    "nop", "const", "get", "put", "add", "sub", "and", "or", "xor", "shl", "shr", "sar",
+    "not", "neg", "zext", "sext", "addr", "load", "store", "flags", "cf", "cmov",
+    "stencil", "exit", "jcc", "branch",
+};
+
+void x64ir_dump(x64ir_t *ir) {
+    log_debug("IR of trace 0x%lx, %u values", ir->block->rip, ir->len);
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op == X64IR_NOP) continue;
+
+        char args[32] = { 0 };
+        char *p = args;
+        for (uint32_t j = 0; j < 4 && v->args[j] != X64IR_NONE; j++)
+            p += sprintf(p, " v%u", v->args[j]);
+
+        log_debug("  v%-4u %-7s w%-2u aux %-2u%-20s imm 0x%lx uses %u (0x%lx)",
+                  i, ir_names[v->op], v->width, v->aux, args, v->imm, v->uses, v->rip);
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef __X64IR_PRIVATE_H_
+#define __X64IR_PRIVATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "x64block.h"
+#include "x64instr.h"
+
+/*
+ * IR of the optimizing JIT tier, see jit_opt.c.
+ * A trace of blocks is lowered into values in SSA form, each defined once by
+ * an operation on earlier values. Guest GPRs, RSP included, are read by GET
+ * and written by PUT, which takes effect in memory by the next exit.
+ * RIP is a constant of every instruction, it is stored at exits.
+ * Lazy flags are FLAGS values, the last one before an exit is stored
+ * to `emu->lazy`, conditions read them without going through memory.
+ *
+ * Instructions the optimizer does not know become STENCIL barriers:
+ * the guest state is written back and the baseline stencils run them.
+ * Values never live across a barrier, GET reads the registers again after it.
+ *
+ * A trace goes on through the blocks its first one was seen to continue with.
+ * Branches between them become side exits, BRANCH values, which need the guest
+ * state in memory like barriers but keep values live on the path followed.
+ */
+
+/** Values a block may lower to, it is left to the baseline beyond that. */
+#define X64IR_MAX_VALUES 1024
+
+/** Unused operand. */
+#define X64IR_NONE 0xFFFF
+
+/** Blocks a trace goes through, at most. */
+#define X64IR_TRACE_BLOCKS 6
+
+/**
+ * Hot path through blocks, the first one is entered and gets the code.
+ * Instructions are copied, the other blocks may be freed while it is compiled.
+ */
+typedef struct {
+    x64block_t *block;
+    uint32_t    len;                            /* blocks */
+    uint64_t    rip[X64IR_TRACE_BLOCKS];
+    uint64_t    end[X64IR_TRACE_BLOCKS];
+    uint32_t    instrs_len[X64IR_TRACE_BLOCKS];
+    x64instr_t  instrs[];                       /* of each block in turn */
+} x64ir_trace_t;
+
+enum {
+    X64IR_NOP,      /* Removed value. */
+    X64IR_CONST,    /* `imm` */
+    X64IR_GET,      /* Guest GPR `aux` as stored in memory. */
+    X64IR_PUT,      /* Guest GPR `aux` becomes args[0]. */
+    X64IR_ADD,      /* args[0] + args[1] */
+    X64IR_SUB,      /* args[0] - args[1] */
+    X64IR_AND,
+    X64IR_OR,
+    X64IR_XOR,
+    X64IR_SHL,      /* args[0] shifted by `imm`, 1 up to width - 1. */
+    X64IR_SHR,
+    X64IR_SAR,
+    X64IR_NOT,      /* ~args[0] */
+    X64IR_NEG,      /* -args[0] */
+    X64IR_ZEXT,     /* args[0] truncated to `width`. */
+    X64IR_SEXT,     /* args[0] sign-extended from `aux` bits to `width`. */
+    X64IR_ADDR,     /* args[0] + (args[1] << `aux`) + `imm`, either operand may be unused. */
+    X64IR_LOAD,     /* `width` bits at address args[0], zero-extended. */
+    X64IR_STORE,    /* `width` bits of args[1] to address args[0]. */
+    X64IR_FLAGS,    /* Lazy flags of kind `aux` with op1 args[0], op2 args[1], result args[2],
+                       and for INC/DEC the CF they keep, args[3]. */
+    X64IR_CF,       /* CF of FLAGS args[0], 0 or 1. */
+    X64IR_CMOV,     /* Condition `aux` of FLAGS args[2] ? args[1] : args[0] */
+    X64IR_STENCIL,  /* Barrier, `count` instructions from `ins` run by stencils,
+                       `imm` instructions of the block are left from `ins`. */
+    X64IR_EXIT,     /* Barrier, leave to guest address `imm`. */
+    X64IR_JCC,      /* Barrier, leave to `imm` if condition `aux` of FLAGS args[0] holds,
+                       past `ins` otherwise. */
+    X64IR_BRANCH,   /* Side exit, leave to `imm` if condition `aux` of FLAGS args[0] holds. */
+};
+
+typedef struct {
+    uint8_t     op;         /* X64IR_* */
+    uint8_t     width;      /* Bits the operation works on, results are zero-extended from it. */
+    uint8_t     aux;
+    uint8_t     count;
+    uint16_t    args[4];    /* Operand values or X64IR_NONE. */
+    uint16_t    uses;       /* Values with this one as operand, set by `x64ir_optimize`. */
+    int64_t     imm;
+    uint64_t    rip;        /* Guest address of the instruction the value comes from. */
+    x64instr_t *ins;
+} x64ir_value_t;
+
+typedef struct {
+    x64block_t   *block;    /* First block of the trace. */
+    uint32_t      len;
+    uint32_t      native;   /* Instructions lowered to anything but STENCIL. */
+    x64ir_value_t values[X64IR_MAX_VALUES];
+} x64ir_t;
+
+/** @return Whether values of the operation are barriers, guest state is in memory after them. */
+static inline bool x64ir_is_barrier(uint8_t op) {
+    return op == X64IR_STENCIL || op == X64IR_EXIT || op == X64IR_JCC;
+}
+
+/** @return Whether the guest state is in memory at values of the operation. */
+static inline bool x64ir_is_exit(uint8_t op) {
+    return x64ir_is_barrier(op) || op == X64IR_BRANCH;
+}
+
+/**
+ * Lower instructions of the trace. It ends early where a branch between
+ * its blocks is left to the stencils.
+ * @return false if there are too many values.
+ */
+bool x64ir_build(x64ir_t *ir, x64ir_trace_t *trace);
+
+/**
+ * Propagate constants, fold address computations, forward loads and stores,
+ * drop overwritten PUTs and STOREs, unread FLAGS and unused values.
+ */
+void x64ir_optimize(x64ir_t *ir);
+
+/**
+ * @return Whether host flags of the operation recorded by the FLAGS value
+ *         tell condition `cc` as the guest would see it.
+ */
+bool x64ir_cc_native(x64ir_t *ir, uint16_t flags, uint8_t cc);
+
+/** Log the values. */
+void x64ir_dump(x64ir_t *ir);
+
+#endif /* __X64IR_PRIVATE_H_ */
@@ -0,0 +1,963 @@
+#define _GNU_SOURCE /* memfd_create */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+#include "x64block.h"
+#include "x64jit.h"
+
+#include "regs_private.h"
+#include "jit_private.h"
+#include "jit_stencils.h"
+
+SET_DEBUG_CHANNEL("X64JIT")
+
+/* Translated blocks start aligned to this. */
+#define JIT_BLOCK_ALIGN 16
+
+/* movabs rax, imm64; jmp rax, written over the baseline entry once a block is optimized. */
+#define JIT_REDIRECT_LEN 12
+
+static bool jit_start(x64jit_t *jit);
+
+bool x64jit_init(x64jit_t *jit, uint32_t threshold, uint32_t opt_threshold, size_t size) {
+    if (!jit) return false;
+    memset(jit, 0, sizeof(x64jit_t));
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    jit->region_size = (size / X64JIT_REGIONS) & ~(page - 1);
+    if (!jit->region_size) {
+        log_err("JIT code buffer of %lu bytes is too small", size);
+        return false;
+    }
+    size = jit->region_size * X64JIT_REGIONS;
+
+    /* W^X: code is written through one mapping and executed through the other. */
+    int fd = memfd_create("flux64-jit", MFD_CLOEXEC);
+    if (fd == -1) {
+        log_err("Failed to create JIT code buffer: %s", strerror(errno));
+        return false;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        log_err("Failed to size JIT code buffer: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    jit->rw = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    jit->rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (jit->rw == MAP_FAILED || jit->rx == MAP_FAILED) {
+        log_err("Failed to map JIT code buffer: %s", strerror(errno));
+        if (jit->rw != MAP_FAILED) munmap(jit->rw, size);
+        if (jit->rx != MAP_FAILED) munmap(jit->rx, size);
+        jit->rw = jit->rx = NULL;
+        return false;
+    }
+
+    jit->size = size;
+    jit->limit = jit->region_size;
+    jit->threshold = threshold;
+    jit->opt_threshold = opt_threshold;
+    if (opt_threshold && x64jit_stencil_count.code_len < JIT_REDIRECT_LEN) {
+        log_warn("Baseline entry is too short to redirect, blocks are not optimized");
+        jit->opt_threshold = 0;
+    }
+    if (threshold && !jit_start(jit)) {
+        log_warn("Blocks are compiled before they run instead");
+        jit->threshold = 0;
+    }
+    return true;
+}
+
+void x64jit_free(x64jit_t *jit) {
+    if (!jit || !jit->rw) return;
+
+    x64jit_stop(jit);
+    munmap(jit->rw, jit->size);
+    munmap(jit->rx, jit->size);
+    jit->rw = jit->rx = NULL;
+    jit->size = jit->used = 0;
+}
+
+void x64jit_dump_stats(x64jit_t *jit) {
+    log_debug("JIT: %lu blocks in %lu bytes, %lu instructions translated, %lu run by handlers",
+              jit->blocks, jit->bytes, jit->native, jit->interp);
+    if (jit->reclaimed)
+        log_debug("JIT: code buffer parts of %lu bytes reused %lu times", jit->region_size, jit->reclaimed);
+    if (jit->threshold)
+        log_debug("JIT: %lu blocks got hot after %u runs", jit->queued, jit->threshold);
+    if (jit->opt_threshold)
+        log_debug("JIT: %lu blocks optimized after %u runs with %lu more in traces, "
+                  "%lu instructions lowered to host code",
+                  jit->optimized, jit->opt_threshold, jit->traced, jit->opt_native);
+}
+
+
+/* Stencil tables */
+
+enum { JIT_R_R, JIT_R_M, JIT_M_R, JIT_R_I, JIT_M_I };
+
+#define JIT_WIDTHS(name) { \
+        &x64jit_stencil_ ## name ## 8,  &x64jit_stencil_ ## name ## 16, \
+        &x64jit_stencil_ ## name ## 32, &x64jit_stencil_ ## name ## 64, \
+    }
+
+/* Indexed with operand form, then width. */
+#define JIT_FORMS(name) { \
+        JIT_WIDTHS(name ## _r_r), JIT_WIDTHS(name ## _r_m), JIT_WIDTHS(name ## _m_r), \
+        JIT_WIDTHS(name ## _r_i), JIT_WIDTHS(name ## _m_i), \
+    }
+
+/* Shifts come only with immediate source. */
+#define JIT_SHIFT(name) { \
+        [JIT_R_I] = JIT_WIDTHS(name ## _r_i), [JIT_M_I] = JIT_WIDTHS(name ## _m_i), \
+    }
+
+/* Indexed with GPR or memory operand, then width. */
+#define JIT_UNARY(name) { JIT_WIDTHS(name ## _r), JIT_WIDTHS(name ## _m) }
+
+typedef const x64jit_stencil_t *const jit_forms_t[5][4];
+typedef const x64jit_stencil_t *const jit_unary_t[2][4];
+
+/* Indexed with whether flags are live, then ALU opcode bits 3..5
+   or ModR/M reg field of group 1. */
+static jit_forms_t jit_alu[2][8] = {
+    {
+        JIT_FORMS(add_nf), JIT_FORMS(or_nf),  JIT_FORMS(adc_nf), JIT_FORMS(sbb_nf),
+        JIT_FORMS(and_nf), JIT_FORMS(sub_nf), JIT_FORMS(xor_nf), JIT_FORMS(cmp_nf),
+    },
+    {
+        JIT_FORMS(add), JIT_FORMS(or),  JIT_FORMS(adc), JIT_FORMS(sbb),
+        JIT_FORMS(and), JIT_FORMS(sub), JIT_FORMS(xor), JIT_FORMS(cmp),
+    },
+};
+
+static jit_forms_t jit_test[2] = { JIT_FORMS(test_nf), JIT_FORMS(test) };
+static jit_forms_t jit_mov = JIT_FORMS(mov);
+
+/* Indexed with ModR/M reg field of group 2, SAL is SHL. */
+static jit_forms_t jit_shift[8] = {
+    [4] = JIT_SHIFT(shl), [5] = JIT_SHIFT(shr), [6] = JIT_SHIFT(shl), [7] = JIT_SHIFT(sar),
+};
+
+static jit_unary_t jit_inc = JIT_UNARY(inc);
+static jit_unary_t jit_dec = JIT_UNARY(dec);
+static jit_unary_t jit_not = JIT_UNARY(not);
+static jit_unary_t jit_neg = JIT_UNARY(neg);
+
+static const x64jit_stencil_t *const jit_ea_base_index[4] = {
+    &x64jit_stencil_ea_base_index0, &x64jit_stencil_ea_base_index1,
+    &x64jit_stencil_ea_base_index2, &x64jit_stencil_ea_base_index3,
+};
+
+static const x64jit_stencil_t *const jit_ea_index[4] = {
+    &x64jit_stencil_ea_index0, &x64jit_stencil_ea_index1,
+    &x64jit_stencil_ea_index2, &x64jit_stencil_ea_index3,
+};
+
+static const x64jit_stencil_t *const jit_jcc[16] = {
+    &x64jit_stencil_jcc_0, &x64jit_stencil_jcc_1, &x64jit_stencil_jcc_2, &x64jit_stencil_jcc_3,
+    &x64jit_stencil_jcc_4, &x64jit_stencil_jcc_5, &x64jit_stencil_jcc_6, &x64jit_stencil_jcc_7,
+    &x64jit_stencil_jcc_8, &x64jit_stencil_jcc_9, &x64jit_stencil_jcc_A, &x64jit_stencil_jcc_B,
+    &x64jit_stencil_jcc_C, &x64jit_stencil_jcc_D, &x64jit_stencil_jcc_E, &x64jit_stencil_jcc_F,
+};
+
+#undef JIT_SHIFT
+#undef JIT_UNARY
+#undef JIT_FORMS
+#undef JIT_WIDTHS
+
+
+/* Translation */
+
+void x64jit_emit(x64jit_ctx_t *ctx, const x64jit_stencil_t *stencil) {
+    x64jit_t *jit = ctx->jit;
+
+    if (ctx->full || ctx->pos + stencil->code_len > jit->limit) {
+        ctx->full = true;
+        return;
+    }
+
+    uint8_t *code = jit->rw + ctx->pos;
+    memcpy(code, stencil->code, stencil->code_len);
+    ctx->pos += stencil->code_len;
+    ctx->values[X64JIT_HOLE_CONTINUE] = (uintptr_t)(jit->rx + ctx->pos);
+
+    for (uint32_t i = 0; i < stencil->holes_len; i++) {
+        const x64jit_hole_t *hole = stencil->holes + i;
+        uint64_t value = ctx->values[hole->kind] + hole->addend;
+        memcpy(code + hole->offset, &value, sizeof(value));
+        if (hole->kind == X64JIT_HOLE_LINK)
+            ctx->link = code + hole->offset;
+        else if (hole->kind == X64JIT_HOLE_TARGET)
+            ctx->target = code + hole->offset;
+        else if (hole->kind == X64JIT_HOLE_RETURN)
+            ctx->ret_link = code + hole->offset;
+    }
+}
+
+uint8_t *x64jit_emit_code(x64jit_ctx_t *ctx, const uint8_t *code, uint32_t len) {
+    x64jit_t *jit = ctx->jit;
+
+    if (ctx->full || ctx->pos + len > jit->limit) {
+        ctx->full = true;
+        return NULL;
+    }
+
+    uint8_t *dest = jit->rw + ctx->pos;
+    memcpy(dest, code, len);
+    ctx->pos += len;
+    return dest;
+}
+
+void x64jit_link(x64jit_ctx_t *ctx, uint8_t *link, uint64_t target) {
+    if (ctx->full || ctx->links_len == X64_BLOCK_TRACE_EXITS) return;
+
+    ctx->links[ctx->links_len] = link;
+    ctx->links_target[ctx->links_len] = target;
+    ctx->links_len++;
+}
+
+/** Emit the indirect exit, it starts with an empty inline cache. */
+static void jit_exit_indirect(x64jit_ctx_t *ctx, const x64jit_stencil_t *stencil) {
+    ctx->values[X64JIT_HOLE_TARGET] = 0;
+    x64jit_emit(ctx, stencil);
+    ctx->ic_target = ctx->target;
+    ctx->ic_link = ctx->link;
+    ctx->exited = true;
+}
+
+/** Emit the stencil which computes the effective address of the memory operand. */
+static void jit_ea(x64jit_ctx_t *ctx, x64instr_t *ins, uint64_t next_rip) {
+    ctx->values[X64JIT_HOLE_BASE] = ins->ea_base;
+    ctx->values[X64JIT_HOLE_INDEX] = ins->ea_index;
+    ctx->values[X64JIT_HOLE_DISPL] = ins->displ.sq[0];
+
+    switch (ins->amode) {
+        case X64_AMODE_BASE:       x64jit_emit(ctx, &x64jit_stencil_ea_base); break;
+        case X64_AMODE_BASE_INDEX: x64jit_emit(ctx, jit_ea_base_index[ins->sib.scale]); break;
+        case X64_AMODE_INDEX:      x64jit_emit(ctx, jit_ea_index[ins->sib.scale]); break;
+        case X64_AMODE_ABS:        x64jit_emit(ctx, &x64jit_stencil_ea_abs); break;
+        case X64_AMODE_RIP:
+            ctx->values[X64JIT_HOLE_DISPL] += next_rip;
+            x64jit_emit(ctx, &x64jit_stencil_ea_abs);
+            break;
+    }
+}
+
+/** r/m,r */
+static void jit_op_rm_r(x64jit_ctx_t *ctx, jit_forms_t forms, x64instr_t *ins, uint64_t next_rip, uint8_t w) {
+    ctx->values[X64JIT_HOLE_SRC] = ins->modrm.reg | (ins->rex.r << 3);
+    if (ins->amode == X64_AMODE_REG) {
+        ctx->values[X64JIT_HOLE_DEST] = ins->ea_base;
+        x64jit_emit(ctx, forms[JIT_R_R][w]);
+    } else {
+        jit_ea(ctx, ins, next_rip);
+        x64jit_emit(ctx, forms[JIT_M_R][w]);
+    }
+}
+
+/** r,r/m */
+static void jit_op_r_rm(x64jit_ctx_t *ctx, jit_forms_t forms, x64instr_t *ins, uint64_t next_rip, uint8_t w) {
+    ctx->values[X64JIT_HOLE_DEST] = ins->modrm.reg | (ins->rex.r << 3);
+    if (ins->amode == X64_AMODE_REG) {
+        ctx->values[X64JIT_HOLE_SRC] = ins->ea_base;
+        x64jit_emit(ctx, forms[JIT_R_R][w]);
+    } else {
+        jit_ea(ctx, ins, next_rip);
+        x64jit_emit(ctx, forms[JIT_R_M][w]);
+    }
+}
+
+/** r/m,imm */
+static void jit_op_rm_imm(x64jit_ctx_t *ctx, jit_forms_t forms, x64instr_t *ins, uint64_t next_rip,
+                          uint8_t w, int64_t imm) {
+    ctx->values[X64JIT_HOLE_IMM] = imm;
+    if (ins->amode == X64_AMODE_REG) {
+        ctx->values[X64JIT_HOLE_DEST] = ins->ea_base;
+        x64jit_emit(ctx, forms[JIT_R_I][w]);
+    } else {
+        jit_ea(ctx, ins, next_rip);
+        x64jit_emit(ctx, forms[JIT_M_I][w]);
+    }
+}
+
+/** r/m */
+static void jit_op_rm(x64jit_ctx_t *ctx, jit_unary_t unary, x64instr_t *ins, uint64_t next_rip, uint8_t w) {
+    if (ins->amode == X64_AMODE_REG) {
+        ctx->values[X64JIT_HOLE_DEST] = ins->ea_base;
+        x64jit_emit(ctx, unary[0][w]);
+    } else {
+        jit_ea(ctx, ins, next_rip);
+        x64jit_emit(ctx, unary[1][w]);
+    }
+}
+
+void x64jit_exit(x64jit_ctx_t *ctx, uint64_t target) {
+    ctx->values[X64JIT_HOLE_TARGET] = target;
+    x64jit_emit(ctx, &x64jit_stencil_exit);
+    x64jit_link(ctx, ctx->link, target);
+    ctx->exited = true;
+}
+
+/** Jcc, leaves the block either way. */
+static void jit_exit_cond(x64jit_ctx_t *ctx, uint8_t cc, uint64_t target, uint64_t next_rip) {
+    ctx->values[X64JIT_HOLE_TARGET] = target;
+    x64jit_emit(ctx, jit_jcc[cc]);
+    x64jit_link(ctx, ctx->link, target);
+    x64jit_exit(ctx, next_rip);
+}
+
+/** @return Row of the tables for operand width of the instruction. */
+static inline uint8_t jit_width(x64instr_t *ins, bool byte_op) {
+    if (byte_op)         return 0;
+    if (ins->rex.w)      return 3;
+    if (ins->operand_sz) return 1;
+    return 2;
+}
+
+/** Sign-extended imm8 or imm16/32. */
+static inline int64_t jit_imm(x64instr_t *ins, bool imm8) {
+    if (imm8) return ins->imm.sb[0];
+    return ins->operand_sz ? ins->imm.sw[0] : ins->imm.sd[0];
+}
+
+bool x64jit_translate(x64jit_ctx_t *ctx, x64instr_t *ins, uint64_t rip) {
+    uint64_t next_rip = rip + ins->len;
+    uint8_t op = ins->opcode[0];
+    uint8_t reg = ins->modrm.reg;
+    bool live = ins->flags_live != 0;
+    uint8_t w;
+
+    if (ins->address_sz) return false;
+
+    /* Forms with ModR/M operand. */
+    switch (op) {
+        case 0x00 ... 0x3B:
+            if (op == 0x0F || (op & 7) > 3) break;
+            /* fallthrough */
+        case 0x80 ... 0x8B:
+        case 0x8D:
+        case 0xC0 ... 0xC1:
+        case 0xC6 ... 0xC7:
+        case 0xD0 ... 0xD1:
+        case 0xF6 ... 0xF7:
+        case 0xFE ... 0xFF:
+            if (ins->amode >= X64_AMODE_GENERIC) return false;
+            break;
+    }
+
+    switch (op) {
+        case 0x00 ... 0x0E:   /* ALU */
+        case 0x10 ... 0x3F:
+            if ((op & 7) > 5) return false;
+            w = jit_width(ins, !(op & 1));
+            if ((op & 7) >= 4) {
+                ctx->values[X64JIT_HOLE_DEST] = _rax;
+                ctx->values[X64JIT_HOLE_IMM] = jit_imm(ins, !(op & 1));
+                x64jit_emit(ctx, jit_alu[live][op >> 3][JIT_R_I][w]);
+            } else if (op & 2) {
+                jit_op_r_rm(ctx, jit_alu[live][op >> 3], ins, next_rip, w);
+            } else {
+                jit_op_rm_r(ctx, jit_alu[live][op >> 3], ins, next_rip, w);
+            }
+            return true;
+
+        case 0x50 ... 0x57:   /* PUSH+r64 */
+            if (ins->operand_sz) return false;
+            ctx->values[X64JIT_HOLE_SRC] = (op & 7) | (ins->rex.b << 3);
+            x64jit_emit(ctx, &x64jit_stencil_push_r);
+            return true;
+
+        case 0x58 ... 0x5F:   /* POP+r64 */
+            if (ins->operand_sz) return false;
+            ctx->values[X64JIT_HOLE_DEST] = (op & 7) | (ins->rex.b << 3);
+            x64jit_emit(ctx, &x64jit_stencil_pop_r);
+            return true;
+
+        case 0x68:            /* PUSH imm32 */
+        case 0x6A:            /* PUSH imm8 */
+            if (ins->operand_sz) return false;
+            ctx->values[X64JIT_HOLE_IMM] = jit_imm(ins, op == 0x6A);
+            x64jit_emit(ctx, &x64jit_stencil_push_i);
+            return true;
+
+        case 0x70 ... 0x7F:   /* Jcc rel8 */
+            jit_exit_cond(ctx, op & 0xF, next_rip + ins->imm.sb[0], next_rip);
+            return true;
+
+        case 0x80:            /* ALU r/m,imm */
+        case 0x81:
+        case 0x83:
+            w = jit_width(ins, op == 0x80);
+            jit_op_rm_imm(ctx, jit_alu[live][reg], ins, next_rip, w, jit_imm(ins, op != 0x81));
+            return true;
+
+        case 0x84 ... 0x85:   /* TEST r/m,r */
+            jit_op_rm_r(ctx, jit_test[live], ins, next_rip, jit_width(ins, op == 0x84));
+            return true;
+
+        case 0x88 ... 0x89:   /* MOV r/m,r */
+            jit_op_rm_r(ctx, jit_mov, ins, next_rip, jit_width(ins, op == 0x88));
+            return true;
+
+        case 0x8A ... 0x8B:   /* MOV r,r/m */
+            jit_op_r_rm(ctx, jit_mov, ins, next_rip, jit_width(ins, op == 0x8A));
+            return true;
+
+        case 0x8D:            /* LEA r32/64,m */
+            if (ins->amode == X64_AMODE_REG || ins->operand_sz) return false;
+            jit_ea(ctx, ins, next_rip);
+            ctx->values[X64JIT_HOLE_DEST] = reg | (ins->rex.r << 3);
+            x64jit_emit(ctx, ins->rex.w ? &x64jit_stencil_lea64 : &x64jit_stencil_lea32);
+            return true;
+
+        case 0x90:            /* NOP */
+            return !ins->rex.b;
+
+        case 0xA8 ... 0xA9:   /* TEST rAX,imm */
+            w = jit_width(ins, op == 0xA8);
+            ctx->values[X64JIT_HOLE_DEST] = _rax;
+            ctx->values[X64JIT_HOLE_IMM] = jit_imm(ins, op == 0xA8);
+            x64jit_emit(ctx, jit_test[live][JIT_R_I][w]);
+            return true;
+
+        case 0xB8 ... 0xBF:   /* MOV+r16/32/64 imm16/32/64 */
+            ctx->values[X64JIT_HOLE_DEST] = (op & 7) | (ins->rex.b << 3);
+            ctx->values[X64JIT_HOLE_IMM] = ins->imm.uq[0];
+            x64jit_emit(ctx, jit_mov[JIT_R_I][jit_width(ins, false)]);
+            return true;
+
+        case 0xC0 ... 0xC1:   /* shift r/m,imm8 */
+        case 0xD0 ... 0xD1:   /* shift r/m,1 */
+            if (!jit_shift[reg][JIT_R_I][0]) return false;
+            w = jit_width(ins, !(op & 1));
+            jit_op_rm_imm(ctx, jit_shift[reg], ins, next_rip, w, op >= 0xD0 ? 1 : ins->imm.ub[0]);
+            return true;
+
+        case 0xC2:            /* RET imm16 */
+        case 0xC3:            /* RET */
+            if (ins->operand_sz) return false;
+            ctx->values[X64JIT_HOLE_IMM] = op == 0xC2 ? ins->imm.uw[0] : 0;
+            jit_exit_indirect(ctx, &x64jit_stencil_ret);
+            return true;
+
+        case 0xC6 ... 0xC7:   /* MOV r/m,imm */
+            if (reg != 0) return false;
+            w = jit_width(ins, op == 0xC6);
+            jit_op_rm_imm(ctx, jit_mov, ins, next_rip, w, jit_imm(ins, op == 0xC6));
+            return true;
+
+        case 0xE8:            /* CALL rel32 */
+            ctx->values[X64JIT_HOLE_RIP] = next_rip;
+            ctx->values[X64JIT_HOLE_TARGET] = next_rip + ins->imm.sd[0];
+            x64jit_emit(ctx, &x64jit_stencil_call);
+            x64jit_link(ctx, ctx->link, ctx->values[X64JIT_HOLE_TARGET]);
+            x64jit_link(ctx, ctx->ret_link, next_rip);
+            ctx->exited = true;
+            return true;
+
+        case 0xE9:            /* JMP rel32 */
+            x64jit_exit(ctx, next_rip + ins->imm.sd[0]);
+            return true;
+
+        case 0xEB:            /* JMP rel8 */
+            x64jit_exit(ctx, next_rip + ins->imm.sb[0]);
+            return true;
+
+        case 0xF6 ... 0xF7:
+            w = jit_width(ins, op == 0xF6);
+            switch (reg) {
+                case 0:
+                case 1:       /* TEST r/m,imm */
+                    jit_op_rm_imm(ctx, jit_test[live], ins, next_rip, w, jit_imm(ins, op == 0xF6));
+                    return true;
+                case 2: jit_op_rm(ctx, jit_not, ins, next_rip, w); return true;
+                case 3: jit_op_rm(ctx, jit_neg, ins, next_rip, w); return true;
+            }
+            return false;
+
+        case 0xFE ... 0xFF:
+            w = jit_width(ins, op == 0xFE);
+            switch (reg) {
+                case 0: jit_op_rm(ctx, jit_inc, ins, next_rip, w); return true;
+                case 1: jit_op_rm(ctx, jit_dec, ins, next_rip, w); return true;
+            }
+            if (op == 0xFE || (reg != 2 && reg != 4)) return false;
+
+            /* CALL/JMP r/m64 */
+            ctx->values[X64JIT_HOLE_RIP] = next_rip;
+            if (ins->amode == X64_AMODE_REG) {
+                ctx->values[X64JIT_HOLE_SRC] = ins->ea_base;
+                jit_exit_indirect(ctx, reg == 2 ? &x64jit_stencil_call_r : &x64jit_stencil_jmp_r);
+            } else {
+                jit_ea(ctx, ins, next_rip);
+                jit_exit_indirect(ctx, reg == 2 ? &x64jit_stencil_call_m : &x64jit_stencil_jmp_m);
+            }
+            if (reg == 2)
+                x64jit_link(ctx, ctx->ret_link, next_rip);
+            return true;
+
+        case 0x0F:
+            if (ins->opcode[1] >= 0x80 && ins->opcode[1] <= 0x8F) {   /* Jcc rel32 */
+                jit_exit_cond(ctx, ins->opcode[1] & 0xF, next_rip + ins->imm.sd[0], next_rip);
+                return true;
+            }
+            return false;
+    }
+    return false;
+}
+
+uint32_t x64jit_interp(x64jit_ctx_t *ctx, x64instr_t *ins, uint32_t left, uint64_t rip,
+                       x64instr_t *copy) {
+    uint32_t len = 1 + ins->fused;
+    if (len > left) len = left;
+
+    /* Handlers take the copy for a block of its own, starting at `rip`. */
+    memcpy(copy, ins, len * sizeof(x64instr_t));
+    memset(copy + len, 0, sizeof(x64instr_t));
+    copy[0].end = ins[0].len;
+    for (uint32_t i = 1; i < len; i++)
+        copy[i].end = copy[i - 1].end + ins[i].len;
+    copy[len].end = copy[len - 1].end;
+    copy[len].handler = x64block_is_end(ins + len - 1) ? x64execute_block_end : x64execute_block_next;
+
+    ctx->values[X64JIT_HOLE_RIP] = rip;
+    ctx->values[X64JIT_HOLE_HANDLER] = (uintptr_t)ins->handler;
+    ctx->values[X64JIT_HOLE_INSTR] = (uintptr_t)copy;
+    x64jit_emit(ctx, &x64jit_stencil_interp);
+
+    /* r_rip is past the handled instructions now, continue with `leave`. */
+    if (len == left)
+        ctx->exited = true;
+    return len;
+}
+
+/** Block being compiled, made by the compiler thread and installed by the dispatcher. */
+struct x64jit_job {
+    x64block_t   *block;
+    x64jit_ctx_t     ctx;
+    size_t        start;    /* offset of the code in the buffer */
+    uint32_t      region;   /* part of the buffer the code is in */
+    uint64_t      leave;    /* host address of the trailing `leave` stencil */
+    x64instr_t   *copies;   /* becomes `jit_instrs` of the block */
+    uint32_t      native;
+    bool          opt;      /* compiled by the optimizer */
+    x64ir_trace_t *trace;   /* the optimizer compiles, starting with the block */
+    x64jit_job_t *next;
+};
+
+/**
+ * @return Exit of the block to `target` without translated jump yet,
+ *         a new one for exits of a trace, or `NULL`.
+ */
+static x64block_exit_t *jit_block_exit(x64block_t *block, uint64_t target) {
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++) {
+        if (block->exits[i].target == target && !block->exits[i].patch)
+            return block->exits + i;
+    }
+    for (uint32_t i = X64_BLOCK_EXITS; i < X64_BLOCK_TRACE_EXITS; i++) {
+        if (!block->exits[i].target) {
+            block->exits[i].target = target;
+            return block->exits + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Emit the code of the block after the code used so far.
+ * Only reads instructions of the block, so it runs on the compiler thread.
+ * @return false if the code buffer is full, then `full` is set unless
+ *         the block does not fit in a whole part of it.
+ */
+static bool jit_emit_block(x64jit_t *jit, x64jit_job_t *job) {
+    x64block_t *block = job->block;
+    x64jit_ctx_t *ctx = &job->ctx;
+
+    if (jit->full) return false;
+
+    memset(ctx, 0, sizeof(x64jit_ctx_t));
+    ctx->jit = jit;
+    ctx->pos = job->start = jit->used;
+    job->region = jit->region;
+    ctx->values[X64JIT_HOLE_BLOCK] = (uintptr_t)block;
+
+    uint32_t instrs_len = block->instrs_len;
+    if (job->trace) {
+        instrs_len = 0;
+        for (uint32_t i = 0; i < job->trace->len; i++)
+            instrs_len += job->trace->instrs_len[i];
+    }
+
+    /* Each instruction run by handler takes at most itself and a terminator. */
+    x64instr_t *copies = malloc(2 * instrs_len * sizeof(x64instr_t));
+    if (!copies) {
+        log_err("Failed to allocate instructions of block 0x%lx", block->rip);
+        return false;
+    }
+
+    uint32_t copies_len = 0;
+    uint32_t native = 0;
+    uint64_t rip = block->rip;
+
+    if (job->opt) {
+        if (!x64jit_optimize(ctx, job->trace, copies, &copies_len, &native) && !ctx->full) {
+            free(copies);
+            return false;
+        }
+        goto leave;
+    }
+
+    /* Runs are counted at the entry, the optimized code is redirected to over it. */
+    if (jit->opt_threshold) {
+        ctx->values[X64JIT_HOLE_IMM] = jit->opt_threshold;
+        x64jit_emit(ctx, &x64jit_stencil_count);
+    }
+
+    for (uint32_t i = 0; i < block->instrs_len;) {
+        x64instr_t *ins = block->instrs + i;
+
+        if (x64jit_translate(ctx, ins, rip)) {
+            rip += ins->len;
+            native++;
+            i++;
+            continue;
+        }
+
+        uint32_t len = x64jit_interp(ctx, ins, block->instrs_len - i, rip, copies + copies_len);
+        for (uint32_t j = 0; j < len; j++)
+            rip += ins[j].len;
+        copies_len += len + 1;
+        i += len;
+    }
+
+    if (!ctx->exited)
+        x64jit_exit(ctx, block->end);
+
+leave:
+    /* Unlinked exits and the interpreted end of the block return through it. */
+    job->leave = (uintptr_t)(jit->rx + ctx->pos);
+    x64jit_emit(ctx, &x64jit_stencil_leave);
+
+    if (ctx->full) {
+        free(copies);
+        if (job->start == job->region * jit->region_size) {
+            log_warn("Block 0x%lx does not fit in the JIT code buffer", block->rip);
+            return false;
+        }
+        __atomic_store_n(&jit->full, true, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    if (!copies_len) {
+        free(copies);
+        copies = NULL;
+    }
+    job->copies = copies;
+    job->native = native;
+
+    jit->used = (ctx->pos + JIT_BLOCK_ALIGN - 1) & ~(size_t)(JIT_BLOCK_ALIGN - 1);
+    if (jit->used > jit->limit) jit->used = jit->limit;
+    return true;
+}
+
+/**
+ * Make the baseline code of the block jump to its optimized code, for exits
+ * which are not relinked: those of inline caches and of the shadow stack.
+ */
+static void jit_redirect(x64jit_t *jit, x64block_t *block, uint64_t code) {
+    uint8_t *entry = jit->rw + ((uint8_t *)block->code - jit->rx);
+
+    entry[0] = 0x48;   /* movabs rax, code */
+    entry[1] = 0xB8;
+    memcpy(entry + 2, &code, sizeof(code));
+    entry[10] = 0xFF;  /* jmp rax */
+    entry[11] = 0xE0;
+
+    /* Exits are assigned their holes in the new code. */
+    for (uint32_t i = 0; i < X64_BLOCK_TRACE_EXITS; i++)
+        block->exits[i].patch = NULL;
+    block->ic.patch = block->ic.patch_target = NULL;
+    free(block->jit_instrs);
+}
+
+/** Set `code` of the block emitted by `jit_emit_block` and link its exits. */
+static void jit_install_block(x64jit_t *jit, x64jit_job_t *job) {
+    x64block_t *block = job->block;
+    x64jit_ctx_t *ctx = &job->ctx;
+    uint64_t leave = job->leave;
+
+    if (block->code)
+        jit_redirect(jit, block, (uintptr_t)(jit->rx + job->start));
+    block->code = (x64jitcode_t)(jit->rx + job->start);
+    block->jit_instrs = job->copies;
+    block->tier = job->opt ? X64_TIER_OPT : X64_TIER_BASELINE;
+    block->regions |= 1U << job->region;
+    block->hits = 0;
+    jit->bytes += ctx->pos - job->start;
+
+    for (uint32_t i = 0; i < ctx->links_len; i++) {
+        x64block_exit_t *exit = jit_block_exit(block, ctx->links_target[i]);
+        if (exit) {
+            exit->patch = ctx->links[i];
+            exit->unlinked = leave;
+        } else {
+            memcpy(ctx->links[i], &leave, sizeof(leave));
+        }
+    }
+    if (ctx->ic_link) {
+        if (block->indirect) {
+            block->ic.patch_target = ctx->ic_target;
+            block->ic.patch = ctx->ic_link;
+            block->ic.unlinked = leave;
+        } else {
+            memcpy(ctx->ic_link, &leave, sizeof(leave));
+        }
+    }
+    x64block_relink(block);
+
+    if (job->opt) {
+        jit->optimized++;
+        jit->opt_native += job->native;
+        jit->traced += job->trace->len - 1;
+        return;
+    }
+    jit->blocks++;
+    jit->native += job->native;
+    jit->interp += block->instrs_len - job->native;
+}
+
+bool x64jit_compile(x64jit_t *jit, x64block_t *block) {
+    if (!jit || !block) return false;
+
+    x64jit_job_t job = { .block = block };
+    if (!jit_emit_block(jit, &job))
+        return false;
+    jit_install_block(jit, &job);
+    return true;
+}
+
+
+/* Compiler thread */
+
+static void *jit_worker(void *arg) {
+    x64jit_t *jit = arg;
+
+    pthread_mutex_lock(&jit->lock);
+    while (1) {
+        while ((!jit->queue || jit->full) && !jit->stop)
+            pthread_cond_wait(&jit->wake, &jit->lock);
+        if (jit->stop) break;
+
+        x64jit_job_t *job = jit->queue;
+        jit->queue = job->next;
+        if (!jit->queue) jit->queue_tail = NULL;
+        jit->compiling = job->block;
+        pthread_mutex_unlock(&jit->lock);
+
+        bool emitted = jit_emit_block(jit, job);
+
+        pthread_mutex_lock(&jit->lock);
+        jit->compiling = NULL;
+        if (emitted) {
+            job->next = jit->done;
+            __atomic_store_n(&jit->done, job, __ATOMIC_RELEASE);
+        } else if (jit->full) {
+            /* Tried again once the dispatcher reclaimed code. */
+            job->next = jit->queue;
+            jit->queue = job;
+            if (!jit->queue_tail) jit->queue_tail = job;
+        } else {
+            /* The block stays queued, so it is not handed over again. */
+            free(job->trace);
+            free(job);
+        }
+        pthread_cond_broadcast(&jit->idle);
+    }
+    pthread_mutex_unlock(&jit->lock);
+    return NULL;
+}
+
+/** Free jobs of the list, with instructions of those already emitted. */
+static void jit_free_jobs(x64jit_job_t *job) {
+    while (job) {
+        x64jit_job_t *next = job->next;
+        free(job->trace);
+        free(job->copies);
+        free(job);
+        job = next;
+    }
+}
+
+/** Drop jobs of the block from the list. */
+static void jit_drop_jobs(x64jit_job_t **list, x64jit_job_t **tail, x64block_t *block) {
+    x64jit_job_t *last = NULL;
+
+    while (*list) {
+        x64jit_job_t *job = *list;
+        if (job->block != block) {
+            last = job;
+            list = &job->next;
+            continue;
+        }
+        *list = job->next;
+        free(job->trace);
+        free(job->copies);
+        free(job);
+    }
+    if (tail) *tail = last;
+}
+
+static bool jit_start(x64jit_t *jit) {
+    pthread_mutex_init(&jit->lock, NULL);
+    pthread_cond_init(&jit->wake, NULL);
+    pthread_cond_init(&jit->idle, NULL);
+
+    /* Guest signals, faults on code pages included, belong to the emulating thread. */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int err = pthread_create(&jit->thread, NULL, jit_worker, jit);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (err) {
+        log_err("Failed to start JIT compiler thread: %s", strerror(err));
+        pthread_cond_destroy(&jit->idle);
+        pthread_cond_destroy(&jit->wake);
+        pthread_mutex_destroy(&jit->lock);
+        return false;
+    }
+    jit->threaded = true;
+    return true;
+}
+
+void x64jit_stop(x64jit_t *jit) {
+    if (!jit || !jit->threaded) return;
+
+    pthread_mutex_lock(&jit->lock);
+    jit->stop = true;
+    pthread_cond_broadcast(&jit->wake);
+    pthread_mutex_unlock(&jit->lock);
+    pthread_join(jit->thread, NULL);
+
+    jit_free_jobs(jit->queue);
+    jit_free_jobs(jit->done);
+    jit->queue = jit->queue_tail = jit->done = NULL;
+
+    pthread_cond_destroy(&jit->idle);
+    pthread_cond_destroy(&jit->wake);
+    pthread_mutex_destroy(&jit->lock);
+    jit->threaded = false;
+}
+
+void x64jit_queue(x64jit_t *jit, x64block_t *block) {
+    bool opt = block->tier == X64_TIER_BASELINE;
+    x64ir_trace_t *trace = NULL;
+
+    /* The compiler thread must not read the other blocks of the trace. */
+    if (opt && !(trace = x64jit_trace(jit, block))) {
+        block->tier = X64_TIER_OPT;
+        return;
+    }
+    block->tier = opt ? X64_TIER_OPT_QUEUED : X64_TIER_QUEUED;
+
+    if (!jit->threaded) {
+        x64jit_job_t job = { .block = block, .opt = opt, .trace = trace };
+        if (jit_emit_block(jit, &job)) {
+            jit_install_block(jit, &job);
+        } else if (jit->full && opt) {
+            /* Baseline code counts runs again, to be optimized after `x64jit_reclaim`. */
+            block->tier = X64_TIER_BASELINE;
+            block->hits = 0;
+        }
+        free(trace);
+        return;
+    }
+
+    x64jit_job_t *job = calloc(1, sizeof(x64jit_job_t));
+    if (!job) {
+        log_err("Failed to queue block 0x%lx", block->rip);
+        free(trace);
+        return;
+    }
+    job->block = block;
+    job->opt = opt;
+    job->trace = trace;
+
+    pthread_mutex_lock(&jit->lock);
+    if (jit->queue_tail)
+        jit->queue_tail->next = job;
+    else
+        jit->queue = job;
+    jit->queue_tail = job;
+    pthread_cond_signal(&jit->wake);
+    pthread_mutex_unlock(&jit->lock);
+
+    if (!opt) jit->queued++;
+}
+
+void x64jit_install(x64jit_t *jit) {
+    pthread_mutex_lock(&jit->lock);
+    x64jit_job_t *job = jit->done;
+    jit->done = NULL;
+    pthread_mutex_unlock(&jit->lock);
+
+    while (job) {
+        x64jit_job_t *next = job->next;
+        jit_install_block(jit, job);
+        free(job->trace);
+        free(job);
+        job = next;
+    }
+}
+
+uint32_t x64jit_reclaim(x64jit_t *jit) {
+    /* The thread puts the job which did not fit back to the queue first. */
+    if (jit->threaded) {
+        pthread_mutex_lock(&jit->lock);
+        while (jit->compiling)
+            pthread_cond_wait(&jit->idle, &jit->lock);
+    }
+
+    jit->region = (jit->region + 1) % X64JIT_REGIONS;
+    jit->used = jit->region * jit->region_size;
+    jit->limit = jit->used + jit->region_size;
+    jit->reclaimed++;
+    __atomic_store_n(&jit->full, false, __ATOMIC_RELEASE);
+
+    if (jit->threaded) {
+        pthread_cond_signal(&jit->wake);
+        pthread_mutex_unlock(&jit->lock);
+    }
+    return jit->region;
+}
+
+void x64jit_forget(x64jit_t *jit, x64block_t *retired) {
+    if (!jit->threaded) return;
+
+    pthread_mutex_lock(&jit->lock);
+    for (x64block_t *block = retired; block; block = block->next) {
+        if (block->tier != X64_TIER_QUEUED && block->tier != X64_TIER_OPT_QUEUED) continue;
+
+        while (jit->compiling == block)
+            pthread_cond_wait(&jit->idle, &jit->lock);
+        jit_drop_jobs(&jit->queue, &jit->queue_tail, block);
+        jit_drop_jobs(&jit->done, NULL, block);
+    }
+    pthread_mutex_unlock(&jit->lock);
+}
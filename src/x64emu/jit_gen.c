@@ -0,0 +1,230 @@
+/*
+ * Build time generator of jit_stencils.h.
+ * Reads jit_stencils.c compiled into an ELF64 relocatable object with
+ * one section per function, and emits code and holes of every
+ * `stencil_<name>` function as `x64jit_stencil_<name>`.
+ *
+ * Usage: jit_gen <jit_stencils.o> <jit_stencils.h>
+ */
+
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STENCIL_PREFIX ".text.stencil_"
+#define HOLE_PREFIX    "_JIT_"
+
+typedef struct {
+    uint8_t    *data;
+    size_t      size;
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdrs;
+    const char *shstrtab;
+} object_t;
+
+typedef struct {
+    uint32_t    offset;
+    char        kind[32];
+    int64_t     addend;
+} hole_t;
+
+static bool read_object(object_t *obj, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "jit_gen: failed to open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    obj->size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    obj->data = malloc(obj->size);
+    if (!obj->data || fread(obj->data, 1, obj->size, file) != obj->size) {
+        fprintf(stderr, "jit_gen: failed to read %s\n", path);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+
+    obj->ehdr = (Elf64_Ehdr *)obj->data;
+    if (obj->size < sizeof(Elf64_Ehdr) || memcmp(obj->ehdr->e_ident, ELFMAG, SELFMAG) ||
+            obj->ehdr->e_ident[EI_CLASS] != ELFCLASS64 || obj->ehdr->e_type != ET_REL ||
+            obj->ehdr->e_machine != EM_X86_64) {
+        fprintf(stderr, "jit_gen: %s is not an x86-64 ELF relocatable object\n", path);
+        return false;
+    }
+    obj->shdrs = (Elf64_Shdr *)(obj->data + obj->ehdr->e_shoff);
+    obj->shstrtab = (const char *)obj->data + obj->shdrs[obj->ehdr->e_shstrndx].sh_offset;
+    return true;
+}
+
+static inline const char *section_name(object_t *obj, Elf64_Shdr *shdr) {
+    return obj->shstrtab + shdr->sh_name;
+}
+
+/** @return Relocation section applying to section `target`, or `NULL`. */
+static Elf64_Shdr *find_rela(object_t *obj, uint32_t target) {
+    for (uint32_t i = 0; i < obj->ehdr->e_shnum; i++) {
+        if (obj->shdrs[i].sh_type == SHT_RELA && obj->shdrs[i].sh_info == target)
+            return obj->shdrs + i;
+    }
+    return NULL;
+}
+
+static int hole_cmp(const void *a, const void *b) {
+    const hole_t *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * Collect holes of the stencil in section `index`.
+ * Only absolute 64 bit references to `_JIT_*` symbols are allowed,
+ * anything else would point outside of the copied code.
+ */
+static bool collect_holes(object_t *obj, uint32_t index, hole_t **holes, uint32_t *holes_len) {
+    Elf64_Shdr *rela = find_rela(obj, index);
+    *holes = NULL;
+    *holes_len = 0;
+    if (!rela) return true;
+
+    Elf64_Shdr *symtab = obj->shdrs + rela->sh_link;
+    Elf64_Sym *syms = (Elf64_Sym *)(obj->data + symtab->sh_offset);
+    const char *strtab = (const char *)obj->data + obj->shdrs[symtab->sh_link].sh_offset;
+    Elf64_Rela *relas = (Elf64_Rela *)(obj->data + rela->sh_offset);
+    uint32_t relas_len = rela->sh_size / sizeof(Elf64_Rela);
+
+    *holes = calloc(relas_len, sizeof(hole_t));
+    if (!*holes) return false;
+
+    for (uint32_t i = 0; i < relas_len; i++) {
+        Elf64_Sym *sym = syms + ELF64_R_SYM(relas[i].r_info);
+        const char *name = strtab + sym->st_name;
+
+        if (ELF64_R_TYPE(relas[i].r_info) != R_X86_64_64 || sym->st_shndx != SHN_UNDEF ||
+                strncmp(name, HOLE_PREFIX, strlen(HOLE_PREFIX)) ||
+                strlen(name) - strlen(HOLE_PREFIX) >= sizeof((*holes)->kind)) {
+            fprintf(stderr, "jit_gen: %s: unsupported relocation %lu against '%s'\n",
+                    section_name(obj, obj->shdrs + index),
+                    (unsigned long)ELF64_R_TYPE(relas[i].r_info),
+                    *name ? name : section_name(obj, obj->shdrs + sym->st_shndx));
+            return false;
+        }
+
+        hole_t *hole = *holes + (*holes_len)++;
+        hole->offset = relas[i].r_offset;
+        hole->addend = relas[i].r_addend;
+        strcpy(hole->kind, name + strlen(HOLE_PREFIX));
+    }
+    qsort(*holes, *holes_len, sizeof(hole_t), hole_cmp);
+    return true;
+}
+
+/**
+ * Drop the jump to the next stencil ending the code, stencils are placed
+ * one after another. It is `movabs $_JIT_CONTINUE, %reg; jmp *%reg`.
+ */
+static void trim_continue(const uint8_t *code, uint32_t *code_len, hole_t *holes, uint32_t *holes_len) {
+    if (!*holes_len) return;
+
+    hole_t *last = holes + *holes_len - 1;
+    if (strcmp(last->kind, "CONTINUE") || last->addend || last->offset < 2) return;
+
+    const uint8_t *movabs = code + last->offset - 2;
+    const uint8_t *jmp = code + last->offset + 8;
+    uint32_t jmp_len;
+
+    if ((movabs[1] & 0xF8) != 0xB8) return;
+    uint8_t reg = movabs[1] & 7;
+
+    if (movabs[0] == 0x48)
+        jmp_len = (jmp[0] == 0xFF && jmp[1] == (0xE0 | reg)) ? 2 : 0;
+    else if (movabs[0] == 0x49)
+        jmp_len = (jmp[0] == 0x41 && jmp[1] == 0xFF && jmp[2] == (0xE0 | reg)) ? 3 : 0;
+    else
+        return;
+
+    if (!jmp_len || last->offset + 8 + jmp_len != *code_len) return;
+
+    *code_len = last->offset - 2;
+    (*holes_len)--;
+}
+
+static void emit_stencil(FILE *out, const char *name, const uint8_t *code, uint32_t code_len,
+                         hole_t *holes, uint32_t holes_len) {
+    fprintf(out, "static const x64jit_stencil_t x64jit_stencil_%s = {\n", name);
+
+    fprintf(out, "    (const uint8_t[]){");
+    for (uint32_t i = 0; i < code_len; i++)
+        fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n        ", code[i]);
+    fprintf(out, "\n    },\n");
+
+    if (holes_len) {
+        fprintf(out, "    (const x64jit_hole_t[]){\n");
+        for (uint32_t i = 0; i < holes_len; i++)
+            fprintf(out, "        { 0x%x, X64JIT_HOLE_%s, %ld },\n",
+                    holes[i].offset, holes[i].kind, (long)holes[i].addend);
+        fprintf(out, "    },\n");
+    } else {
+        fprintf(out, "    NULL,\n");
+    }
+
+    fprintf(out, "    %u, %u\n};\n\n", code_len, holes_len);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <jit_stencils.o> <jit_stencils.h>\n", argv[0]);
+        return 1;
+    }
+
+    object_t obj = { 0 };
+    if (!read_object(&obj, argv[1])) return 1;
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "jit_gen: failed to create %s\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by jit_gen from jit_stencils.c, do not edit. */\n\n");
+    fprintf(out, "#ifndef __X64JIT_STENCILS_H_\n#define __X64JIT_STENCILS_H_\n\n");
+    fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n\n#include \"jit_private.h\"\n\n");
+
+    uint32_t stencils_len = 0;
+    for (uint32_t i = 0; i < obj.ehdr->e_shnum; i++) {
+        Elf64_Shdr *shdr = obj.shdrs + i;
+        const char *name = section_name(&obj, shdr);
+
+        if (shdr->sh_type != SHT_PROGBITS || !(shdr->sh_flags & SHF_EXECINSTR) || !shdr->sh_size)
+            continue;
+        if (strncmp(name, STENCIL_PREFIX, strlen(STENCIL_PREFIX))) {
+            fprintf(stderr, "jit_gen: unexpected code section %s\n", name);
+            return 1;
+        }
+
+        hole_t *holes;
+        uint32_t holes_len;
+        if (!collect_holes(&obj, i, &holes, &holes_len)) return 1;
+
+        const uint8_t *code = obj.data + shdr->sh_offset;
+        uint32_t code_len = shdr->sh_size;
+        trim_continue(code, &code_len, holes, &holes_len);
+
+        emit_stencil(out, name + strlen(STENCIL_PREFIX), code, code_len, holes, holes_len);
+        free(holes);
+        stencils_len++;
+    }
+
+    fprintf(out, "#endif /* __X64JIT_STENCILS_H_ */\n");
+    fclose(out);
+    free(obj.data);
+
+    if (!stencils_len) {
+        fprintf(stderr, "jit_gen: no stencils found in %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,867 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64block.h"
+#include "x64flags.h"
+
+#include "ir_private.h"
+#include "jit_private.h"
+
+SET_DEBUG_CHANNEL("X64JIT")
+
+/*
+ * Optimizing tier: a hot block and the blocks it was seen to go on with form
+ * a trace, which is lowered to the IR, optimized, and compiled to host code
+ * with values in host registers. Guest GPRs are loaded once per barrier
+ * interval, and stored along with the last FLAGS right before exits only.
+ * Conditions recompute host flags from the operands where they are tested.
+ * Barriers are compiled like the baseline does, host registers do not survive them.
+ * Side exits store the guest state on their own path, the trace goes on past
+ * them with registers as they were.
+ *
+ * Register usage follows the stencil calling convention: rdi holds `emu`,
+ * rax is scratch, values live in the other caller-saved registers and are
+ * spilled to the red zone below rsp.
+ */
+
+/* Host registers. */
+enum { H_RAX, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI, H_R8, H_R9, H_R10, H_R11 };
+
+/* Registers values are allocated to, in order of preference. */
+static const uint8_t opt_regs[] = { H_RCX, H_RDX, H_RSI, H_R8, H_R9, H_R10, H_R11 };
+#define OPT_REGS (sizeof(opt_regs) / sizeof(opt_regs[0]))
+
+/* Spill slots of 8 bytes in the red zone. */
+#define OPT_SLOTS 16
+
+/* Guest code a trace may span, writes anywhere in it retire the trace. */
+#define OPT_TRACE_SPAN 0x10000
+
+/* Encoding flags. */
+enum {
+    OPT_W       = 1,    /* 64 bit operands */
+    OPT_16      = 2,    /* 16 bit operands */
+    OPT_BYTE_REG = 4,   /* ModR/M reg is an 8 bit register */
+    OPT_BYTE_RM = 8,    /* ModR/M r/m is an 8 bit register */
+};
+
+/** Memory operand, either register may be missing. */
+typedef struct {
+    int8_t  base;
+    int8_t  index;
+    uint8_t scale;
+    int32_t disp;
+} opt_mem_t;
+
+typedef struct {
+    x64jit_ctx_t *ctx;
+    bool          failed;   /* out of spill slots */
+    uint32_t      pos;      /* value being compiled */
+    uint16_t      pinned;   /* host registers the value works on */
+    uint16_t      host[16]; /* value in each host register or X64IR_NONE */
+    uint16_t      slots[OPT_SLOTS];
+    uint16_t      dirty[16];    /* value put in each guest GPR not stored yet, or X64IR_NONE */
+    uint16_t      lazy;         /* FLAGS not stored to `emu->lazy` yet, or X64IR_NONE */
+    int8_t        reg[X64IR_MAX_VALUES];    /* host register of each value or -1 */
+    int8_t        slot[X64IR_MAX_VALUES];   /* spill slot of each value or -1 */
+    uint16_t      last[X64IR_MAX_VALUES];   /* last value needing it in a register */
+    bool          fold[X64IR_MAX_VALUES];   /* ADDR is folded into the memory operands */
+    x64ir_t       ir;
+} opt_t;
+
+#define OP(...) (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ })
+
+static inline bool opt_simm32(int64_t imm) {
+    return imm == (int32_t)imm;
+}
+
+static inline opt_mem_t opt_emu(size_t offset) {
+    return (opt_mem_t){ H_RDI, -1, 0, (int32_t)offset };
+}
+
+static inline opt_mem_t opt_slot(uint32_t slot) {
+    return (opt_mem_t){ H_RSP, -1, 0, -8 * (int32_t)(slot + 1) };
+}
+
+
+/* Encoding */
+
+static void opt_out(opt_t *o, const uint8_t *code, uint32_t len) {
+    x64jit_emit_code(o->ctx, code, len);
+}
+
+/**
+ * Emit opcode `op` with ModR/M operands `reg` and register `rm` or memory `mem`,
+ * followed by `imm_len` bytes of `imm`.
+ */
+static void opt_modrm(opt_t *o, uint32_t flags, const uint8_t *op, uint32_t op_len, uint8_t reg,
+                      int8_t rm, const opt_mem_t *mem, int64_t imm, uint32_t imm_len) {
+    uint8_t code[24];
+    uint32_t n = 0;
+    uint8_t rex = (flags & OPT_W ? 8 : 0) | (reg & 8 ? 4 : 0);
+
+    if (mem) {
+        if (mem->index >= 0 && (mem->index & 8)) rex |= 2;
+        if (mem->base >= 0 && (mem->base & 8)) rex |= 1;
+    } else if (rm & 8) {
+        rex |= 1;
+    }
+
+    if (flags & OPT_16) code[n++] = 0x66;
+    /* SPL..DIL need REX, AH..BH are never used. */
+    if (rex || ((flags & OPT_BYTE_REG) && reg >= 4) || ((flags & OPT_BYTE_RM) && !mem && rm >= 4))
+        code[n++] = 0x40 | rex;
+    memcpy(code + n, op, op_len);
+    n += op_len;
+
+    if (!mem) {
+        code[n++] = 0xC0 | (reg & 7) << 3 | (rm & 7);
+    } else if (mem->base < 0) {
+        /* [index * scale + disp32] or [disp32], without RIP. */
+        code[n++] = 0x04 | (reg & 7) << 3;
+        code[n++] = mem->scale << 6 | (mem->index < 0 ? 4 : mem->index & 7) << 3 | 5;
+        memcpy(code + n, &mem->disp, 4);
+        n += 4;
+    } else if (mem->index < 0 && (mem->base & 7) != H_RSP) {
+        code[n++] = 0x80 | (reg & 7) << 3 | (mem->base & 7);
+        memcpy(code + n, &mem->disp, 4);
+        n += 4;
+    } else {
+        code[n++] = 0x84 | (reg & 7) << 3;
+        code[n++] = mem->scale << 6 | (mem->index < 0 ? 4 : mem->index & 7) << 3 | (mem->base & 7);
+        memcpy(code + n, &mem->disp, 4);
+        n += 4;
+    }
+
+    memcpy(code + n, &imm, imm_len);
+    n += imm_len;
+    opt_out(o, code, n);
+}
+
+static inline void opt_rr(opt_t *o, uint32_t flags, const uint8_t *op, uint32_t op_len,
+                          uint8_t reg, uint8_t rm) {
+    opt_modrm(o, flags, op, op_len, reg, rm, NULL, 0, 0);
+}
+
+static inline void opt_rm(opt_t *o, uint32_t flags, const uint8_t *op, uint32_t op_len,
+                          uint8_t reg, opt_mem_t mem) {
+    opt_modrm(o, flags, op, op_len, reg, 0, &mem, 0, 0);
+}
+
+static inline uint32_t opt_w(uint8_t width) {
+    return width == 64 ? OPT_W : 0;
+}
+
+/** mov r, imm, zero-extended from 32 bits if possible. */
+static void opt_mov_imm(opt_t *o, uint8_t r, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        uint8_t code[6] = { 0x41, 0xB8 | (r & 7) };
+        memcpy(code + 2, &imm, 4);
+        if (r & 8) opt_out(o, code, 6);
+        else opt_out(o, code + 1, 5);
+    } else if (opt_simm32(imm)) {
+        opt_modrm(o, OPT_W, OP(0xC7), 0, r, NULL, imm, 4);
+    } else {
+        uint8_t code[10] = { 0x48 | (r & 8 ? 1 : 0), 0xB8 | (r & 7) };
+        memcpy(code + 2, &imm, 8);
+        opt_out(o, code, 10);
+    }
+}
+
+/** mov r64, r64 */
+static inline void opt_mov(opt_t *o, uint8_t dest, uint8_t src) {
+    if (dest != src)
+        opt_rr(o, OPT_W, OP(0x8B), dest, src);
+}
+
+
+/* Register allocation */
+
+static inline bool opt_is_const(opt_t *o, uint16_t v) {
+    return o->ir.values[v].op == X64IR_CONST;
+}
+
+/** Free the register of the value, its spill slot stays valid. */
+static void opt_release(opt_t *o, uint8_t r) {
+    uint16_t v = o->host[r];
+    if (v == X64IR_NONE) return;
+    o->reg[v] = -1;
+    o->host[r] = X64IR_NONE;
+}
+
+/** Move the value out of its register, to a spill slot unless it is a constant. */
+static void opt_spill(opt_t *o, uint8_t r) {
+    uint16_t v = o->host[r];
+
+    if (!opt_is_const(o, v) && o->slot[v] < 0) {
+        uint32_t s = 0;
+        while (s < OPT_SLOTS && o->slots[s] != X64IR_NONE)
+            s++;
+        if (s == OPT_SLOTS) {
+            o->failed = true;
+        } else {
+            o->slots[s] = v;
+            o->slot[v] = s;
+            opt_rm(o, OPT_W, OP(0x89), r, opt_slot(s));
+        }
+    }
+    opt_release(o, r);
+}
+
+/** @return Free host register for the current value, spilling the one needed last. */
+static uint8_t opt_alloc(opt_t *o) {
+    int best = -1;
+    uint32_t best_last = 0;
+
+    for (uint32_t i = 0; i < OPT_REGS; i++) {
+        uint8_t r = opt_regs[i];
+        if (o->pinned & (1 << r)) continue;
+
+        uint16_t v = o->host[r];
+        if (v == X64IR_NONE) {
+            best = r;
+            break;
+        }
+        /* Constants are cheap to bring back. */
+        uint32_t last = opt_is_const(o, v) ? X64IR_MAX_VALUES : o->last[v];
+        if (best < 0 || last > best_last) {
+            best = r;
+            best_last = last;
+        }
+    }
+
+    if (best < 0) {
+        o->failed = true;
+        return H_RAX;
+    }
+    if (o->host[best] != X64IR_NONE)
+        opt_spill(o, best);
+    o->pinned |= 1 << best;
+    return best;
+}
+
+/** Assign register `r` to value `v`, replacing an operand not needed any more. */
+static inline void opt_def(opt_t *o, uint16_t v, uint8_t r) {
+    if (o->host[r] != X64IR_NONE)
+        o->reg[o->host[r]] = -1;
+    o->host[r] = v;
+    o->reg[v] = r;
+    o->pinned |= 1 << r;
+}
+
+/** @return Host register holding value `v`, loaded if needed. */
+static uint8_t opt_use(opt_t *o, uint16_t v) {
+    if (o->reg[v] >= 0) {
+        o->pinned |= 1 << o->reg[v];
+        return o->reg[v];
+    }
+
+    uint8_t r = opt_alloc(o);
+    if (opt_is_const(o, v))
+        opt_mov_imm(o, r, o->ir.values[v].imm);
+    else if (o->slot[v] >= 0)
+        opt_rm(o, OPT_W, OP(0x8B), r, opt_slot(o->slot[v]));
+    else
+        o->failed = true;
+    opt_def(o, v, r);
+    return r;
+}
+
+/**
+ * @return Register for the result of the current value, the one of operand `v`
+ *         if it is not needed afterwards, else a new one with a copy of it.
+ */
+static uint8_t opt_use_dest(opt_t *o, uint16_t v) {
+    uint8_t src = opt_use(o, v);
+
+    if (o->last[v] <= o->pos)
+        return src;
+    uint8_t dest = opt_alloc(o);
+    opt_mov(o, dest, src);
+    return dest;
+}
+
+/**
+ * @return Host register holding value `v`, rax if it has to be loaded,
+ *         for code on a side exit path which must leave allocation alone.
+ */
+static uint8_t opt_peek(opt_t *o, uint16_t v) {
+    if (o->reg[v] >= 0)
+        return o->reg[v];
+    if (opt_is_const(o, v))
+        opt_mov_imm(o, H_RAX, o->ir.values[v].imm);
+    else if (o->slot[v] >= 0)
+        opt_rm(o, OPT_W, OP(0x8B), H_RAX, opt_slot(o->slot[v]));
+    else
+        o->failed = true;
+    return H_RAX;
+}
+
+/** Free registers and slots of values not needed past the current one. */
+static void opt_expire(opt_t *o) {
+    for (uint32_t i = 0; i < OPT_REGS; i++) {
+        uint16_t v = o->host[opt_regs[i]];
+        if (v != X64IR_NONE && o->last[v] <= o->pos)
+            opt_release(o, opt_regs[i]);
+    }
+    for (uint32_t s = 0; s < OPT_SLOTS; s++) {
+        uint16_t v = o->slots[s];
+        if (v != X64IR_NONE && o->last[v] <= o->pos) {
+            o->slot[v] = -1;
+            o->slots[s] = X64IR_NONE;
+        }
+    }
+}
+
+/** Forget all registers and slots, code of a barrier clobbers them. */
+static void opt_reset(opt_t *o) {
+    for (uint32_t i = 0; i < 16; i++)
+        o->dirty[i] = X64IR_NONE;
+    o->lazy = X64IR_NONE;
+    for (uint32_t i = 0; i < 16; i++)
+        opt_release(o, i);
+    for (uint32_t s = 0; s < OPT_SLOTS; s++) {
+        if (o->slots[s] != X64IR_NONE)
+            o->slot[o->slots[s]] = -1;
+        o->slots[s] = X64IR_NONE;
+    }
+}
+
+
+/* Code generation */
+
+/* ModR/M reg field of group 1 per IR operation, the r/m,r opcode is 8 times it plus 1. */
+static const uint8_t opt_alu_ext[] = {
+    [X64IR_ADD] = 0, [X64IR_OR] = 1, [X64IR_AND] = 4, [X64IR_SUB] = 5, [X64IR_XOR] = 6,
+};
+#define OPT_CMP 7
+
+/* ModR/M reg field of group 2 per IR operation or lazy flags kind. */
+static const uint8_t opt_shift_ext[] = {
+    [X64IR_SHL] = 4, [X64IR_SHR] = 5, [X64IR_SAR] = 7,
+};
+static const uint8_t opt_lazy_shift_ext[] = {
+    [X64_LAZY_SHL] = 4, [X64_LAZY_SHR] = 5, [X64_LAZY_SAR] = 7,
+};
+
+/** @return Whether constant `v` is an imm32 operand of `width` bit operations. */
+static inline bool opt_imm_operand(opt_t *o, uint16_t v, uint8_t width) {
+    return opt_is_const(o, v) && (width == 32 || opt_simm32(o->ir.values[v].imm));
+}
+
+/** dest = dest op src at `width` bits, `ext` from `opt_alu_ext` or OPT_CMP, `dest` may be rax. */
+static void opt_alu(opt_t *o, uint8_t ext, uint8_t width, uint8_t dest, uint16_t src) {
+    if (opt_imm_operand(o, src, width)) {
+        opt_modrm(o, opt_w(width), OP(0x81), ext, dest, NULL, o->ir.values[src].imm, 4);
+    } else {
+        uint8_t op = ext << 3 | 1;
+        opt_rr(o, opt_w(width), &op, 1, opt_use(o, src), dest);
+    }
+}
+
+/** Set host flags from the FLAGS value as the guest sees them for native conditions. */
+static void opt_flags(opt_t *o, uint16_t flags) {
+    x64ir_value_t *f = o->ir.values + flags;
+    uint16_t op1 = f->args[0], op2 = f->args[1];
+    uint32_t w = opt_w(f->width);
+
+    switch (f->aux) {
+        case X64_LAZY_SUB:
+            opt_alu(o, OPT_CMP, f->width, opt_use(o, op1), op2);
+            return;
+        case X64_LAZY_LOGIC:
+        {
+            uint8_t r = opt_use(o, f->args[2]);
+            opt_rr(o, w, OP(0x85), r, r);
+            return;
+        }
+        case X64_LAZY_ADD:
+        case X64_LAZY_INC:
+        case X64_LAZY_DEC:
+            opt_mov(o, H_RAX, opt_use(o, op1));
+            opt_alu(o, opt_alu_ext[f->aux == X64_LAZY_DEC ? X64IR_SUB : X64IR_ADD], f->width, H_RAX, op2);
+            return;
+        case X64_LAZY_SHL:
+        case X64_LAZY_SHR:
+        case X64_LAZY_SAR:
+            opt_mov(o, H_RAX, opt_use(o, op1));
+            opt_modrm(o, w, OP(0xC1), opt_lazy_shift_ext[f->aux], H_RAX, NULL, o->ir.values[op2].imm, 1);
+            return;
+    }
+}
+
+/** @return Memory operand at address value `addr`. */
+static opt_mem_t opt_addr(opt_t *o, uint16_t addr) {
+    x64ir_value_t *a = o->ir.values + addr;
+
+    if (a->op == X64IR_ADDR && o->fold[addr]) {
+        opt_mem_t mem = { -1, -1, a->aux, (int32_t)a->imm };
+        if (a->args[0] != X64IR_NONE) mem.base = opt_use(o, a->args[0]);
+        if (a->args[1] != X64IR_NONE) mem.index = opt_use(o, a->args[1]);
+        return mem;
+    }
+    if (a->op == X64IR_CONST && opt_simm32(a->imm))
+        return (opt_mem_t){ -1, -1, 0, (int32_t)a->imm };
+    return (opt_mem_t){ opt_use(o, addr), -1, 0, 0 };
+}
+
+/** Store value `v` of `width` bits zero-extended to the 64 bit field of `emu`. */
+static void opt_store_lazy(opt_t *o, uint16_t v, uint8_t width, size_t offset) {
+    x64ir_value_t *val = o->ir.values + v;
+
+    if (val->op == X64IR_CONST) {
+        uint64_t imm = width == 64 ? (uint64_t)val->imm : (uint32_t)val->imm;
+        if (imm <= INT32_MAX) {
+            opt_modrm(o, OPT_W, OP(0xC7), 0, 0, &(opt_mem_t){ H_RDI, -1, 0, offset }, imm, 4);
+            return;
+        }
+        opt_mov_imm(o, H_RAX, imm);
+        opt_rm(o, OPT_W, OP(0x89), H_RAX, opt_emu(offset));
+        return;
+    }
+
+    uint8_t r = opt_peek(o, v);
+    if (width == 32 && (val->op == X64IR_GET || val->op == X64IR_ADDR || val->width > 32)) {
+        opt_rr(o, 0, OP(0x8B), H_RAX, r);   /* mov eax, r32 */
+        r = H_RAX;
+    }
+    opt_rm(o, OPT_W, OP(0x89), r, opt_emu(offset));
+}
+
+/** Record FLAGS in `emu->lazy` for code past the exit, and CF kept by INC/DEC in RFLAGS. */
+static void opt_store_flags(opt_t *o, x64ir_value_t *f) {
+    opt_modrm(o, 0, OP(0xC6), 0, 0, &(opt_mem_t){ H_RDI, -1, 0, offsetof(x64emu_t, lazy.kind) },
+              f->aux, 1);
+    opt_modrm(o, 0, OP(0xC6), 0, 0, &(opt_mem_t){ H_RDI, -1, 0, offsetof(x64emu_t, lazy.width) },
+              f->width, 1);
+    opt_store_lazy(o, f->args[0], f->width, offsetof(x64emu_t, lazy.op1));
+    opt_store_lazy(o, f->args[1], f->width, offsetof(x64emu_t, lazy.op2));
+    opt_store_lazy(o, f->args[2], f->width, offsetof(x64emu_t, lazy.res));
+
+    if (f->aux != X64_LAZY_INC && f->aux != X64_LAZY_DEC) return;
+
+    opt_mem_t flags = opt_emu(offsetof(x64emu_t, flags));
+    opt_modrm(o, 0, OP(0x80), 4, 0, &flags, ~X64_FLAG_CF & 0xFF, 1);   /* and byte [flags], ~CF */
+    if (opt_is_const(o, f->args[3])) {
+        if (o->ir.values[f->args[3]].imm)
+            opt_modrm(o, 0, OP(0x80), 1, 0, &flags, X64_FLAG_CF, 1);
+    } else {
+        opt_rm(o, OPT_BYTE_REG, OP(0x08), opt_peek(o, f->args[3]), flags);   /* or byte [flags], r8 */
+    }
+}
+
+/** Store guest GPRs and flags the code past the exit reads from memory. */
+static void opt_flush(opt_t *o) {
+    for (uint32_t i = 0; i < 16; i++) {
+        uint16_t v = o->dirty[i];
+        if (v == X64IR_NONE) continue;
+
+        opt_mem_t mem = opt_emu(offsetof(x64emu_t, regs) + i * sizeof(reg64_t));
+        if (opt_is_const(o, v) && opt_simm32(o->ir.values[v].imm))
+            opt_modrm(o, OPT_W, OP(0xC7), 0, 0, &mem, o->ir.values[v].imm, 4);
+        else
+            opt_rm(o, OPT_W, OP(0x89), opt_peek(o, v), mem);
+    }
+    if (o->lazy != X64IR_NONE)
+        opt_store_flags(o, o->ir.values + o->lazy);
+}
+
+/** Run the instructions of a STENCIL value the way the baseline does. */
+static void opt_stencil(opt_t *o, x64ir_value_t *v, x64instr_t *copies, uint32_t *copies_len) {
+    uint64_t rip = v->rip;
+
+    for (uint32_t done = 0; done < v->count && !o->ctx->exited;) {
+        x64instr_t *ins = v->ins + done;
+
+        if (x64jit_translate(o->ctx, ins, rip)) {
+            rip += ins->len;
+            done++;
+            continue;
+        }
+
+        uint32_t len = x64jit_interp(o->ctx, ins, v->imm - done, rip, copies + *copies_len);
+        for (uint32_t j = 0; j < len; j++)
+            rip += ins[j].len;
+        *copies_len += len + 1;
+        done += len;
+    }
+}
+
+/** Emit jcc rel32 on host flags, to where `opt_land` is called with the result. */
+static uint8_t *opt_jump(opt_t *o, uint8_t cc) {
+    uint8_t jcc[6] = { 0x0F, 0x80 | cc };
+    return x64jit_emit_code(o->ctx, jcc, sizeof(jcc));
+}
+
+static void opt_land(opt_t *o, uint8_t *jcc) {
+    if (!jcc) return;
+    int32_t offset = o->ctx->pos - (jcc - o->ctx->jit->rw) - 6;
+    memcpy(jcc + 2, &offset, sizeof(offset));
+}
+
+/** Jcc, leaves the block either way. */
+static void opt_jcc(opt_t *o, x64ir_value_t *v) {
+    opt_flush(o);
+    opt_flags(o, v->args[0]);
+    uint8_t *jcc = opt_jump(o, v->aux);
+    x64jit_exit(o->ctx, v->rip + v->ins->len);
+    opt_land(o, jcc);
+    x64jit_exit(o->ctx, v->imm);
+}
+
+/** Side exit, the trace goes on past it with values where they are. */
+static void opt_branch(opt_t *o, x64ir_value_t *v) {
+    opt_flags(o, v->args[0]);
+    uint8_t *jcc = opt_jump(o, v->aux ^ 1);
+    opt_flush(o);
+    x64jit_exit(o->ctx, v->imm);
+    o->ctx->exited = false;
+    opt_land(o, jcc);
+}
+
+/** Emit the code of value `i`. */
+static void opt_value(opt_t *o, uint16_t i, x64instr_t *copies, uint32_t *copies_len) {
+    x64ir_value_t *v = o->ir.values + i;
+    uint32_t w = opt_w(v->width);
+    uint8_t r;
+
+    switch (v->op) {
+        case X64IR_NOP:
+        case X64IR_CONST:
+            return;
+
+        case X64IR_GET:
+            r = opt_alloc(o);
+            opt_rm(o, OPT_W, OP(0x8B), r, opt_emu(offsetof(x64emu_t, regs) + v->aux * sizeof(reg64_t)));
+            opt_def(o, i, r);
+            return;
+
+        case X64IR_PUT:
+            o->dirty[v->aux] = v->args[0];
+            return;
+
+        case X64IR_ADD:
+        case X64IR_SUB:
+        case X64IR_AND:
+        case X64IR_OR:
+        case X64IR_XOR:
+            r = opt_use_dest(o, v->args[0]);
+            opt_alu(o, opt_alu_ext[v->op], v->width, r, v->args[1]);
+            opt_def(o, i, r);
+            return;
+
+        case X64IR_SHL:
+        case X64IR_SHR:
+        case X64IR_SAR:
+            r = opt_use_dest(o, v->args[0]);
+            opt_modrm(o, w, OP(0xC1), opt_shift_ext[v->op], r, NULL, v->imm, 1);
+            opt_def(o, i, r);
+            return;
+
+        case X64IR_NOT:
+        case X64IR_NEG:
+            r = opt_use_dest(o, v->args[0]);
+            opt_rr(o, w, OP(0xF7), v->op == X64IR_NOT ? 2 : 3, r);
+            opt_def(o, i, r);
+            return;
+
+        case X64IR_ZEXT:
+        {
+            uint8_t src = opt_use(o, v->args[0]);
+            r = o->last[v->args[0]] <= o->pos ? src : opt_alloc(o);
+            if (v->width == 8)
+                opt_rr(o, OPT_BYTE_RM, OP(0x0F, 0xB6), r, src);
+            else if (v->width == 16)
+                opt_rr(o, 0, OP(0x0F, 0xB7), r, src);
+            else
+                opt_rr(o, 0, OP(0x8B), r, src);
+            opt_def(o, i, r);
+            return;
+        }
+
+        case X64IR_SEXT:
+        {
+            uint8_t src = opt_use(o, v->args[0]);
+            r = o->last[v->args[0]] <= o->pos ? src : opt_alloc(o);
+            if (v->aux == 32)
+                opt_rr(o, OPT_W, OP(0x63), r, src);
+            else if (v->aux == 16)
+                opt_rr(o, w, OP(0x0F, 0xBF), r, src);
+            else
+                opt_rr(o, w | OPT_BYTE_RM, OP(0x0F, 0xBE), r, src);
+            opt_def(o, i, r);
+            return;
+        }
+
+        case X64IR_ADDR:
+        {
+            if (o->fold[i]) return;
+
+            opt_mem_t mem = { -1, -1, v->aux, 0 };
+            if (v->args[0] != X64IR_NONE) mem.base = opt_use(o, v->args[0]);
+            if (v->args[1] != X64IR_NONE) mem.index = opt_use(o, v->args[1]);
+            r = opt_alloc(o);
+            if (opt_simm32(v->imm)) {
+                mem.disp = v->imm;
+                opt_rm(o, OPT_W, OP(0x8D), r, mem);
+            } else {
+                opt_rm(o, OPT_W, OP(0x8D), r, mem);
+                opt_mov_imm(o, H_RAX, v->imm);
+                opt_rr(o, OPT_W, OP(0x01), H_RAX, r);
+            }
+            opt_def(o, i, r);
+            return;
+        }
+
+        case X64IR_LOAD:
+        {
+            opt_mem_t mem = opt_addr(o, v->args[0]);
+            r = opt_alloc(o);
+            switch (v->width) {
+                case 8:  opt_rm(o, 0, OP(0x0F, 0xB6), r, mem); break;
+                case 16: opt_rm(o, 0, OP(0x0F, 0xB7), r, mem); break;
+                default: opt_rm(o, w, OP(0x8B), r, mem); break;
+            }
+            opt_def(o, i, r);
+            return;
+        }
+
+        case X64IR_STORE:
+        {
+            opt_mem_t mem = opt_addr(o, v->args[0]);
+            x64ir_value_t *val = o->ir.values + v->args[1];
+            uint32_t flags = v->width == 16 ? OPT_16 : w;
+
+            if (val->op == X64IR_CONST && (v->width != 64 || opt_simm32(val->imm))) {
+                uint32_t len = v->width == 8 ? 1 : v->width == 16 ? 2 : 4;
+                opt_modrm(o, flags, v->width == 8 ? (const uint8_t[]){ 0xC6 } : (const uint8_t[]){ 0xC7 }, 1,
+                          0, 0, &mem, val->imm, len);
+            } else if (v->width == 8) {
+                opt_rm(o, OPT_BYTE_REG, OP(0x88), opt_use(o, v->args[1]), mem);
+            } else {
+                opt_rm(o, flags, OP(0x89), opt_use(o, v->args[1]), mem);
+            }
+            return;
+        }
+
+        case X64IR_FLAGS:
+            o->lazy = i;
+            return;
+
+        case X64IR_CF:
+            r = opt_alloc(o);
+            opt_flags(o, v->args[0]);
+            opt_rr(o, 0, OP(0x0F, 0x92), 0, H_RAX);   /* setc al */
+            opt_rr(o, 0, OP(0x0F, 0xB6), r, H_RAX);   /* movzx r32, al */
+            opt_def(o, i, r);
+            return;
+
+        case X64IR_CMOV:
+        {
+            uint8_t src = opt_use(o, v->args[1]);
+            r = opt_use_dest(o, v->args[0]);
+            opt_flags(o, v->args[2]);
+            uint8_t cmov[] = { 0x0F, 0x40 | v->aux };
+            opt_rr(o, w, cmov, sizeof(cmov), r, src);
+            opt_def(o, i, r);
+            return;
+        }
+
+        case X64IR_STENCIL:
+            opt_flush(o);
+            opt_stencil(o, v, copies, copies_len);
+            opt_reset(o);
+            return;
+
+        case X64IR_EXIT:
+            opt_flush(o);
+            x64jit_exit(o->ctx, v->imm);
+            return;
+
+        case X64IR_JCC:
+            opt_jcc(o, v);
+            return;
+
+        case X64IR_BRANCH:
+            opt_branch(o, v);
+            return;
+    }
+}
+
+/** Raise where value `v` is last needed to `pos`. */
+static inline void opt_need(opt_t *o, uint16_t v, uint32_t pos) {
+    if (v != X64IR_NONE && o->last[v] < pos)
+        o->last[v] = pos;
+}
+
+/** Find where values are last needed and which addresses fold. */
+static void opt_prepare(opt_t *o) {
+    x64ir_t *ir = &o->ir;
+    uint16_t dirty[16], lazy = X64IR_NONE;
+
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        o->last[i] = i;
+        o->reg[i] = o->slot[i] = -1;
+        o->fold[i] = v->op == X64IR_ADDR && opt_simm32(v->imm);
+        if (v->op == X64IR_NOP) continue;
+
+        for (uint32_t j = 0; j < 4; j++) {
+            uint16_t a = v->args[j];
+            if (a == X64IR_NONE) continue;
+            o->last[a] = i;
+            if ((v->op != X64IR_LOAD && v->op != X64IR_STORE) || j != 0)
+                o->fold[a] = false;
+        }
+    }
+
+    /* Values put in guest GPRs and the last FLAGS are stored at each exit up to the next barrier. */
+    for (uint32_t r = 0; r < 16; r++)
+        dirty[r] = X64IR_NONE;
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op == X64IR_PUT) dirty[v->aux] = v->args[0];
+        if (v->op == X64IR_FLAGS) lazy = i;
+        if (!x64ir_is_exit(v->op)) continue;
+
+        for (uint32_t r = 0; r < 16; r++)
+            opt_need(o, dirty[r], i);
+        opt_need(o, lazy, i);
+        if (x64ir_is_barrier(v->op)) {
+            for (uint32_t r = 0; r < 16; r++)
+                dirty[r] = X64IR_NONE;
+            lazy = X64IR_NONE;
+        }
+    }
+
+    /* Conditions recompute host flags from the operands. */
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op != X64IR_FLAGS) continue;
+        for (uint32_t j = 0; j < 4; j++)
+            opt_need(o, v->args[j], o->last[i]);
+    }
+
+    /* Folded addresses are computed by the memory operands. */
+    for (uint32_t i = 0; i < ir->len; i++) {
+        x64ir_value_t *v = ir->values + i;
+        if (v->op != X64IR_ADDR || !o->fold[i]) continue;
+        for (uint32_t j = 0; j < 2; j++)
+            opt_need(o, v->args[j], o->last[i]);
+    }
+
+    for (uint32_t r = 0; r < 16; r++)
+        o->host[r] = o->dirty[r] = X64IR_NONE;
+    for (uint32_t s = 0; s < OPT_SLOTS; s++)
+        o->slots[s] = X64IR_NONE;
+    o->lazy = X64IR_NONE;
+}
+
+/** @return How often the block ran lately, those queued for the optimizer ran enough. */
+static inline uint32_t opt_heat(x64jit_t *jit, x64block_t *block) {
+    return block->tier >= X64_TIER_OPT_QUEUED ? jit->opt_threshold : block->hits;
+}
+
+/** @return Successor the trace goes on with past the block, or `NULL`. */
+static x64block_t *opt_trace_next(x64jit_t *jit, x64block_t *block) {
+    x64block_t *next = NULL;
+
+    /* Returns go through the shadow stack, the trace ends at calls. */
+    if (block->call) return NULL;
+
+    for (uint32_t i = 0; i < X64_BLOCK_EXITS; i++) {
+        x64block_t *to = block->exits[i].to;
+        if (to && to->code && (!next || opt_heat(jit, to) > opt_heat(jit, next)))
+            next = to;
+    }
+    return next;
+}
+
+x64ir_trace_t *x64jit_trace(x64jit_t *jit, x64block_t *block) {
+    x64block_t *blocks[X64IR_TRACE_BLOCKS] = { block };
+    uint32_t len = 1;
+    uint32_t instrs_len = block->instrs_len;
+    uint64_t rip = block->rip, end = block->end;
+
+    while (len < X64IR_TRACE_BLOCKS) {
+        x64block_t *next = opt_trace_next(jit, blocks[len - 1]);
+        if (!next) break;
+
+        /* Loops close through the exit to their first block. */
+        uint32_t i = 0;
+        while (i < len && blocks[i] != next)
+            i++;
+        if (i < len) break;
+
+        uint64_t next_rip = next->rip < rip ? next->rip : rip;
+        uint64_t next_end = next->end > end ? next->end : end;
+        if (next_end - next_rip > OPT_TRACE_SPAN) break;
+
+        rip = next_rip;
+        end = next_end;
+        blocks[len++] = next;
+        instrs_len += next->instrs_len;
+    }
+
+    x64ir_trace_t *trace = malloc(sizeof(x64ir_trace_t) + instrs_len * sizeof(x64instr_t));
+    if (!trace) {
+        log_err("Failed to allocate trace of block 0x%lx", block->rip);
+        return NULL;
+    }
+    trace->block = block;
+    trace->len = len;
+
+    x64instr_t *instrs = trace->instrs;
+    for (uint32_t i = 0; i < len; i++) {
+        trace->rip[i] = blocks[i]->rip;
+        trace->end[i] = blocks[i]->end;
+        trace->instrs_len[i] = blocks[i]->instrs_len;
+        memcpy(instrs, blocks[i]->instrs, blocks[i]->instrs_len * sizeof(x64instr_t));
+        instrs += blocks[i]->instrs_len;
+    }
+
+    block->trace_rip = rip;
+    block->trace_end = end;
+    return trace;
+}
+
+bool x64jit_optimize(x64jit_ctx_t *ctx, x64ir_trace_t *trace, x64instr_t *copies,
+                     uint32_t *copies_len, uint32_t *native) {
+    opt_t *o = malloc(sizeof(opt_t));
+    if (!o) {
+        log_err("Failed to allocate optimizer of block 0x%lx", trace->block->rip);
+        return false;
+    }
+    memset(o, 0, offsetof(opt_t, ir));
+    o->ctx = ctx;
+
+    /* Traces the stencils do entirely keep their baseline code. */
+    if (!x64ir_build(&o->ir, trace) || !o->ir.native) {
+        free(o);
+        return false;
+    }
+    x64ir_optimize(&o->ir);
+    opt_prepare(o);
+#ifdef HAVE_TRACE
+    x64ir_dump(&o->ir);
+#endif
+
+    for (o->pos = 0; o->pos < o->ir.len && !ctx->exited && !o->failed; o->pos++) {
+        o->pinned = 0;
+        opt_value(o, o->pos, copies, copies_len);
+        opt_expire(o);
+    }
+
+    *native = o->ir.native;
+    bool ok = !o->failed;
+    if (!ok)
+        log_debug("Block 0x%lx ran out of spill slots, it keeps its baseline code", trace->block->rip);
+    free(o);
+    return ok;
+}
@@ -0,0 +1,121 @@
+#ifndef __X64JIT_PRIVATE_H_
+#define __X64JIT_PRIVATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "x64instr.h"
+#include "x64block.h"
+#include "x64jit.h"
+
+#include "ir_private.h"
+
+/*
+ * Stencils are functions of jit_stencils.c compiled at build time,
+ * jit_gen extracts their machine code into jit_stencils.h.
+ * A stencil references symbol `_JIT_<KIND>` wherever a value known only
+ * at translation time goes, each such place is a hole of kind
+ * `X64JIT_HOLE_<KIND>` patched with the 64 bit value plus addend.
+ */
+
+/** Values patched into stencil holes. */
+enum {
+    X64JIT_HOLE_CONTINUE,   /* Host address of the next stencil. */
+    X64JIT_HOLE_DEST,       /* Destination GPR number. */
+    X64JIT_HOLE_SRC,        /* Source GPR number. */
+    X64JIT_HOLE_BASE,       /* Base GPR number of the effective address. */
+    X64JIT_HOLE_INDEX,      /* Index GPR number of the effective address. */
+    X64JIT_HOLE_DISPL,      /* Displacement or absolute effective address. */
+    X64JIT_HOLE_IMM,        /* Sign-extended immediate. */
+    X64JIT_HOLE_RIP,        /* Guest address of the instruction, or past it. */
+    X64JIT_HOLE_TARGET,     /* Guest address the block exits to. */
+    X64JIT_HOLE_HANDLER,    /* Interpreter handler of the instruction. */
+    X64JIT_HOLE_INSTR,      /* Decoded instruction passed to the handler. */
+    X64JIT_HOLE_LINK,       /* Host code a direct exit jumps to, see x64block_exit_t. */
+    X64JIT_HOLE_BLOCK,      /* Block the code is translated from. */
+    X64JIT_HOLE_RETURN,     /* Host code a return to after the call continues with, like LINK. */
+    X64JIT_HOLES_LEN
+};
+
+typedef struct {
+    uint32_t    offset;     /* Offset of the 64 bit value in the code. */
+    uint32_t    kind;       /* X64JIT_HOLE_* */
+    int64_t     addend;
+} x64jit_hole_t;
+
+typedef struct {
+    const uint8_t       *code;
+    const x64jit_hole_t *holes;
+    uint32_t             code_len;
+    uint32_t             holes_len;
+} x64jit_stencil_t;
+
+/** State of a block being translated. */
+typedef struct {
+    x64jit_t   *jit;
+    size_t      pos;                        /* where the next stencil goes */
+    bool        full;                       /* a stencil did not fit */
+    bool        exited;                     /* the last stencil leaves the block */
+    uint64_t    values[X64JIT_HOLES_LEN];   /* patched into holes */
+    uint8_t    *link;                       /* LINK hole of the last stencil */
+    uint8_t    *target;                     /* TARGET hole of the last stencil */
+    uint8_t    *ret_link;                   /* RETURN hole of the last stencil */
+
+    /* Holes of the indirect exit checking the inline cache. */
+    uint8_t    *ic_target;
+    uint8_t    *ic_link;
+
+    /* LINK holes of direct exits and targets they leave to. */
+    uint8_t    *links[X64_BLOCK_TRACE_EXITS];
+    uint64_t    links_target[X64_BLOCK_TRACE_EXITS];
+    uint32_t    links_len;
+} x64jit_ctx_t;
+
+/** Copy the stencil after the previous one and fill its holes. */
+void x64jit_emit(x64jit_ctx_t *ctx, const x64jit_stencil_t *stencil);
+
+/**
+ * Copy host code other than a stencil after the previous one.
+ * @return Writable address of the copy, or `NULL` if it did not fit.
+ */
+uint8_t *x64jit_emit_code(x64jit_ctx_t *ctx, const uint8_t *code, uint32_t len);
+
+/** Record the LINK or RETURN hole `link` of the stencil just emitted, leading to `target`. */
+void x64jit_link(x64jit_ctx_t *ctx, uint8_t *link, uint64_t target);
+
+/** Leave the block to `target`. */
+void x64jit_exit(x64jit_ctx_t *ctx, uint64_t target);
+
+/**
+ * Emit stencils of the instruction at guest address `rip`.
+ * @return false, with nothing emitted, if there are none for it.
+ */
+bool x64jit_translate(x64jit_ctx_t *ctx, x64instr_t *ins, uint64_t rip);
+
+/**
+ * Emit the stencil running the handler of the instruction, and of those
+ * fused with it, on a copy followed by the block terminator.
+ * `left` instructions of the block remain, this one included.
+ * @return Number of instructions run.
+ */
+uint32_t x64jit_interp(x64jit_ctx_t *ctx, x64instr_t *ins, uint32_t left, uint64_t rip,
+                       x64instr_t *copy);
+
+/**
+ * Record the trace the hot block starts, along the successors it was
+ * linked to which ran most. Writes to any block of it retire this one.
+ * @return Trace to compile, or `NULL` if there is no memory.
+ */
+x64ir_trace_t *x64jit_trace(x64jit_t *jit, x64block_t *block);
+
+/**
+ * Emit code of the trace optimized through the IR, see jit_opt.c.
+ * Instructions run by handlers are copied to `copies`, `copies_len` entries are used.
+ * @return false, leaving the baseline code in place, if it is not worth it
+ *         or does not fit. `native` is set to instructions not run by stencils.
+ */
+bool x64jit_optimize(x64jit_ctx_t *ctx, x64ir_trace_t *trace, x64instr_t *copies,
+                     uint32_t *copies_len, uint32_t *native);
+
+#endif /* __X64JIT_PRIVATE_H_ */
@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "x64instr.h"
+#include "x64emu.h"
+
+#include "regs_private.h"
+#include "flags_private.h"
+#include "stack_private.h"
+#include "execute_private.h"
+#include "x64block.h"
+
+/*
+ * Stencils of the baseline JIT, see jit_private.h.
+ * Not linked into flux64, jit_gen turns the compiled object into jit_stencils.h.
+ * Every stencil takes the guest state and the effective address computed by
+ * a preceding `ea_*` stencil, and either returns to the caller of the block
+ * or continues with the next stencil.
+ */
+
+extern uint8_t _JIT_DEST, _JIT_SRC, _JIT_BASE, _JIT_INDEX, _JIT_DISPL,
+               _JIT_IMM, _JIT_RIP, _JIT_TARGET, _JIT_HANDLER, _JIT_INSTR, _JIT_BLOCK,
+               _JIT_RETURN;
+extern bool _JIT_CONTINUE(x64emu_t *emu, uint64_t ea);
+extern bool _JIT_LINK(x64emu_t *emu, uint64_t ea);
+
+/** Value patched into the hole of `kind`. */
+#define JIT_HOLE(kind) ((uint64_t)(uintptr_t)&_JIT_ ## kind)
+
+/* Stencils are copied alone, everything they call must be inlined. */
+#define STENCIL(name) \
+    __attribute__((flatten)) bool stencil_ ## name(x64emu_t *emu, uint64_t ea)
+
+#define CONTINUE() MUSTTAIL return _JIT_CONTINUE(emu, ea)
+
+/* Direct exit, to the successor block once linked. */
+#define LINK() MUSTTAIL return _JIT_LINK(emu, ea)
+
+/* Whether the destination is a register and whether the flags are read
+   afterwards is known for every stencil. */
+#undef DEST_IS_GPR
+#define DEST_IS_GPR dest_is_gpr
+#undef FLAGS_LIVE
+#define FLAGS_LIVE flags_live
+
+
+/* Effective address */
+
+STENCIL(ea_base) {
+    ea = emu->regs[JIT_HOLE(BASE)].uq[0] + JIT_HOLE(DISPL);
+    CONTINUE();
+}
+
+STENCIL(ea_abs) {
+    ea = JIT_HOLE(DISPL);
+    CONTINUE();
+}
+
+#define STENCIL_EA_SCALED(scale) \
+    STENCIL(ea_base_index ## scale) { \
+        ea = emu->regs[JIT_HOLE(BASE)].uq[0] + \
+             (emu->regs[JIT_HOLE(INDEX)].uq[0] << scale) + JIT_HOLE(DISPL); \
+        CONTINUE(); \
+    } \
+    STENCIL(ea_index ## scale) { \
+        ea = (emu->regs[JIT_HOLE(INDEX)].uq[0] << scale) + JIT_HOLE(DISPL); \
+        CONTINUE(); \
+    }
+
+STENCIL_EA_SCALED(0)
+STENCIL_EA_SCALED(1)
+STENCIL_EA_SCALED(2)
+STENCIL_EA_SCALED(3)
+
+
+/* Two operand operations */
+
+/* `r`: GPR destination, `m`: memory destination at `ea`,
+   second letter is the source: GPR, memory or immediate. */
+#define STENCIL_OPS_r_r \
+    void *dest = emu->regs + JIT_HOLE(DEST); \
+    void *src = emu->regs + JIT_HOLE(SRC); \
+    const bool dest_is_gpr = true;
+#define STENCIL_OPS_r_m \
+    void *dest = emu->regs + JIT_HOLE(DEST); \
+    void *src = (void *)ea; \
+    const bool dest_is_gpr = true;
+#define STENCIL_OPS_m_r \
+    void *dest = (void *)ea; \
+    void *src = emu->regs + JIT_HOLE(SRC); \
+    const bool dest_is_gpr = false;
+#define STENCIL_OPS_r_i \
+    void *dest = emu->regs + JIT_HOLE(DEST); \
+    const bool dest_is_gpr = true;
+#define STENCIL_OPS_m_i \
+    void *dest = (void *)ea; \
+    const bool dest_is_gpr = false;
+
+#define STENCIL_SRC_r_r(s_type) (*(s_type *)src)
+#define STENCIL_SRC_r_m(s_type) (*(s_type *)src)
+#define STENCIL_SRC_m_r(s_type) (*(s_type *)src)
+#define STENCIL_SRC_r_i(s_type) ((s_type)JIT_HOLE(IMM))
+#define STENCIL_SRC_m_i(s_type) ((s_type)JIT_HOLE(IMM))
+
+#define STENCIL_OP2(name, oper, live, form, w) \
+    STENCIL(name ## _ ## form ## w) { \
+        STENCIL_OPS_ ## form \
+        const bool flags_live = live; \
+        oper(int ## w ## _t, uint ## w ## _t, STENCIL_SRC_ ## form(int ## w ## _t)) \
+        CONTINUE(); \
+    }
+
+#define STENCIL_WIDTHS(name, oper, live, form) \
+    STENCIL_OP2(name, oper, live, form, 8) \
+    STENCIL_OP2(name, oper, live, form, 16) \
+    STENCIL_OP2(name, oper, live, form, 32) \
+    STENCIL_OP2(name, oper, live, form, 64)
+
+#define STENCIL_FORMS(name, oper, live) \
+    STENCIL_WIDTHS(name, oper, live, r_r) \
+    STENCIL_WIDTHS(name, oper, live, r_m) \
+    STENCIL_WIDTHS(name, oper, live, m_r) \
+    STENCIL_WIDTHS(name, oper, live, r_i) \
+    STENCIL_WIDTHS(name, oper, live, m_i)
+
+/* Flag writing operations get `_nf` variants for instructions with dead flags. */
+#define STENCIL_FLAG_FORMS(name, oper) \
+    STENCIL_FORMS(name, oper, true) \
+    STENCIL_FORMS(name ## _nf, oper, false)
+
+STENCIL_FLAG_FORMS(add, OP_S_ADD)
+STENCIL_FLAG_FORMS(or,  OP_S_OR)
+STENCIL_FLAG_FORMS(adc, OP_S_ADC)
+STENCIL_FLAG_FORMS(sbb, OP_S_SBB)
+STENCIL_FLAG_FORMS(and, OP_S_AND)
+STENCIL_FLAG_FORMS(sub, OP_S_SUB)
+STENCIL_FLAG_FORMS(xor, OP_S_XOR)
+STENCIL_FLAG_FORMS(cmp, OP_S_CMP)
+STENCIL_FLAG_FORMS(test, OP_S_TEST_AND)
+STENCIL_FORMS(mov, OP_S_MOV, true)
+
+/* Shifts by immediate. */
+#define STENCIL_SHIFT(name, oper) \
+    STENCIL_WIDTHS(name, oper, true, r_i) \
+    STENCIL_WIDTHS(name, oper, true, m_i)
+
+STENCIL_SHIFT(shl, OP_SHL)
+STENCIL_SHIFT(shr, OP_SHR)
+STENCIL_SHIFT(sar, OP_SAR)
+
+
+/* One operand operations */
+
+#define STENCIL_OP1(name, oper, form, w) \
+    STENCIL(name ## _ ## form ## w) { \
+        STENCIL_OPS_ ## form ## _i \
+        const bool flags_live = true; \
+        oper(int ## w ## _t, uint ## w ## _t, 1) \
+        CONTINUE(); \
+    }
+
+#define STENCIL_OP1_FORMS(name, oper) \
+    STENCIL_OP1(name, oper, r, 8)  STENCIL_OP1(name, oper, m, 8) \
+    STENCIL_OP1(name, oper, r, 16) STENCIL_OP1(name, oper, m, 16) \
+    STENCIL_OP1(name, oper, r, 32) STENCIL_OP1(name, oper, m, 32) \
+    STENCIL_OP1(name, oper, r, 64) STENCIL_OP1(name, oper, m, 64)
+
+STENCIL_OP1_FORMS(inc, OP_S_INC)
+STENCIL_OP1_FORMS(dec, OP_S_DEC)
+STENCIL_OP1_FORMS(neg, OP_S_NEG)
+STENCIL_OP1_FORMS(not, OP_S_NOT)
+
+
+/* LEA, the effective address is the operand. */
+
+STENCIL(lea32) {
+    emu->regs[JIT_HOLE(DEST)].uq[0] = (uint32_t)ea;
+    CONTINUE();
+}
+
+STENCIL(lea64) {
+    emu->regs[JIT_HOLE(DEST)].uq[0] = ea;
+    CONTINUE();
+}
+
+
+/* Stack */
+
+STENCIL(push_r) {
+    push_64(emu, emu->regs[JIT_HOLE(SRC)].uq[0]);
+    CONTINUE();
+}
+
+STENCIL(push_i) {
+    push_64(emu, JIT_HOLE(IMM));
+    CONTINUE();
+}
+
+STENCIL(pop_r) {
+    uint64_t v = pop_64(emu);
+    emu->regs[JIT_HOLE(DEST)].uq[0] = v;
+    CONTINUE();
+}
+
+
+/**
+ * Count runs of the baseline code at its entry. The run reaching the
+ * optimizer threshold returns to the dispatcher instead, r_rip is the entry already.
+ */
+STENCIL(count) {
+    x64block_t *block = (x64block_t *)(uintptr_t)JIT_HOLE(BLOCK);
+    if (++block->hits == (uint32_t)JIT_HOLE(IMM)) {
+        emu->jit_hot = block;
+        return true;
+    }
+    CONTINUE();
+}
+
+
+/* Block exits, r_rip is not kept up to date before them. */
+
+/** Leave the block to a known address. */
+STENCIL(exit) {
+    r_rip = JIT_HOLE(TARGET);
+    LINK();
+}
+
+/**
+ * Return to the dispatcher, r_rip is set already.
+ * Ends every block, unlinked exits jump here.
+ */
+STENCIL(leave) {
+    emu->jit_exit = (x64block_t *)(uintptr_t)JIT_HOLE(BLOCK);
+    return true;
+}
+
+/* Calls predict the return through the shadow stack, RIP is the return address. */
+#define CALL_PUSH(target) \
+    push_64(emu, JIT_HOLE(RIP)); \
+    x64shadow_push(&emu->shadow, JIT_HOLE(RIP), \
+                   (x64block_t *)(uintptr_t)JIT_HOLE(BLOCK), (void *)(uintptr_t)JIT_HOLE(RETURN)); \
+    r_rip = target;
+
+/** CALL rel32 */
+STENCIL(call) {
+    CALL_PUSH(JIT_HOLE(TARGET))
+    LINK();
+}
+
+/* Indirect exits, TARGET and LINK are the first entry of the inline cache.
+   On a mismatch they continue with `leave`. */
+#define IC_EXIT() \
+    if (r_rip == JIT_HOLE(TARGET)) \
+        LINK(); \
+    CONTINUE();
+
+/** RET and RET imm16, continues after the call if the shadow stack predicts it. */
+STENCIL(ret) {
+    r_rip = pop_64(emu);
+    r_rsp += JIT_HOLE(IMM);
+
+    x64shadow_entry_t *entry = x64shadow_pop(&emu->shadow, r_rip);
+    if (entry && entry->code)
+        MUSTTAIL return ((x64jitcode_t)entry->code)(emu, ea);
+    IC_EXIT();
+}
+
+/** JMP r64 */
+STENCIL(jmp_r) {
+    r_rip = emu->regs[JIT_HOLE(SRC)].uq[0];
+    IC_EXIT();
+}
+
+/** JMP m64 */
+STENCIL(jmp_m) {
+    r_rip = *(uint64_t *)ea;
+    IC_EXIT();
+}
+
+/** CALL r64 */
+STENCIL(call_r) {
+    uint64_t target = emu->regs[JIT_HOLE(SRC)].uq[0];
+    CALL_PUSH(target)
+    IC_EXIT();
+}
+
+/** CALL m64 */
+STENCIL(call_m) {
+    uint64_t target = *(uint64_t *)ea;
+    CALL_PUSH(target)
+    IC_EXIT();
+}
+
+/* Jcc, falls through to the exit to the next instruction. */
+#define STENCIL_JCC(cc) \
+    STENCIL(jcc_ ## cc) { \
+        if (x64execute_jmp_cond(emu, NULL, 0x ## cc)) { \
+            r_rip = JIT_HOLE(TARGET); \
+            LINK(); \
+        } \
+        CONTINUE(); \
+    }
+
+STENCIL_JCC(0) STENCIL_JCC(1) STENCIL_JCC(2) STENCIL_JCC(3)
+STENCIL_JCC(4) STENCIL_JCC(5) STENCIL_JCC(6) STENCIL_JCC(7)
+STENCIL_JCC(8) STENCIL_JCC(9) STENCIL_JCC(A) STENCIL_JCC(B)
+STENCIL_JCC(C) STENCIL_JCC(D) STENCIL_JCC(E) STENCIL_JCC(F)
+
+
+/* Anything else runs the interpreter handler on a copy of the
+   instruction followed by the block terminator. */
+
+STENCIL(interp) {
+    r_rip = JIT_HOLE(RIP);
+    x64handler_t handler = (x64handler_t)(uintptr_t)JIT_HOLE(HANDLER);
+    if (!handler(emu, (x64instr_t *)(uintptr_t)JIT_HOLE(INSTR)))
+        return false;
+    CONTINUE();
+}
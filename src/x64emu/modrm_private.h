@@ -0,0 +1,57 @@
+#ifndef __X64MODRM_PRIVATE_H_
+#define __X64MODRM_PRIVATE_H_
+
+#include <stdint.h>
+
+#include "x64emu.h"
+#include "x64instr.h"
+#include "x64modrm.h"
+
+#include "regs_private.h"
+
+/* Effective address computation for each addressing form. */
+
+static inline void *x64modrm_ea_reg(x64emu_t *emu, x64instr_t *ins) {
+    return emu->regs + ins->ea_base;
+}
+
+static inline void *x64modrm_ea_base(x64emu_t *emu, x64instr_t *ins) {
+    return (void *)(emu->regs[ins->ea_base].uq[0] + ins->displ.sq[0]);
+}
+
+static inline void *x64modrm_ea_base_index(x64emu_t *emu, x64instr_t *ins) {
+    return (void *)(emu->regs[ins->ea_base].uq[0] +
+                    (emu->regs[ins->ea_index].uq[0] << ins->sib.scale) + ins->displ.sq[0]);
+}
+
+static inline void *x64modrm_ea_index(x64emu_t *emu, x64instr_t *ins) {
+    return (void *)((emu->regs[ins->ea_index].uq[0] << ins->sib.scale) + ins->displ.sq[0]);
+}
+
+static inline void *x64modrm_ea_abs(x64emu_t *emu, x64instr_t *ins) {
+    return (void *)ins->displ.sq[0];
+}
+
+static inline void *x64modrm_ea_rip(x64emu_t *emu, x64instr_t *ins) {
+    return (void *)(x64instr_next(ins, r_rip) + ins->displ.sq[0]);
+}
+
+/** Effective address of r/m operand in any form but `X64_AMODE_GENERIC`. */
+static inline void *x64modrm_ea(x64emu_t *emu, x64instr_t *ins) {
+    switch (ins->amode) {
+        case X64_AMODE_REG:        return x64modrm_ea_reg(emu, ins);
+        case X64_AMODE_BASE:       return x64modrm_ea_base(emu, ins);
+        case X64_AMODE_BASE_INDEX: return x64modrm_ea_base_index(emu, ins);
+        case X64_AMODE_INDEX:      return x64modrm_ea_index(emu, ins);
+        case X64_AMODE_ABS:        return x64modrm_ea_abs(emu, ins);
+        case X64_AMODE_RIP:        return x64modrm_ea_rip(emu, ins);
+    }
+    return NULL;
+}
+
+/** GPR selected by ModR/M reg field. */
+static inline void *x64modrm_reg(x64emu_t *emu, x64instr_t *ins) {
+    return emu->regs + (ins->modrm.reg | (ins->rex.r << 3));
+}
+
+#endif /* __X64MODRM_PRIVATE_H_ */
@@ -0,0 +1,69 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <fenv.h>
+
+#include "debug.h"
+#include "x64emu.h"
+#include "x64mxcsr.h"
+
+SET_DEBUG_CHANNEL("X64MXCSR")
+
+#if defined(__x86_64__)
+
+/* The host has MXCSR of its own, guest flags are kept in it as they are raised. */
+
+void x64mxcsr_load(x64emu_t *emu, uint32_t mxcsr) {
+    if ((mxcsr & X64_MXCSR_MASKS) != X64_MXCSR_MASKS)
+        log_warn("Unmasked SSE exceptions are not delivered, MXCSR 0x%x", mxcsr);
+
+    emu->mxcsr = mxcsr & 0xFFFF;
+    __builtin_ia32_ldmxcsr((emu->mxcsr & ~X64_MXCSR_MASKS) | X64_MXCSR_MASKS);
+}
+
+uint32_t x64mxcsr_store(x64emu_t *emu) {
+    return (emu->mxcsr & ~X64_MXCSR_FLAGS) | (__builtin_ia32_stmxcsr() & X64_MXCSR_FLAGS);
+}
+
+#else
+
+/* Portable fallback through fenv, FTZ/DAZ and DE have no equivalent there. */
+
+static const struct {
+    uint32_t guest;
+    int      host;
+} mxcsr_excepts[] = {
+    { X64_MXCSR_IE, FE_INVALID },
+    { X64_MXCSR_ZE, FE_DIVBYZERO },
+    { X64_MXCSR_OE, FE_OVERFLOW },
+    { X64_MXCSR_UE, FE_UNDERFLOW },
+    { X64_MXCSR_PE, FE_INEXACT },
+};
+
+static const int mxcsr_rounding[4] = { FE_TONEAREST, FE_DOWNWARD, FE_UPWARD, FE_TOWARDZERO };
+
+void x64mxcsr_load(x64emu_t *emu, uint32_t mxcsr) {
+    if ((mxcsr & X64_MXCSR_MASKS) != X64_MXCSR_MASKS)
+        log_warn("Unmasked SSE exceptions are not delivered, MXCSR 0x%x", mxcsr);
+    if (mxcsr & (X64_MXCSR_FTZ | X64_MXCSR_DAZ))
+        log_warn("FTZ/DAZ are not supported on this host, MXCSR 0x%x", mxcsr);
+
+    emu->mxcsr = mxcsr & 0xFFFF;
+    fesetround(mxcsr_rounding[(mxcsr & X64_MXCSR_RC) >> 13]);
+    feclearexcept(FE_ALL_EXCEPT);
+    for (size_t i = 0; i < sizeof(mxcsr_excepts) / sizeof(mxcsr_excepts[0]); i++) {
+        if (mxcsr & mxcsr_excepts[i].guest)
+            feraiseexcept(mxcsr_excepts[i].host);
+    }
+}
+
+uint32_t x64mxcsr_store(x64emu_t *emu) {
+    uint32_t mxcsr = emu->mxcsr & ~(X64_MXCSR_FLAGS & ~X64_MXCSR_DE);
+
+    for (size_t i = 0; i < sizeof(mxcsr_excepts) / sizeof(mxcsr_excepts[0]); i++) {
+        if (fetestexcept(mxcsr_excepts[i].host))
+            mxcsr |= mxcsr_excepts[i].guest;
+    }
+    return mxcsr;
+}
+
+#endif
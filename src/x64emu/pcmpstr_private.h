@@ -0,0 +1,156 @@
+#ifndef __X64PCMPSTR_PRIVATE_H_
+#define __X64PCMPSTR_PRIVATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "simd_private.h"
+
+/*
+ * Kernels of the SSE4.2 string instructions PCMPESTRI/PCMPESTRM and
+ * PCMPISTRI/PCMPISTRM. `a` is the first operand (xmm1, the set, ranges
+ * or needle), `b` the second one (xmm2/m128, the text). Each element of
+ * `a` is compared against all of `b` at once with a host vector compare,
+ * results are kept as bit masks with one bit per element of `b`.
+ *
+ * imm8 controls:
+ *   [1:0] elements: unsigned bytes, unsigned words, signed bytes, signed words
+ *   [3:2] aggregation: equal any, ranges, equal each, equal ordered
+ *   [5:4] polarity: positive, negative, positive, masked negative
+ *   [6]   least or most significant index, bit or element mask
+ */
+
+#define PCMPSTR_WORDS    0x01
+#define PCMPSTR_SIGNED   0x02
+#define PCMPSTR_AGG      0x0C
+#define PCMPSTR_ANY      0x00
+#define PCMPSTR_RANGES   0x04
+#define PCMPSTR_EACH     0x08
+#define PCMPSTR_ORDERED  0x0C
+#define PCMPSTR_NEGATE   0x10
+#define PCMPSTR_MASKED   0x20
+#define PCMPSTR_MSB      0x40
+
+/** Result of the comparison, what the instructions output is taken from. */
+typedef struct {
+    uint32_t res;       /* IntRes2, one bit per element */
+    uint8_t  n;         /* 16 bytes or 8 words */
+    uint8_t  len_a;     /* valid elements of `a` */
+    uint8_t  len_b;     /* valid elements of `b` */
+} pcmpstr_t;
+
+/** Bit mask of the byte mask `m` of 16 bit lanes, one bit per lane. */
+static inline uint32_t pcmpstr_words(uint32_t m) {
+    m &= 0x5555;
+    m = (m | m >> 1) & 0x3333;
+    m = (m | m >> 2) & 0x0F0F;
+    return (m | m >> 4) & 0x00FF;
+}
+
+/** One bit per element of the lane mask `m`. */
+static inline uint32_t pcmpstr_bits(simd_t m, bool words) {
+    uint32_t bytes = simd_movmsk8(m);
+    return words ? pcmpstr_words(bytes) : bytes;
+}
+
+/** Length of the null-terminated string in `v`, PCMPISTRx. */
+static inline uint8_t pcmpstr_implicit(simd_t v, bool words) {
+    simd_t z = words ? (simd_t)((simd_u16_t)v == 0) : (simd_t)((simd_u8_t)v == 0);
+    uint32_t m = pcmpstr_bits(z, words);
+    return m ? __builtin_ctz(m) : (words ? 8 : 16);
+}
+
+/** Length given in a register, PCMPESTRx: absolute value saturated to the element count. */
+static inline uint8_t pcmpstr_explicit(int64_t len, bool words) {
+    uint64_t n = words ? 8 : 16;
+    uint64_t l = len < 0 ? -(uint64_t)len : (uint64_t)len;
+    return l < n ? l : n;
+}
+
+/**
+ * Elements of `b` equal to element `i` of `a`, or for ranges greater or
+ * equal with even `i` and less or equal with odd `i`.
+ */
+#define PCMPSTR_CMP(vec_t, a, b, i, ranges) \
+    ({ \
+        vec_t _x = (vec_t)(a), _y = (vec_t)(b), _s = (vec_t){ 0 } + _x[i]; \
+        (simd_t)(!(ranges) ? _y == _s : ((i) & 1) ? _y <= _s : _y >= _s); \
+    })
+
+static inline uint32_t pcmpstr_cmp(simd_t a, simd_t b, int i, uint8_t imm, bool ranges) {
+    switch (imm & (PCMPSTR_WORDS | PCMPSTR_SIGNED)) {
+        case 0:  return pcmpstr_bits(PCMPSTR_CMP(simd_u8_t, a, b, i, ranges), false);
+        case 1:  return pcmpstr_bits(PCMPSTR_CMP(simd_u16_t, a, b, i, ranges), true);
+        case 2:  return pcmpstr_bits(PCMPSTR_CMP(simd_s8_t, a, b, i, ranges), false);
+        default: return pcmpstr_bits(PCMPSTR_CMP(simd_s16_t, a, b, i, ranges), true);
+    }
+}
+
+/**
+ * Compare `a` holding `len_a` valid elements with `b` holding `len_b`.
+ * Invalid elements compare as x86 forces them: false for equal any and
+ * ranges, true between two invalid ones for equal each, and true for
+ * an invalid element of `a` in equal ordered.
+ */
+static inline pcmpstr_t pcmpstr(simd_t a, simd_t b, uint8_t len_a, uint8_t len_b, uint8_t imm) {
+    bool words = imm & PCMPSTR_WORDS;
+    uint8_t n = words ? 8 : 16;
+    uint32_t all = (1u << n) - 1;
+    uint32_t valid_a = (1u << len_a) - 1, valid_b = (1u << len_b) - 1;
+    uint32_t res = 0;
+
+    switch (imm & PCMPSTR_AGG) {
+        case PCMPSTR_ANY:
+            for (int i = 0; i < len_a; i++)
+                res |= pcmpstr_cmp(a, b, i, imm, false);
+            res &= valid_b;
+            break;
+
+        case PCMPSTR_RANGES:
+            for (int i = 0; i + 1 < len_a; i += 2)
+                res |= pcmpstr_cmp(a, b, i, imm, true) & pcmpstr_cmp(a, b, i + 1, imm, true);
+            res &= valid_b;
+            break;
+
+        case PCMPSTR_EACH: {
+            simd_t eq = words ? (simd_t)((simd_u16_t)a == (simd_u16_t)b) : (simd_t)((simd_u8_t)a == (simd_u8_t)b);
+            res = (pcmpstr_bits(eq, words) & valid_a & valid_b) | (~valid_a & ~valid_b & all);
+            break;
+        }
+
+        case PCMPSTR_ORDERED:
+            /* Needle element i must match at j + i, or run past the end of `b`. */
+            res = all;
+            for (int i = 0; i < len_a; i++)
+                res &= ((pcmpstr_cmp(a, b, i, imm, false) & valid_b) >> i) | (all & ~(all >> i));
+            break;
+    }
+
+    if (imm & PCMPSTR_NEGATE)
+        res ^= imm & PCMPSTR_MASKED ? valid_b : all;
+
+    return (pcmpstr_t){ res, n, len_a, len_b };
+}
+
+/** @return PCMPxSTRI index, the element count if no bit is set. */
+static inline uint32_t pcmpstr_index(pcmpstr_t r, uint8_t imm) {
+    if (!r.res) return r.n;
+    return imm & PCMPSTR_MSB ? 31 - __builtin_clz(r.res) : __builtin_ctz(r.res);
+}
+
+/** @return PCMPxSTRM mask, bits zero-extended or elements expanded. */
+static inline simd_t pcmpstr_mask(pcmpstr_t r, uint8_t imm) {
+    if (!(imm & PCMPSTR_MSB))
+        return (simd_t){ r.res, 0 };
+
+    if (r.n == 8) {
+        simd_u16_t bit = { 1, 2, 4, 8, 16, 32, 64, 128 };
+        return (simd_t)((((simd_u16_t){ 0 } + (uint16_t)r.res) & bit) != 0);
+    }
+    uint8_t lo = r.res, hi = r.res >> 8;
+    simd_u8_t v = { lo, lo, lo, lo, lo, lo, lo, lo, hi, hi, hi, hi, hi, hi, hi, hi };
+    simd_u8_t bit = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    return (simd_t)((v & bit) != 0);
+}
+
+#endif /* __X64PCMPSTR_PRIVATE_H_ */
@@ -0,0 +1,667 @@
+#ifndef __X64SIMD_PRIVATE_H_
+#define __X64SIMD_PRIVATE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Kernels of packed integer instructions on 128 bit host vectors.
+ * They are written with GCC vector extensions, which become SSE2 on x86-64
+ * hosts, NEON on AArch64 and plain scalar code anywhere else.
+ * Vectors are loaded and stored with memcpy, guest operands need no alignment.
+ *
+ * 64 bit MMX operands are zero-extended to the low half. Lane-wise kernels
+ * then work on them as they are, the few others have `simd_mmx_*` variants.
+ */
+
+typedef int8_t   simd_s8_t   __attribute__((vector_size(16)));
+typedef uint8_t  simd_u8_t   __attribute__((vector_size(16)));
+typedef int16_t  simd_s16_t  __attribute__((vector_size(16)));
+typedef uint16_t simd_u16_t  __attribute__((vector_size(16)));
+typedef int32_t  simd_s32_t  __attribute__((vector_size(16)));
+typedef uint32_t simd_u32_t  __attribute__((vector_size(16)));
+typedef int64_t  simd_s64_t  __attribute__((vector_size(16)));
+typedef uint64_t simd_u64_t  __attribute__((vector_size(16)));
+
+/* Twice as many lanes of twice the width, for saturation and high products. */
+typedef int16_t  simd_s16x16_t __attribute__((vector_size(32)));
+typedef uint16_t simd_u16x16_t __attribute__((vector_size(32)));
+typedef int32_t  simd_s32x8_t  __attribute__((vector_size(32)));
+typedef uint32_t simd_u32x8_t  __attribute__((vector_size(32)));
+
+/* Halves of the packed results, and sources of the widening moves. */
+typedef int8_t   simd_s8x8_t   __attribute__((vector_size(8)));
+typedef uint8_t  simd_u8x8_t   __attribute__((vector_size(8)));
+typedef int16_t  simd_s16x4_t  __attribute__((vector_size(8)));
+typedef uint16_t simd_u16x4_t  __attribute__((vector_size(8)));
+typedef int32_t  simd_s32x2_t  __attribute__((vector_size(8)));
+typedef uint32_t simd_u32x2_t  __attribute__((vector_size(8)));
+typedef int8_t   simd_s8x4_t   __attribute__((vector_size(4)));
+typedef uint8_t  simd_u8x4_t   __attribute__((vector_size(4)));
+typedef int16_t  simd_s16x2_t  __attribute__((vector_size(4)));
+typedef uint16_t simd_u16x2_t  __attribute__((vector_size(4)));
+typedef int8_t   simd_s8x2_t   __attribute__((vector_size(2)));
+typedef uint8_t  simd_u8x2_t   __attribute__((vector_size(2)));
+
+/** Generic operand, kernels view it with the lanes they need. */
+typedef simd_u64_t simd_t;
+
+/** Lanes of `a` where the comparison mask `m` is set, of `b` elsewhere. */
+#define SIMD_SELECT(m, a, b) \
+    (((__typeof__(a))(m) & (a)) | (~(__typeof__(a))(m) & (b)))
+
+/** `v` clamped to `lo`..`hi`. */
+#define SIMD_CLAMP(v, lo, hi) \
+    SIMD_SELECT((v) < (lo), (__typeof__(v)){ 0 } + (lo), \
+                SIMD_SELECT((v) > (hi), (__typeof__(v)){ 0 } + (hi), (v)))
+
+static inline simd_t simd_load(const void *p) {
+    simd_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void simd_store(void *p, simd_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+/** @return 64 bits at `p` zero-extended. */
+static inline simd_t simd_load64(const void *p) {
+    simd_t v = { 0, 0 };
+    memcpy(&v, p, 8);
+    return v;
+}
+
+/** Store the low 64 bits. */
+static inline void simd_store64(void *p, simd_t v) {
+    memcpy(p, &v, 8);
+}
+
+/* Wrapping arithmetic. */
+
+static inline simd_t simd_add8(simd_t a, simd_t b)  { return (simd_t)((simd_u8_t)a + (simd_u8_t)b); }
+static inline simd_t simd_add16(simd_t a, simd_t b) { return (simd_t)((simd_u16_t)a + (simd_u16_t)b); }
+static inline simd_t simd_add32(simd_t a, simd_t b) { return (simd_t)((simd_u32_t)a + (simd_u32_t)b); }
+static inline simd_t simd_add64(simd_t a, simd_t b) { return a + b; }
+static inline simd_t simd_sub8(simd_t a, simd_t b)  { return (simd_t)((simd_u8_t)a - (simd_u8_t)b); }
+static inline simd_t simd_sub16(simd_t a, simd_t b) { return (simd_t)((simd_u16_t)a - (simd_u16_t)b); }
+static inline simd_t simd_sub32(simd_t a, simd_t b) { return (simd_t)((simd_u32_t)a - (simd_u32_t)b); }
+static inline simd_t simd_sub64(simd_t a, simd_t b) { return a - b; }
+
+/* Saturating arithmetic. */
+
+static inline simd_t simd_addus8(simd_t a, simd_t b) {
+    simd_u8_t r = (simd_u8_t)a + (simd_u8_t)b;
+    return (simd_t)(r | (simd_u8_t)(r < (simd_u8_t)a));
+}
+
+static inline simd_t simd_addus16(simd_t a, simd_t b) {
+    simd_u16_t r = (simd_u16_t)a + (simd_u16_t)b;
+    return (simd_t)(r | (simd_u16_t)(r < (simd_u16_t)a));
+}
+
+static inline simd_t simd_subus8(simd_t a, simd_t b) {
+    simd_u8_t r = (simd_u8_t)a - (simd_u8_t)b;
+    return (simd_t)(r & ~(simd_u8_t)((simd_u8_t)a < (simd_u8_t)b));
+}
+
+static inline simd_t simd_subus16(simd_t a, simd_t b) {
+    simd_u16_t r = (simd_u16_t)a - (simd_u16_t)b;
+    return (simd_t)(r & ~(simd_u16_t)((simd_u16_t)a < (simd_u16_t)b));
+}
+
+static inline simd_t simd_adds8(simd_t a, simd_t b) {
+    simd_s16x16_t r = __builtin_convertvector((simd_s8_t)a, simd_s16x16_t) +
+                      __builtin_convertvector((simd_s8_t)b, simd_s16x16_t);
+    return (simd_t)__builtin_convertvector(SIMD_CLAMP(r, INT8_MIN, INT8_MAX), simd_s8_t);
+}
+
+static inline simd_t simd_subs8(simd_t a, simd_t b) {
+    simd_s16x16_t r = __builtin_convertvector((simd_s8_t)a, simd_s16x16_t) -
+                      __builtin_convertvector((simd_s8_t)b, simd_s16x16_t);
+    return (simd_t)__builtin_convertvector(SIMD_CLAMP(r, INT8_MIN, INT8_MAX), simd_s8_t);
+}
+
+static inline simd_t simd_adds16(simd_t a, simd_t b) {
+    simd_s32x8_t r = __builtin_convertvector((simd_s16_t)a, simd_s32x8_t) +
+                     __builtin_convertvector((simd_s16_t)b, simd_s32x8_t);
+    return (simd_t)__builtin_convertvector(SIMD_CLAMP(r, INT16_MIN, INT16_MAX), simd_s16_t);
+}
+
+static inline simd_t simd_subs16(simd_t a, simd_t b) {
+    simd_s32x8_t r = __builtin_convertvector((simd_s16_t)a, simd_s32x8_t) -
+                     __builtin_convertvector((simd_s16_t)b, simd_s32x8_t);
+    return (simd_t)__builtin_convertvector(SIMD_CLAMP(r, INT16_MIN, INT16_MAX), simd_s16_t);
+}
+
+/* Logic, ANDN is `~a & b` as PANDN has it. */
+
+static inline simd_t simd_and(simd_t a, simd_t b)  { return a & b; }
+static inline simd_t simd_andn(simd_t a, simd_t b) { return ~a & b; }
+static inline simd_t simd_or(simd_t a, simd_t b)   { return a | b; }
+static inline simd_t simd_xor(simd_t a, simd_t b)  { return a ^ b; }
+
+/* Comparisons, lanes become all ones where true. */
+
+static inline simd_t simd_cmpeq8(simd_t a, simd_t b)  { return (simd_t)((simd_u8_t)a == (simd_u8_t)b); }
+static inline simd_t simd_cmpeq16(simd_t a, simd_t b) { return (simd_t)((simd_u16_t)a == (simd_u16_t)b); }
+static inline simd_t simd_cmpeq32(simd_t a, simd_t b) { return (simd_t)((simd_u32_t)a == (simd_u32_t)b); }
+static inline simd_t simd_cmpgt8(simd_t a, simd_t b)  { return (simd_t)((simd_s8_t)a > (simd_s8_t)b); }
+static inline simd_t simd_cmpgt16(simd_t a, simd_t b) { return (simd_t)((simd_s16_t)a > (simd_s16_t)b); }
+static inline simd_t simd_cmpgt32(simd_t a, simd_t b) { return (simd_t)((simd_s32_t)a > (simd_s32_t)b); }
+
+/* Minimum and maximum. */
+
+static inline simd_t simd_minu8(simd_t a, simd_t b) {
+    return (simd_t)SIMD_SELECT((simd_u8_t)a < (simd_u8_t)b, (simd_u8_t)a, (simd_u8_t)b);
+}
+
+static inline simd_t simd_maxu8(simd_t a, simd_t b) {
+    return (simd_t)SIMD_SELECT((simd_u8_t)a > (simd_u8_t)b, (simd_u8_t)a, (simd_u8_t)b);
+}
+
+static inline simd_t simd_mins16(simd_t a, simd_t b) {
+    return (simd_t)SIMD_SELECT((simd_s16_t)a < (simd_s16_t)b, (simd_s16_t)a, (simd_s16_t)b);
+}
+
+static inline simd_t simd_maxs16(simd_t a, simd_t b) {
+    return (simd_t)SIMD_SELECT((simd_s16_t)a > (simd_s16_t)b, (simd_s16_t)a, (simd_s16_t)b);
+}
+
+/* Averages, rounded up. */
+
+static inline simd_t simd_avgu8(simd_t a, simd_t b) {
+    simd_u16x16_t r = __builtin_convertvector((simd_u8_t)a, simd_u16x16_t) +
+                      __builtin_convertvector((simd_u8_t)b, simd_u16x16_t) + 1;
+    return (simd_t)__builtin_convertvector(r >> 1, simd_u8_t);
+}
+
+static inline simd_t simd_avgu16(simd_t a, simd_t b) {
+    simd_u32x8_t r = __builtin_convertvector((simd_u16_t)a, simd_u32x8_t) +
+                     __builtin_convertvector((simd_u16_t)b, simd_u32x8_t) + 1;
+    return (simd_t)__builtin_convertvector(r >> 1, simd_u16_t);
+}
+
+/* Multiplication. */
+
+static inline simd_t simd_mullo16(simd_t a, simd_t b) {
+    return (simd_t)((simd_u16_t)a * (simd_u16_t)b);
+}
+
+static inline simd_t simd_mulhs16(simd_t a, simd_t b) {
+    simd_s32x8_t r = __builtin_convertvector((simd_s16_t)a, simd_s32x8_t) *
+                     __builtin_convertvector((simd_s16_t)b, simd_s32x8_t);
+    return (simd_t)__builtin_convertvector(r >> 16, simd_s16_t);
+}
+
+static inline simd_t simd_mulhu16(simd_t a, simd_t b) {
+    simd_u32x8_t r = __builtin_convertvector((simd_u16_t)a, simd_u32x8_t) *
+                     __builtin_convertvector((simd_u16_t)b, simd_u32x8_t);
+    return (simd_t)__builtin_convertvector(r >> 16, simd_u16_t);
+}
+
+/** Unsigned products of the even dwords, PMULUDQ. */
+static inline simd_t simd_mulu32(simd_t a, simd_t b) {
+    return (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+}
+
+/** Sums of products of adjacent words, PMADDWD. */
+static inline simd_t simd_madd16(simd_t a, simd_t b) {
+    simd_s32x8_t p = __builtin_convertvector((simd_s16_t)a, simd_s32x8_t) *
+                     __builtin_convertvector((simd_s16_t)b, simd_s32x8_t);
+    simd_s32_t r;
+    for (int i = 0; i < 4; i++)
+        r[i] = (int32_t)((uint32_t)p[2 * i] + (uint32_t)p[2 * i + 1]);
+    return (simd_t)r;
+}
+
+/** Sums of absolute differences of bytes of each qword, PSADBW. */
+static inline simd_t simd_sadu8(simd_t a, simd_t b) {
+    simd_u8_t x = (simd_u8_t)a, y = (simd_u8_t)b;
+    simd_u8_t d = SIMD_SELECT(x > y, x - y, y - x);
+    simd_t r = { 0, 0 };
+    for (int i = 0; i < 16; i++)
+        r[i / 8] += d[i];
+    return r;
+}
+
+/* Shifts by a count, counts past the lane width clear it, or fill it with the sign. */
+
+#define SIMD_SHIFT(name, v_type, w, op, max) \
+    static inline simd_t simd_ ## name(simd_t a, uint64_t count) { \
+        if (count > (w) - 1) { \
+            if (!(max)) return (simd_t){ 0, 0 }; \
+            count = (w) - 1; \
+        } \
+        return (simd_t)((v_type)a op (int)count); \
+    }
+
+SIMD_SHIFT(sll16, simd_u16_t, 16, <<, false)
+SIMD_SHIFT(sll32, simd_u32_t, 32, <<, false)
+SIMD_SHIFT(sll64, simd_u64_t, 64, <<, false)
+SIMD_SHIFT(srl16, simd_u16_t, 16, >>, false)
+SIMD_SHIFT(srl32, simd_u32_t, 32, >>, false)
+SIMD_SHIFT(srl64, simd_u64_t, 64, >>, false)
+SIMD_SHIFT(sra16, simd_s16_t, 16, >>, true)
+SIMD_SHIFT(sra32, simd_s32_t, 32, >>, true)
+
+#undef SIMD_SHIFT
+
+/** Whole vector shifted left by `count` bytes, PSLLDQ. */
+static inline simd_t simd_slldq(simd_t a, uint64_t count) {
+    if (count > 15) return (simd_t){ 0, 0 };
+    const simd_u8_t lanes = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    /* Lanes below `count` come from the zero vector. */
+    simd_u8_t idx = SIMD_SELECT(lanes < (uint8_t)count, lanes + 16, lanes - (uint8_t)count);
+    return (simd_t)__builtin_shuffle((simd_u8_t)a, (simd_u8_t){ 0 }, idx);
+}
+
+/** Whole vector shifted right by `count` bytes, PSRLDQ. */
+static inline simd_t simd_srldq(simd_t a, uint64_t count) {
+    if (count > 15) return (simd_t){ 0, 0 };
+    const simd_u8_t lanes = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    return (simd_t)__builtin_shuffle((simd_u8_t)a, (simd_u8_t){ 0 }, lanes + (uint8_t)count);
+}
+
+/* Interleaving the low or high halves of `a` and `b`. */
+
+static inline simd_t simd_unpacklo8(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u8_t)a, (simd_u8_t)b,
+        (simd_u8_t){ 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23 });
+}
+
+static inline simd_t simd_unpackhi8(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u8_t)a, (simd_u8_t)b,
+        (simd_u8_t){ 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31 });
+}
+
+static inline simd_t simd_unpacklo16(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, (simd_u16_t){ 0, 8, 1, 9, 2, 10, 3, 11 });
+}
+
+static inline simd_t simd_unpackhi16(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, (simd_u16_t){ 4, 12, 5, 13, 6, 14, 7, 15 });
+}
+
+static inline simd_t simd_unpacklo32(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, (simd_u32_t){ 0, 4, 1, 5 });
+}
+
+static inline simd_t simd_unpackhi32(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, (simd_u32_t){ 2, 6, 3, 7 });
+}
+
+static inline simd_t simd_unpacklo64(simd_t a, simd_t b) {
+    return (simd_t){ a[0], b[0] };
+}
+
+static inline simd_t simd_unpackhi64(simd_t a, simd_t b) {
+    return (simd_t){ a[1], b[1] };
+}
+
+/* Narrowing with saturation, lanes of `a` go to the low half, of `b` to the high one. */
+
+static inline simd_t simd_packss16(simd_t a, simd_t b) {
+    simd_s8x8_t lo = __builtin_convertvector(SIMD_CLAMP((simd_s16_t)a, INT8_MIN, INT8_MAX), simd_s8x8_t);
+    simd_s8x8_t hi = __builtin_convertvector(SIMD_CLAMP((simd_s16_t)b, INT8_MIN, INT8_MAX), simd_s8x8_t);
+    simd_t r;
+    memcpy(&r, &lo, 8);
+    memcpy((uint8_t *)&r + 8, &hi, 8);
+    return r;
+}
+
+static inline simd_t simd_packus16(simd_t a, simd_t b) {
+    simd_u8x8_t lo = __builtin_convertvector(SIMD_CLAMP((simd_s16_t)a, 0, UINT8_MAX), simd_u8x8_t);
+    simd_u8x8_t hi = __builtin_convertvector(SIMD_CLAMP((simd_s16_t)b, 0, UINT8_MAX), simd_u8x8_t);
+    simd_t r;
+    memcpy(&r, &lo, 8);
+    memcpy((uint8_t *)&r + 8, &hi, 8);
+    return r;
+}
+
+static inline simd_t simd_packss32(simd_t a, simd_t b) {
+    simd_s16x4_t lo = __builtin_convertvector(SIMD_CLAMP((simd_s32_t)a, INT16_MIN, INT16_MAX), simd_s16x4_t);
+    simd_s16x4_t hi = __builtin_convertvector(SIMD_CLAMP((simd_s32_t)b, INT16_MIN, INT16_MAX), simd_s16x4_t);
+    simd_t r;
+    memcpy(&r, &lo, 8);
+    memcpy((uint8_t *)&r + 8, &hi, 8);
+    return r;
+}
+
+/* Shuffles by the immediate, two bits select each lane. */
+
+static inline simd_t simd_shuffle32(simd_t a, uint8_t imm) {
+    simd_u32_t idx = { imm & 3, (imm >> 2) & 3, (imm >> 4) & 3, imm >> 6 };
+    return (simd_t)__builtin_shuffle((simd_u32_t)a, idx);
+}
+
+static inline simd_t simd_shufflelo16(simd_t a, uint8_t imm) {
+    simd_u16_t idx = { imm & 3, (imm >> 2) & 3, (imm >> 4) & 3, imm >> 6, 4, 5, 6, 7 };
+    return (simd_t)__builtin_shuffle((simd_u16_t)a, idx);
+}
+
+static inline simd_t simd_shufflehi16(simd_t a, uint8_t imm) {
+    simd_u16_t idx = { 0, 1, 2, 3, 4 + (imm & 3), 4 + ((imm >> 2) & 3), 4 + ((imm >> 4) & 3), 4 + (imm >> 6) };
+    return (simd_t)__builtin_shuffle((simd_u16_t)a, idx);
+}
+
+/** Two dwords of `a` then two of `b`, SHUFPS. */
+static inline simd_t simd_shuffle2x32(simd_t a, simd_t b, uint8_t imm) {
+    simd_u32_t idx = { imm & 3, (imm >> 2) & 3, 4 + ((imm >> 4) & 3), 4 + (imm >> 6) };
+    return (simd_t)__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, idx);
+}
+
+/** A qword of `a` then one of `b`, SHUFPD. */
+static inline simd_t simd_shuffle2x64(simd_t a, simd_t b, uint8_t imm) {
+    return (simd_t){ a[imm & 1], b[(imm >> 1) & 1] };
+}
+
+/** @return Most significant bits of the bytes, PMOVMSKB. */
+static inline uint32_t simd_movmsk8(simd_t a) {
+#if defined(__SSE2__)
+    typedef char simd_char_t __attribute__((vector_size(16)));
+    return (uint16_t)__builtin_ia32_pmovmskb128((simd_char_t)a);
+#else
+    simd_s8_t m = (simd_s8_t)a < 0;
+    uint32_t r = 0;
+    for (int i = 0; i < 16; i++)
+        r |= (uint32_t)(m[i] & 1) << i;
+    return r;
+#endif
+}
+
+/*
+ * SSSE3, SSE4.1 and AVX2 kernels, their 256 bit forms run them on each
+ * 128 bit half. Unary ones take `b`, as the source operand it is.
+ */
+
+/** Bytes of `a` selected by the low 4 bits of those of `b`, zeros where its top bit is set, PSHUFB. */
+static inline simd_t simd_shuffle8(simd_t a, simd_t b) {
+    simd_u8_t r = __builtin_shuffle((simd_u8_t)a, (simd_u8_t)b & 15);
+    return (simd_t)(r & ~(simd_u8_t)((simd_s8_t)b < 0));
+}
+
+/** `a` above `b` shifted right by `count` bytes, low half of the result, PALIGNR. */
+static inline simd_t simd_alignr(simd_t a, simd_t b, uint8_t count) {
+    if (count > 15) return simd_srldq(a, count - 16);
+    return simd_srldq(b, count) | simd_slldq(a, 16 - count);
+}
+
+/* Absolute values, the most negative value stays as it is. */
+
+static inline simd_t simd_abs8(simd_t a, simd_t b) {
+    (void)a;
+    return (simd_t)SIMD_SELECT((simd_s8_t)b < 0, -(simd_u8_t)b, (simd_u8_t)b);
+}
+
+static inline simd_t simd_abs16(simd_t a, simd_t b) {
+    (void)a;
+    return (simd_t)SIMD_SELECT((simd_s16_t)b < 0, -(simd_u16_t)b, (simd_u16_t)b);
+}
+
+static inline simd_t simd_abs32(simd_t a, simd_t b) {
+    (void)a;
+    return (simd_t)SIMD_SELECT((simd_s32_t)b < 0, -(simd_u32_t)b, (simd_u32_t)b);
+}
+
+/* `a` negated where `b` is negative, cleared where it is zero, PSIGN. */
+
+#define SIMD_SIGN(name, s_type, u_type) \
+    static inline simd_t simd_ ## name(simd_t a, simd_t b) { \
+        u_type r = SIMD_SELECT((s_type)b < 0, -(u_type)a, (u_type)a); \
+        return (simd_t)(r & ~(u_type)((s_type)b == 0)); \
+    }
+
+SIMD_SIGN(sign8,  simd_s8_t,  simd_u8_t)
+SIMD_SIGN(sign16, simd_s16_t, simd_u16_t)
+SIMD_SIGN(sign32, simd_s32_t, simd_u32_t)
+
+#undef SIMD_SIGN
+
+/* Horizontal sums and differences of adjacent lanes, pairs of `a` go to the low half. */
+
+#define SIMD_EVEN16 (simd_u16_t){ 0, 2, 4, 6, 8, 10, 12, 14 }
+#define SIMD_ODD16  (simd_u16_t){ 1, 3, 5, 7, 9, 11, 13, 15 }
+#define SIMD_EVEN32 (simd_u32_t){ 0, 2, 4, 6 }
+#define SIMD_ODD32  (simd_u32_t){ 1, 3, 5, 7 }
+
+static inline simd_t simd_hadd16(simd_t a, simd_t b) {
+    return (simd_t)(__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_EVEN16) +
+                    __builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_ODD16));
+}
+
+static inline simd_t simd_hsub16(simd_t a, simd_t b) {
+    return (simd_t)(__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_EVEN16) -
+                    __builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_ODD16));
+}
+
+static inline simd_t simd_hadd32(simd_t a, simd_t b) {
+    return (simd_t)(__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, SIMD_EVEN32) +
+                    __builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, SIMD_ODD32));
+}
+
+static inline simd_t simd_hsub32(simd_t a, simd_t b) {
+    return (simd_t)(__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, SIMD_EVEN32) -
+                    __builtin_shuffle((simd_u32_t)a, (simd_u32_t)b, SIMD_ODD32));
+}
+
+static inline simd_t simd_hadds16(simd_t a, simd_t b) {
+    return simd_adds16((simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_EVEN16),
+                       (simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_ODD16));
+}
+
+static inline simd_t simd_hsubs16(simd_t a, simd_t b) {
+    return simd_subs16((simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_EVEN16),
+                       (simd_t)__builtin_shuffle((simd_u16_t)a, (simd_u16_t)b, SIMD_ODD16));
+}
+
+#undef SIMD_EVEN16
+#undef SIMD_ODD16
+#undef SIMD_EVEN32
+#undef SIMD_ODD32
+
+/** Saturated sums of products of adjacent unsigned bytes of `a` and signed ones of `b`, PMADDUBSW. */
+static inline simd_t simd_maddubs16(simd_t a, simd_t b) {
+    simd_s16_t even = (simd_s16_t)((simd_u16_t)a & 0xFF) * (((simd_s16_t)b << 8) >> 8);
+    simd_s16_t odd = (simd_s16_t)((simd_u16_t)a >> 8) * ((simd_s16_t)b >> 8);
+    simd_s32x8_t r = __builtin_convertvector(even, simd_s32x8_t) + __builtin_convertvector(odd, simd_s32x8_t);
+    return (simd_t)__builtin_convertvector(SIMD_CLAMP(r, INT16_MIN, INT16_MAX), simd_s16_t);
+}
+
+/** High words of products scaled and rounded, PMULHRSW. */
+static inline simd_t simd_mulhrs16(simd_t a, simd_t b) {
+    simd_s32x8_t r = __builtin_convertvector((simd_s16_t)a, simd_s32x8_t) *
+                     __builtin_convertvector((simd_s16_t)b, simd_s32x8_t);
+    return (simd_t)__builtin_convertvector(((r >> 14) + 1) >> 1, simd_s16_t);
+}
+
+static inline simd_t simd_mullo32(simd_t a, simd_t b) {
+    return (simd_t)((simd_u32_t)a * (simd_u32_t)b);
+}
+
+/** Signed products of the even dwords, PMULDQ. */
+static inline simd_t simd_muls32(simd_t a, simd_t b) {
+    return (simd_t)((((simd_s64_t)a << 32) >> 32) * (((simd_s64_t)b << 32) >> 32));
+}
+
+#define SIMD_MINMAX(name, v_type, op) \
+    static inline simd_t simd_ ## name(simd_t a, simd_t b) { \
+        return (simd_t)SIMD_SELECT((v_type)a op (v_type)b, (v_type)a, (v_type)b); \
+    }
+
+SIMD_MINMAX(mins8,  simd_s8_t,  <)
+SIMD_MINMAX(maxs8,  simd_s8_t,  >)
+SIMD_MINMAX(minu16, simd_u16_t, <)
+SIMD_MINMAX(maxu16, simd_u16_t, >)
+SIMD_MINMAX(mins32, simd_s32_t, <)
+SIMD_MINMAX(maxs32, simd_s32_t, >)
+SIMD_MINMAX(minu32, simd_u32_t, <)
+SIMD_MINMAX(maxu32, simd_u32_t, >)
+
+#undef SIMD_MINMAX
+
+static inline simd_t simd_cmpeq64(simd_t a, simd_t b) { return (simd_t)(a == b); }
+static inline simd_t simd_cmpgt64(simd_t a, simd_t b) { return (simd_t)((simd_s64_t)a > (simd_s64_t)b); }
+
+static inline simd_t simd_packus32(simd_t a, simd_t b) {
+    simd_u16x4_t lo = __builtin_convertvector(SIMD_CLAMP((simd_s32_t)a, 0, UINT16_MAX), simd_u16x4_t);
+    simd_u16x4_t hi = __builtin_convertvector(SIMD_CLAMP((simd_s32_t)b, 0, UINT16_MAX), simd_u16x4_t);
+    simd_t r;
+    memcpy(&r, &lo, 8);
+    memcpy((uint8_t *)&r + 8, &hi, 8);
+    return r;
+}
+
+/** Smallest unsigned word to the low word, its index to the next one, PHMINPOSUW. */
+static inline simd_t simd_minpos16(simd_t a, simd_t b) {
+    simd_u16_t v = (simd_u16_t)b;
+    uint16_t min = v[0], idx = 0;
+    (void)a;
+    for (int i = 1; i < 8; i++)
+        if (v[i] < min) min = v[i], idx = i;
+    return (simd_t){ min | (uint32_t)idx << 16, 0 };
+}
+
+/* Lanes widened from the low ones with sign or zero extension, PMOVSX and PMOVZX. */
+
+#define SIMD_EXTEND(name, from_type, to_type) \
+    static inline simd_t simd_ ## name(simd_t a, simd_t b) { \
+        from_type v; \
+        (void)a; \
+        memcpy(&v, &b, sizeof(v)); \
+        return (simd_t)__builtin_convertvector(v, to_type); \
+    }
+
+SIMD_EXTEND(movsx8to16,  simd_s8x8_t,  simd_s16_t)
+SIMD_EXTEND(movsx8to32,  simd_s8x4_t,  simd_s32_t)
+SIMD_EXTEND(movsx8to64,  simd_s8x2_t,  simd_s64_t)
+SIMD_EXTEND(movsx16to32, simd_s16x4_t, simd_s32_t)
+SIMD_EXTEND(movsx16to64, simd_s16x2_t, simd_s64_t)
+SIMD_EXTEND(movsx32to64, simd_s32x2_t, simd_s64_t)
+SIMD_EXTEND(movzx8to16,  simd_u8x8_t,  simd_u16_t)
+SIMD_EXTEND(movzx8to32,  simd_u8x4_t,  simd_u32_t)
+SIMD_EXTEND(movzx8to64,  simd_u8x2_t,  simd_u64_t)
+SIMD_EXTEND(movzx16to32, simd_u16x4_t, simd_u32_t)
+SIMD_EXTEND(movzx16to64, simd_u16x2_t, simd_u64_t)
+SIMD_EXTEND(movzx32to64, simd_u32x2_t, simd_u64_t)
+
+#undef SIMD_EXTEND
+
+/* Blends, lanes of `b` where the bit of `imm` or the top bit of the lane of `m` is set. */
+
+static inline simd_t simd_blend16(simd_t a, simd_t b, uint8_t imm) {
+    simd_u16_t bits = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    return (simd_t)SIMD_SELECT((((simd_u16_t){ 0 } + imm) & bits) != 0, (simd_u16_t)b, (simd_u16_t)a);
+}
+
+static inline simd_t simd_blend32(simd_t a, simd_t b, uint8_t imm) {
+    simd_u32_t bits = { 1, 2, 4, 8 };
+    return (simd_t)SIMD_SELECT((((simd_u32_t){ 0 } + imm) & bits) != 0, (simd_u32_t)b, (simd_u32_t)a);
+}
+
+static inline simd_t simd_blend64(simd_t a, simd_t b, uint8_t imm) {
+    simd_u64_t bits = { 1, 2 };
+    return SIMD_SELECT((((simd_u64_t){ 0 } + imm) & bits) != 0, b, a);
+}
+
+static inline simd_t simd_blendv8(simd_t a, simd_t b, simd_t m) {
+    return (simd_t)SIMD_SELECT((simd_s8_t)m < 0, (simd_u8_t)b, (simd_u8_t)a);
+}
+
+static inline simd_t simd_blendv32(simd_t a, simd_t b, simd_t m) {
+    return (simd_t)SIMD_SELECT((simd_s32_t)m < 0, (simd_u32_t)b, (simd_u32_t)a);
+}
+
+static inline simd_t simd_blendv64(simd_t a, simd_t b, simd_t m) {
+    return SIMD_SELECT((simd_s64_t)m < 0, b, a);
+}
+
+/* Shifts by the counts in the lanes of `b`, AVX2. */
+
+static inline simd_t simd_sllv32(simd_t a, simd_t b) {
+    simd_u32_t n = (simd_u32_t)b;
+    return (simd_t)((simd_u32_t)a << (n & 31) & ~(simd_u32_t)(n > 31));
+}
+
+static inline simd_t simd_srlv32(simd_t a, simd_t b) {
+    simd_u32_t n = (simd_u32_t)b;
+    return (simd_t)((simd_u32_t)a >> (n & 31) & ~(simd_u32_t)(n > 31));
+}
+
+static inline simd_t simd_srav32(simd_t a, simd_t b) {
+    simd_u32_t n = (simd_u32_t)b;
+    return (simd_t)((simd_s32_t)a >> (simd_s32_t)SIMD_SELECT(n > 31, (simd_u32_t){ 0 } + 31, n));
+}
+
+static inline simd_t simd_sllv64(simd_t a, simd_t b) {
+    return a << (b & 63) & ~(simd_u64_t)(b > 63);
+}
+
+static inline simd_t simd_srlv64(simd_t a, simd_t b) {
+    return a >> (b & 63) & ~(simd_u64_t)(b > 63);
+}
+
+/**
+ * Sums of absolute differences of 4 bytes of `b`, selected by `imm` bits 1:0,
+ * with 8 sliding groups of 4 bytes of `a`, starting at the one of bit 2, MPSADBW.
+ */
+static inline simd_t simd_mpsad8(simd_t a, simd_t b, uint8_t imm) {
+    simd_u8_t x = (simd_u8_t)a, y = (simd_u8_t)b;
+    int ia = (imm & 4), ib = (imm & 3) * 4;
+    simd_u16_t r = { 0 };
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++) {
+            int d = x[ia + i + j] - y[ib + j];
+            r[i] += d < 0 ? -d : d;
+        }
+    return (simd_t)r;
+}
+
+/** Dwords of `a` selected by bits 1:0 of the dwords of `b`, VPERMILPS. */
+static inline simd_t simd_permil32(simd_t a, simd_t b) {
+    return (simd_t)__builtin_shuffle((simd_u32_t)a, (simd_u32_t)b & 3);
+}
+
+/** Qwords of `a` selected by bit 1 of the qwords of `b`, VPERMILPD. */
+static inline simd_t simd_permil64(simd_t a, simd_t b) {
+    return __builtin_shuffle(a, (b >> 1) & 1);
+}
+
+/** Dword `imm` bits 7:6 of `b` to lane bits 5:4 of `a`, lanes of bits 3:0 cleared, INSERTPS. */
+static inline simd_t simd_insertps(simd_t a, simd_t b, uint8_t imm) {
+    simd_u32_t r = (simd_u32_t)a;
+    simd_u32_t zero = { imm & 1, imm & 2, imm & 4, imm & 8 };
+    r[(imm >> 4) & 3] = ((simd_u32_t)b)[imm >> 6];
+    return (simd_t)(r & (simd_u32_t)(zero == 0));
+}
+
+/* MMX forms that differ from the low half of the 128 bit ones. */
+
+static inline simd_t simd_mmx_unpackhi8(simd_t a, simd_t b) {
+    return simd_unpacklo8(simd_srldq(a, 4), simd_srldq(b, 4));
+}
+
+static inline simd_t simd_mmx_unpackhi16(simd_t a, simd_t b) {
+    return simd_unpacklo16(simd_srldq(a, 4), simd_srldq(b, 4));
+}
+
+static inline simd_t simd_mmx_unpackhi32(simd_t a, simd_t b) {
+    return simd_unpacklo32(simd_srldq(a, 4), simd_srldq(b, 4));
+}
+
+static inline simd_t simd_mmx_packss16(simd_t a, simd_t b) {
+    simd_t v = simd_unpacklo64(a, b);
+    return simd_packss16(v, v);
+}
+
+static inline simd_t simd_mmx_packus16(simd_t a, simd_t b) {
+    simd_t v = simd_unpacklo64(a, b);
+    return simd_packus16(v, v);
+}
+
+static inline simd_t simd_mmx_packss32(simd_t a, simd_t b) {
+    simd_t v = simd_unpacklo64(a, b);
+    return simd_packss32(v, v);
+}
+
+#endif /* __X64SIMD_PRIVATE_H_ */
@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "debug.h"
+#include "virtual.h"
+#include "x64smc.h"
+
+SET_DEBUG_CHANNEL("X64SMC")
+
+struct x64smc_page {
+    uint64_t        addr;
+    int             prot;       /* Protection the guest asked for. */
+    bool            protected;  /* Write access is taken away. */
+    x64smc_page_t  *next;       /* Next page in the same bucket. */
+};
+
+static inline uint32_t smc_hash(x64smc_t *smc, uint64_t addr) {
+    return (uint32_t)(addr / smc->page_size) & (X64_SMC_BUCKETS - 1);
+}
+
+static x64smc_page_t *smc_lookup(x64smc_t *smc, uint64_t addr) {
+    for (x64smc_page_t *page = smc->buckets[smc_hash(smc, addr)]; page; page = page->next) {
+        if (page->addr == addr)
+            return page;
+    }
+    return NULL;
+}
+
+bool x64smc_init(x64smc_t *smc, uint64_t page_size) {
+    if (!smc || !page_size) return false;
+
+    memset(smc->buckets, 0, sizeof(smc->buckets));
+    smc->page_size = page_size;
+    smc->faults = 0;
+    return true;
+}
+
+void x64smc_free(x64smc_t *smc) {
+    if (!smc) return;
+
+    for (uint32_t i = 0; i < X64_SMC_BUCKETS; i++) {
+        x64smc_page_t *page = smc->buckets[i];
+        while (page) {
+            x64smc_page_t *next = page->next;
+            free(page);
+            page = next;
+        }
+        smc->buckets[i] = NULL;
+    }
+}
+
+bool x64smc_protect(x64smc_t *smc, uint64_t start, uint64_t end) {
+    for (uint64_t addr = start & ~(smc->page_size - 1); addr < end; addr += smc->page_size) {
+        x64smc_page_t *page = smc_lookup(smc, addr);
+
+        if (!page) {
+            page = malloc(sizeof(x64smc_page_t));
+            if (!page) {
+                log_err("Failed to allocate code page 0x%lx", addr);
+                return false;
+            }
+            if (!query_prot(addr, &page->prot)) {
+                log_err("Code page 0x%lx is not mapped", addr);
+                free(page);
+                return false;
+            }
+            page->addr = addr;
+            page->protected = false;
+
+            uint32_t h = smc_hash(smc, addr);
+            page->next = smc->buckets[h];
+            smc->buckets[h] = page;
+        }
+
+        if (page->protected || !(page->prot & PROT_WRITE)) continue;
+
+        if (mprotect((void *)addr, smc->page_size, page->prot & ~PROT_WRITE) != 0) {
+            log_err("Failed to write-protect code page 0x%lx: %s", addr, strerror(errno));
+            return false;
+        }
+        page->protected = true;
+    }
+    return true;
+}
+
+bool x64smc_unprotect(x64smc_t *smc, uint64_t addr) {
+    x64smc_page_t *page = smc_lookup(smc, addr & ~(smc->page_size - 1));
+    if (!page || !page->protected) return false;
+
+    if (mprotect((void *)page->addr, smc->page_size, page->prot) != 0)
+        return false;
+    page->protected = false;
+    smc->faults++;
+    return true;
+}
+
+void x64smc_forget(x64smc_t *smc, uint64_t start, uint64_t end) {
+    /* Ranges may be huge, walk the pages instead. */
+    for (uint32_t i = 0; i < X64_SMC_BUCKETS; i++) {
+        x64smc_page_t **link = smc->buckets + i;
+        while (*link) {
+            x64smc_page_t *page = *link;
+            if (page->addr + smc->page_size <= start || page->addr >= end) {
+                link = &page->next;
+                continue;
+            }
+            *link = page->next;
+            free(page);
+        }
+    }
+}
@@ -2,11 +2,13 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include "debug.h"
 #include "x64emu.h"
 
 #include "regs_private.h"
+#include "flags_private.h"
 
 SET_DEBUG_CHANNEL("X64SYSCALL")
 
@@ -16,6 +18,7 @@ bool x64syscall(x64emu_t *emu) {
 
     log_dump("Syscall %lX", r_rax);
 
+    x64flags_materialize(emu);
     r_rcx = r_rip;
     r_r11 = r_flags;
     r_flags = 0; /* FIXME: Maybe implement IA32_FMASK? */
@@ -27,9 +30,27 @@ bool x64syscall(x64emu_t *emu) {
                 s_rax = -errno;
             break;
 
+        case 0x0A:            /* SYS_mprotect */
+        case 0x0B: {          /* SYS_munmap */
+            /* Code there may change or go away, cached blocks cannot stay. */
+            uint64_t end = r_rdi + r_rsi;
+            x64emu_invalidate(emu, r_rdi, end);
+            x64smc_forget(&emu->smc, r_rdi, end);
+
+            if (r_rax == 0x0A)
+                s_rax = mprotect((void *)r_rdi, (size_t)r_rsi, s_edx);
+            else
+                s_rax = munmap((void *)r_rdi, (size_t)r_rsi);
+            if (s_rax == -1)
+                s_rax = -errno;
+            break;
+        }
+
         case 0x3C: {          /* SYS_exit */
             int status = s_edi;
             x64emu_free(emu);
+            /* _exit skips stdio, the statistics logged above would be lost. */
+            fflush(stdout);
             _exit(status);
         }
 
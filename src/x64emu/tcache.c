@@ -0,0 +1,378 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "x64instr.h"
+#include "x64block.h"
+#include "x64cache.h"
+#include "x64tcache.h"
+
+SET_DEBUG_CHANNEL("X64TCACHE")
+
+#define TCACHE_MAGIC   "FLUX64TC"
+#define TCACHE_VERSION 2
+
+/* Longest x86 instruction, bounds the code of a block. */
+#define TCACHE_MAX_INSTR_LEN 15
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    instr_size;    /* sizeof(x64instr_t), differs between build options */
+    uint64_t    exe_size;      /* flux64 build the handlers belong to */
+    uint64_t    exe_mtime;
+    uint64_t    exe_ino;
+    uint64_t    key;           /* hash of the loaded segments */
+    uint64_t    data_hash;     /* hash of everything after the header */
+    uint32_t    records_len;
+    uint32_t    reserved;
+} tcache_header_t;
+
+/**
+ * Saved block, records are sorted by `rip`.
+ * At `offset` are the guest code bytes, padded to 8,
+ * followed by the instructions with handlers relative to x64execute_block_end.
+ */
+typedef struct {
+    uint64_t    rip;
+    uint64_t    end;
+    uint32_t    instrs_len;
+    uint32_t    flags_dead;
+    uint64_t    offset;
+} tcache_record_t;
+
+/** Block about to be saved, from the cache or from the old file. */
+typedef struct {
+    uint64_t            rip;
+    uint64_t            end;
+    uint32_t            instrs_len;
+    uint32_t            flags_dead;
+    const uint8_t      *code;
+    const x64instr_t   *instrs;
+    bool                relative;  /* handlers are already relative */
+} tcache_entry_t;
+
+static inline size_t tcache_align(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static uint64_t tcache_hash(uint64_t h, const uint8_t *data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001B3UL;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++)
+        h = (h ^ data[i]) * 0x100000001B3UL;
+    return h;
+}
+
+/** Identify this flux64 build, handler offsets are only valid within it. */
+static bool tcache_exe_stamp(tcache_header_t *header) {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) != 0) return false;
+
+    header->exe_size = st.st_size;
+    header->exe_mtime = st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+    header->exe_ino = st.st_ino;
+    return true;
+}
+
+/** @return Whether [start, end) lies within one loaded segment. */
+static bool tcache_in_segments(x64context_t *ctx, uint64_t start, uint64_t end) {
+    for (uint32_t i = 0; i < ctx->segments_len; i++) {
+        uint64_t base = (uintptr_t)ctx->segments[i].base;
+        if (start >= base && end <= base + ctx->segments[i].size)
+            return true;
+    }
+    return false;
+}
+
+static inline tcache_header_t *tcache_header(x64tcache_t *tcache) {
+    return (tcache_header_t *)tcache->map;
+}
+
+static inline tcache_record_t *tcache_records(x64tcache_t *tcache) {
+    return (tcache_record_t *)(tcache->map + sizeof(tcache_header_t));
+}
+
+/** Map the cache file if it belongs to this build and binary and is intact. */
+static void tcache_map(x64tcache_t *tcache, tcache_header_t *expect) {
+    int fd = open(tcache->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(tcache_header_t)) {
+        close(fd);
+        return;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    tcache->map = map;
+    tcache->map_size = st.st_size;
+
+    tcache_header_t *header = tcache_header(tcache);
+    size_t size = tcache->map_size;
+    const char *stale = NULL;
+
+    if (memcmp(header->magic, TCACHE_MAGIC, 8) || header->version != TCACHE_VERSION ||
+            header->instr_size != sizeof(x64instr_t))
+        stale = "format version";
+    else if (header->exe_size != expect->exe_size || header->exe_mtime != expect->exe_mtime ||
+            header->exe_ino != expect->exe_ino)
+        stale = "flux64 build";
+    else if (header->key != expect->key)
+        stale = "binary";
+    else if ((size - sizeof(tcache_header_t)) / sizeof(tcache_record_t) < header->records_len ||
+            tcache_hash(0, map + sizeof(tcache_header_t), size - sizeof(tcache_header_t)) != header->data_hash)
+        stale = "contents";
+
+    for (uint32_t i = 0; !stale && i < header->records_len; i++) {
+        tcache_record_t *record = tcache_records(tcache) + i;
+        size_t code_len = record->end - record->rip;
+        if (record->end <= record->rip || !record->instrs_len ||
+                record->instrs_len > X64_BLOCK_MAX_INSTRS ||
+                code_len > X64_BLOCK_MAX_INSTRS * TCACHE_MAX_INSTR_LEN ||
+                record->offset > size ||
+                size - record->offset < tcache_align(code_len) + record->instrs_len * sizeof(x64instr_t) ||
+                (i && record->rip <= record[-1].rip))
+            stale = "records";
+    }
+
+    if (stale) {
+        log_debug("Ignoring %s, it was saved for another %s", tcache->path, stale);
+        munmap(tcache->map, tcache->map_size);
+        tcache->map = NULL;
+        tcache->map_size = 0;
+        return;
+    }
+
+    tcache->records_len = header->records_len;
+}
+
+bool x64tcache_open(x64tcache_t *tcache, const char *dir, x64context_t *ctx) {
+    if (!tcache || !dir || !ctx) return false;
+
+    memset(tcache, 0, sizeof(x64tcache_t));
+    tcache->ctx = ctx;
+
+    tcache_header_t expect = { 0 };
+    if (!tcache_exe_stamp(&expect)) {
+        log_err("Failed to identify flux64 binary for the translation cache");
+        return false;
+    }
+
+    /* Segments are not written by the guest yet. */
+    uint64_t key = 0xCBF29CE484222325UL;
+    for (uint32_t i = 0; i < ctx->segments_len; i++) {
+        uint64_t range[2] = { (uintptr_t)ctx->segments[i].base, ctx->segments[i].size };
+        key = tcache_hash(key, (uint8_t *)range, sizeof(range));
+        key = tcache_hash(key, ctx->segments[i].base, ctx->segments[i].size);
+    }
+    expect.key = tcache->key = key;
+
+    size_t path_len = strlen(dir) + 32;
+    tcache->path = malloc(path_len);
+    if (!tcache->path) {
+        log_err("Failed to allocate translation cache path");
+        return false;
+    }
+    snprintf(tcache->path, path_len, "%s/%016lx.tc", dir, key);
+
+    tcache_map(tcache, &expect);
+    log_debug("Translation cache %s with %u blocks", tcache->path, tcache->records_len);
+    return true;
+}
+
+static const tcache_record_t *tcache_find(x64tcache_t *tcache, uint64_t rip) {
+    const tcache_record_t *records = tcache_records(tcache);
+    uint32_t lo = 0, hi = tcache->records_len;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (records[mid].rip < rip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < tcache->records_len && records[lo].rip == rip ? records + lo : NULL;
+}
+
+x64block_t *x64tcache_get(x64tcache_t *tcache, x64cache_t *cache, uint64_t rip) {
+    if (!tcache->map) return NULL;
+
+    const tcache_record_t *record = tcache_find(tcache, rip);
+    if (!record) return NULL;
+
+    /* The guest may have changed the code since it was saved. */
+    const uint8_t *code = tcache->map + record->offset;
+    if (!tcache_in_segments(tcache->ctx, record->rip, record->end) ||
+            memcmp(code, (void *)record->rip, record->end - record->rip)) {
+        tcache->rejected++;
+        return NULL;
+    }
+
+    x64instr_t instrs[X64_BLOCK_MAX_INSTRS];
+    memcpy(instrs, code + tcache_align(record->end - record->rip), record->instrs_len * sizeof(x64instr_t));
+
+    for (uint32_t i = 0; i < record->instrs_len; i++) {
+        int64_t offset;
+        memcpy(&offset, &instrs[i].handler, sizeof(offset));
+        instrs[i].handler = (x64handler_t)((uintptr_t)x64execute_block_end + offset);
+    }
+
+    x64block_t *block = x64block_new(cache, record->rip, record->end, instrs, record->instrs_len,
+                                     record->flags_dead);
+    if (block) tcache->loaded++;
+    return block;
+}
+
+void x64tcache_add(x64tcache_t *tcache, x64block_t *block) {
+    if (!tcache->path || tcache->dirty) return;
+
+    /* Code rejected from the file was changed by the guest at run time,
+       saving it again would not help the next run. */
+    if (tcache_in_segments(tcache->ctx, block->rip, block->end) &&
+            (!tcache->map || !tcache_find(tcache, block->rip)))
+        tcache->dirty = true;
+}
+
+static int tcache_entry_cmp(const void *a, const void *b) {
+    const tcache_entry_t *x = a, *y = b;
+    return (x->rip > y->rip) - (x->rip < y->rip);
+}
+
+/** Collect blocks to save, cached ones win over records of the old file. */
+static tcache_entry_t *tcache_collect(x64tcache_t *tcache, x64cache_t *cache, uint32_t *entries_len) {
+    tcache_entry_t *entries = malloc((cache->blocks_len + tcache->records_len) * sizeof(tcache_entry_t));
+    if (!entries) return NULL;
+    uint32_t len = 0;
+
+    for (uint32_t i = 0; i < cache->buckets_len; i++) {
+        for (x64block_t *block = cache->buckets[i]; block; block = block->next) {
+            if (!tcache_in_segments(tcache->ctx, block->rip, block->end)) continue;
+            entries[len++] = (tcache_entry_t){
+                block->rip, block->end, block->instrs_len, block->flags_dead,
+                (const uint8_t *)block->rip, block->instrs, false
+            };
+        }
+    }
+
+    for (uint32_t i = 0; i < tcache->records_len; i++) {
+        const tcache_record_t *record = tcache_records(tcache) + i;
+        if (x64cache_lookup(cache, record->rip)) continue;
+
+        const uint8_t *code = tcache->map + record->offset;
+        entries[len++] = (tcache_entry_t){
+            record->rip, record->end, record->instrs_len, record->flags_dead,
+            code, (const x64instr_t *)(code + tcache_align(record->end - record->rip)), true
+        };
+    }
+
+    qsort(entries, len, sizeof(tcache_entry_t), tcache_entry_cmp);
+    *entries_len = len;
+    return entries;
+}
+
+/** Write the cache file next to the old one and replace it, concurrent runs see either. */
+static bool tcache_save(x64tcache_t *tcache, x64cache_t *cache) {
+    uint32_t entries_len;
+    tcache_entry_t *entries = tcache_collect(tcache, cache, &entries_len);
+    if (!entries) {
+        log_err("Failed to allocate translation cache entries");
+        return false;
+    }
+
+    size_t data_size = entries_len * sizeof(tcache_record_t);
+    for (uint32_t i = 0; i < entries_len; i++)
+        data_size += tcache_align(entries[i].end - entries[i].rip) + entries[i].instrs_len * sizeof(x64instr_t);
+
+    size_t size = sizeof(tcache_header_t) + data_size;
+    uint8_t *data = calloc(1, size);
+    if (!data) {
+        log_err("Failed to allocate translation cache file");
+        free(entries);
+        return false;
+    }
+
+    tcache_header_t *header = (tcache_header_t *)data;
+    tcache_record_t *records = (tcache_record_t *)(data + sizeof(tcache_header_t));
+    size_t offset = sizeof(tcache_header_t) + entries_len * sizeof(tcache_record_t);
+
+    for (uint32_t i = 0; i < entries_len; i++) {
+        tcache_entry_t *entry = entries + i;
+        size_t code_len = entry->end - entry->rip;
+
+        records[i] = (tcache_record_t){ entry->rip, entry->end, entry->instrs_len, entry->flags_dead, offset };
+        memcpy(data + offset, entry->code, code_len);
+        offset += tcache_align(code_len);
+
+        x64instr_t *instrs = (x64instr_t *)(data + offset);
+        memcpy(instrs, entry->instrs, entry->instrs_len * sizeof(x64instr_t));
+        if (!entry->relative) {
+            for (uint32_t j = 0; j < entry->instrs_len; j++) {
+                int64_t rel = (uintptr_t)instrs[j].handler - (uintptr_t)x64execute_block_end;
+                memcpy(&instrs[j].handler, &rel, sizeof(rel));
+            }
+        }
+        offset += entry->instrs_len * sizeof(x64instr_t);
+    }
+    free(entries);
+
+    memcpy(header->magic, TCACHE_MAGIC, 8);
+    header->version = TCACHE_VERSION;
+    header->instr_size = sizeof(x64instr_t);
+    tcache_exe_stamp(header);
+    header->key = tcache->key;
+    header->records_len = entries_len;
+    header->data_hash = tcache_hash(0, data + sizeof(tcache_header_t), data_size);
+
+    size_t tmp_len = strlen(tcache->path) + 32;
+    char *tmp = malloc(tmp_len);
+    bool ok = false;
+    if (tmp) {
+        snprintf(tmp, tmp_len, "%s.%d", tcache->path, (int)getpid());
+        FILE *file = fopen(tmp, "wb");
+        if (file) {
+            ok = fwrite(data, size, 1, file) == 1;
+            ok = !fclose(file) && ok;
+            ok = ok && !rename(tmp, tcache->path);
+            if (!ok) unlink(tmp);
+        }
+    }
+
+    if (ok)
+        log_debug("Saved %u blocks to %s", entries_len, tcache->path);
+    else
+        log_warn("Failed to save translation cache %s: %s", tcache->path, strerror(errno));
+
+    free(tmp);
+    free(data);
+    return ok;
+}
+
+void x64tcache_close(x64tcache_t *tcache, x64cache_t *cache) {
+    if (!tcache || !tcache->path) return;
+
+    log_debug("Translation cache: %lu blocks loaded, %lu rejected", tcache->loaded, tcache->rejected);
+    if (tcache->dirty)
+        tcache_save(tcache, cache);
+
+    if (tcache->map)
+        munmap(tcache->map, tcache->map_size);
+    free(tcache->path);
+    memset(tcache, 0, sizeof(x64tcache_t));
+}